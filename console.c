@@ -0,0 +1,125 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#ifdef __unix__
+#include <unistd.h>
+#endif
+#include "console.h"
+
+#define RVCON_MAX_MSG 1024
+
+bool rv_console_init(rv_console* con, FILE* file, uint32_t policy, uint32_t size)
+{
+    memset(con,0,sizeof(rv_console));
+    con->file = file;
+    con->size = size? size : RVCON_BUF_SIZE;
+    con->buf = (uint8_t*)malloc(con->size);
+    if (!con->buf) return false;
+
+    // the same thing stdio does by default
+    if (!file) policy = RVCON_FLUSH_EXIT;
+    else if (policy == RVCON_FLUSH_AUTO) {
+#ifdef __unix__
+        policy = isatty(fileno(file))? RVCON_FLUSH_LINE : RVCON_FLUSH_SIZE;
+#else
+        policy = (file == stdout)? RVCON_FLUSH_LINE : RVCON_FLUSH_SIZE;
+#endif
+    }
+    con->policy = policy;
+    return true;
+}
+
+void rv_console_destroy(rv_console* con)
+{
+    rv_console_flush(con);
+    free(con->buf);
+    con->buf = NULL;
+    con->len = con->size = 0;
+}
+
+// Write the data straight into the file (it's flushed as well, so nothing else is buffered on the way)
+static bool put(rv_console* con, const void* data, uint32_t len)
+{
+    con->flushes++;
+    if (fwrite(data,1,len,con->file) == len && !fflush(con->file)) return true;
+    con->lost += len;
+    return false;
+}
+
+bool rv_console_flush(rv_console* con)
+{
+    if (!con->file || !con->len) return true;
+    bool ok = put(con,con->buf,con->len);
+    con->len = 0;
+    return ok;
+}
+
+// Make room for 'len' more bytes
+static bool grow(rv_console* con, uint32_t len)
+{
+    uint64_t size = con->size;
+    while (size - con->len < len) size *= 2;
+    if (size > UINT32_MAX) return false;
+    uint8_t* ptr = (uint8_t*)realloc(con->buf,size);
+    if (!ptr) return false;
+    con->buf = ptr;
+    con->size = size;
+    return true;
+}
+
+void rv_console_write_slow(rv_console* con, const void* data, uint32_t len)
+{
+    con->total += len;
+    if (!con->buf) {
+        con->lost += len;
+        return;
+    }
+
+    // output written on exit (or captured one) is kept in memory as long as there's memory
+    if (con->policy == RVCON_FLUSH_EXIT && len > con->size - con->len && !grow(con,len)) {
+        if (!con->file) {
+            con->lost += len;
+            return;
+        }
+        rv_console_flush(con);
+    }
+
+    // it doesn't fit into the buffer: whatever's there goes first, and the large ones bypass it
+    if (len > con->size - con->len) {
+        rv_console_flush(con);
+        if (len >= con->size) {
+            put(con,data,len);
+            return;
+        }
+    }
+
+    memcpy(con->buf + con->len,data,len);
+    con->len += len;
+    if (con->policy == RVCON_FLUSH_LINE && memchr(data,'\n',len)) rv_console_flush(con);
+}
+
+void rv_console_printf(rv_console* con, const char* fmt, ...)
+{
+    char msg[RVCON_MAX_MSG];
+    va_list ap;
+    va_start(ap,fmt);
+    int len = vsnprintf(msg,sizeof(msg),fmt,ap);
+    va_end(ap);
+    if (len < 0) return;
+    if (len >= (int)sizeof(msg)) len = sizeof(msg) - 1;
+    rv_console_write_slow(con,msg,len);
+}
+
+const uint8_t* rv_console_captured(rv_console* con, uint32_t* len)
+{
+    *len = con->file? 0 : con->len;
+    return con->buf;
+}
@@ -0,0 +1,77 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef CONSOLE_H_
+#define CONSOLE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define RVCON_BUF_SIZE (16U << 10)  /* default output buffer size */
+
+// When the buffered output is written out
+enum rv_con_flush {
+    RVCON_FLUSH_AUTO = 0,   // every line for terminals, when the buffer is full for anything else
+    RVCON_FLUSH_LINE,       // after every write with a line break in it
+    RVCON_FLUSH_SIZE,       // when the buffer is full
+    RVCON_FLUSH_EXIT,       // only by rv_console_flush() or rv_console_destroy() (the buffer grows as needed)
+};
+
+// Program output of one VM. Every VM has its own buffer, so many of them can run in one process
+// without taking stdio locks on every character. Output goes into a file, or it's kept in memory.
+typedef struct {
+    FILE* file;             /* Where the output goes (NULL means it's captured, see rv_console_captured()) */
+    uint32_t policy;        /* See rv_con_flush above (never RVCON_FLUSH_AUTO once initialized) */
+    uint8_t* buf;
+    uint32_t len;
+    uint32_t size;
+    uint64_t total;         /* Statistics counters */
+    uint64_t flushes;
+    uint64_t lost;          /* Bytes which couldn't be written or captured */
+} rv_console;
+
+bool rv_console_init(rv_console* con, FILE* file, uint32_t policy, uint32_t size);
+void rv_console_destroy(rv_console* con); // (flushes it first)
+
+// Write buffered data into the file (captured data stays where it is). Returns false on error.
+bool rv_console_flush(rv_console* con);
+
+// Slow path of the functions below (full buffer or flush needed)
+void rv_console_write_slow(rv_console* con, const void* data, uint32_t len);
+
+// Add data to the output
+static inline void rv_console_write(rv_console* con, const void* data, uint32_t len)
+{
+    if (con->policy != RVCON_FLUSH_LINE && len <= con->size - con->len) {
+        memcpy(con->buf + con->len,data,len);
+        con->len += len;
+        con->total += len;
+        return;
+    }
+    rv_console_write_slow(con,data,len);
+}
+
+static inline void rv_console_putc(rv_console* con, uint8_t c)
+{
+    if (con->len < con->size && (c != '\n' || con->policy != RVCON_FLUSH_LINE)) {
+        con->buf[con->len++] = c;
+        con->total++;
+        return;
+    }
+    rv_console_write_slow(con,&c,1);
+}
+
+void rv_console_printf(rv_console* con, const char* fmt, ...) __attribute__((format(printf,2,3)));
+
+// Captured output (it isn't NUL-terminated)
+const uint8_t* rv_console_captured(rv_console* con, uint32_t* len);
+
+#endif /* CONSOLE_H_ */
@@ -19,6 +19,8 @@ static const struct {
         { 'r', DBG_REGS },
         { 'i', DBG_INTERACTIVE },
         { 'l', DBG_LOAD },
+        { 'c', DBG_CACHE },
+        { 'p', DBG_PROFILE },
         { 0, 0 }
 };
 
@@ -19,6 +19,8 @@ enum debug_opts {
     DBG_REGS = 0x08,
     DBG_INTERACTIVE = 0x10,
     DBG_LOAD = 0x20,
+    DBG_CACHE = 0x40,
+    DBG_PROFILE = 0x80,
 };
 
 uint32_t debug_readopts(const char* arg);
@@ -7,56 +7,116 @@
  *
  * */
 
+#ifdef __linux__
+#define _GNU_SOURCE         /* fallocate() */
+#define ELF_USE_FALLOCATE   /* BSS in memory file RAM is zeroed by punching holes in it */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "elf.h"
 #include "riscv.h"
 #include "debug.h"
 
-static bool readelf_internal(rv_interface* vm, FILE* fin)
+// Fill a range of RAM with zeros. Whole pages of memory file are just dropped, so they're
+// zero-filled lazily, when the program touches them.
+static void zero_fill(rv_interface* vm, uint32_t start, uint32_t len, uint32_t page)
+{
+#ifdef ELF_USE_FALLOCATE
+    uint32_t head = (page - start % page) % page;
+    if (vm->ram_file && vm->ram_shared && len > head + page) {
+        uint32_t whole = (len - head) & ~(page - 1);
+        if (!fallocate(vm->ram_file->fd,FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,start + head,whole)) {
+            memset(vm->ram + start,0,head);
+            memset(vm->ram + start + head + whole,0,len - head - whole);
+            return;
+        }
+    }
+#else
+    (void)page;
+#endif
+    memset(vm->ram + start,0,len);
+}
+
+// Place file data of a segment into RAM. Whole pages of read-only segments are mapped straight from the file
+// (privately, so they still can be written into), everything else is copied. Returns the number of mapped pages.
+static uint32_t place_data(rv_interface* vm, int fd, const uint8_t* img, const elf_proghdr_t* ph, uint32_t page)
+{
+    uint8_t* dst = vm->ram + ph->vaddr;
+    const uint8_t* src = img + ph->off;
+    uint32_t head = (page - ph->vaddr % page) % page; // bytes before the first whole page
+    uint32_t whole = (ph->filesz > head)? (ph->filesz - head) & ~(page - 1) : 0;
+
+    if (!vm->ram_mapped || vm->nmaps >= IFACE_MAX_MAPS || (ph->flags & ELF_PF_W) ||
+        (ph->vaddr % page) != (ph->off % page) || !whole ||
+        mmap(dst + head,whole,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_FIXED,fd,ph->off + head) == MAP_FAILED) {
+        memcpy(dst,src,ph->filesz);
+        return 0;
+    }
+
+    // first and last pages might be shared with other segments
+    memcpy(dst,src,head);
+    memcpy(dst + head + whole,src + head + whole,ph->filesz - head - whole);
+
+    // RAM isn't the same as its memory file anymore (see rv_iface_fork())
+    vm->maps[vm->nmaps][0] = ph->vaddr + head;
+    vm->maps[vm->nmaps++][1] = whole;
+    vm->ram_synced = false;
+    return whole / page;
+}
+
+static bool readelf_internal(rv_interface* vm, int fd, const uint8_t* img, size_t size)
 {
     // get ELF header
-    elf_header_t elfhdr;
-    if (!fread(&elfhdr,sizeof(elfhdr),1,fin)) return false;
+    const elf_header_t* elfhdr = (const elf_header_t*)img;
+    if (size < sizeof(elf_header_t)) return false;
 
     // check that it's of correct version and machine type
     const char magic[] = "\x7f" "ELF";
-    if (memcmp(magic,elfhdr.magic,4)) return false;
-    if (elfhdr.ver != 1) return false;
-    if (elfhdr.class != 1) return false;
-    if (elfhdr.endianness != 1) return false;
-    if (elfhdr.machine != ELF_RISCV_MACH_CODE) return false;
+    if (memcmp(magic,elfhdr->magic,4)) return false;
+    if (elfhdr->ver != 1) return false;
+    if (elfhdr->class != 1) return false;
+    if (elfhdr->endianness != 1) return false;
+    if (elfhdr->machine != ELF_RISCV_MACH_CODE) return false;
 
-    // jump into program headers section
-    fseek(fin,elfhdr.proghdr_off,SEEK_SET);
+    // all program headers must be inside the file
+    if (elfhdr->proghdr_size < sizeof(elf_proghdr_t)) return false;
+    if ((uint64_t)elfhdr->proghdr_off + (uint64_t)elfhdr->proghdr_num * elfhdr->proghdr_size > size) return false;
+
+    uint32_t page = sysconf(_SC_PAGESIZE);
+    vm->prog_break = 0;
 
     // for each header block
-    for (uint16_t i = 0; i < elfhdr.proghdr_num; i++) {
-        // get data
+    for (uint16_t i = 0; i < elfhdr->proghdr_num; i++) {
         elf_proghdr_t phdr;
-        if (!fread(&phdr,sizeof(phdr),1,fin)) return false;
+        memcpy(&phdr,img + elfhdr->proghdr_off + (size_t)i * elfhdr->proghdr_size,sizeof(phdr));
+
+        // only loadable segments go into memory
+        if (phdr.type != ELF_PT_LOAD || !phdr.memsz) continue;
+        if (phdr.filesz > phdr.memsz || (uint64_t)phdr.off + phdr.filesz > size) return false;
 
         // would it fit into our RAM ?
-        vm->prog_break = phdr.vaddr + phdr.memsz;
-        if (vm->prog_break >= vm->ram_size) {
-            printf("ERROR: ELF Section %u is too big (0x%08X - 0x%08X) to fit in RAM\n",i,phdr.vaddr,vm->prog_break);
+        uint64_t end = (uint64_t)phdr.vaddr + phdr.memsz;
+        if (end >= vm->ram_space) {
+            printf("ERROR: ELF Section %u is too big (0x%08X - 0x%08" PRIX64 ") to fit in RAM\n",i,phdr.vaddr,end);
             return false;
         }
+        if (end > vm->prog_break) vm->prog_break = end;
 
-        // jump to start of the actual data referenced in this section
-        size_t pos = ftell(fin);
-        fseek(fin,phdr.off,SEEK_SET);
-
-        // and load it all up
-        if (!fread(vm->ram+phdr.vaddr,phdr.filesz,1,fin)) return false;
-        fseek(fin,pos,SEEK_SET);
+        // file data, then zeros (BSS)
+        uint32_t mapped = place_data(vm,fd,img,&phdr,page);
+        if (phdr.memsz > phdr.filesz) zero_fill(vm,phdr.vaddr + phdr.filesz,phdr.memsz - phdr.filesz,page);
 
         if (vm->debug & DBG_LOAD)
-            printf("Section %u loaded, 0x%08X - 0x%08X, %u bytes\n",i,phdr.vaddr,vm->prog_break,phdr.memsz);
+            printf("Section %u loaded, 0x%08X - 0x%08X, %u bytes (%u pages mapped, %u bytes zeroed)\n",i,phdr.vaddr,
+                   (uint32_t)end,phdr.memsz,mapped,phdr.memsz - phdr.filesz);
     }
 
-    vm->start = elfhdr.entry;
+    vm->start = elfhdr->entry;
 
     if (vm->debug & DBG_LOAD)
         printf("Start address 0x%08X\n",vm->start);
@@ -67,16 +127,106 @@ static bool readelf_internal(rv_interface* vm, FILE* fin)
 // Load and parse an ELF file, and put it properly into RAM
 bool readelf(rv_interface* vm, const char* fn)
 {
-    FILE* f = fopen(fn,"rb");
-    if (!f) {
+    int fd = open(fn,O_RDONLY);
+    if (fd < 0) {
         printf("ERROR: Unable to open file '%s'\n", fn);
         return false;
     }
 
-    bool ret = readelf_internal(vm,f);
-    fclose(f);
+    // the whole file is mapped once, segments are mapped from it or copied
+    struct stat sb;
+    void* img = MAP_FAILED;
+    if (!fstat(fd,&sb) && sb.st_size > 0) img = mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+
+    bool ret = (img != MAP_FAILED) && readelf_internal(vm,fd,(const uint8_t*)img,sb.st_size);
+    if (ret) vm->elf_file = fn;
+    if (img != MAP_FAILED) munmap(img,sb.st_size);
+    close(fd);
 
     if (!ret) printf("ERROR: Unable to parse ELF file\n");
 
     return ret;
 }
+
+static int by_addr(const void* a, const void* b)
+{
+    const elf_symbol* x = (const elf_symbol*)a;
+    const elf_symbol* y = (const elf_symbol*)b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static bool read_symtab_internal(const uint8_t* img, size_t size, elf_symtab* tab)
+{
+    const elf_header_t* elfhdr = (const elf_header_t*)img;
+    if (size < sizeof(elf_header_t) || memcmp(elfhdr->magic,"\x7f" "ELF",4) || elfhdr->class != 1) return false;
+    if (elfhdr->secthdr_size < sizeof(elf_secthdr_t)) return false;
+    if ((uint64_t)elfhdr->secthdr_off + (uint64_t)elfhdr->secthdr_num * elfhdr->secthdr_size > size) return false;
+
+    for (uint16_t i = 0; i < elfhdr->secthdr_num; i++) {
+        elf_secthdr_t sh, strh;
+        memcpy(&sh,img + elfhdr->secthdr_off + (size_t)i * elfhdr->secthdr_size,sizeof(sh));
+        if (sh.type != ELF_SHT_SYMTAB || sh.entsize < sizeof(elf_sym_t) || sh.link >= elfhdr->secthdr_num) continue;
+        if ((uint64_t)sh.off + sh.size > size) return false;
+
+        // symbol names are in the linked string table
+        memcpy(&strh,img + elfhdr->secthdr_off + (size_t)sh.link * elfhdr->secthdr_size,sizeof(strh));
+        if ((uint64_t)strh.off + strh.size > size || !strh.size) return false;
+
+        uint32_t n = sh.size / sh.entsize;
+        tab->syms = (elf_symbol*)malloc((n + 1) * sizeof(elf_symbol));
+        tab->strings = (char*)malloc(strh.size + 1);
+        if (!tab->syms || !tab->strings) return false;
+        memcpy(tab->strings,img + strh.off,strh.size);
+        tab->strings[strh.size] = 0;
+
+        for (uint32_t j = 0; j < n; j++) {
+            elf_sym_t sym;
+            memcpy(&sym,img + sh.off + (size_t)j * sh.entsize,sizeof(sym));
+            if ((sym.info & 0xF) != ELF_STT_FUNC || sym.name >= strh.size) continue;
+            elf_symbol* f = tab->syms + tab->num++;
+            f->addr = sym.value;
+            f->size = sym.size;
+            f->name = tab->strings + sym.name;
+        }
+        qsort(tab->syms,tab->num,sizeof(elf_symbol),by_addr);
+        return tab->num > 0;
+    }
+    return false;
+}
+
+bool elf_read_symtab(const char* fn, elf_symtab* tab)
+{
+    memset(tab,0,sizeof(elf_symtab));
+    int fd = open(fn,O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat sb;
+    void* img = MAP_FAILED;
+    if (!fstat(fd,&sb) && sb.st_size > 0) img = mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (img == MAP_FAILED) return false;
+
+    bool ret = read_symtab_internal((const uint8_t*)img,sb.st_size,tab);
+    munmap(img,sb.st_size);
+    if (!ret) elf_free_symtab(tab);
+    return ret;
+}
+
+void elf_free_symtab(elf_symtab* tab)
+{
+    free(tab->syms);
+    free(tab->strings);
+    memset(tab,0,sizeof(elf_symtab));
+}
+
+const elf_symbol* elf_find_symbol(const elf_symtab* tab, uint32_t addr)
+{
+    // the last symbol starting at or before the address
+    uint32_t lo = 0, hi = tab->num;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (tab->syms[mid].addr <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo? tab->syms + lo - 1 : NULL;
+}
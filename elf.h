@@ -16,6 +16,10 @@
 
 #define ELF_LOAD_FAILURE 0xFFFFFFFF
 #define ELF_RISCV_MACH_CODE 0xF3
+#define ELF_PT_LOAD 1       /* loadable segment type */
+#define ELF_PF_W 2          /* writable segment flag */
+#define ELF_SHT_SYMTAB 2    /* symbol table section type */
+#define ELF_STT_FUNC 2      /* function symbol type */
 
 typedef struct {
     char magic[4];
@@ -51,6 +55,49 @@ typedef struct {
     uint32_t align;
 } elf_proghdr_t;
 
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t addr;
+    uint32_t off;
+    uint32_t size;
+    uint32_t link;
+    uint32_t info;
+    uint32_t addralign;
+    uint32_t entsize;
+} elf_secthdr_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t value;
+    uint32_t size;
+    uint8_t info;
+    uint8_t other;
+    uint16_t shndx;
+} elf_sym_t;
+
+// Function symbol
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    const char* name;
+} elf_symbol;
+
+// Function symbols of a program, sorted by address
+typedef struct {
+    elf_symbol* syms;
+    uint32_t num;
+    char* strings;          /* Names storage */
+} elf_symtab;
+
 bool readelf(rv_interface* vm, const char* fn);
 
+// Read function symbols from ELF file symbol table (.symtab). Returns false if there are none
+bool elf_read_symtab(const char* fn, elf_symtab* tab);
+void elf_free_symtab(elf_symtab* tab);
+
+// Find the function containing the address (or the closest one before it), NULL if there's none
+const elf_symbol* elf_find_symbol(const elf_symtab* tab, uint32_t addr);
+
 #endif /* ELF_H_ */
@@ -0,0 +1,390 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "fleet.h"
+#include "elf.h"
+
+static const char* status_names[] = { "running", "exit", "budget", "timeout", "fault", "error", "closed", "nostart", "nomem" };
+
+typedef struct {
+    rv_fleet* fleet;
+    uint32_t id;
+} rv_fleet_worker;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Size in KiB (from 1 KiB to the whole RAM space) into bytes
+static bool parse_kib(const char* str, uint32_t* bytes)
+{
+    char* end;
+    errno = 0;
+    unsigned long long kib = strtoull(str,&end,10);
+    if (errno || end == str || *end || *str == '-' || !kib || kib > IFACE_RAM_SPACE / 1024) return false;
+    *bytes = kib * 1024;
+    return true;
+}
+
+static bool parse_job(rv_fleet_job* j, char* line, uint32_t lineno)
+{
+    char* tok[FLEET_MAX_ARGS + 5];
+    char* save = NULL;
+    int n = 0;
+    for (char* t = strtok_r(line," \t\r\n",&save); t; t = strtok_r(NULL," \t\r\n",&save)) {
+        if (n >= FLEET_MAX_ARGS + 5) {
+            printf("ERROR: Too many arguments in line %u\n",lineno);
+            return false;
+        }
+        tok[n++] = t;
+    }
+    if (n < 6) {
+        printf("ERROR: Malformed job description in line %u\n",lineno);
+        return false;
+    }
+    if (strchr(tok[0],'/')) {
+        printf("ERROR: Job name '%s' must not contain slashes\n",tok[0]);
+        return false;
+    }
+
+    if (!parse_kib(tok[1],&j->ram_size) || !parse_kib(tok[2],&j->stack_size)) {
+        printf("ERROR: RAM and stack sizes must be between 1 and %u KiB in line %u\n",IFACE_RAM_SPACE / 1024,lineno);
+        return false;
+    }
+
+    j->name = strdup(tok[0]);
+    j->budget = strtoull(tok[3],NULL,0);
+    j->timeout = strtoul(tok[4],NULL,0);
+    j->argc = n - 5;
+    j->argv = (char**)calloc(j->argc,sizeof(char*));
+    if (!j->name || !j->argv) return false;
+    for (int i = 0; i < j->argc; i++)
+        if (!(j->argv[i] = strdup(tok[i+5]))) return false;
+    return true;
+}
+
+rv_fleet* rv_fleet_load(const char* fn)
+{
+    FILE* f = fopen(fn,"r");
+    if (!f) {
+        printf("ERROR: Unable to open file '%s'\n",fn);
+        return NULL;
+    }
+
+    rv_fleet* fl = (rv_fleet*)calloc(1,sizeof(rv_fleet));
+    char line[FLEET_MAX_LINE];
+    uint32_t lineno = 0, cap = 0;
+    bool ok = (fl != NULL);
+    while (ok && fgets(line,sizeof(line),f)) {
+        lineno++;
+        char* p = line + strspn(line," \t\r\n");
+        if (!*p || *p == '#') continue;
+
+        if (fl->njobs >= cap) {
+            cap = cap? cap * 2 : 64;
+            rv_fleet_job* ptr = (rv_fleet_job*)realloc(fl->jobs,cap * sizeof(rv_fleet_job));
+            if (!ptr) {
+                printf("ERROR: Unable to allocate memory\n");
+                ok = false;
+                break;
+            }
+            fl->jobs = ptr;
+        }
+
+        rv_fleet_job* j = fl->jobs + fl->njobs++;
+        memset(j,0,sizeof(rv_fleet_job));
+        ok = parse_job(j,p,lineno);
+    }
+    fclose(f);
+
+    if (ok && !fl->njobs) {
+        printf("ERROR: No jobs found in '%s'\n",fn);
+        ok = false;
+    }
+    if (!ok) {
+        rv_fleet_destroy(fl);
+        return NULL;
+    }
+    return fl;
+}
+
+void rv_fleet_destroy(rv_fleet* f)
+{
+    if (!f) return;
+    for (uint32_t i = 0; i < f->njobs; i++) {
+        rv_fleet_job* j = f->jobs + i;
+        if (j->argv)
+            for (int k = 0; k < j->argc; k++) free(j->argv[k]);
+        free(j->argv);
+        free(j->name);
+    }
+    free(f->jobs);
+    free(f->queues);
+    free(f);
+}
+
+// Run queue operations: the owner takes jobs from the head and puts them back to the tail (round-robin),
+// idle workers steal from the head too
+static void queue_push(rv_fleet_queue* q, rv_fleet_job* j)
+{
+    j->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail) q->tail->next = j;
+    else q->head = j;
+    q->tail = j;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static rv_fleet_job* queue_pop(rv_fleet_queue* q, bool steal)
+{
+    pthread_mutex_lock(&q->lock);
+    rv_fleet_job* j = q->head;
+    if (j) {
+        q->head = j->next;
+        if (!q->head) q->tail = NULL;
+        if (steal) q->active--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return j;
+}
+
+// Take next job which isn't started yet (if this worker doesn't have too many of them already)
+static rv_fleet_job* admit(rv_fleet* f, rv_fleet_queue* q)
+{
+    pthread_mutex_lock(&q->lock);
+    bool can = q->active < FLEET_MAX_ACTIVE;
+    pthread_mutex_unlock(&q->lock);
+    if (!can) return NULL;
+
+    rv_fleet_job* j = NULL;
+    pthread_mutex_lock(&f->lock);
+    if (f->next < f->njobs) j = f->jobs + f->next++;
+    pthread_mutex_unlock(&f->lock);
+
+    if (j) {
+        pthread_mutex_lock(&q->lock);
+        q->active++;
+        pthread_mutex_unlock(&q->lock);
+    }
+    return j;
+}
+
+static rv_fleet_job* steal(rv_fleet* f, uint32_t id)
+{
+    for (uint32_t k = 1; k < f->nthreads; k++) {
+        rv_fleet_job* j = queue_pop(f->queues + (id + k) % f->nthreads,true);
+        if (j) {
+            rv_fleet_queue* q = f->queues + id;
+            pthread_mutex_lock(&q->lock);
+            q->active++;
+            q->steals++;
+            pthread_mutex_unlock(&q->lock);
+            return j;
+        }
+    }
+    return NULL;
+}
+
+static bool start_job(rv_fleet* f, rv_fleet_job* j)
+{
+    rv_interface* iface = (rv_interface*)malloc(sizeof(rv_interface));
+    if (!iface) {
+        printf("ERROR: Unable to allocate memory for job '%s'\n",j->name);
+        return false;
+    }
+    j->iface = iface;
+    rv_iface_init(iface);
+    iface->ram_size = j->ram_size;
+    iface->stack_size = j->stack_size;
+    iface->engine = f->engine;
+    iface->budget = j->budget;
+    iface->headless = true;
+    iface->root = f->root;
+    iface->out_flush = f->out_flush;
+    iface->files[0] = -1; // (jobs don't share our standard input)
+    iface->argc = j->argc;
+    iface->argv = j->argv;
+
+    char fn[FLEET_MAX_LINE];
+    snprintf(fn,sizeof(fn),"%s/%s.out",f->outdir,j->name);
+    iface->out = fopen(fn,"w");
+    if (!iface->out) {
+        printf("ERROR: Unable to create file '%s'\n",fn);
+        iface->out = stdout;
+        return false;
+    }
+
+    return rv_iface_resize(iface) && readelf(iface,j->argv[0]) && rv_iface_start(iface);
+}
+
+static void finish_job(rv_fleet* f, rv_fleet_queue* q, rv_fleet_job* j, uint32_t status)
+{
+    rv_interface* iface = j->iface;
+    j->elapsed = now_ms() - j->started;
+    j->status = status;
+    if (iface) {
+        j->exit_code = iface->exit_code;
+        j->instret = iface->vm.instret;
+        FILE* out = iface->out;
+        rv_iface_stop(iface);
+        if (out && out != stdout) fclose(out); // (NULL means the output was captured)
+        free(iface);
+        j->iface = NULL;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->active--;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&f->lock);
+    f->remaining--;
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Run one time slice of the job, then put it back into the queue (unless it's finished)
+static void run_slice(rv_fleet* f, rv_fleet_queue* q, rv_fleet_job* j)
+{
+    if (!j->iface) {
+        j->started = now_ms();
+        if (!start_job(f,j)) {
+            finish_job(f,q,j,RVSTAT_NOSTART);
+            return;
+        }
+    }
+
+    j->slices++;
+    for (int i = 0; i < FLEET_SLICES; i++) {
+        if (!rv_iface_step(j->iface)) {
+            finish_job(f,q,j,j->iface->status);
+            return;
+        }
+    }
+
+    if (j->timeout && now_ms() - j->started >= j->timeout) {
+        finish_job(f,q,j,RVSTAT_TIMEOUT);
+        return;
+    }
+
+    queue_push(q,j);
+}
+
+static void* worker(void* arg)
+{
+    rv_fleet_worker* w = (rv_fleet_worker*)arg;
+    rv_fleet* f = w->fleet;
+    rv_fleet_queue* q = f->queues + w->id;
+
+    for (;;) {
+        rv_fleet_job* j = admit(f,q);
+        if (!j) j = queue_pop(q,false);
+        if (!j) j = steal(f,w->id);
+        if (j) {
+            run_slice(f,q,j);
+            continue;
+        }
+
+        // nothing to do: either we're done, or the rest of the jobs are being run by other workers
+        pthread_mutex_lock(&f->lock);
+        uint32_t left = f->remaining;
+        pthread_mutex_unlock(&f->lock);
+        if (!left) break;
+
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts,NULL);
+    }
+    return NULL;
+}
+
+static bool write_summary(rv_fleet* f, uint32_t threads, double ms)
+{
+    char fn[FLEET_MAX_LINE];
+    snprintf(fn,sizeof(fn),"%s/summary.txt",f->outdir);
+    FILE* out = fopen(fn,"w");
+    if (!out) {
+        printf("ERROR: Unable to create file '%s'\n",fn);
+        return false;
+    }
+
+    uint32_t counts[RVSTAT_NOMEM + 1] = { 0 };
+    uint64_t total = 0;
+    fprintf(out,"# name\tstatus\texit_code\tinstructions\ttime_ms\tslices\n");
+    for (uint32_t i = 0; i < f->njobs; i++) {
+        rv_fleet_job* j = f->jobs + i;
+        fprintf(out,"%s\t%s\t%u\t%" PRIu64 "\t%.2f\t%u\n",j->name,status_names[j->status],j->exit_code,j->instret,j->elapsed,j->slices);
+        counts[j->status]++;
+        total += j->instret;
+    }
+    fclose(out);
+
+    uint32_t steals = 0;
+    for (uint32_t i = 0; i < threads; i++) steals += f->queues[i].steals;
+
+    printf("Fleet: %u jobs on %u threads in %.2f ms, %" PRIu64 " instructions (%.2f MIPS), %u steals\n",
+           f->njobs,threads,ms,total,ms? total / ms / 1000.0 : 0.0,steals);
+    printf("Fleet:");
+    for (uint32_t i = RVSTAT_EXIT; i <= RVSTAT_NOMEM; i++)
+        if (counts[i]) printf(" %u %s",counts[i],status_names[i]);
+    printf("; see %s for details\n",fn);
+    return true;
+}
+
+bool rv_fleet_run(rv_fleet* f, uint32_t threads, const char* outdir, uint32_t engine)
+{
+    if (!threads) threads = 1;
+    if (mkdir(outdir,0755) && errno != EEXIST) {
+        printf("ERROR: Unable to create directory '%s'\n",outdir);
+        return false;
+    }
+
+    f->outdir = outdir;
+    f->engine = engine;
+    f->next = 0;
+    f->remaining = f->njobs;
+    f->nthreads = threads;
+    f->queues = (rv_fleet_queue*)calloc(threads,sizeof(rv_fleet_queue));
+    rv_fleet_worker* workers = (rv_fleet_worker*)calloc(threads,sizeof(rv_fleet_worker));
+    pthread_t* tids = (pthread_t*)calloc(threads,sizeof(pthread_t));
+    if (!f->queues || !workers || !tids) {
+        printf("ERROR: Unable to allocate memory\n");
+        free(workers);
+        free(tids);
+        return false;
+    }
+
+    pthread_mutex_init(&f->lock,NULL);
+    for (uint32_t i = 0; i < threads; i++) pthread_mutex_init(&f->queues[i].lock,NULL);
+
+    double t = now_ms();
+    uint32_t started = 0;
+    for (; started < threads; started++) {
+        workers[started].fleet = f;
+        workers[started].id = started;
+        if (pthread_create(tids + started,NULL,worker,workers + started)) break;
+    }
+    // if some threads couldn't be created, the rest will do their work
+    if (!started) printf("ERROR: Unable to create worker threads\n");
+    for (uint32_t i = 0; i < started; i++) pthread_join(tids[i],NULL);
+    t = now_ms() - t;
+
+    for (uint32_t i = 0; i < threads; i++) pthread_mutex_destroy(&f->queues[i].lock);
+    pthread_mutex_destroy(&f->lock);
+    free(workers);
+    free(tids);
+
+    return started && write_summary(f,started,t);
+}
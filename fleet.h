@@ -0,0 +1,76 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef FLEET_H_
+#define FLEET_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "interface.h"
+
+#define FLEET_MAX_ACTIVE 8          /* max number of started jobs per worker thread (they're time-sliced) */
+#define FLEET_SLICES 4              /* number of rv_iface_step() calls in one time slice */
+#define FLEET_MAX_ARGS 64
+#define FLEET_MAX_LINE 4096
+
+typedef struct rv_fleet_job_s rv_fleet_job;
+
+// One guest job: program, its arguments and limits, and the results
+struct rv_fleet_job_s {
+    char* name;
+    int argc;                       /* argv[0] is ELF file name */
+    char** argv;
+    uint32_t ram_size;
+    uint32_t stack_size;
+    uint64_t budget;                /* Max instructions (0 means no limit) */
+    uint32_t timeout;               /* Wall-clock time limit, ms (0 means no limit) */
+    rv_interface* iface;            /* VM (only exists while the job is running) */
+    double started;
+    double elapsed;                 /* Wall-clock time from the first slice to the end, ms */
+    uint32_t status;                /* See rv_status in interface.h */
+    uint32_t exit_code;
+    uint64_t instret;
+    uint32_t slices;
+    rv_fleet_job* next;             /* Link in the run queue */
+};
+
+// Run queue of one worker thread
+typedef struct {
+    pthread_mutex_t lock;
+    rv_fleet_job* head;
+    rv_fleet_job* tail;
+    uint32_t active;                /* Started jobs owned by this worker (including the one it runs) */
+    uint32_t steals;                /* Statistics counter */
+} rv_fleet_queue;
+
+typedef struct {
+    rv_fleet_job* jobs;
+    uint32_t njobs;
+    uint32_t engine;                /* Execution engine for all jobs */
+    const char* outdir;             /* Directory for captured output of the jobs */
+    const char* root;               /* Sandbox directory for files of all jobs (NULL means no files) */
+    uint32_t out_flush;             /* When output of the jobs is written out (see console.h) */
+    pthread_mutex_t lock;           /* Protects the two fields below */
+    uint32_t next;                  /* Next job to start */
+    uint32_t remaining;             /* Jobs not finished yet */
+    rv_fleet_queue* queues;
+    uint32_t nthreads;
+} rv_fleet;
+
+// Load jobs manifest: one job per line, "name ram_kib stack_kib budget timeout_ms elf_file [arguments]"
+// (empty lines and lines starting with '#' are ignored). Returns NULL on error.
+rv_fleet* rv_fleet_load(const char* fn);
+void rv_fleet_destroy(rv_fleet* f);
+
+// Run all jobs on 'threads' worker threads, writing each job output into "<outdir>/<name>.out"
+// and per-job results into "<outdir>/summary.txt"
+bool rv_fleet_run(rv_fleet* f, uint32_t threads, const char* outdir, uint32_t engine);
+
+#endif /* FLEET_H_ */
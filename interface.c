@@ -7,102 +7,476 @@
  *
  * */
 
+#ifdef __linux__
+#define _GNU_SOURCE         /* memfd_create(), copy_file_range(), fallocate() and SEEK_DATA */
+#define IFACE_USE_MEMFD     /* RAM is backed by memory file, so VMs can be forked cheaply */
+#define IFACE_USE_HOSTFS    /* guest file syscalls are served by host files in the sandbox directory */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#if defined(SYS_openat2) && __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#define IFACE_USE_OPENAT2   /* the kernel keeps path lookup inside the sandbox */
+#endif
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include "interface.h"
 #include "riscv.h"
+#include "riscv_jit.h"
+#include "riscv_trace.h"
+#include "riscv_profile.h"
 #include "debug.h"
+#include "elf.h"
 #include "sdl_wrapper.h"
 
-#define RAM_BOUNDARY_CHECK(R) rv_interface* iface = (rv_interface*)st->user; \
-    if (addr >= iface->ram_size) { \
-        iface->error = 1; \
-        return R; \
+#define MEM_ACCESS(EXPR) rv_interface* iface = (rv_interface*)st->user; \
+    int fault = 0; \
+    EXPR; \
+    if (fault) st->fault = 1;
+
+// Memory access functions (RAM is usually accessed by the core directly, so we mostly get here for devices).
+// TRACE decides whether all the accesses are printed out: a constant for the specialised sets
+// (so there are no checks at all without DBG_MEM), or a run-time check for the generic one.
+#define MEM_FUNCS(SUFFIX,TRACE) \
+static uint32_t read8##SUFFIX(riscv_state* st, uint32_t addr) \
+{ \
+    MEM_ACCESS(uint32_t val = rv_mem_read(&iface->mem,addr,1,&fault)) \
+    if (TRACE) printf("Read byte from 0x%08X: 0x%02X\n",addr,val); \
+    return val; \
+} \
+\
+static uint32_t read16##SUFFIX(riscv_state* st, uint32_t addr) \
+{ \
+    MEM_ACCESS(uint32_t val = rv_mem_read(&iface->mem,addr,2,&fault)) \
+    if (TRACE) printf("Read half-word from 0x%08X: 0x%02X\n",addr,val); \
+    return val; \
+} \
+\
+static uint32_t read32##SUFFIX(riscv_state* st, uint32_t addr) \
+{ \
+    MEM_ACCESS(uint32_t val = rv_mem_read(&iface->mem,addr,4,&fault)) \
+    if (TRACE) printf("Read word from 0x%08X: 0x%02X\n",addr,val); \
+    return val; \
+} \
+\
+static void write8##SUFFIX(riscv_state* st, uint32_t addr, uint32_t val) \
+{ \
+    MEM_ACCESS(rv_mem_write(&iface->mem,addr,val & 0xFF,1,&fault)) \
+    if (TRACE) printf("Write byte to 0x%08X: 0x%02X\n",addr,val); \
+} \
+\
+static void write16##SUFFIX(riscv_state* st, uint32_t addr, uint32_t val) \
+{ \
+    MEM_ACCESS(rv_mem_write(&iface->mem,addr,val & 0xFFFF,2,&fault)) \
+    if (TRACE) printf("Write half-word to 0x%08X: 0x%02X\n",addr,val); \
+} \
+\
+static void write32##SUFFIX(riscv_state* st, uint32_t addr, uint32_t val) \
+{ \
+    MEM_ACCESS(rv_mem_write(&iface->mem,addr,val,4,&fault)) \
+    if (TRACE) printf("Write word to 0x%08X: 0x%02X\n",addr,val); \
+}
+
+#ifdef IFACE_GENERIC
+MEM_FUNCS(_generic,iface->debug & DBG_MEM)
+#else
+MEM_FUNCS(_plain,0)
+MEM_FUNCS(_traced,1)
+#endif
+
+#define SET_MEM_FUNCS(F,SUFFIX) \
+    (F)->read8 = read8##SUFFIX; \
+    (F)->read16 = read16##SUFFIX; \
+    (F)->read32 = read32##SUFFIX; \
+    (F)->write8 = write8##SUFFIX; \
+    (F)->write16 = write16##SUFFIX; \
+    (F)->write32 = write32##SUFFIX;
+
+// Program output and files are shared with the syscall ring thread, if there's one
+#define IO_LOCK(I) do { if ((I)->ring) rv_ring_lock((I)->ring); } while (0)
+#define IO_UNLOCK(I) do { if ((I)->ring) rv_ring_unlock((I)->ring); } while (0)
+
+// Console device: writing into data register prints a character
+static uint32_t console_read(void* user, uint32_t offset, uint32_t len)
+{
+    (void)user; (void)offset; (void)len;
+    return 0;
+}
+
+static void console_write(void* user, uint32_t offset, uint32_t val, uint32_t len)
+{
+    rv_interface* iface = (rv_interface*)user;
+    (void)len;
+    if (offset != IFACE_CONSOLE_DATA) return;
+    IO_LOCK(iface);
+    rv_console_putc(&iface->con,val & 0xFF);
+    IO_UNLOCK(iface);
+}
+
+// Guest file syscalls. Buffers are accessed right in guest RAM (one check for the whole buffer), and errors
+// are returned the way the kernel does it: as negative errno values.
+
+// Guest (newlib) open() flags
+#define GUEST_O_ACCMODE 0x0003
+#define GUEST_O_APPEND  0x0008
+#define GUEST_O_CREAT   0x0200
+#define GUEST_O_TRUNC   0x0400
+#define GUEST_O_EXCL    0x0800
+#define GUEST_AT_FDCWD  (-100)
+
+// Guest (newlib) struct kernel_stat, filled by fstat()
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t rdev;
+    uint64_t pad1;
+    int64_t size;
+    int32_t blksize;
+    int32_t pad2;
+    int64_t blocks;
+    struct {
+        int64_t sec;
+        int32_t nsec;
+        int32_t pad;
+    } times[3];             /* access, modification, status change */
+    int32_t reserved[2];
+} guest_stat;
+
+// Host pointer to the guest RAM range, or NULL if it isn't all in RAM
+static uint8_t* guest_span(rv_interface* iface, uint32_t addr, uint32_t len)
+{
+    if (addr >= iface->ram_space || len > iface->ram_space - addr) return NULL;
+    return iface->ram + addr;
+}
+
+// Host descriptor of the guest one (or IFACE_FD_OUT), or -1 if it's not open
+static int host_fd(rv_interface* iface, uint32_t fd)
+{
+    return (fd < IFACE_MAX_FILES)? iface->files[fd] : -1;
+}
+
+static int32_t file_write(rv_interface* iface, uint32_t fd, uint32_t addr, uint32_t len)
+{
+    if (len > INT32_MAX) len = INT32_MAX; // (so the result can't be taken for an error code)
+    int h = host_fd(iface,fd);
+    uint8_t* buf = guest_span(iface,addr,len);
+    if (h == -1) return -EBADF;
+    if (!buf) return -EFAULT;
+    if (h == IFACE_FD_OUT) {
+        rv_console_write(&iface->con,buf,len);
+        return len;
     }
+#ifdef IFACE_USE_HOSTFS
+    ssize_t r = write(h,buf,len);
+    return (r < 0)? -errno : r;
+#else
+    return -EBADF;
+#endif
+}
 
-// RAM read access functions
-static uint32_t read8(riscv_state* st, uint32_t addr)
+#ifdef IFACE_USE_HOSTFS
+// The data went around the core, so it doesn't know the code there might have changed
+// (the ring thread can't touch the caches, so it only collects the ranges)
+static void ram_written(rv_interface* iface, uint32_t addr, uint32_t len)
 {
-    RAM_BOUNDARY_CHECK(0)
-    uint8_t* ptr = iface->ram + addr;
-    uint32_t val = *ptr;
-    if (iface->debug & DBG_MEM) printf("Read byte from 0x%08X: 0x%02X\n",addr,val);
-    return val;
+    if (iface->in_ring) rv_ring_dirty(iface->ring,addr,len);
+    else riscv_icache_invalidate(&iface->vm,addr,len);
+#ifdef IFACE_USE_MEMFD
+    // the pages might be new ones, and they aren't page faults of the VM thread (see run_slice())
+    __atomic_add_fetch(&iface->ram_bound,(uint64_t)len + 2 * RVMEM_PAGE_SIZE,__ATOMIC_RELAXED);
+#endif
 }
 
-static uint32_t read16(riscv_state* st, uint32_t addr)
+static int32_t file_read(rv_interface* iface, uint32_t fd, uint32_t addr, uint32_t len)
 {
-    RAM_BOUNDARY_CHECK(0)
-    uint16_t* ptr = (uint16_t*)(iface->ram + addr);
-    uint32_t val = *ptr;
-    if (iface->debug & DBG_MEM) printf("Read half-word from 0x%08X: 0x%02X\n",addr,val);
-    return val;
+    if (len > INT32_MAX) len = INT32_MAX;
+    int h = host_fd(iface,fd);
+    uint8_t* buf = guest_span(iface,addr,len);
+    if (h < 0) return -EBADF;
+    if (!buf) return -EFAULT;
+    ssize_t r = read(h,buf,len);
+    if (r < 0) return -errno;
+    ram_written(iface,addr,r);
+    return r;
 }
 
-static uint32_t read32(riscv_state* st, uint32_t addr)
+// readv() and writev(): guest array of {base, length} pairs is turned into the host one
+// (it's copied first: the program keeps running while the ring thread does it, and could change it meanwhile)
+static int32_t file_vector(rv_interface* iface, uint32_t fd, uint32_t addr, uint32_t cnt, bool wr)
 {
-    RAM_BOUNDARY_CHECK(0)
-    uint32_t* ptr = (uint32_t*)(iface->ram + addr);
-    uint32_t val = *ptr;
-    if (iface->debug & DBG_MEM) printf("Read word from 0x%08X: 0x%02X\n",addr,val);
-    return val;
+    int h = host_fd(iface,fd);
+    uint8_t* ptr = guest_span(iface,addr,cnt * 8);
+    uint32_t vec[IFACE_MAX_IOV * 2];
+    struct iovec iov[IFACE_MAX_IOV];
+    if (h == -1 || (h == IFACE_FD_OUT && !wr)) return -EBADF;
+    if (cnt > IFACE_MAX_IOV) return -EINVAL;
+    if (!ptr) return -EFAULT;
+    memcpy(vec,ptr,cnt * 8);
+    // the total is limited the same way as for write() and read() (the buffers past it are left alone)
+    for (uint32_t i = 0, left = INT32_MAX; i < cnt; i++) {
+        if (vec[i*2+1] > left) vec[i*2+1] = left;
+        left -= vec[i*2+1];
+        iov[i].iov_base = guest_span(iface,vec[i*2],vec[i*2+1]);
+        iov[i].iov_len = vec[i*2+1];
+        if (!iov[i].iov_base) return -EFAULT;
+    }
+
+    if (h == IFACE_FD_OUT) {
+        uint32_t total = 0;
+        for (uint32_t i = 0; i < cnt; i++) {
+            rv_console_write(&iface->con,iov[i].iov_base,iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+
+    ssize_t r = wr? writev(h,iov,cnt) : readv(h,iov,cnt);
+    if (r < 0) return -errno;
+    for (uint32_t i = 0, left = r; i < cnt && left && !wr; i++) {
+        uint32_t n = (left < vec[i*2+1])? left : vec[i*2+1];
+        ram_written(iface,vec[i*2],n);
+        left -= n;
+    }
+    return r;
 }
 
-// RAM write access functions
-static void write8(riscv_state* st, uint32_t addr, uint32_t val)
+// Open the path inside the directory without openat2(): one component at a time, not going up, and not following
+// symbolic links (any of them could point outside), returns the descriptor or -1 (errno tells why)
+static int open_beneath(int root, const char* name, int flags, mode_t mode)
 {
-    RAM_BOUNDARY_CHECK()
-    uint8_t* ptr = iface->ram + addr;
-    *ptr = val & 0xFF;
-    if (iface->debug & DBG_MEM) printf("Write byte to 0x%08X: 0x%02X\n",addr,val);
+    char part[NAME_MAX + 1];
+    int dir = root, h = -1;
+    for (;;) {
+        while (*name == '/') name++;
+        size_t len = strcspn(name,"/");
+        if (len > NAME_MAX) {
+            errno = ENAMETOOLONG;
+            break;
+        }
+        if (len == 2 && name[0] == '.' && name[1] == '.') {
+            errno = EACCES;
+            break;
+        }
+        memcpy(part,len? name : ".",len? len : 1);
+        part[len? len : 1] = 0;
+        name += len;
+        while (*name == '/') name++;
+
+        // the last one is the file itself, the rest are directories
+        if (!*name) {
+            h = openat(dir,part,flags | O_NOFOLLOW,mode);
+            break;
+        }
+        int next = openat(dir,part,O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir != root) close(dir);
+        dir = next;
+        if (dir < 0) return -1;
+    }
+    if (dir != root) {
+        int err = errno;
+        close(dir);
+        errno = err;
+    }
+    return h;
 }
 
-static void write16(riscv_state* st, uint32_t addr, uint32_t val)
+// Open a file in the sandbox directory. Absolute paths start at its top, and nothing outside of it can be reached.
+static int32_t file_open(rv_interface* iface, int32_t dir, uint32_t path, uint32_t flags, uint32_t mode)
 {
-    RAM_BOUNDARY_CHECK()
-    uint16_t* ptr = (uint16_t*)(iface->ram + addr);
-    *ptr = val & 0xFFFF;
-    if (iface->debug & DBG_MEM) printf("Write half-word to 0x%08X: 0x%02X\n",addr,val);
+    // the path is copied before it's checked, so the program can't change it after that (see file_vector())
+    char name[PATH_MAX];
+    if (path >= iface->ram_space) return -EFAULT;
+    uint32_t max = iface->ram_space - path;
+    if (max > PATH_MAX) max = PATH_MAX;
+    if (!memccpy(name,iface->ram + path,0,max)) return (max < PATH_MAX)? -EFAULT : -ENAMETOOLONG;
+    if (dir != GUEST_AT_FDCWD) return -EBADF; // (no directory descriptors)
+    if (iface->root_fd < 0) return -EACCES;
+
+    int fd = 0;
+    while (fd < IFACE_MAX_FILES && iface->files[fd] != -1) fd++;
+    if (fd == IFACE_MAX_FILES) return -EMFILE;
+
+    int hflags = ((flags & GUEST_O_ACCMODE) == 1)? O_WRONLY : ((flags & GUEST_O_ACCMODE) == 2)? O_RDWR : O_RDONLY;
+    if (flags & GUEST_O_APPEND) hflags |= O_APPEND;
+    if (flags & GUEST_O_CREAT) hflags |= O_CREAT;
+    if (flags & GUEST_O_TRUNC) hflags |= O_TRUNC;
+    if (flags & GUEST_O_EXCL) hflags |= O_EXCL;
+    hflags |= O_CLOEXEC | O_NOCTTY;
+    mode &= 0777;
+
+    if (iface->debug & DBG_SYSCALL) printf("Opening file '%s' (flags 0x%X)\n",name,flags);
+
+    int h = -1;
+#ifdef IFACE_USE_OPENAT2
+    struct open_how how = { .flags = (uint64_t)hflags, .mode = (hflags & O_CREAT)? mode : 0, .resolve = RESOLVE_IN_ROOT };
+    h = syscall(SYS_openat2,iface->root_fd,name,&how,sizeof(how));
+    if (h < 0 && errno != ENOSYS) return -errno;
+#endif
+    if (h < 0) {
+        // no openat2() (or an older kernel), so we walk the path ourselves
+        h = open_beneath(iface->root_fd,name,hflags,mode);
+        if (h < 0) return -errno;
+    }
+
+    iface->files[fd] = h;
+    return fd;
 }
 
-static void write32(riscv_state* st, uint32_t addr, uint32_t val)
+static int32_t file_close(rv_interface* iface, uint32_t fd)
 {
-    RAM_BOUNDARY_CHECK()
-    uint32_t* ptr = (uint32_t*)(iface->ram + addr);
-    *ptr = val;
-    if (iface->debug & DBG_MEM) printf("Write word to 0x%08X: 0x%02X\n",addr,val);
+    int h = host_fd(iface,fd);
+    if (h == -1) return -EBADF;
+    iface->files[fd] = -1;
+    // (standard streams are the host ones, so they're left open)
+    if (h > STDERR_FILENO && close(h)) return -errno;
+    return 0;
 }
 
-// ECALL (a.k.a. SYSCALL) instruction implementation
-static uint8_t ecall(riscv_state* st)
+static int32_t file_seek(rv_interface* iface, uint32_t fd, int32_t off, uint32_t whence)
 {
-    rv_interface* iface = (rv_interface*)st->user;
+    int h = host_fd(iface,fd);
+    if (h == -1) return -EBADF;
+    if (h == IFACE_FD_OUT) return -ESPIPE;
+    off_t r = lseek(h,off,whence);
+    if (r < 0) return -errno;
+    return (r > INT32_MAX)? -EOVERFLOW : r;
+}
 
-    // trace - syscalls
-    if (iface->debug & DBG_SYSCALL)
-        printf("Syscall request %u encountered at ip=0x%08X\n",st->regs[RVR_A7],st->ip);
+static int32_t file_stat(rv_interface* iface, uint32_t fd, uint32_t addr)
+{
+    int h = host_fd(iface,fd);
+    uint8_t* buf = guest_span(iface,addr,sizeof(guest_stat));
+    guest_stat gs;
+    struct stat sb;
+    if (h == -1) return -EBADF;
+    if (!buf) return -EFAULT;
+
+    memset(&gs,0,sizeof(guest_stat));
+    if (h == IFACE_FD_OUT) {
+        // a terminal, as far as the program is concerned (so newlib makes it line-buffered)
+        gs.mode = S_IFCHR | 0620;
+        gs.nlink = 1;
+    } else {
+        if (fstat(h,&sb)) return -errno;
+        gs.dev = sb.st_dev;
+        gs.ino = sb.st_ino;
+        gs.mode = sb.st_mode;
+        gs.nlink = sb.st_nlink;
+        gs.uid = sb.st_uid;
+        gs.gid = sb.st_gid;
+        gs.rdev = sb.st_rdev;
+        gs.size = sb.st_size;
+        gs.blksize = sb.st_blksize;
+        gs.blocks = sb.st_blocks;
+        gs.times[0].sec = sb.st_atim.tv_sec;
+        gs.times[0].nsec = sb.st_atim.tv_nsec;
+        gs.times[1].sec = sb.st_mtim.tv_sec;
+        gs.times[1].nsec = sb.st_mtim.tv_nsec;
+        gs.times[2].sec = sb.st_ctim.tv_sec;
+        gs.times[2].nsec = sb.st_ctim.tv_nsec;
+    }
+
+    memcpy(buf,&gs,sizeof(guest_stat));
+    ram_written(iface,addr,sizeof(guest_stat));
+    return 0;
+}
+#endif
+
+// File syscalls (from ECALL or from the ring), returns false if it isn't one of them
+static bool file_syscall(rv_interface* iface, uint32_t num, const uint32_t* a, int32_t* res)
+{
+    switch (num) {
+    case RVSYS_WRITE:
+        *res = file_write(iface,a[0],a[1],a[2]);
+        break;
+
+#ifdef IFACE_USE_HOSTFS
+    case RVSYS_OPENAT:
+        *res = file_open(iface,a[0],a[1],a[2],a[3]);
+        break;
+
+    case RVSYS_OPEN:
+        *res = file_open(iface,GUEST_AT_FDCWD,a[0],a[1],a[2]);
+        break;
 
-    // execute known syscall
-    switch (st->regs[RVR_A7]) {
     case RVSYS_CLOSE:
-        //TODO
-        st->regs[RVR_A0] = 0; // success
+        *res = file_close(iface,a[0]);
         break;
 
-    case RVSYS_WRITE:
-        for (unsigned j = 0; j < st->regs[RVR_A2]; j++) putchar(read8(st,st->regs[RVR_A1]+j));
-        st->regs[RVR_A0] = st->regs[RVR_A2]; // return length field
+    case RVSYS_LSEEK:
+        *res = file_seek(iface,a[0],a[1],a[2]);
+        break;
+
+    case RVSYS_READ:
+        *res = file_read(iface,a[0],a[1],a[2]);
+        break;
+
+    case RVSYS_READV:
+    case RVSYS_WRITEV:
+        *res = file_vector(iface,a[0],a[1],a[2],num == RVSYS_WRITEV);
         break;
 
     case RVSYS_FSTAT:
-        //TODO
-        st->regs[RVR_A0] = 0; // success
+        *res = file_stat(iface,a[0],a[1]);
         break;
+#else
+    case RVSYS_CLOSE:
+    case RVSYS_FSTAT:
+        *res = 0; // (pretend it's done)
+        break;
+#endif
+
+    default:
+        return false;
+    }
+    return true;
+}
+
+// Asynchronous syscall ring: requests are run by its own thread (see ring.h)
+static int32_t ring_handler(void* user, uint32_t op, const uint32_t* args)
+{
+    rv_interface* iface = (rv_interface*)user;
+    int32_t res = -ENOSYS;
+    iface->in_ring = true;
+    file_syscall(iface,op,args,&res);
+    iface->in_ring = false;
+    return res;
+}
+
+static void ring_written(void* user, uint32_t addr, uint32_t len)
+{
+    riscv_icache_invalidate(&((rv_interface*)user)->vm,addr,len);
+}
+
+// ECALL (a.k.a. SYSCALL) instruction implementation
+static uint8_t ecall(riscv_state* st)
+{
+    rv_interface* iface = (rv_interface*)st->user;
+
+    // trace - syscalls
+    if (iface->debug & DBG_SYSCALL)
+        printf("Syscall request %u encountered at ip=0x%08X\n",st->regs[RVR_A7],st->ip);
 
+    // execute known syscall
+    uint32_t* a = st->regs + RVR_A0;
+    int32_t res;
+    switch (st->regs[RVR_A7]) {
     case RVSYS_EXIT:
         if (iface->debug & DBG_SYSCALL) printf("Exiting with code %u\n",st->regs[RVR_A0]);
+        iface->exit_code = st->regs[RVR_A0];
         return 1;
 
     case RVSYS_BRK:
@@ -113,8 +487,23 @@ static uint8_t ecall(riscv_state* st)
         st->regs[RVR_A0] = iface->prog_break;
         break;
 
+    case RVSYS_RING_SETUP:
+        if (iface->debug & DBG_SYSCALL) printf("Syscall ring at 0x%08X, %u entries\n",a[0],a[1]);
+        if (iface->ring) res = -EBUSY;
+        else iface->ring = rv_ring_create(iface->ram,iface->ram_space,a[0],a[1],ring_handler,ring_written,iface,&res);
+        a[0] = res;
+        break;
+
+    case RVSYS_RING_ENTER:
+        a[0] = iface->ring? rv_ring_enter(iface->ring,a[0]) : -EINVAL;
+        break;
+
     default:
-        printf("WARNING: Unimplemented syscall %d\n",st->regs[RVR_A7]);
+        IO_LOCK(iface);
+        bool known = file_syscall(iface,st->regs[RVR_A7],a,&res);
+        IO_UNLOCK(iface);
+        if (known) a[0] = res;
+        else printf("WARNING: Unimplemented syscall %d\n",st->regs[RVR_A7]);
     }
 
     return 0;
@@ -123,18 +512,121 @@ static uint8_t ecall(riscv_state* st)
 // EBREAK instruction implementation
 static void ebreak(riscv_state* st)
 {
+    rv_interface* iface = (rv_interface*)st->user;
+    if (iface->headless) {
+        IO_LOCK(iface);
+        rv_console_printf(&iface->con,"Breakpoint encountered at ip=0x%08X\n",st->ip);
+        IO_UNLOCK(iface);
+        return;
+    }
+
     printf("Breakpoint encountered at ip=0x%08X\nPress Enter to continue\n",st->ip);
     // simply stop there, probably I'll fit some debug output later
     getchar();
 }
 
+// Put program arguments on top of the stack, the way crt0 expects them: argc, argv[], NULL, envp[] (empty)
+static bool push_args(rv_interface* iface)
+{
+    uint32_t len = 0;
+    for (int i = 0; i < iface->argc; i++) len += strlen(iface->argv[i]) + 1;
+
+    uint32_t str = (iface->stack_start - len) & ~15U;
+    uint32_t sp = (str - (iface->argc + 3) * 4) & ~15U;
+    if (len > iface->stack_start || sp < iface->ram_space - iface->stack_size || sp > str) {
+        printf("ERROR: Program arguments don't fit into the stack\n");
+        return false;
+    }
+
+    uint32_t* vec = (uint32_t*)(iface->ram + sp);
+    vec[0] = iface->argc;
+    for (int i = 0; i < iface->argc; i++) {
+        uint32_t n = strlen(iface->argv[i]) + 1;
+        memcpy(iface->ram + str,iface->argv[i],n);
+        vec[i+1] = str;
+        str += n;
+    }
+    vec[iface->argc+1] = 0; // end of argv
+    vec[iface->argc+2] = 0; // end of envp
+
+    iface->vm.regs[RVR_SP] = sp;
+    iface->vm.regs[RVR_A0] = iface->argc;
+    iface->vm.regs[RVR_A1] = sp + 4;
+    return true;
+}
+
 void rv_iface_init(rv_interface* iface)
 {
     memset(iface,0,sizeof(rv_interface));
+    rv_mem_init(&iface->mem);
+    iface->out = stdout;
+
+    // standard input is the host one, and both output streams go into 'out'
+    iface->root_fd = -1;
+    for (int i = 0; i < IFACE_MAX_FILES; i++) iface->files[i] = -1;
+    iface->files[0] = 0;
+    iface->files[1] = IFACE_FD_OUT;
+    iface->files[2] = IFACE_FD_OUT;
 }
 
+#ifdef IFACE_USE_MEMFD
+// Create memory file for RAM contents (so VM could be forked cheaply later). It's sparse, so it takes
+// no memory until something is written into it.
+static rv_ramfile* ram_file_create(void)
+{
+    rv_ramfile* f = (rv_ramfile*)malloc(sizeof(rv_ramfile));
+    if (!f) return NULL;
+    f->refs = 1;
+    f->fd = memfd_create("nanorvi-ram",MFD_CLOEXEC);
+    if (f->fd >= 0 && !ftruncate(f->fd,IFACE_RAM_SPACE)) return f;
+    if (f->fd >= 0) close(f->fd);
+    free(f);
+    return NULL;
+}
+
+static void ram_file_release(rv_ramfile* f)
+{
+    if (f && !__atomic_sub_fetch(&f->refs,1,__ATOMIC_ACQ_REL)) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+// Map the whole RAM space of the file. Nothing is reserved for private mappings either, so the pages
+// are only accounted for when they're written into.
+static uint8_t* ram_map(rv_ramfile* f, void* addr, bool shared)
+{
+    int flags = (shared? MAP_SHARED : MAP_PRIVATE) | MAP_NORESERVE | (addr? MAP_FIXED : 0);
+    void* ptr = mmap(addr,IFACE_RAM_SPACE,PROT_READ | PROT_WRITE,flags,f->fd,0);
+    return (ptr == MAP_FAILED)? NULL : (uint8_t*)ptr;
+}
+#endif
+
 bool rv_iface_resize(rv_interface* iface)
 {
+    if (!iface->ram_size || iface->ram_size > IFACE_RAM_SPACE) {
+        printf("ERROR: RAM size must be between 1 and %u bytes\n",IFACE_RAM_SPACE);
+        return false;
+    }
+
+#ifdef IFACE_USE_MEMFD
+    // RAM is a shared mapping of memory file (unless it couldn't be created), which covers the whole RAM space,
+    // and RAM size only limits how much of it could be used, so there's nothing to do once it's mapped
+    if (iface->ram_mapped) return true;
+    if (!iface->ram && (iface->ram_file = ram_file_create())) {
+        iface->ram = ram_map(iface->ram_file,NULL,true);
+        if (iface->ram) {
+            iface->ram_mapped = IFACE_RAM_SPACE;
+            iface->ram_space = IFACE_RAM_SPACE;
+            iface->ram_shared = true;
+            iface->ram_synced = true;
+            return true;
+        }
+        ram_file_release(iface->ram_file);
+        iface->ram_file = NULL;
+    }
+#endif
+
     // (Re-) Allocate RAM
     uint8_t* ptr = (uint8_t*)realloc(iface->ram,iface->ram_size);
     if (!ptr) {
@@ -143,78 +635,705 @@ bool rv_iface_resize(rv_interface* iface)
     }
 
     iface->ram = ptr;
+    iface->ram_space = iface->ram_size;
     return true;
 }
 
+#ifdef IFACE_USE_MEMFD
+// Resident pages of RAM mapping, one byte per page (see mincore()), NULL if it's unknown
+static uint8_t* resident_pages(rv_interface* iface)
+{
+    uint8_t* vec = (uint8_t*)malloc(iface->ram_mapped / RVMEM_PAGE_SIZE);
+    if (vec && mincore(iface->ram,iface->ram_mapped,vec)) {
+        free(vec);
+        return NULL;
+    }
+    return vec;
+}
+
+// Page faults taken by the calling thread so far
+static uint64_t thread_faults(void)
+{
+    struct rusage ru;
+    return getrusage(RUSAGE_THREAD,&ru)? 0 : (uint64_t)ru.ru_minflt + ru.ru_majflt;
+}
+#endif
+
+uint64_t rv_iface_committed(rv_interface* iface)
+{
+#ifdef IFACE_USE_MEMFD
+    if (!iface->ram_mapped) return 0;
+
+    // shared mapping has all of its pages in the file
+    struct stat sb;
+    if (iface->ram_shared) return fstat(iface->ram_file->fd,&sb)? 0 : (uint64_t)sb.st_blocks * 512;
+
+    // private one has its own copies of some of them, so count resident pages instead (file pages are among them)
+    uint8_t* vec = resident_pages(iface);
+    if (!vec) return 0;
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < iface->ram_mapped / RVMEM_PAGE_SIZE; i++) n += vec[i] & 1;
+    free(vec);
+    return n * RVMEM_PAGE_SIZE;
+#else
+    (void)iface;
+    return 0;
+#endif
+}
+
+// Allocate the caches (and native code translator) for selected engine
+static bool alloc_caches(rv_interface* iface)
+{
+    // Allocate pre-decoded instructions cache
+    iface->vm.icache = (riscv_icache*)malloc(sizeof(riscv_icache));
+    if (!iface->vm.icache) {
+        printf("ERROR: Unable to allocate instruction cache\n");
+        return false;
+    }
+    riscv_icache_reset(iface->vm.icache);
+
+    // Profiler counts translated blocks, so it needs a block engine (but native code isn't profiled)
+    if (iface->debug & DBG_PROFILE) iface->engine = RVENG_THREADED;
+
+    // Per-instruction debug output is only possible with the reference engine
+    if (iface->debug & (DBG_TRACE | DBG_REGS | DBG_INTERACTIVE)) iface->engine = RVENG_REFERENCE;
+
+    if (iface->engine == RVENG_THREADED || iface->engine == RVENG_JIT) {
+        // zero-filled cache is a reset one, and calloc() lets the pages stay untouched until they're used
+        iface->vm.bcache = (riscv_bcache*)calloc(1,sizeof(riscv_bcache));
+        if (!iface->vm.bcache) {
+            printf("ERROR: Unable to allocate translated blocks cache\n");
+            return false;
+        }
+    }
+
+    if (iface->engine == RVENG_JIT) {
+#ifdef RV_USE_JIT
+        iface->vm.jit = riscv_jit_create(0);
+        if (!iface->vm.jit) {
+            printf("ERROR: Unable to allocate native code buffer\n");
+            return false;
+        }
+#else
+        printf("ERROR: Native code translator is not available in this build\n");
+        return false;
+#endif
+    }
+
+    return true;
+}
+
+// Execute up to 'slice' instructions and check the results
+static bool run_slice(rv_interface* iface, uint64_t slice)
+{
+    // forked VMs get their caches only when they actually run
+    if (!iface->vm.icache && !alloc_caches(iface)) {
+        iface->status = RVSTAT_ERROR;
+        return false;
+    }
+
+    // check the instruction budget
+    if (iface->budget) {
+        if (iface->vm.instret >= iface->budget) {
+            iface->status = RVSTAT_BUDGET;
+            return false;
+        }
+        if (slice > iface->budget - iface->vm.instret) slice = iface->budget - iface->vm.instret;
+    }
+
+    // private RAM won't match its memory file anymore (see rv_iface_fork())
+    iface->ram_synced = iface->ram_shared;
+
+#ifdef IFACE_USE_MEMFD
+    // RAM size is a soft limit: pages are committed when the program touches them, so it's checked afterwards.
+    // Counting them is a system call (or a look at every page of private mapping), but every new page is a page fault,
+    // so 'ram_bound' (the last count plus a page per fault) tells when it's needed. The slice is cut short when
+    // the bound gets close to the limit, so the program can't get far past it (an instruction touches one page).
+    uint64_t faults = 0;
+    if (iface->ram_mapped) {
+        uint64_t room = (iface->ram_bound < iface->ram_size)? (iface->ram_size - iface->ram_bound) / RVMEM_PAGE_SIZE : 0;
+        if (room < IFACE_MIN_SLICE) room = IFACE_MIN_SLICE;
+        if (slice > room) slice = room;
+        faults = thread_faults();
+    }
+#endif
+
+    // actual instruction execution :)
+    riscv_exit ret = riscv_run(&(iface->vm),slice,NULL);
+
+#ifdef IFACE_USE_MEMFD
+    if (iface->ram_mapped) {
+        faults = thread_faults() - faults;
+        uint64_t bound = __atomic_add_fetch(&iface->ram_bound,faults * RVMEM_PAGE_SIZE,__ATOMIC_RELAXED);
+        if (bound > iface->ram_size) {
+            // (the ring thread might be adding its pages meanwhile, so the difference is added instead of the count)
+            uint64_t used = rv_iface_committed(iface);
+            __atomic_add_fetch(&iface->ram_bound,used - bound,__ATOMIC_RELAXED);
+            if (used > iface->ram_size) {
+                IO_LOCK(iface);
+                rv_console_printf(&iface->con,"ERROR: out of memory (%" PRIu64 " KiB of RAM used, %u KiB allowed)\n",
+                                  used / 1024,iface->ram_size / 1024);
+                IO_UNLOCK(iface);
+                iface->status = RVSTAT_NOMEM;
+                return false;
+            }
+        }
+    }
+#endif
+
+    // show the framebuffer (closing the window stops the VM)
+    if (iface->framebuf && sdl_wrapper_update(&iface->sdl,iface->framebuf)) {
+        iface->status = RVSTAT_CLOSED;
+        return false;
+    }
+
+    // check for errors
+    switch (ret) {
+    case RVEXIT_BUDGET:
+    case RVEXIT_BREAKPOINT:
+        return true;
+    case RVEXIT_HALT:
+        iface->status = RVSTAT_EXIT;
+        return false;
+    case RVEXIT_FAULT:
+        IO_LOCK(iface);
+        rv_console_printf(&iface->con,"ERROR: execution error %u\n",iface->vm.fault);
+        IO_UNLOCK(iface);
+        iface->status = RVSTAT_FAULT;
+        return false;
+    default:
+        iface->status = RVSTAT_ERROR;
+        return false;
+    }
+}
+
+// Step functions: DEBUG is debug options, a constant for the specialised ones (so the checks below
+// are compiled out), or the actual options for the generic one. Per-instruction trace means one instruction per step.
+#define STEP_FUNC(NAME,DEBUG) \
+static bool NAME(rv_interface* iface) \
+{ \
+    /* trace - part 1 */ \
+    if ((DEBUG) & DBG_TRACE) { \
+        char buf[IFACE_DISASM_MAX_LEN]; \
+        riscv_exit r = riscv_disasm((*(uint32_t*)(iface->ram+iface->vm.ip)),buf,sizeof(buf)); \
+        if (r == RVEXIT_SUCCESS) \
+            printf("0x%08X: %s\n",iface->vm.ip,buf); \
+    } \
+\
+    /* trace - part 2, registers */ \
+    if ((DEBUG) & DBG_REGS) { \
+        for (int k = 1; k < 32; k++) printf("%d ",iface->vm.regs[k]); \
+        puts(""); \
+    } \
+\
+    /* trace - part 3, interactive wait */ \
+    if ((DEBUG) & DBG_INTERACTIVE) getchar(); \
+\
+    return run_slice(iface,((DEBUG) & (DBG_TRACE | DBG_REGS | DBG_INTERACTIVE))? 1 : IFACE_RUN_SLICE); \
+}
+
+#ifdef IFACE_GENERIC
+STEP_FUNC(step_generic,iface->debug)
+#else
+STEP_FUNC(step_plain,0)
+STEP_FUNC(step_traced,iface->debug)
+#endif
+
 bool rv_iface_start(rv_interface* iface)
 {
     iface->vm.user = iface; // create circular pointer
 
-    // Fill in all the callbacks
-    iface->vm.funcs.read8 = read8;
-    iface->vm.funcs.read16 = read16;
-    iface->vm.funcs.read32 = read32;
-    iface->vm.funcs.write8 = write8;
-    iface->vm.funcs.write16 = write16;
-    iface->vm.funcs.write32 = write32;
+    // Fill in all the callbacks, and select step function, specialised for debug options
+#ifdef IFACE_GENERIC
+    SET_MEM_FUNCS(&iface->vm.funcs,_generic)
+    iface->step = step_generic;
+#else
+    if (iface->debug & DBG_MEM) {
+        SET_MEM_FUNCS(&iface->vm.funcs,_traced)
+    } else {
+        SET_MEM_FUNCS(&iface->vm.funcs,_plain)
+    }
+    iface->step = (iface->debug & (DBG_TRACE | DBG_REGS | DBG_INTERACTIVE))? step_traced : step_plain;
+#endif
     iface->vm.funcs.ecall = ecall;
     iface->vm.funcs.ebreak = ebreak;
 
-    // If stack bottom is still not initialized, set it to the end of RAM
-    if (!iface->stack_start) iface->stack_start = iface->ram_size - 4;
+    // Program output is buffered (debug output isn't, so it has to be written line by line to keep them in order)
+    uint32_t flush = (iface->debug && iface->out_flush == RVCON_FLUSH_AUTO)? RVCON_FLUSH_LINE : iface->out_flush;
+    if (!rv_console_init(&iface->con,iface->out,flush,0)) {
+        printf("ERROR: Unable to allocate output buffer\n");
+        return false;
+    }
+
+#ifdef IFACE_USE_HOSTFS
+    // Guest files are opened relative to the sandbox directory
+    if (iface->root) {
+        iface->root_fd = open(iface->root,O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (iface->root_fd < 0) {
+            printf("ERROR: Unable to open directory '%s'\n",iface->root);
+            return false;
+        }
+    }
+#else
+    if (iface->root) printf("WARNING: Guest files aren't supported in this build\n");
+#endif
+
+    // Build the memory map: RAM at 0, console registers and (optionally) the framebuffer
+    if (!rv_mem_add(&iface->mem,RVMEM_RAM,0,iface->ram_space,iface->ram,NULL,NULL,iface) ||
+        !rv_mem_add(&iface->mem,RVMEM_MMIO,IFACE_CONSOLE_BASE,RVMEM_PAGE_SIZE,NULL,console_read,console_write,iface)) {
+        printf("ERROR: Unable to build memory map\n");
+        return false;
+    }
+
+    if (iface->frame_w && iface->frame_h) {
+        uint32_t len = (uint32_t)iface->frame_w * iface->frame_h * 4;
+        iface->framebuf = (uint8_t*)calloc(len,1);
+        if (!iface->framebuf || !rv_mem_add(&iface->mem,RVMEM_RAM,IFACE_FRAMEBUF_BASE,len,iface->framebuf,NULL,NULL,iface)) {
+            printf("ERROR: Unable to allocate framebuffer\n");
+            return false;
+        }
+    }
+
+    // Let the core access RAM directly (unless we need to trace all memory transactions)
+    if (!(iface->debug & DBG_MEM)) {
+        iface->vm.ram = iface->ram;
+        iface->vm.ram_base = 0;
+        iface->vm.ram_size = iface->ram_space;
+    }
+
+    if (!alloc_caches(iface)) return false;
+
+    // Binary trace is written by its own thread while VM runs
+    if (iface->trace_file) {
+        iface->vm.trace = riscv_trace_create(iface->trace_file,IFACE_TRACE_BUF,RV_TRACE_MEM);
+        if (!iface->vm.trace) {
+            printf("ERROR: Unable to create trace file '%s'\n",iface->trace_file);
+            return false;
+        }
+    }
+
+    if ((iface->debug & DBG_PROFILE) && iface->vm.bcache) {
+        iface->vm.profile = riscv_profile_create();
+        if (!iface->vm.profile) {
+            printf("ERROR: Unable to allocate profiler\n");
+            return false;
+        }
+    }
+
+    // If stack bottom is still not initialized, set it to the end of RAM space (with memory file, it's way above
+    // RAM size, which only limits committed memory, so the heap could take all of that, wherever the program is)
+    if (!iface->stack_start) iface->stack_start = iface->ram_space - 4;
 
     // Set IP & SP
     iface->vm.ip = iface->start;
     iface->vm.regs[RVR_SP] = iface->stack_start;
 
     // Set other limits
-    iface->heap_max = iface->ram_size - iface->stack_size;
+    iface->heap_max = iface->ram_space - iface->stack_size;
+
+    // Pass the arguments
+    if (iface->argc && !push_args(iface)) return false;
 
     // Finally, if we're using graphics, let's initialize it
     if (iface->frame_w && iface->frame_h) {
-        int r = sdl_wrapper_init(iface->frame_w,iface->frame_h,"NanoRVI");
+        int r = sdl_wrapper_init(&iface->sdl,iface->frame_w,iface->frame_h,"NanoRVI");
         if (r) {
             printf("ERROR: unable to initialize graphics (error code = %d)\n",r);
             return false;
         }
     }
 
+    // the program and its arguments are in RAM already, and the rest is counted as it runs (see run_slice())
+    iface->ram_bound = rv_iface_committed(iface);
     return true;
 }
 
-bool rv_iface_step(rv_interface* iface)
+#ifdef IFACE_USE_MEMFD
+// Copy all data of one memory file into another one (holes are skipped, so it stays sparse)
+static bool copy_data(int from, int to)
 {
-    // trace - part 1
-    if (iface->debug & DBG_TRACE) {
-        char buf[IFACE_DISASM_MAX_LEN];
-        riscv_exit r = riscv_disasm((*(uint32_t*)(iface->ram+iface->vm.ip)),buf,sizeof(buf));
-        if (r == RVEXIT_SUCCESS)
-            printf("0x%08X: %s\n",iface->vm.ip,buf);
+    uint8_t buf[RVMEM_PAGE_SIZE];
+    off_t pos = 0, end;
+    while ((pos = lseek(from,pos,SEEK_DATA)) >= 0) {
+        if ((end = lseek(from,pos,SEEK_HOLE)) < pos) return false;
+        while (pos < end) {
+            off_t dst = pos;
+            if (copy_file_range(from,&pos,to,&dst,end - pos,0) > 0) continue;
+            // (copying between files might be unsupported, so do it the old way)
+            ssize_t len = pread(from,buf,sizeof(buf),pos);
+            if (len <= 0 || pwrite(to,buf,len,pos) != len) return false;
+            pos += len;
+        }
     }
+    return errno == ENXIO; // no more data
+}
+
+// Write RAM pages which might differ from the old file into the new one: resident pages of private mapping
+// (written ones are among them) and ranges mapped from other files. All-zero pages become holes (the old file
+// might have had some data there).
+static bool write_changes(rv_interface* iface, int fd)
+{
+    uint32_t npages = iface->ram_mapped / RVMEM_PAGE_SIZE;
+    uint8_t* vec = resident_pages(iface);
+    if (!vec) return false;
+    for (uint32_t i = 0; i < iface->nmaps; i++)
+        memset(vec + iface->maps[i][0] / RVMEM_PAGE_SIZE,1,(iface->maps[i][1] + RVMEM_PAGE_SIZE - 1) / RVMEM_PAGE_SIZE);
 
-    // trace - part 2, registers
-    if (iface->debug & DBG_REGS) {
-        for (int k = 1; k < 32; k++) printf("%d ",iface->vm.regs[k]);
-        puts("");
+    static const uint8_t zero[RVMEM_PAGE_SIZE] = { 0 };
+    bool ok = true;
+    for (uint32_t i = 0; i < npages && ok; i++) {
+        uint8_t* page = iface->ram + i * RVMEM_PAGE_SIZE;
+        if (!(vec[i] & 1)) continue;
+        off_t pos = (off_t)i * RVMEM_PAGE_SIZE;
+        if (memcmp(page,zero,RVMEM_PAGE_SIZE))
+            ok = pwrite(fd,page,RVMEM_PAGE_SIZE,pos) == RVMEM_PAGE_SIZE;
+        else
+            ok = !fallocate(fd,FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,pos,RVMEM_PAGE_SIZE) ||
+                 pwrite(fd,zero,RVMEM_PAGE_SIZE,pos) == RVMEM_PAGE_SIZE;
     }
+    free(vec);
+    return ok;
+}
 
-    // trace - part 3, interactive wait
-    if (iface->debug & DBG_INTERACTIVE) getchar();
+// Make sure the memory file has current RAM contents, and turn RAM into a private (copy-on-write) mapping of it
+static bool ram_snapshot(rv_interface* iface)
+{
+    if (!iface->ram_mapped) return false;
 
-    // actual instruction execution :)
-    riscv_exit ret = riscv_exec(&(iface->vm));
+    if (!iface->ram_synced) {
+        // RAM has diverged from the file, so we need a new one: data of the old one, plus what's changed since then
+        rv_ramfile* f = ram_file_create();
+        if (!f) return false;
+        if (!copy_data(iface->ram_file->fd,f->fd) || !write_changes(iface,f->fd)) {
+            ram_file_release(f);
+            return false;
+        }
+        ram_file_release(iface->ram_file);
+        iface->ram_file = f;
+        iface->ram_shared = true; // (not yet, but it has the same contents now)
+    }
 
-    // check for errors
-    if (iface->error) {
-        printf("ERROR: execution error %u\n",iface->error);
+    // replace the mapping with a private one of the file at the same address (so all the pointers stay valid)
+    if (iface->ram_shared) {
+        if (!ram_map(iface->ram_file,iface->ram,false)) return false;
+        iface->ram_shared = false;
+        iface->ram_synced = true;
+        iface->nmaps = 0;
+    }
+    return true;
+}
+#endif
+
+static bool fork_vm(rv_interface* iface, rv_interface* clone)
+{
+    if (iface->framebuf) {
+        printf("ERROR: VM with graphics can't be forked\n");
+        rv_iface_init(clone);
         return false;
+    }
+
+    memcpy(clone,iface,sizeof(rv_interface));
+    // nothing below belongs to the clone until it's acquired (so a failure releases only what's been acquired)
+    rv_mem_init(&clone->mem);
+    memset(&clone->con,0,sizeof(rv_console));
+    clone->ram = NULL;
+    clone->ram_file = NULL;
+    clone->ram_mapped = 0;
+    clone->ram_shared = false;
+    clone->ram_synced = false;
+    clone->nmaps = 0;
+    clone->vm.user = clone;
+    clone->vm.icache = NULL; // caches are allocated by first rv_iface_step()
+    clone->vm.bcache = NULL;
+    clone->vm.jit = NULL;
+    clone->vm.trace = NULL; // (clones aren't traced)
+    clone->trace_file = NULL;
+    clone->vm.profile = NULL; // (nor profiled)
+    clone->ring = NULL; // (it gets a thread of its own below)
+    clone->in_ring = false;
+
+#ifdef IFACE_USE_HOSTFS
+    // the clone gets copies of all open files (sharing file offsets with the original, as fork() does)
+    bool dup_ok = true;
+    for (int i = -1; i < IFACE_MAX_FILES; i++) {
+        int* fd = (i < 0)? &clone->root_fd : clone->files + i;
+        if (*fd <= STDERR_FILENO) continue;
+        *fd = dup_ok? fcntl(*fd,F_DUPFD_CLOEXEC,0) : -1;
+        if (*fd < 0) dup_ok = false;
+    }
+    if (!dup_ok) {
+        printf("ERROR: Unable to copy open files\n");
+        goto fail;
+    }
+#endif
+
+    // output buffered so far belongs to the original, the clone gets its own buffer
+    rv_console_flush(&iface->con);
+    if (!rv_console_init(&clone->con,clone->out,iface->con.policy,iface->con.size)) {
+        printf("ERROR: Unable to allocate output buffer\n");
+        goto fail;
+    }
+
+#ifdef IFACE_USE_MEMFD
+    // the clone keeps a reference to the file, so it doesn't need a new one when it's forked itself
+    if (ram_snapshot(iface) && (clone->ram = ram_map(iface->ram_file,NULL,false))) {
+        clone->ram_file = iface->ram_file;
+        __atomic_add_fetch(&clone->ram_file->refs,1,__ATOMIC_RELAXED);
+        clone->ram_mapped = iface->ram_mapped;
+        clone->ram_synced = true;
+    }
+#endif
+
+    // no memory files: just copy it all (memory file RAM covers the whole RAM space, that's way too much to copy)
+    if (!clone->ram && iface->ram_mapped) {
+        printf("ERROR: Unable to map a copy of RAM\n");
+        goto fail;
+    }
+    if (!clone->ram) {
+        clone->ram = (uint8_t*)malloc(iface->ram_space);
+        if (!clone->ram) {
+            printf("ERROR: Unable to allocate %u bytes of RAM\n",iface->ram_space);
+            goto fail;
+        }
+        memcpy(clone->ram,iface->ram,iface->ram_space);
+    }
+    if (iface->vm.ram) clone->vm.ram = clone->ram;
+
+    // same memory map, but with our own RAM
+    if (!rv_mem_copy(&clone->mem,&iface->mem)) {
+        printf("ERROR: Unable to build memory map\n");
+        goto fail;
+    }
+    for (uint32_t i = 0; i < clone->mem.nregions; i++) {
+        rv_memregion* r = clone->mem.regions + i;
+        if (r->host == iface->ram) r->host = clone->ram;
+        if (r->user == iface) r->user = clone;
+    }
+
+    // the clone's ring picks up where the original's one has stopped (requests it hasn't run yet are the clone's too)
+    if (iface->ring) {
+        int32_t err;
+        clone->ring = rv_ring_create(clone->ram,clone->ram_space,(uint8_t*)iface->ring->hdr - iface->ram,
+                                     iface->ring->mask + 1,ring_handler,ring_written,clone,&err);
+        if (!clone->ring) {
+            printf("ERROR: Unable to start syscall ring thread (%d)\n",err);
+            goto fail;
+        }
+    }
+    return true;
+
+fail:
+    // release what the clone has got so far, and leave it as a blank VM (that needs no rv_iface_stop())
+    rv_ring_destroy(clone->ring);
+    rv_mem_destroy(&clone->mem);
+#ifdef IFACE_USE_MEMFD
+    if (clone->ram_mapped) munmap(clone->ram,clone->ram_mapped);
+    else
+#endif
+    free(clone->ram);
+#ifdef IFACE_USE_MEMFD
+    ram_file_release(clone->ram_file);
+#endif
+    free(clone->con.buf);
+#ifdef IFACE_USE_HOSTFS
+    for (int i = -1; i < IFACE_MAX_FILES; i++) {
+        int fd = (i < 0)? clone->root_fd : clone->files[i];
+        if (fd > STDERR_FILENO) close(fd);
+    }
+#endif
+    rv_iface_init(clone);
+    return false;
+}
+
+bool rv_iface_fork(rv_interface* iface, rv_interface* clone)
+{
+    // the ring thread mustn't touch RAM or files while they're copied, and the requests already submitted go first
+    // (so they're run once, by the original, and the clone sees their results)
+    if (iface->ring) rv_ring_quiesce(iface->ring);
+    bool ok = fork_vm(iface,clone);
+    if (iface->ring) rv_ring_unlock(iface->ring);
+    return ok;
+}
+
+bool rv_iface_step(rv_interface* iface)
+{
+    return iface->step(iface);
+}
+
+static int by_count(const void* a, const void* b)
+{
+    uint64_t x = **(const uint64_t* const*)a;
+    uint64_t y = **(const uint64_t* const*)b;
+    return (x < y) - (x > y);
+}
+
+// Print function name and offset for the address
+static void print_location(const elf_symtab* tab, uint32_t addr)
+{
+    const elf_symbol* f = elf_find_symbol(tab,addr);
+    if (f && (!f->size || addr - f->addr < f->size)) printf("%s+0x%X",f->name,addr - f->addr);
+    else printf("???");
+}
+
+// Profile report: the hottest functions (if the program has symbols), then the hottest blocks disassembled
+static void print_profile(rv_interface* iface)
+{
+    riscv_profile* p = iface->vm.profile;
+    riscv_prof_block** blocks;
+    uint32_t n = riscv_profile_sorted(p,&blocks);
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < n; i++) total += blocks[i]->insts;
+    if (!n || !total) {
+        free(blocks);
+        return;
+    }
+
+    printf("\nProfile: %" PRIu64 " instructions in %u blocks",total,n);
+    if (p->lost) printf(", %" PRIu64 " block runs not counted",p->lost);
+    putchar('\n');
+
+    // symbols are only needed now, so they aren't loaded with the program
+    elf_symtab tab;
+    if (!iface->elf_file || !elf_read_symtab(iface->elf_file,&tab)) memset(&tab,0,sizeof(tab));
+
+    if (tab.num) {
+        // instructions count of each function; blocks outside of any function aren't counted
+        uint64_t* insts = (uint64_t*)calloc(tab.num,sizeof(uint64_t));
+        uint64_t** order = (uint64_t**)malloc(tab.num * sizeof(uint64_t*));
+        if (insts && order) {
+            for (uint32_t i = 0; i < n; i++) {
+                const elf_symbol* f = elf_find_symbol(&tab,blocks[i]->ip);
+                if (f && (!f->size || blocks[i]->ip - f->addr < f->size)) insts[f - tab.syms] += blocks[i]->insts;
+            }
+            for (uint32_t i = 0; i < tab.num; i++) order[i] = insts + i;
+            qsort(order,tab.num,sizeof(uint64_t*),by_count);
+
+            printf("\n%-16s %-8s %s\n","Instructions","%","Function");
+            for (uint32_t i = 0; i < tab.num && i < IFACE_PROF_FUNCS && *order[i]; i++)
+                printf("%-16" PRIu64 " %-8.2f %s\n",*order[i],100.0 * *order[i] / total,tab.syms[order[i] - insts].name);
+        }
+        free(insts);
+        free(order);
+    }
+
+    for (uint32_t i = 0; i < n && i < IFACE_PROF_BLOCKS; i++) {
+        riscv_prof_block* b = blocks[i];
+        printf("\nBlock 0x%08X (",b->ip);
+        print_location(&tab,b->ip);
+        printf("): %" PRIu64 " runs, %" PRIu64 " instructions (%.2f%%)\n",b->count,b->insts,100.0 * b->insts / total);
+
+        for (uint32_t j = 0, ip = b->ip, len; j < b->len && ip <= iface->ram_space - 4; j++, ip += len) {
+            char buf[IFACE_DISASM_MAX_LEN];
+            uint32_t inst;
+            memcpy(&inst,iface->ram + ip,4); // (compressed instructions are only 2-byte aligned)
+            if (riscv_disasm(inst,buf,sizeof(buf)) != RVEXIT_SUCCESS) strcpy(buf,"???");
+            len = RV_INST_LEN(inst);
+            printf("    0x%08X: %0*X%*s %s\n",ip,len * 2,(len == 4)? inst : inst & 0xFFFF,8 - len * 2,"",buf);
+        }
+
+        for (int j = 0; j < RV_PROF_SUCC && b->succ[j] != RV_PROF_EMPTY; j++) {
+            printf("    -> 0x%08X (",b->succ[j]);
+            print_location(&tab,b->succ[j]);
+            printf("): %" PRIu64 " times\n",b->edges[j]);
+        }
+        if (b->other) printf("    -> other blocks: %" PRIu64 " times\n",b->other);
+    }
 
-    } else
-        return ret == RVEXIT_SUCCESS;
+    elf_free_symtab(&tab);
+    free(blocks);
 }
 
 void rv_iface_stop(rv_interface* iface)
 {
+    // requests already submitted are completed first
+    rv_ring_stop(iface->ring);
+
+    // the rest of program output goes before all the reports
+    rv_console_destroy(&iface->con);
+
+    if (iface->debug & DBG_CACHE) {
+        printf("Instructions retired: %" PRIu64 "\n",iface->vm.instret);
+        printf("Console: %" PRIu64 " bytes in %" PRIu64 " writes, %" PRIu64 " bytes lost\n",
+               iface->con.total,iface->con.flushes,iface->con.lost);
+        if (iface->ring)
+            printf("Syscall ring: %" PRIu64 " requests in %" PRIu64 " batches, %" PRIu64 " doorbells\n",
+                   iface->ring->requests,iface->ring->batches,iface->ring->doorbells);
+        uint64_t used = rv_iface_committed(iface);
+        if (used) printf("RAM: %" PRIu64 " KiB committed\n",used / 1024);
+    }
+    rv_ring_destroy(iface->ring);
+    iface->ring = NULL;
+
+    riscv_icache* ic = iface->vm.icache;
+    if (ic) {
+        if (iface->debug & DBG_CACHE) {
+            uint64_t total = ic->hits + ic->misses;
+            printf("Instruction cache: %" PRIu64 " hits, %" PRIu64 " misses (%.2f%% hit rate)\n",
+                   ic->hits,ic->misses,total? 100.0 * ic->hits / total : 0.0);
+            printf("Instruction cache: %" PRIu64 " page invalidations, %" PRIu64 " lines dropped\n",
+                   ic->invalidations,ic->dropped);
+        }
+        free(ic);
+    }
+
+    riscv_bcache* bc = iface->vm.bcache;
+    if (bc) {
+        if (iface->debug & DBG_CACHE) {
+            uint64_t total = bc->hits + bc->misses;
+            printf("Blocks cache: %" PRIu64 " hits, %" PRIu64 " translations (%.2f%% hit rate)\n",
+                   bc->hits,bc->misses,total? 100.0 * bc->hits / total : 0.0);
+            printf("Blocks cache: %" PRIu64 " page invalidations, %" PRIu64 " blocks dropped\n",
+                   bc->invalidations,bc->dropped);
+            printf("Fused pairs: %" PRIu64 " lui+addi, %" PRIu64 " auipc+jalr, %" PRIu64 " auipc+lw, %" PRIu64
+                   " slt+branch, %" PRIu64 " addi+bne\n",bc->fused[RVF_LUI_ADDI],bc->fused[RVF_AUIPC_JALR],
+                   bc->fused[RVF_AUIPC_LW],bc->fused[RVF_SLT_BRANCH],bc->fused[RVF_ADDI_BNE]);
+        }
+        free(bc);
+    }
+
+#ifdef RV_USE_JIT
+    riscv_jit* jit = iface->vm.jit;
+    if (jit) {
+        if (iface->debug & DBG_CACHE) {
+            printf("Native code: %" PRIu64 " blocks compiled, %" PRIu64 " exits chained, %" PRIu64 " runs\n",
+                   jit->compiled,jit->chained,jit->runs);
+            printf("Native code: %" PRIu64 " flushes, %u of %u bytes used\n",jit->flushes,jit->used,jit->size);
+        }
+        riscv_jit_destroy(jit);
+    }
+#endif
+
+    if (iface->vm.profile) {
+        print_profile(iface);
+        riscv_profile_destroy(iface->vm.profile);
+    }
+
+    riscv_trace* tr = iface->vm.trace;
+    if (tr) {
+        if (iface->debug & DBG_CACHE)
+            printf("Trace: %" PRIu64 " records, %" PRIu64 " bytes (%.2f bytes per instruction), %" PRIu64 " stalls\n",
+                   tr->records,tr->head,tr->records? (double)tr->head / tr->records : 0.0,tr->stalls);
+        if (!riscv_trace_destroy(tr)) printf("ERROR: Unable to write trace file '%s'\n",iface->trace_file);
+    }
+
+    if (iface->debug & DBG_CACHE)
+        printf("Memory map: %" PRIu64 " TLB hits, %" PRIu64 " misses\n",iface->mem.tlb_hits,iface->mem.tlb_misses);
+    rv_mem_destroy(&iface->mem);
+
+#ifdef IFACE_USE_MEMFD
+    if (iface->ram_mapped) munmap(iface->ram,iface->ram_mapped);
+    else
+#endif
     if (iface->ram) free(iface->ram);
-    if (iface->frame_w || iface->frame_h) sdl_wrapper_destroy();
+#ifdef IFACE_USE_MEMFD
+    ram_file_release(iface->ram_file);
+#endif
+    if (iface->framebuf) free(iface->framebuf);
+    if (iface->frame_w || iface->frame_h) sdl_wrapper_destroy(&iface->sdl);
+
+#ifdef IFACE_USE_HOSTFS
+    for (int i = 0; i < IFACE_MAX_FILES; i++)
+        if (iface->files[i] > STDERR_FILENO) close(iface->files[i]);
+    if (iface->root_fd >= 0) close(iface->root_fd);
+#endif
 }
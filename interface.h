@@ -10,35 +10,120 @@
 #ifndef INTERFACE_H_
 #define INTERFACE_H_
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include "riscv.h"
+#include "memmap.h"
+#include "console.h"
+#include "ring.h"
+#include "sdl_wrapper.h"
 
 #define IFACE_DISASM_MAX_LEN 356
+#define IFACE_PROF_FUNCS 20         /* number of functions in the profile report */
+#define IFACE_PROF_BLOCKS 5         /* number of blocks disassembled in the profile report */
+#define IFACE_RUN_SLICE 1000000 /* max number of instructions executed in one step (without tracing) */
+#define IFACE_MIN_SLICE 16384   /* ... and min one, when the program is close to its RAM limit (see run_slice()) */
+#define IFACE_TRACE_BUF (4U << 20) /* binary trace ring buffer size */
 
-// Virtual machine state structure
+// Guest memory map: RAM space at 0, then devices
+#define IFACE_RAM_SPACE 0xE0000000U     /* whole RAM space is reserved, but pages are only committed when touched */
+#define IFACE_FRAMEBUF_BASE 0xE0000000  /* 32-bit ARGB pixels, frame_w * frame_h of them */
+#define IFACE_CONSOLE_BASE 0xF0000000   /* console registers */
+#define IFACE_CONSOLE_DATA 0            /* write a character here to print it */
+
+#define IFACE_MAX_MAPS 8                /* max number of RAM ranges mapped from other files */
+#define IFACE_MAX_FILES 32              /* size of guest file descriptors table */
+#define IFACE_MAX_IOV 64                /* max number of buffers in one readv()/writev() call */
+#define IFACE_FD_OUT (-2)               /* host side of a descriptor writing into 'out' stream (see below) */
+
+// Memory file with RAM contents (shared by a VM and its forks)
 typedef struct {
+    int fd;
+    int refs;
+} rv_ramfile;
+
+typedef struct rv_interface_s rv_interface;
+
+// Virtual machine state structure
+struct rv_interface_s {
     riscv_state vm;
+    rv_memmap mem;
     uint8_t* ram;
-    uint32_t ram_size;
+    uint32_t ram_size;      /* RAM size (with memory file, only a limit for committed memory) */
+    uint32_t ram_space;     /* Guest addresses below that are RAM */
+    rv_ramfile* ram_file;   /* Memory file with RAM contents (NULL if there's none) */
+    uint32_t ram_mapped;    /* Size of RAM mapping (0 if RAM is allocated on the heap) */
+    bool ram_shared;        /* RAM is a shared mapping of the file (otherwise it's a private one, or a heap block) */
+    bool ram_synced;        /* The file has the same contents as RAM */
+    uint64_t ram_bound;     /* Committed RAM is no more than that (forked VMs start with the bound of the original) */
+    uint32_t maps[IFACE_MAX_MAPS][2]; /* RAM ranges mapped privately from other files: start, length (see elf.c) */
+    uint32_t nmaps;
     uint32_t stack_size;
     uint32_t stack_start;
     uint32_t prog_break;
     uint32_t heap_max;
     uint32_t start;
     uint32_t debug;
-    uint32_t error;
+    const char* trace_file; /* Write binary execution trace there (see riscv_trace.h) */
+    const char* elf_file;   /* Program file (symbols for the profile report are read from it) */
+    uint32_t engine;
     uint16_t frame_w;
     uint16_t frame_h;
-} rv_interface;
+    uint8_t* framebuf;
+    sdl_wrapper sdl;
+    FILE* out;              /* Where program output goes (stdout by default, NULL means it's captured in 'con') */
+    uint32_t out_flush;     /* When buffered output is written there (see rv_con_flush in console.h) */
+    rv_console con;         /* Output buffer (created by rv_iface_start(), read captured output before rv_iface_stop()) */
+    rv_ring* ring;          /* Asynchronous syscall ring (NULL until the program sets it up, see ring.h) */
+    bool in_ring;           /* Syscall is run by the ring thread */
+    bool headless;          /* Don't wait for user input (on breakpoints) */
+    const char* root;       /* Sandbox directory for guest files (NULL means the program can't open any) */
+    int root_fd;            /* Its descriptor (-1 if it's not open) */
+    int files[IFACE_MAX_FILES]; /* Host descriptors of guest ones (-1 means closed): stdin, 'out' and 'out' by default */
+    int argc;               /* Program arguments (put on the stack at start) */
+    char** argv;
+    uint64_t budget;        /* Max number of instructions to execute (0 means no limit) */
+    uint32_t status;        /* Why the VM has stopped (see below) */
+    uint32_t exit_code;     /* Argument of exit() syscall */
+    bool (*step)(rv_interface* iface); /* Step function specialised for debug options (see rv_iface_start()) */
+};
+
+// Execution engines
+enum rv_engine {
+    RVENG_REFERENCE = 0,    // riscv_exec(), one instruction at a time
+    RVENG_THREADED,         // riscv_exec_block(), direct-threaded basic blocks
+    RVENG_JIT,              // riscv_exec_block() with native code translator attached
+};
+
+// VM status
+enum rv_status {
+    RVSTAT_RUNNING = 0,
+    RVSTAT_EXIT,            // program has called exit()
+    RVSTAT_BUDGET,          // instruction budget is exhausted
+    RVSTAT_TIMEOUT,         // wall-clock time limit is reached (not checked here, see fleet.c)
+    RVSTAT_FAULT,           // memory access fault
+    RVSTAT_ERROR,           // unknown instruction or other execution error
+    RVSTAT_CLOSED,          // graphics window has been closed
+    RVSTAT_NOSTART,         // VM couldn't be started (bad program or not enough memory)
+    RVSTAT_NOMEM,           // program has committed more RAM than allowed
+};
 
 // Syscall codes (see "syscall.h" for values)
 enum rv_syscall {
+    RVSYS_OPENAT = 56,
     RVSYS_CLOSE = 57,
+    RVSYS_LSEEK = 62,
+    RVSYS_READ = 63,
     RVSYS_WRITE = 64,
+    RVSYS_READV = 65,
+    RVSYS_WRITEV = 66,
     RVSYS_FSTAT = 80,
     RVSYS_EXIT = 93,
     RVSYS_BRK = 214,
+    RVSYS_OPEN = 1024,      // (older newlib versions use it instead of openat)
+    RVSYS_RING_SETUP = RVRING_SYS_SETUP,
+    RVSYS_RING_ENTER = RVRING_SYS_ENTER,
 };
 
 void rv_iface_init(rv_interface* iface);
@@ -47,4 +132,14 @@ bool rv_iface_start(rv_interface* iface);
 bool rv_iface_step(rv_interface* iface);
 void rv_iface_stop(rv_interface* iface);
 
+// Bytes of RAM actually committed (touched by the program), or 0 if it's unknown
+// (it's cheap for the original VM, but looks at every page of RAM once it has been forked)
+uint64_t rv_iface_committed(rv_interface* iface);
+
+// Make a copy of the VM (which must not be running) in its current state. RAM pages are shared copy-on-write between
+// all copies, so it takes only a few microseconds. Don't change RAM of the original directly after forking it
+// (running it is fine). Both VMs must be stopped with rv_iface_stop(), in any order. If it fails, the original is
+// intact, and the clone is left as a blank VM just initialized by rv_iface_init() (stopping it is optional).
+bool rv_iface_fork(rv_interface* iface, rv_interface* clone);
+
 #endif /* INTERFACE_H_ */
@@ -11,21 +11,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include "riscv.h"
 #include "interface.h"
 #include "debug.h"
 #include "elf.h"
+#include "fleet.h"
+
+// Fleet mode options
+typedef struct {
+    const char* manifest;
+    const char* outdir;
+    uint32_t threads;
+} fleet_opts;
 
 // Helper function to print out nicely formatted usage instructions
 static void usage(const char* progname)
 {
-    printf("Usage: %s <command> <argument> ... [<command> <argument>]\n",progname);
+    printf("Usage: %s <command> <argument> ... [<command> <argument>] [-- <program arguments>]\n",progname);
     printf("\nAvailable commands are:\n");
     printf("\t-m: set the amount of virtual RAM available (in KiB)\n");
     printf("\t-s: set the size of the stack (in KiB)\n");
     printf("\t-f: execute ELF file\n");
     printf("\t-d: set debug options (string of characters, see below)\n");
     printf("\t-g: enable graphics mode and set frame size (\"WxH\")\n");
+    printf("\t-e: select execution engine (see below)\n");
+    printf("\t-j: run all jobs from manifest file in parallel (see below)\n");
+    printf("\t-t: set the number of worker threads for the jobs (default is the number of CPUs)\n");
+    printf("\t-o: set the directory for job outputs and summary (default is current directory)\n");
+    printf("\t-b: write binary execution trace into file (use trace_dump to read it)\n");
+    printf("\t-r: let the program open files in this directory (it can't get outside of it)\n");
+    printf("\t-c: set when program output is written out (see below)\n");
     printf("\nAvailable debug options are:\n");
     printf("\tt - enable trace output\n");
     printf("\ts - verbose syscalls\n");
@@ -33,16 +49,38 @@ static void usage(const char* progname)
     printf("\tr - print registers contents in trace output\n");
     printf("\ti - enable interactive, step-by-step mode\n");
     printf("\tl - verbose program loading procedure\n");
+    printf("\tc - print pre-decoded instructions cache statistics on exit\n");
+    printf("\tp - profile the program, print its hottest functions and blocks on exit\n");
+    printf("\nAvailable execution engines are:\n");
+    printf("\tr - reference interpreter, one instruction at a time (default)\n");
+    printf("\tt - direct-threaded interpreter, one basic block at a time\n");
+    printf("\tj - direct-threaded interpreter with hot blocks compiled into native x86-64 code\n");
+    printf("\nProgram output can be written out:\n");
+    printf("\tl - after every line\n");
+    printf("\ts - when 16 KiB buffer is full\n");
+    printf("\te - on exit only\n");
+    printf("\t(default is every line for terminals and full buffers otherwise)\n");
+    printf("\nJobs manifest has one job per line (lines starting with '#' are ignored):\n");
+    printf("\t<name> <RAM KiB> <stack KiB> <max instructions> <time limit, ms> <ELF file> [arguments]\n");
+    printf("\t(zero limits mean no limit)\n");
 }
 
 // Helper function to read command line arguments
-static bool read_args(rv_interface* iface, int argc, char* argv[])
+static bool read_args(rv_interface* iface, fleet_opts* fleet, int argc, char* argv[])
 {
     int fsm = 0;
     int loaded = 0;
     for (int i = 1; i < argc; i++) {
         switch (fsm) {
         case 0:
+            if (!strcmp(argv[i],"--") && loaded) {
+                // the rest are program arguments
+                argv[i] = iface->argv[0];
+                iface->argv = argv + i;
+                iface->argc = argc - i;
+                i = argc;
+                break;
+            }
             if (argv[i][0] != '-' || !argv[i][1]) {
                 printf("ERROR: malformed argument %d\n",i);
                 return false;
@@ -54,6 +92,13 @@ static bool read_args(rv_interface* iface, int argc, char* argv[])
             case 'f': fsm = 3; break;
             case 'd': fsm = 4; break;
             case 'g': fsm = 5; break;
+            case 'e': fsm = 6; break;
+            case 'j': fsm = 7; break;
+            case 't': fsm = 8; break;
+            case 'o': fsm = 9; break;
+            case 'b': fsm = 10; break;
+            case 'r': fsm = 11; break;
+            case 'c': fsm = 12; break;
             default:
                 printf("ERROR: Unknown command switch '%c'\n",argv[i][1]);
                 return false;
@@ -77,6 +122,8 @@ static bool read_args(rv_interface* iface, int argc, char* argv[])
                 return false;
             }
             if (!readelf(iface,argv[i])) return false;
+            iface->argv = argv + i;
+            iface->argc = 1;
             loaded = 1;
             fsm = 0;
             break;
@@ -93,6 +140,56 @@ static bool read_args(rv_interface* iface, int argc, char* argv[])
             }
             iface->frame_w = atoi(argv[i]);
             iface->frame_h = atoi(strchr(argv[i],'x')+1);
+            fsm = 0;
+            break;
+
+        case 6: // Execution engine
+            switch (argv[i][0]) {
+            case 'r': iface->engine = RVENG_REFERENCE; break;
+            case 't': iface->engine = RVENG_THREADED; break;
+            case 'j': iface->engine = RVENG_JIT; break;
+            default:
+                printf("ERROR: Unknown execution engine '%s'\n",argv[i]);
+                return false;
+            }
+            fsm = 0;
+            break;
+
+        case 7: // Jobs manifest
+            fleet->manifest = argv[i];
+            fsm = 0;
+            break;
+
+        case 8: // Number of worker threads
+            fleet->threads = atoi(argv[i]);
+            fsm = 0;
+            break;
+
+        case 9: // Output directory
+            fleet->outdir = argv[i];
+            fsm = 0;
+            break;
+
+        case 10: // Binary trace file
+            iface->trace_file = argv[i];
+            fsm = 0;
+            break;
+
+        case 11: // Sandbox directory
+            iface->root = argv[i];
+            fsm = 0;
+            break;
+
+        case 12: // Output flush policy
+            switch (argv[i][0]) {
+            case 'l': iface->out_flush = RVCON_FLUSH_LINE; break;
+            case 's': iface->out_flush = RVCON_FLUSH_SIZE; break;
+            case 'e': iface->out_flush = RVCON_FLUSH_EXIT; break;
+            default:
+                printf("ERROR: Unknown output flush policy '%s'\n",argv[i]);
+                return false;
+            }
+            fsm = 0;
             break;
 
         default:
@@ -100,23 +197,43 @@ static bool read_args(rv_interface* iface, int argc, char* argv[])
         }
     }
 
+    if (fleet->manifest) return !loaded;
     return (iface->ram_size && iface->stack_size && loaded);
 }
 
 // Emulator entry point :)
 int main(int argc, char* argv[])
 {
-    // Only one virtual CPU for now
+    // Build instruction decoder tables
+    riscv_init();
+
+    // One virtual CPU (unless we're given a list of jobs)
     rv_interface iface;
     rv_iface_init(&iface);
 
     // Read command line arguments, filling our interface structure
-    if (!read_args(&iface,argc,argv)) {
+    fleet_opts fleet = { NULL, ".", 0 };
+    if (!read_args(&iface,&fleet,argc,argv)) {
         usage(argv[0]);
         rv_iface_stop(&iface); // clean-up
         return 1;
     }
 
+    // Or run many independent virtual CPUs
+    if (fleet.manifest) {
+        uint32_t engine = iface.engine;
+        rv_iface_stop(&iface);
+
+        rv_fleet* f = rv_fleet_load(fleet.manifest);
+        if (!f) return 1;
+        f->root = iface.root;
+        f->out_flush = iface.out_flush;
+        if (!fleet.threads) fleet.threads = sysconf(_SC_NPROCESSORS_ONLN);
+        bool ok = rv_fleet_run(f,fleet.threads,fleet.outdir,engine);
+        rv_fleet_destroy(f);
+        return ok? 0 : 2;
+    }
+
     // Prepare VM for execution
     if (!rv_iface_start(&iface)) {
         printf("ERROR: unable to start virtual machine\n");
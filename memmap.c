@@ -0,0 +1,231 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+#include "memmap.h"
+
+#define RVMEM_L2_SIZE (1U << RVMEM_L2_BITS)
+#define RVMEM_PAGE(A) ((A) >> RVMEM_PAGE_BITS)
+#define RVMEM_OFFSET(A) ((A) & (RVMEM_PAGE_SIZE - 1))
+
+static void tlb_flush(rv_memmap* m)
+{
+    for (uint32_t i = 0; i < RVMEM_TLB_SIZE; i++) {
+        m->rtlb[i].page = RVMEM_TLB_INVALID;
+        m->wtlb[i].page = RVMEM_TLB_INVALID;
+    }
+}
+
+// Remember the page, if it's entirely inside the region
+static void tlb_fill(rv_tlbentry* tlb, const rv_memregion* r, uint32_t addr)
+{
+    uint32_t off = (addr & ~(RVMEM_PAGE_SIZE - 1)) - r->start;
+    if (off + RVMEM_PAGE_SIZE > r->size || off + RVMEM_PAGE_SIZE < off) return;
+
+    rv_tlbentry* e = tlb + (RVMEM_PAGE(addr) & (RVMEM_TLB_SIZE - 1));
+    e->page = RVMEM_PAGE(addr);
+    e->host = r->host + off;
+}
+
+void rv_mem_init(rv_memmap* m)
+{
+    memset(m,0,sizeof(rv_memmap));
+    tlb_flush(m);
+}
+
+// Is that second level table owned by a single region?
+static bool is_uniform(const rv_memmap* m, const uint8_t* l2)
+{
+    for (uint32_t r = 0; r < m->nregions; r++)
+        if (m->uniform[r] == l2) return true;
+    return false;
+}
+
+void rv_mem_destroy(rv_memmap* m)
+{
+    for (uint32_t i = 0; i < (1U << RVMEM_L1_BITS); i++)
+        if (m->map[i] && !is_uniform(m,m->map[i])) free(m->map[i]);
+    for (uint32_t r = 0; r < m->nregions; r++)
+        if (m->uniform[r]) free(m->uniform[r]);
+    rv_mem_init(m);
+}
+
+bool rv_mem_copy(rv_memmap* dst, const rv_memmap* src)
+{
+    rv_mem_init(dst);
+    memcpy(dst->regions,src->regions,sizeof(dst->regions));
+    dst->nregions = src->nregions;
+
+    for (uint32_t r = 0; r < src->nregions; r++) {
+        if (!src->uniform[r]) continue;
+        dst->uniform[r] = (uint8_t*)malloc(RVMEM_L2_SIZE);
+        if (!dst->uniform[r]) {
+            rv_mem_destroy(dst);
+            return false;
+        }
+        memcpy(dst->uniform[r],src->uniform[r],RVMEM_L2_SIZE);
+    }
+
+    for (uint32_t i = 0; i < (1U << RVMEM_L1_BITS); i++) {
+        const uint8_t* l2 = src->map[i];
+        if (!l2) continue;
+        uint32_t r = l2[0]? l2[0] - 1 : RVMEM_MAX_REGIONS;
+        if (r < RVMEM_MAX_REGIONS && l2 == src->uniform[r]) {
+            dst->map[i] = dst->uniform[r];
+            continue;
+        }
+        dst->map[i] = (uint8_t*)malloc(RVMEM_L2_SIZE);
+        if (!dst->map[i]) {
+            rv_mem_destroy(dst);
+            return false;
+        }
+        memcpy(dst->map[i],l2,RVMEM_L2_SIZE);
+    }
+    return true;
+}
+
+rv_memregion* rv_mem_add(rv_memmap* m, rv_memtype type, uint32_t start, uint32_t size, uint8_t* host,
+                         rv_mmio_read read, rv_mmio_write write, void* user)
+{
+    if (!size || RVMEM_OFFSET(start) || start + (size - 1) < start) return NULL;
+    if (m->nregions >= RVMEM_MAX_REGIONS) return NULL;
+    if (type != RVMEM_MMIO && !host) return NULL;
+
+    uint32_t first = RVMEM_PAGE(start);
+    uint32_t last = RVMEM_PAGE(start + (size - 1));
+    uint32_t idx = m->nregions;
+
+    // parts of the map entirely inside the region share one table
+    if (last - first + 1 >= RVMEM_L2_SIZE) {
+        m->uniform[idx] = (uint8_t*)malloc(RVMEM_L2_SIZE);
+        if (!m->uniform[idx]) return NULL;
+        memset(m->uniform[idx],idx + 1,RVMEM_L2_SIZE);
+    }
+
+    // check for overlaps and allocate all the tables needed beforehand
+    bool ok = true;
+    for (uint32_t p = first; ok;) {
+        uint8_t** l2 = m->map + (p >> RVMEM_L2_BITS);
+        uint32_t pos = p & (RVMEM_L2_SIZE - 1);
+        if (!pos && last - p + 1 >= RVMEM_L2_SIZE) {
+            // whole table
+            if (*l2) ok = false;
+        } else {
+            if (!*l2 && !(*l2 = (uint8_t*)calloc(RVMEM_L2_SIZE,1))) ok = false;
+            else if (is_uniform(m,*l2) || (*l2)[pos]) ok = false;
+        }
+        if (p == last) break;
+        p = (!pos && last - p + 1 >= RVMEM_L2_SIZE)? p + RVMEM_L2_SIZE : p + 1;
+        if (p > last) break;
+    }
+    if (!ok) {
+        if (m->uniform[idx]) free(m->uniform[idx]);
+        m->uniform[idx] = NULL;
+        return NULL;
+    }
+
+    for (uint32_t p = first;;) {
+        uint32_t pos = p & (RVMEM_L2_SIZE - 1);
+        if (!pos && last - p + 1 >= RVMEM_L2_SIZE) {
+            m->map[p >> RVMEM_L2_BITS] = m->uniform[idx];
+            p += RVMEM_L2_SIZE;
+            if (!p || p > last) break;
+        } else {
+            m->map[p >> RVMEM_L2_BITS][pos] = idx + 1;
+            if (p++ == last) break;
+        }
+    }
+
+    rv_memregion* r = m->regions + m->nregions++;
+    r->start = start;
+    r->size = size;
+    r->type = type;
+    r->host = host;
+    r->read = read;
+    r->write = write;
+    r->user = user;
+
+    tlb_flush(m);
+    return r;
+}
+
+rv_memregion* rv_mem_find(rv_memmap* m, uint32_t addr)
+{
+    uint32_t p = RVMEM_PAGE(addr);
+    const uint8_t* l2 = m->map[p >> RVMEM_L2_BITS];
+    if (!l2 || !l2[p & (RVMEM_L2_SIZE - 1)]) return NULL;
+
+    // the last page of a region might be incomplete
+    rv_memregion* r = m->regions + (l2[p & (RVMEM_L2_SIZE - 1)] - 1);
+    return (addr - r->start < r->size)? r : NULL;
+}
+
+uint8_t* rv_mem_host(rv_memmap* m, uint32_t addr, uint32_t len)
+{
+    rv_memregion* r = rv_mem_find(m,addr);
+    if (!r || r->type == RVMEM_MMIO || len > r->size - (addr - r->start)) return NULL;
+    return r->host + (addr - r->start);
+}
+
+uint32_t rv_mem_read_slow(rv_memmap* m, uint32_t addr, uint32_t len, int* fault)
+{
+    m->tlb_misses++;
+
+    // accesses crossing page boundary might span multiple regions, so just split them
+    if (RVMEM_OFFSET(addr) > RVMEM_PAGE_SIZE - len) {
+        uint32_t val = 0;
+        for (uint32_t k = 0; k < len; k++) val |= rv_mem_read(m,addr + k,1,fault) << (k * 8);
+        return val;
+    }
+
+    rv_memregion* r = rv_mem_find(m,addr);
+    uint32_t off = addr - (r? r->start : 0);
+    if (!r || len > r->size - off) {
+        *fault = 1;
+        return 0;
+    }
+
+    if (r->type == RVMEM_MMIO) {
+        if (r->read) return r->read(r->user,off,len);
+        *fault = 1;
+        return 0;
+    }
+
+    tlb_fill(m->rtlb,r,addr);
+    uint32_t val = 0;
+    memcpy(&val,r->host + off,len);
+    return val;
+}
+
+void rv_mem_write_slow(rv_memmap* m, uint32_t addr, uint32_t val, uint32_t len, int* fault)
+{
+    m->tlb_misses++;
+
+    if (RVMEM_OFFSET(addr) > RVMEM_PAGE_SIZE - len) {
+        for (uint32_t k = 0; k < len; k++) rv_mem_write(m,addr + k,(val >> (k * 8)) & 0xFF,1,fault);
+        return;
+    }
+
+    rv_memregion* r = rv_mem_find(m,addr);
+    uint32_t off = addr - (r? r->start : 0);
+    if (!r || len > r->size - off || r->type == RVMEM_ROM) {
+        *fault = 1;
+        return;
+    }
+
+    if (r->type == RVMEM_MMIO) {
+        if (r->write) r->write(r->user,off,val,len);
+        else *fault = 1;
+        return;
+    }
+
+    tlb_fill(m->wtlb,r,addr);
+    memcpy(r->host + off,&val,len);
+}
@@ -0,0 +1,111 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef MEMMAP_H_
+#define MEMMAP_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define RVMEM_PAGE_BITS 12
+#define RVMEM_PAGE_SIZE (1U << RVMEM_PAGE_BITS)
+#define RVMEM_L1_BITS 10
+#define RVMEM_L2_BITS (32 - RVMEM_PAGE_BITS - RVMEM_L1_BITS)
+#define RVMEM_TLB_BITS 8
+#define RVMEM_TLB_SIZE (1U << RVMEM_TLB_BITS)
+#define RVMEM_TLB_INVALID 0xFFFFFFFF
+#define RVMEM_MAX_REGIONS 32
+
+// Memory region types
+typedef enum {
+    RVMEM_RAM,      // host memory, read and write
+    RVMEM_ROM,      // host memory, read only (writes are faults)
+    RVMEM_MMIO,     // device registers, every access goes to handlers
+} rv_memtype;
+
+// MMIO handlers ('offset' is relative to the region start, 'len' is 1, 2 or 4 bytes)
+typedef uint32_t (*rv_mmio_read)(void* user, uint32_t offset, uint32_t len);
+typedef void (*rv_mmio_write)(void* user, uint32_t offset, uint32_t val, uint32_t len);
+
+typedef struct {
+    uint32_t start;         /* Guest address (page-aligned) */
+    uint32_t size;          /* Size in bytes */
+    rv_memtype type;
+    uint8_t* host;          /* Backing storage for RAM and ROM */
+    rv_mmio_read read;      /* Handlers for MMIO */
+    rv_mmio_write write;
+    void* user;             /* User-defined data passed to handlers */
+} rv_memregion;
+
+// Software TLB entry: guest page number and host address of that page
+typedef struct {
+    uint32_t page;
+    uint8_t* host;
+} rv_tlbentry;
+
+// Guest physical memory map
+typedef struct {
+    rv_memregion regions[RVMEM_MAX_REGIONS];
+    uint32_t nregions;
+    uint8_t* map[1U << RVMEM_L1_BITS];      /* Radix table: region number + 1 for every page (0 means unmapped) */
+    uint8_t* uniform[RVMEM_MAX_REGIONS];    /* Second level tables shared by all parts of the map entirely inside one region */
+    rv_tlbentry rtlb[RVMEM_TLB_SIZE];       /* Direct-mapped TLBs for reads (RAM and ROM) and writes (RAM only) */
+    rv_tlbentry wtlb[RVMEM_TLB_SIZE];
+    uint64_t tlb_hits;                      /* Statistics counters */
+    uint64_t tlb_misses;
+} rv_memmap;
+
+void rv_mem_init(rv_memmap* m);
+void rv_mem_destroy(rv_memmap* m);
+
+// Make a copy of the map (same regions, so update their 'host' and 'user' fields if needed). Returns false on error.
+bool rv_mem_copy(rv_memmap* dst, const rv_memmap* src);
+
+// Register a new region (it shouldn't overlap with existing ones). Returns NULL on error.
+rv_memregion* rv_mem_add(rv_memmap* m, rv_memtype type, uint32_t start, uint32_t size, uint8_t* host,
+                         rv_mmio_read read, rv_mmio_write write, void* user);
+
+// Find a region containing the address
+rv_memregion* rv_mem_find(rv_memmap* m, uint32_t addr);
+
+// Get host pointer for a range of RAM or ROM (NULL if it's not entirely inside one such region)
+uint8_t* rv_mem_host(rv_memmap* m, uint32_t addr, uint32_t len);
+
+// Slow paths of the accessors below (TLB miss, page crossing, MMIO or fault)
+uint32_t rv_mem_read_slow(rv_memmap* m, uint32_t addr, uint32_t len, int* fault);
+void rv_mem_write_slow(rv_memmap* m, uint32_t addr, uint32_t val, uint32_t len, int* fault);
+
+// Read or write 'len' (1, 2 or 4) bytes of guest memory. 'fault' is set to non-zero on access fault.
+static inline uint32_t rv_mem_read(rv_memmap* m, uint32_t addr, uint32_t len, int* fault)
+{
+    const rv_tlbentry* e = m->rtlb + ((addr >> RVMEM_PAGE_BITS) & (RVMEM_TLB_SIZE - 1));
+    uint32_t off = addr & (RVMEM_PAGE_SIZE - 1);
+    if (e->page == (addr >> RVMEM_PAGE_BITS) && off <= RVMEM_PAGE_SIZE - len) {
+        uint32_t val = 0;
+        memcpy(&val,e->host + off,len); // little-endian host assumed
+        m->tlb_hits++;
+        return val;
+    }
+    return rv_mem_read_slow(m,addr,len,fault);
+}
+
+static inline void rv_mem_write(rv_memmap* m, uint32_t addr, uint32_t val, uint32_t len, int* fault)
+{
+    const rv_tlbentry* e = m->wtlb + ((addr >> RVMEM_PAGE_BITS) & (RVMEM_TLB_SIZE - 1));
+    uint32_t off = addr & (RVMEM_PAGE_SIZE - 1);
+    if (e->page == (addr >> RVMEM_PAGE_BITS) && off <= RVMEM_PAGE_SIZE - len) {
+        memcpy(e->host + off,&val,len);
+        m->tlb_hits++;
+        return;
+    }
+    rv_mem_write_slow(m,addr,val,len,fault);
+}
+
+#endif /* MEMMAP_H_ */
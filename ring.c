@@ -0,0 +1,178 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ring.h"
+
+// Run everything the program has submitted (as long as there's room for the results)
+static uint32_t drain(rv_ring* r)
+{
+    rv_ring_hdr* h = r->hdr;
+    uint32_t head = h->sq_head, done = 0;
+    for (;;) {
+        uint32_t tail = __atomic_load_n(&h->sq_tail,__ATOMIC_ACQUIRE);
+        uint32_t ct = h->cq_tail;
+        if (tail == head || ct - __atomic_load_n(&h->cq_head,__ATOMIC_ACQUIRE) > r->mask) break;
+
+        // (the program could change the request meanwhile, so it's copied first)
+        rv_ring_sqe e = r->sq[head & r->mask];
+        pthread_mutex_lock(&r->io);
+        int32_t res = r->handler(r->user,e.op,e.args);
+        pthread_mutex_unlock(&r->io);
+
+        rv_ring_cqe* c = r->cq + (ct & r->mask);
+        c->user = e.user;
+        c->res = res;
+        __atomic_store_n(&h->cq_tail,ct + 1,__ATOMIC_RELEASE);
+        __atomic_store_n(&h->sq_head,++head,__ATOMIC_RELEASE);
+        done++;
+    }
+    return done;
+}
+
+// Ring thread: wait for the doorbell, then run a batch of requests
+static void* worker(void* arg)
+{
+    rv_ring* r = (rv_ring*)arg;
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->kicks && !r->stop) pthread_cond_wait(&r->kick,&r->lock);
+        if (!r->kicks) break;
+        r->kicks = 0;
+        pthread_mutex_unlock(&r->lock);
+
+        uint32_t n = drain(r);
+
+        pthread_mutex_lock(&r->lock);
+        r->requests += n;
+        r->batches++;
+        pthread_cond_broadcast(&r->done);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+rv_ring* rv_ring_create(uint8_t* ram, uint32_t ram_size, uint32_t addr, uint32_t entries,
+                        rv_ring_handler handler, rv_ring_written written, void* user, int32_t* err)
+{
+    if (!entries || entries > RVRING_MAX_ENTRIES || (entries & (entries - 1)) || (addr & 3)) {
+        *err = -EINVAL;
+        return NULL;
+    }
+    // (the only bounds check: every request and completion is inside)
+    if (addr >= ram_size || RVRING_SIZE(entries) > ram_size - addr) {
+        *err = -EFAULT;
+        return NULL;
+    }
+
+    rv_ring* r = (rv_ring*)calloc(1,sizeof(rv_ring));
+    if (!r) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    r->hdr = (rv_ring_hdr*)(ram + addr);
+    r->sq = (rv_ring_sqe*)(r->hdr + 1);
+    r->cq = (rv_ring_cqe*)(r->sq + entries);
+    r->mask = entries - 1;
+    r->handler = handler;
+    r->written = written;
+    r->user = user;
+    r->dirty_lo = UINT32_MAX;
+
+    pthread_mutex_init(&r->io,NULL);
+    pthread_mutex_init(&r->lock,NULL);
+    pthread_cond_init(&r->kick,NULL);
+    pthread_cond_init(&r->done,NULL);
+    if (pthread_create(&r->worker,NULL,worker,r)) {
+        free(r);
+        *err = -EAGAIN;
+        return NULL;
+    }
+    r->running = true;
+    *err = 0;
+    return r;
+}
+
+void rv_ring_stop(rv_ring* r)
+{
+    if (!r || !r->running) return;
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    r->kicks++; // one last batch
+    pthread_cond_signal(&r->kick);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->worker,NULL);
+    r->running = false;
+}
+
+void rv_ring_destroy(rv_ring* r)
+{
+    if (!r) return;
+    rv_ring_stop(r);
+
+    pthread_cond_destroy(&r->kick);
+    pthread_cond_destroy(&r->done);
+    pthread_mutex_destroy(&r->lock);
+    pthread_mutex_destroy(&r->io);
+    free(r);
+}
+
+int32_t rv_ring_enter(rv_ring* r, uint32_t wait)
+{
+    rv_ring_hdr* h = r->hdr;
+    if (wait > r->mask + 1) wait = r->mask + 1;
+
+    pthread_mutex_lock(&r->lock);
+    r->doorbells++;
+    r->kicks++;
+    pthread_cond_signal(&r->kick);
+
+    // there's no point in waiting for completions of requests which haven't been submitted
+    for (;;) {
+        uint32_t ready = __atomic_load_n(&h->cq_tail,__ATOMIC_ACQUIRE) - h->cq_head;
+        uint32_t queued = h->sq_tail - __atomic_load_n(&h->sq_head,__ATOMIC_ACQUIRE);
+        if (ready >= wait || !queued || ready > r->mask) break;
+        pthread_cond_wait(&r->done,&r->lock);
+    }
+
+    uint32_t lo = r->dirty_lo, hi = r->dirty_hi;
+    r->dirty_lo = UINT32_MAX;
+    r->dirty_hi = 0;
+    pthread_mutex_unlock(&r->lock);
+
+    if (lo < hi && r->written) r->written(r->user,lo,hi - lo);
+    return __atomic_load_n(&h->cq_tail,__ATOMIC_ACQUIRE) - h->cq_head;
+}
+
+void rv_ring_quiesce(rv_ring* r)
+{
+    rv_ring_hdr* h = r->hdr;
+    pthread_mutex_lock(&r->lock);
+    while (r->running) {
+        uint32_t ready = __atomic_load_n(&h->cq_tail,__ATOMIC_ACQUIRE) - h->cq_head;
+        uint32_t queued = h->sq_tail - __atomic_load_n(&h->sq_head,__ATOMIC_ACQUIRE);
+        if (!queued || ready > r->mask) break;
+        r->kicks++; // (the doorbell might not have been rung for them yet)
+        pthread_cond_signal(&r->kick);
+        pthread_cond_wait(&r->done,&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    pthread_mutex_lock(&r->io);
+}
+
+void rv_ring_dirty(rv_ring* r, uint32_t addr, uint32_t len)
+{
+    if (!len) return;
+    pthread_mutex_lock(&r->lock);
+    if (addr < r->dirty_lo) r->dirty_lo = addr;
+    if (addr + len > r->dirty_hi) r->dirty_hi = addr + len;
+    pthread_mutex_unlock(&r->lock);
+}
@@ -0,0 +1,165 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+// Asynchronous syscall ring, shared by the program and the emulator. The program puts syscall requests
+// into the submission queue and rings the doorbell (RVRING_SYS_ENTER), and a host thread executes them
+// while the program keeps running, putting the results into the completion queue.
+// This header is for both sides: include it into the program to get the helpers at the end.
+//
+// The ring lives in guest RAM: header, then 'entries' submissions, then 'entries' completions.
+// Queue positions are free-running counters (taken modulo 'entries'), every one of them is written by one side only.
+// Only file syscalls can be submitted (read, write, readv, writev, lseek, openat, close, fstat), anything else
+// completes with -ENOSYS. Data read through the ring isn't checked for code until the next doorbell.
+
+#define RVRING_SYS_SETUP 2048           /* a0 = ring address, a1 = entries (power of 2), returns 0 or -errno */
+#define RVRING_SYS_ENTER 2049           /* a0 = completions to wait for, returns the number of completions ready */
+#define RVRING_MAX_ENTRIES 4096
+
+typedef struct {
+    uint32_t op;                        /* Syscall number */
+    uint32_t args[4];                   /* a0-a3 */
+    uint32_t user;                      /* Copied into the completion as is */
+} rv_ring_sqe;
+
+typedef struct {
+    uint32_t user;
+    int32_t res;                        /* Syscall result (a0) */
+} rv_ring_cqe;
+
+typedef struct {
+    uint32_t entries;
+    uint32_t sq_tail;                   /* Written by the program */
+    uint32_t cq_head;
+    uint32_t pad0[13];
+    uint32_t sq_head;                   /* Written by the emulator (separate cache line) */
+    uint32_t cq_tail;
+    uint32_t pad1[14];
+} rv_ring_hdr;
+
+#define RVRING_SQ(H) ((rv_ring_sqe*)((H) + 1))
+#define RVRING_CQ(H) ((rv_ring_cqe*)(RVRING_SQ(H) + (H)->entries))
+#define RVRING_SIZE(N) (sizeof(rv_ring_hdr) + (N) * (sizeof(rv_ring_sqe) + sizeof(rv_ring_cqe)))
+
+#ifdef __riscv
+// Guest side: rv_ring_setup() once (the memory must be RVRING_SIZE(entries) bytes), then rv_ring_submit()
+// and rv_ring_enter() to get requests going, and rv_ring_reap() to get the results
+
+static inline int32_t rv_ring_ecall(uint32_t num, uint32_t a0, uint32_t a1)
+{
+    register uint32_t r0 asm("a0") = a0;
+    register uint32_t r1 asm("a1") = a1;
+    register uint32_t r7 asm("a7") = num;
+    asm volatile ("ecall" : "+r"(r0) : "r"(r1), "r"(r7) : "memory");
+    return r0;
+}
+
+static inline int32_t rv_ring_setup(rv_ring_hdr* h, uint32_t entries)
+{
+    for (uint32_t i = 0; i < sizeof(rv_ring_hdr) / 4; i++) ((uint32_t*)h)[i] = 0;
+    h->entries = entries;
+    return rv_ring_ecall(RVRING_SYS_SETUP,(uint32_t)h,entries);
+}
+
+// Queue a request, returns false if the queue is full (it's only seen by the emulator after rv_ring_enter())
+static inline bool rv_ring_submit(rv_ring_hdr* h, uint32_t op, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t user)
+{
+    uint32_t tail = h->sq_tail;
+    if (tail - __atomic_load_n(&h->sq_head,__ATOMIC_ACQUIRE) >= h->entries) return false;
+    rv_ring_sqe* e = RVRING_SQ(h) + (tail & (h->entries - 1));
+    e->op = op;
+    e->args[0] = a0;
+    e->args[1] = a1;
+    e->args[2] = a2;
+    e->args[3] = a3;
+    e->user = user;
+    __atomic_store_n(&h->sq_tail,tail + 1,__ATOMIC_RELEASE);
+    return true;
+}
+
+// Ring the doorbell and wait for at least 'wait' completions, returns the number of completions ready
+static inline int32_t rv_ring_enter(uint32_t wait)
+{
+    return rv_ring_ecall(RVRING_SYS_ENTER,wait,0);
+}
+
+// Get the next completion, returns false if there's none yet
+static inline bool rv_ring_reap(rv_ring_hdr* h, rv_ring_cqe* c)
+{
+    uint32_t head = h->cq_head;
+    if (head == __atomic_load_n(&h->cq_tail,__ATOMIC_ACQUIRE)) return false;
+    *c = RVRING_CQ(h)[head & (h->entries - 1)];
+    __atomic_store_n(&h->cq_head,head + 1,__ATOMIC_RELEASE);
+    return true;
+}
+
+#else
+#include <pthread.h>
+
+// Host side: the thread executing the requests. 'handler' runs the syscalls on that thread, and tells
+// which guest RAM ranges it has changed with rv_ring_dirty(); they're passed to 'written' on VM thread
+// by rv_ring_enter() (so cached code could be invalidated there).
+typedef int32_t (*rv_ring_handler)(void* user, uint32_t op, const uint32_t* args);
+typedef void (*rv_ring_written)(void* user, uint32_t addr, uint32_t len);
+
+typedef struct {
+    rv_ring_hdr* hdr;                   /* The ring in host memory */
+    rv_ring_sqe* sq;
+    rv_ring_cqe* cq;
+    uint32_t mask;
+    rv_ring_handler handler;
+    rv_ring_written written;
+    void* user;
+    pthread_t worker;
+    pthread_mutex_t io;                 /* Held while the handler runs (see rv_ring_lock()) */
+    pthread_mutex_t lock;               /* Protects everything below */
+    pthread_cond_t kick;                /* Doorbell */
+    pthread_cond_t done;                /* Some requests are completed */
+    uint32_t kicks;
+    int stop;
+    bool running;                       /* The thread hasn't been joined yet */
+    uint32_t dirty_lo;                  /* Guest RAM range written since the last rv_ring_enter() */
+    uint32_t dirty_hi;
+    uint64_t requests;                  /* Statistics counters */
+    uint64_t batches;
+    uint64_t doorbells;
+} rv_ring;
+
+// Set up the ring at guest address 'addr' ('entries' must be a power of 2, and the whole ring must be in 'ram').
+// Queue positions are taken as they are (rv_ring_setup() zeroes them, and a forked VM goes on with those of
+// the original). Returns NULL on error, with negative errno value in 'err'.
+rv_ring* rv_ring_create(uint8_t* ram, uint32_t ram_size, uint32_t addr, uint32_t entries,
+                        rv_ring_handler handler, rv_ring_written written, void* user, int32_t* err);
+
+// Finish the requests already submitted and stop the thread (statistics are still there until it's destroyed)
+void rv_ring_stop(rv_ring* r);
+void rv_ring_destroy(rv_ring* r);
+
+// Doorbell: let the thread pick up new requests and wait for 'wait' completions (as long as there are requests
+// it could complete). Returns the number of completions ready.
+int32_t rv_ring_enter(rv_ring* r, uint32_t wait);
+
+// Guest RAM range has been written by the handler
+void rv_ring_dirty(rv_ring* r, uint32_t addr, uint32_t len);
+
+// VM thread runs its syscalls under the same lock as the handler, so they don't race with each other
+static inline void rv_ring_lock(rv_ring* r) { pthread_mutex_lock(&r->io); }
+static inline void rv_ring_unlock(rv_ring* r) { pthread_mutex_unlock(&r->io); }
+
+// Let the thread run all requests submitted so far (as long as there's room for the results), then take the lock above,
+// so it won't touch guest RAM until rv_ring_unlock() (the program mustn't be running meanwhile)
+void rv_ring_quiesce(rv_ring* r);
+#endif
+
+#endif /* RING_H_ */
@@ -8,15 +8,284 @@
  * */
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <time.h>
 #include "riscv.h"
 #include "riscv_tabs.h"
+#include "riscv_jit.h"
+#include "riscv_trace.h"
+#include "riscv_profile.h"
+
+// Table-driven decoder. All tables below are compiled once from 'riscv_encode' by riscv_init().
+// First level is indexed by opcode and funct3 fields, second level (if needed) by funct7 field.
+// Leaves are short chains of candidate opcodes (in 'riscv_encode' order), normally just one.
+#define RV_DEC_L1_SIZE 1024
+#define RV_DEC_L2_SIZE 128
+#define RV_DEC_L2_MAX 32
+#define RV_DEC_POOL_SIZE 8192
+#define RV_DEC_L2_FLAG 0x8000
+#define RV_DEC_MAX_SEGS 8
+
+// Fixed bits and immediate gathering shuffle of a single opcode
+typedef struct {
+    uint32_t mask;  // fixed bits positions
+    uint32_t match; // fixed bits values
+    int8_t sign;    // sign bit position of the immediate (-1 if there's no immediate)
+    uint8_t nsegs;  // number of contiguous immediate pieces
+    struct {
+        uint8_t src;    // position of the piece in instruction
+        uint8_t dst;    // position of the piece in immediate
+        uint32_t mask;  // piece mask (already shifted to bit 0)
+    } segs[RV_DEC_MAX_SEGS];
+} riscv_decop;
+
+static riscv_decop dec_ops[RV_NUMOPS];
+static uint16_t dec_l1[RV_DEC_L1_SIZE];
+static uint16_t dec_l2[RV_DEC_L2_MAX][RV_DEC_L2_SIZE];
+static struct {
+    uint8_t op;
+    uint16_t next;
+} dec_pool[RV_DEC_POOL_SIZE];
+static int dec_ready = 0;
+
+#if defined(__GNUC__) && !defined(RV_NO_COMPUTED_GOTO)
+#define RV_THREADED_GOTO
+// Threaded code handlers addresses (filled in by riscv_init())
+static const void* const* thr_handlers = NULL;
+static riscv_exit run_block(riscv_state* st, const riscv_block* b, int64_t budget, const void* const** handlers);
+#endif
+
+#define RV_DEC_L1_IDX(I) (((I) & 0x7F) | (((I) >> 5) & 0x380))
+#define RV_DEC_L2_IDX(I) ((I) >> 25)
+
+// Parse single template string into fixed bits and immediate shuffle
+static void compile_template(riscv_op op)
+{
+    riscv_decop* d = dec_ops + op;
+    int last_src = -2, last_dst = -2;
+    d->sign = -1;
+
+    // go from LSB to MSB, same as the original parser
+    for (int j = 31; j >= 0; j--) {
+        int bit = 31 - j;
+        char c = riscv_encode[op][j];
+        if (c == RV_ENCODE_SYM_DONT_CARE) continue;
+
+        if (c >= RV_ENCODE_SYM_IMM_START) {
+            int dst = c - RV_ENCODE_SYM_IMM_START;
+            if (bit == last_src + 1 && dst == last_dst + 1)
+                d->segs[d->nsegs-1].mask = (d->segs[d->nsegs-1].mask << 1) | 1; // extend current piece
+            else {
+                assert(d->nsegs < RV_DEC_MAX_SEGS);
+                d->segs[d->nsegs].src = bit;
+                d->segs[d->nsegs].dst = dst;
+                d->segs[d->nsegs].mask = 1;
+                d->nsegs++;
+            }
+            last_src = bit;
+            last_dst = dst;
+            if (dst > d->sign) d->sign = dst;
+
+        } else {
+            d->mask |= 1U << bit;
+            if (c == '1') d->match |= 1U << bit;
+        }
+    }
+}
+
+// Create a chain of all opcodes which could possibly match instructions with given fixed bits
+static uint16_t build_chain(uint32_t mask, uint32_t bits, int* used)
+{
+    uint16_t head = 0, tail = 0;
+    for (int i = 0; i < RV_NUMOPS; i++) {
+        uint32_t m = dec_ops[i].mask & mask;
+        if ((bits & m) != (dec_ops[i].match & m)) continue;
+
+        assert(*used < RV_DEC_POOL_SIZE);
+        uint16_t n = (*used)++;
+        dec_pool[n].op = i;
+        dec_pool[n].next = 0;
+        if (tail) dec_pool[tail].next = n;
+        else head = n;
+        tail = n;
+    }
+    return head;
+}
+
+void riscv_init(void)
+{
+    if (dec_ready) return;
+
+    // sanity check - all opcodes should have their encoding templates
+    assert(sizeof(riscv_encode) / sizeof(riscv_encode[0]) == RV_NUMOPS);
+
+    for (int i = 0; i < RV_NUMOPS; i++) compile_template(i);
+
+    int used = 1; // pool node #0 is reserved as "end of chain" marker
+    int nl2 = 0;
+    const uint32_t l1_mask = 0x707F;
+    const uint32_t l2_mask = 0xFE000000;
+
+    for (uint32_t i = 0; i < RV_DEC_L1_SIZE; i++) {
+        uint32_t bits = (i & 0x7F) | ((i & 0x380) << 5);
+        uint16_t head = build_chain(l1_mask,bits,&used);
+
+        // single candidate (or none) doesn't need second level lookup
+        if (!head || !dec_pool[head].next) {
+            dec_l1[i] = head;
+            continue;
+        }
+
+        // otherwise, split candidates by funct7
+        used = head;
+        assert(nl2 < RV_DEC_L2_MAX);
+        for (uint32_t k = 0; k < RV_DEC_L2_SIZE; k++)
+            dec_l2[nl2][k] = build_chain(l1_mask|l2_mask,bits|(k << 25),&used);
+        dec_l1[i] = RV_DEC_L2_FLAG | nl2;
+        nl2++;
+    }
+
+#ifdef RV_THREADED_GOTO
+    run_block(NULL,NULL,0,&thr_handlers);
+#endif
+
+    dec_ready = 1;
+}
 
 // Decode an instruction and extract its immediate argument at the same time
-static riscv_op decode(uint32_t in, uint32_t* imm)
+static inline riscv_op decode(uint32_t in, uint32_t* imm)
+{
+    uint16_t e = dec_l1[RV_DEC_L1_IDX(in)];
+    if (e & RV_DEC_L2_FLAG) e = dec_l2[e & ~RV_DEC_L2_FLAG][RV_DEC_L2_IDX(in)];
+
+    for (; e; e = dec_pool[e].next) {
+        const riscv_decop* d = dec_ops + dec_pool[e].op;
+        if ((in & d->mask) != d->match) continue;
+
+        // we found our opcode, let's gather the immediate argument
+        uint32_t tmp = 0;
+        for (int i = 0; i < d->nsegs; i++)
+            tmp |= ((in >> d->segs[i].src) & d->segs[i].mask) << d->segs[i].dst;
+        *imm = tmp;
+        return dec_pool[e].op;
+    }
+
+    return RV_NUMOPS; //invalid op
+}
+
+// Encoders for 32-bit instruction formats (immediates are taken as they are in the instruction, not shifted)
+static inline uint32_t enc_r(uint32_t f7, uint32_t rs2, uint32_t rs1, uint32_t f3, uint32_t rd, uint32_t opc)
+{
+    return (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | opc;
+}
+
+static inline uint32_t enc_i(uint32_t imm, uint32_t rs1, uint32_t f3, uint32_t rd, uint32_t opc)
+{
+    return (imm << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | opc;
+}
+
+static inline uint32_t enc_s(uint32_t imm, uint32_t rs2, uint32_t rs1, uint32_t f3)
+{
+    return ((imm >> 5) << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | ((imm & 0x1F) << 7) | 0x23;
+}
+
+static inline uint32_t enc_b(uint32_t imm, uint32_t rs2, uint32_t rs1, uint32_t f3)
+{
+    return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) |
+           (((imm >> 1) & 0xF) << 8) | (((imm >> 11) & 1) << 7) | 0x63;
+}
+
+static inline uint32_t enc_j(uint32_t imm, uint32_t rd)
+{
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3FF) << 21) | (((imm >> 11) & 1) << 20) |
+           (((imm >> 12) & 0xFF) << 12) | (rd << 7) | 0x6F;
+}
+
+// Quadrant (two lowest bits) and funct3 field of a compressed instruction
+#define RVC_QF(Q,F3) (((Q) << 3) | (F3))
+
+// Expand RV32C instruction into the 32-bit one it stands for (riscv-spec-20191213, chapter 16).
+// This is only done when instructions are pre-decoded, so compressed code runs exactly as fast as normal one.
+// Floating point loads and stores aren't supported, same as reserved encodings they expand into zero (invalid).
+static uint32_t expand(uint32_t c)
+{
+    uint32_t rd = (c >> 7) & 0x1F, rs2 = (c >> 2) & 0x1F;   // full register fields
+    uint32_t rs1c = 8 + ((c >> 7) & 7), rs2c = 8 + ((c >> 2) & 7); // 3-bit fields (x8 to x15)
+    uint32_t ci = (uint32_t)RV_EXTEND(((c >> 7) & 0x20) | rs2,5); // 6-bit immediate of most instructions
+    uint32_t imm;
+
+    switch (RVC_QF(c & 3,(c >> 13) & 7)) {
+    case RVC_QF(0,0): // c.addi4spn -> addi rd',sp,uimm
+        imm = ((c >> 7) & 0x30) | ((c >> 1) & 0x3C0) | ((c >> 4) & 4) | ((c >> 2) & 8);
+        return imm? enc_i(imm,RVR_SP,0,rs2c,0x13) : 0;
+    case RVC_QF(0,2): // c.lw -> lw rd',uimm(rs1')
+        imm = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+        return enc_i(imm,rs1c,2,rs2c,0x03);
+    case RVC_QF(0,6): // c.sw -> sw rs2',uimm(rs1')
+        imm = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+        return enc_s(imm,rs2c,rs1c,2);
+
+    case RVC_QF(1,0): // c.addi (c.nop) -> addi rd,rd,imm
+        return enc_i(ci,rd,0,rd,0x13);
+    case RVC_QF(1,1): // c.jal -> jal ra,offset
+    case RVC_QF(1,5): // c.j -> jal zero,offset
+        imm = ((c >> 1) & 0xB40) | ((c >> 7) & 0x10) | ((c << 2) & 0x400) | ((c << 1) & 0x80) | ((c >> 2) & 0xE) | ((c << 3) & 0x20);
+        return enc_j((uint32_t)RV_EXTEND(imm,11),(c & 0x8000)? RVR_ZERO : RVR_RA);
+    case RVC_QF(1,2): // c.li -> addi rd,zero,imm
+        return enc_i(ci,RVR_ZERO,0,rd,0x13);
+    case RVC_QF(1,3):
+        if (rd == RVR_SP) { // c.addi16sp -> addi sp,sp,nzimm
+            imm = ((c >> 3) & 0x200) | ((c >> 2) & 0x10) | ((c << 1) & 0x40) | ((c << 4) & 0x180) | ((c << 3) & 0x20);
+            return imm? enc_i((uint32_t)RV_EXTEND(imm,9),RVR_SP,0,RVR_SP,0x13) : 0;
+        }
+        // c.lui -> lui rd,nzimm
+        return ci? (ci << 12) | (rd << 7) | 0x37 : 0;
+    case RVC_QF(1,4):
+        switch ((c >> 10) & 3) {
+        case 0: // c.srli -> srli rd',rd',shamt (shamt[5] must be zero on RV32)
+            return (c & 0x1000)? 0 : enc_r(0x00,rs2,rs1c,5,rs1c,0x13);
+        case 1: // c.srai -> srai rd',rd',shamt
+            return (c & 0x1000)? 0 : enc_r(0x20,rs2,rs1c,5,rs1c,0x13);
+        case 2: // c.andi -> andi rd',rd',imm
+            return enc_i(ci,rs1c,7,rs1c,0x13);
+        default: { // c.sub, c.xor, c.or, c.and -> op rd',rd',rs2' (the rest are RV64 only)
+            static const uint8_t f3[4] = { 0, 4, 6, 7 };
+            uint32_t f2 = (c >> 5) & 3;
+            return (c & 0x1000)? 0 : enc_r(f2? 0x00 : 0x20,rs2c,rs1c,f3[f2],rs1c,0x33);
+        }
+        }
+    case RVC_QF(1,6): // c.beqz -> beq rs1',zero,offset
+    case RVC_QF(1,7): // c.bnez -> bne rs1',zero,offset
+        imm = ((c >> 4) & 0x100) | ((c >> 7) & 0x18) | ((c << 1) & 0xC0) | ((c >> 2) & 6) | ((c << 3) & 0x20);
+        return enc_b((uint32_t)RV_EXTEND(imm,8),RVR_ZERO,rs1c,(c >> 13) & 1);
+
+    case RVC_QF(2,0): // c.slli -> slli rd,rd,shamt
+        return (c & 0x1000)? 0 : enc_r(0x00,rs2,rd,1,rd,0x13);
+    case RVC_QF(2,2): // c.lwsp -> lw rd,uimm(sp)
+        imm = ((c >> 7) & 0x20) | ((c >> 2) & 0x1C) | ((c << 4) & 0xC0);
+        return rd? enc_i(imm,RVR_SP,2,rd,0x03) : 0;
+    case RVC_QF(2,4):
+        if (!(c & 0x1000)) {
+            if (rs2) return enc_r(0x00,rs2,RVR_ZERO,0,rd,0x33);         // c.mv -> add rd,zero,rs2
+            return rd? enc_i(0,rd,0,RVR_ZERO,0x67) : 0;                 // c.jr -> jalr zero,0(rs1)
+        }
+        if (rs2) return enc_r(0x00,rs2,rd,0,rd,0x33);                   // c.add -> add rd,rd,rs2
+        return rd? enc_i(0,rd,0,RVR_RA,0x67) : 0x00100073;              // c.jalr -> jalr ra,0(rs1), or c.ebreak
+    case RVC_QF(2,6): // c.swsp -> sw rs2,uimm(sp)
+        imm = ((c >> 7) & 0x3C) | ((c >> 1) & 0xC0);
+        return enc_s(imm,rs2,RVR_SP,2);
+    }
+
+    return 0;
+}
+
+#ifdef RV_DECODER_SELFCHECK
+// The original (slow, but very straightforward) template matching decoder
+static riscv_op decode_ref(uint32_t in, uint32_t* imm)
 {
     // for each opcode template in the 'riscv_encode' table
-    for (int i = 0; i <= RV_EBREAK; i++) {
+    for (int i = 0; i < RV_NUMOPS; i++) {
         uint32_t tmp = 0;
         int fnd = 1;
 
@@ -47,47 +316,351 @@ static riscv_op decode(uint32_t in, uint32_t* imm)
         }
     }
 
-    return RV_EBREAK + 1; //invalid op
+    return RV_NUMOPS; //invalid op
+}
+
+uint32_t riscv_decoder_selfcheck(uint32_t from, uint32_t to)
+{
+    uint32_t errs = 0;
+    riscv_init();
+
+    for (uint32_t in = from;; in++) {
+        uint32_t imm_a = 0, imm_b = 0;
+        riscv_op a = decode(in,&imm_a);
+        riscv_op b = decode_ref(in,&imm_b);
+        if (a != b || (a < RV_NUMOPS && imm_a != imm_b)) {
+            if (errs++ < 16)
+                printf("Decoder mismatch for 0x%08X: op %d imm 0x%08X (reference: op %d imm 0x%08X)\n",in,a,imm_a,b,imm_b);
+        }
+        if (in == to) break;
+    }
+
+    return errs;
+}
+#endif /* RV_DECODER_SELFCHECK */
+
+// Guest memory is little-endian
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define RV_LE16(X) __builtin_bswap16(X)
+#define RV_LE32(X) __builtin_bswap32(X)
+#else
+#define RV_LE16(X) (X)
+#define RV_LE32(X) (X)
+#endif
+
+// Accesses which fall entirely into the flat RAM window are done directly, everything else goes through callbacks
+#define RV_IN_RAM(A,N) (st->ram_size >= (N) && (A) - st->ram_base <= st->ram_size - (N))
+
+static inline uint32_t mem_read8(riscv_state* st, uint32_t addr)
+{
+    if (RV_IN_RAM(addr,1)) return st->ram[addr - st->ram_base];
+    return st->funcs.read8(st,addr);
+}
+
+static inline uint32_t mem_read16(riscv_state* st, uint32_t addr)
+{
+    if (RV_IN_RAM(addr,2)) {
+        uint16_t val;
+        memcpy(&val,st->ram + (addr - st->ram_base),2);
+        return RV_LE16(val);
+    }
+    return st->funcs.read16(st,addr);
+}
+
+static inline uint32_t mem_read32(riscv_state* st, uint32_t addr)
+{
+    if (RV_IN_RAM(addr,4)) {
+        uint32_t val;
+        memcpy(&val,st->ram + (addr - st->ram_base),4);
+        return RV_LE32(val);
+    }
+    return st->funcs.read32(st,addr);
+}
+
+static inline void mem_write8(riscv_state* st, uint32_t addr, uint32_t val)
+{
+    if (RV_IN_RAM(addr,1)) st->ram[addr - st->ram_base] = val;
+    else st->funcs.write8(st,addr,val);
+}
+
+static inline void mem_write16(riscv_state* st, uint32_t addr, uint32_t val)
+{
+    if (RV_IN_RAM(addr,2)) {
+        uint16_t v = RV_LE16((uint16_t)val);
+        memcpy(st->ram + (addr - st->ram_base),&v,2);
+    } else
+        st->funcs.write16(st,addr,val);
+}
+
+static inline void mem_write32(riscv_state* st, uint32_t addr, uint32_t val)
+{
+    if (RV_IN_RAM(addr,4)) {
+        uint32_t v = RV_LE32(val);
+        memcpy(st->ram + (addr - st->ram_base),&v,4);
+    } else
+        st->funcs.write32(st,addr,val);
 }
 
 // Helper memory interface functions to help with signed/unsigned readings
-static uint32_t read8(riscv_state* st, uint32_t addr, int sign)
+static inline uint32_t read8(riscv_state* st, uint32_t addr, int sign)
 {
-    uint8_t val = st->funcs.read8(st,addr);
+    uint8_t val = mem_read8(st,addr);
     return sign? (uint32_t)RV_EXTEND(val,7) : (uint32_t)val;
 }
 
-static uint32_t read16(riscv_state* st, uint32_t addr, int sign)
+static inline uint32_t read16(riscv_state* st, uint32_t addr, int sign)
 {
-    uint16_t val = st->funcs.read16(st,addr);
+    uint16_t val = mem_read16(st,addr);
     return sign? (uint32_t)RV_EXTEND(val,15) : (uint32_t)val;
 }
 
-// Simply execute RISC-V instructions
-riscv_exit riscv_exec(riscv_state* st)
+// Fetch an instruction: either 32-bit word or a compressed one (in the lower half, upper half is zero).
+// It's done by halves, since 32-bit instructions only need to be 2-byte aligned now.
+static inline uint32_t fetch_inst(riscv_state* st, uint32_t ip)
 {
-    assert((st->ip & 3) == 0); // sanity check
-    st->regs[RVR_ZERO] = 0; // to simplify things, x0 is just a regular register
+    uint32_t inst = mem_read16(st,ip);
+    if (RV_INST_LEN(inst) == 4) inst |= mem_read16(st,ip + 2) << 16;
+    return inst;
+}
+
+// Fetch and decode an instruction, converting it into its ready-to-execute form
+static int predecode(riscv_state* st, uint32_t ip, riscv_decoded* d)
+{
+    uint32_t raw = fetch_inst(st,ip);
+    uint32_t len = RV_INST_LEN(raw);
+    uint32_t inst = (len == 2)? expand(raw) : raw;
 
-    // read next 32-bit instruction, extract known fields and decode the opcode
-    uint32_t inst = st->funcs.read32(st,st->ip);
     uint32_t imm = 0;
-    uint32_t rd = (inst >> 7) & 0x1F;
-    uint32_t rs1 = (inst >> 15) & 0x1F;
-    uint32_t rs2 = (inst >> 20) & 0x1F;
     riscv_op op = decode(inst,&imm);
+    if (op >= RV_NUMOPS) return 0;
+
+    d->ip = ip;
+    d->inst = raw;
+    d->len = len;
+    d->op = op;
+    d->rd = (inst >> 7) & 0x1F;
+    d->rs1 = (inst >> 15) & 0x1F;
+    d->rs2 = (inst >> 20) & 0x1F;
+
+    // bit 31 is the sign bit already, no need to extend it
+    int sign = dec_ops[op].sign;
+    d->imm = (sign >= 0 && sign < 31)? (uint32_t)RV_EXTEND(imm,sign) : imm;
+    return 1;
+}
+
+// Instructions at odd halfwords (there are some only if the code is compressed) go into the other half of the cache,
+// so two compressed instructions in one word don't fight for the same line
+#define RV_ICACHE_IDX(A) ((((A) >> 2) ^ (((A) & 2) << (RV_ICACHE_BITS - 2))) & (RV_ICACHE_SIZE - 1))
+#define RV_ICACHE_PAGE(A) ((A) >> RV_ICACHE_PAGE_BITS)
+// Page filter hash folds the upper page bits in, so device pages at the top of address space (e.g., a console register
+// stored into on every character) don't look like the code pages at the bottom of it. They're folded in above the bits
+// selecting the lines of a page, so pages sharing a filter bit still share the lines (see icache_drop_page()).
+#define RV_ICACHE_SET_BITS (RV_ICACHE_BITS + 2 - RV_ICACHE_PAGE_BITS)
+#define RV_ICACHE_FILTER(P) (((P) ^ (((P) >> RV_ICACHE_FILTER_BITS) << RV_ICACHE_SET_BITS)) & ((1U << RV_ICACHE_FILTER_BITS) - 1))
+
+void riscv_icache_reset(riscv_icache* ic)
+{
+    for (uint32_t i = 0; i < RV_ICACHE_SIZE; i++) ic->lines[i].ip = RV_ICACHE_INVALID;
+    memset(ic->code_pages,0,sizeof(ic->code_pages));
+    ic->hits = 0;
+    ic->misses = 0;
+    ic->invalidations = 0;
+    ic->dropped = 0;
+}
+
+// Drop all cached lines belonging to a page. Since the filter size is a multiple of the number
+// of pages covered by the cache, all pages sharing a filter bit are mapped into the same set of lines,
+// so we can tell if the filter bit could be cleared after the sweep.
+static void icache_drop_page(riscv_icache* ic, uint32_t page)
+{
+    uint32_t flt = RV_ICACHE_FILTER(page);
+    if (!(ic->code_pages[flt >> 3] & (1U << (flt & 7)))) return;
+
+    uint32_t lines = 1U << (RV_ICACHE_PAGE_BITS - 2);
+    int alias = 0;
+
+    // the page occupies two ranges of lines: for even and for odd halfwords
+    ic->invalidations++;
+    for (uint32_t half = 0; half <= 2; half += 2) {
+        riscv_decoded* l = ic->lines + RV_ICACHE_IDX((page << RV_ICACHE_PAGE_BITS) | half);
+        for (uint32_t i = 0; i < lines; i++, l++) {
+            if (l->ip == RV_ICACHE_INVALID) continue;
+            uint32_t p = RV_ICACHE_PAGE(l->ip);
+            if (p == page) {
+                l->ip = RV_ICACHE_INVALID;
+                ic->dropped++;
+            } else if (RV_ICACHE_FILTER(p) == flt)
+                alias = 1;
+        }
+    }
+
+    if (!alias) ic->code_pages[flt >> 3] &= ~(1U << (flt & 7));
+}
+
+// Drop all translated blocks belonging to a page (block cache is small enough to be swept entirely)
+static void bcache_drop_page(riscv_bcache* bc, uint32_t page)
+{
+    uint32_t flt = RV_ICACHE_FILTER(page);
+    if (!(bc->code_pages[flt >> 3] & (1U << (flt & 7)))) return;
+
+    int alias = 0;
+    bc->invalidations++;
+    for (uint32_t i = 0; i < RV_BCACHE_SIZE; i++) {
+        riscv_block* b = bc->blocks + i;
+        if (!b->len) continue;
+        uint32_t p = RV_ICACHE_PAGE(b->ip);
+        if (p == page) {
+            b->len = 0;
+            bc->dropped++;
+        } else if (RV_ICACHE_FILTER(p) == flt)
+            alias = 1;
+    }
+
+    if (!alias) bc->code_pages[flt >> 3] &= ~(1U << (flt & 7));
+}
+
+// Check if the memory range written might contain some cached code, and invalidate it
+static int code_modified(riscv_state* st, uint32_t addr, uint32_t len)
+{
+    const uint32_t pmask = (1U << (32 - RV_ICACHE_PAGE_BITS)) - 1;
+    uint32_t last = RV_ICACHE_PAGE(addr + (len - 1));
+    int hit = 0;
+
+    for (uint32_t p = RV_ICACHE_PAGE(addr);; p = (p + 1) & pmask) {
+        uint32_t flt = RV_ICACHE_FILTER(p);
+        uint8_t bit = 1U << (flt & 7);
+        if (st->icache && (st->icache->code_pages[flt >> 3] & bit)) {
+            icache_drop_page(st->icache,p);
+            hit = 1;
+        }
+        if (st->bcache && (st->bcache->code_pages[flt >> 3] & bit)) {
+            bcache_drop_page(st->bcache,p);
+            hit = 1;
+        }
+        if (st->bcache && (st->bcache->native_pages[flt >> 3] & bit)) {
+            // compiled blocks might be chained together, so the easiest way is to throw them all away
+            st->bcache->flush_native = 1;
+            hit = 1;
+        }
+        if (p == last) break;
+    }
+
+    return hit;
+}
+
+int riscv_icache_invalidate(riscv_state* st, uint32_t addr, uint32_t len)
+{
+    return len? code_modified(st,addr,len) : 0;
+}
+
+// Get pre-decoded instruction from cache (or decode it if it's not there yet)
+static inline const riscv_decoded* fetch(riscv_state* st, riscv_decoded* tmp)
+{
+    riscv_icache* ic = st->icache;
+    if (!ic) return predecode(st,st->ip,tmp)? tmp : NULL;
+
+    riscv_decoded* l = ic->lines + RV_ICACHE_IDX(st->ip);
+    if (l->ip == st->ip) {
+        ic->hits++;
+        return l;
+    }
+
+    ic->misses++;
+    if (!predecode(st,st->ip,l)) {
+        l->ip = RV_ICACHE_INVALID;
+        return NULL;
+    }
 
-    if (op > RV_EBREAK) {
+    // an instruction crossing page boundary isn't cached (page invalidation wouldn't notice changes to its second half)
+    if (RV_ICACHE_PAGE(st->ip + l->len - 1) != RV_ICACHE_PAGE(st->ip)) {
+        *tmp = *l;
+        l->ip = RV_ICACHE_INVALID;
+        return tmp;
+    }
+
+    uint32_t flt = RV_ICACHE_FILTER(RV_ICACHE_PAGE(st->ip));
+    ic->code_pages[flt >> 3] |= 1U << (flt & 7);
+    return l;
+}
+
+// Stores need to invalidate cached code they might overwrite
+#define RV_STORE_CHECK(A,N) if (st->icache || st->bcache) code_modified(st,(A),(N))
+
+// Host monotonic clock in 'time' CSR ticks
+static uint64_t host_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * RV_TIME_FREQ + (uint64_t)ts.tv_nsec / (1000000000 / RV_TIME_FREQ);
+}
+
+int riscv_csr_access(riscv_state* st, uint32_t op, uint32_t rd, uint32_t rs1, uint32_t csr)
+{
+    // set and clear don't write anything if the mask is zero (x0 or zero immediate)
+    if (op == RV_CSRRW || op == RV_CSRRWI || rs1) return 0; // all our CSRs are read-only
+
+    uint64_t val;
+    switch (csr & 0xFFF) {
+    case RV_CSR_CYCLE:
+    case RV_CSR_INSTRET:
+        val = st->instret;
+        break;
+    case RV_CSR_CYCLEH:
+    case RV_CSR_INSTRETH:
+        val = st->instret >> 32;
+        break;
+    case RV_CSR_TIME:
+        val = host_time();
+        break;
+    case RV_CSR_TIMEH:
+        val = host_time() >> 32;
+        break;
+    default:
+        return 0;
+    }
+
+    if (rd) st->regs[rd] = (uint32_t)val;
+    return 1;
+}
+
+// Report CSR access which has failed
+static riscv_exit csr_failed(riscv_state* st, uint32_t csr)
+{
+    printf("Illegal access to CSR 0x%03X @ 0x%08X\n",csr & 0xFFF,st->ip);
+    return RVEXIT_WRONGOPCODE;
+}
+
+// Put executed instruction into the binary trace
+static void trace(riscv_state* st, uint32_t ip, uint32_t inst, uint32_t op, uint32_t rd, uint32_t mem)
+{
+    riscv_trace_insn(st->trace,ip,inst,op,rd,st->regs[rd],mem);
+}
+
+// Simply execute single RISC-V instruction
+static inline riscv_exit step(riscv_state* st)
+{
+    st->regs[RVR_ZERO] = 0; // to simplify things, x0 is just a regular register
+
+    // get next instruction, already decoded
+    riscv_decoded tmp;
+    const riscv_decoded* d = fetch(st,&tmp);
+
+    if (!d) {
         // dunno what was that
-        printf("Unable to decode instruction 0x%08X @ 0x%08X\n",inst,st->ip);
-        for (int i = 0; i < 32; i++, inst <<= 1) putchar((inst & 0x80000000)? '1':'0');
+        uint32_t inst = fetch_inst(st,st->ip);
+        int bits = RV_INST_LEN(inst) * 8;
+        printf("Unable to decode instruction 0x%0*X @ 0x%08X\n",bits / 4,inst,st->ip);
+        for (int i = bits - 1; i >= 0; i--) putchar((inst & (1U << i))? '1':'0');
         putchar('\n');
         return RVEXIT_WRONGOPCODE;
     }
 
     // execute instruction according to riscv-spec-20191213
-    uint8_t shf, jmp = 0, end = 0;
-    uint32_t tmp;
+    uint32_t op = d->op, rd = d->rd, rs1 = d->rs1, rs2 = d->rs2, imm = d->imm, len = d->len, inst = d->inst;
+    uint32_t ip = st->ip, mem = st->regs[rs1] + imm;
+    uint8_t shf, jmp = 0;
+    uint32_t tmp32;
+    riscv_exit end = RVEXIT_SUCCESS;
     switch (op) {
     case RV_LUI:
         st->regs[rd] = imm;
@@ -96,81 +669,84 @@ riscv_exit riscv_exec(riscv_state* st)
         st->regs[rd] = st->ip + imm;
         break;
     case RV_JAL:
-        if (rd) st->regs[rd] = st->ip + 4;
-        st->ip += RV_EXTEND(imm,20);
+        if (rd) st->regs[rd] = st->ip + len;
+        st->ip += imm;
         jmp = 1;
         break;
     case RV_JALR:
-        tmp = st->ip;
-        st->ip = st->regs[rs1] + RV_EXTEND(imm,11);
-        if (rd) st->regs[rd] = tmp + 4;
+        tmp32 = st->ip;
+        st->ip = (st->regs[rs1] + imm) & ~1U;
+        if (rd) st->regs[rd] = tmp32 + len;
         jmp = 1;
         break;
     case RV_BEQ:
-        st->ip += (st->regs[rs1] == st->regs[rs2])? RV_EXTEND(imm,12):4;
+        st->ip += (st->regs[rs1] == st->regs[rs2])? imm:len;
         jmp = 1;
         break;
     case RV_BNE:
-        st->ip += (st->regs[rs1] != st->regs[rs2])? RV_EXTEND(imm,12):4;
+        st->ip += (st->regs[rs1] != st->regs[rs2])? imm:len;
         jmp = 1;
         break;
     case RV_BLT:
-        st->ip += ((int32_t)(st->regs[rs1]) < (int32_t)(st->regs[rs2]))? RV_EXTEND(imm,12):4;
+        st->ip += ((int32_t)(st->regs[rs1]) < (int32_t)(st->regs[rs2]))? imm:len;
         jmp = 1;
         break;
     case RV_BGE:
-        st->ip += ((int32_t)(st->regs[rs1]) >= (int32_t)(st->regs[rs2]))? RV_EXTEND(imm,12):4;
+        st->ip += ((int32_t)(st->regs[rs1]) >= (int32_t)(st->regs[rs2]))? imm:len;
         jmp = 1;
         break;
     case RV_BLTU:
-        st->ip += (st->regs[rs1] < st->regs[rs2])? RV_EXTEND(imm,12):4;
+        st->ip += (st->regs[rs1] < st->regs[rs2])? imm:len;
         jmp = 1;
         break;
     case RV_BGEU:
-        st->ip += (st->regs[rs1] >= st->regs[rs2])? RV_EXTEND(imm,12):4;
+        st->ip += (st->regs[rs1] >= st->regs[rs2])? imm:len;
         jmp = 1;
         break;
     case RV_LB:
-        st->regs[rd] = read8(st,st->regs[rs1]+RV_EXTEND(imm,11),1);
+        st->regs[rd] = read8(st,st->regs[rs1]+imm,1);
         break;
     case RV_LH:
-        st->regs[rd] = read16(st,st->regs[rs1]+RV_EXTEND(imm,11),1);
+        st->regs[rd] = read16(st,st->regs[rs1]+imm,1);
         break;
     case RV_LW:
-        st->regs[rd] = st->funcs.read32(st,st->regs[rs1]+RV_EXTEND(imm,11));
+        st->regs[rd] = mem_read32(st,st->regs[rs1]+imm);
         break;
     case RV_LBU:
-        st->regs[rd] = read8(st,st->regs[rs1]+RV_EXTEND(imm,11),0);
+        st->regs[rd] = read8(st,st->regs[rs1]+imm,0);
         break;
     case RV_LHU:
-        st->regs[rd] = read16(st,st->regs[rs1]+RV_EXTEND(imm,11),0);
+        st->regs[rd] = read16(st,st->regs[rs1]+imm,0);
         break;
     case RV_SB:
-        st->funcs.write8(st,st->regs[rs1]+RV_EXTEND(imm,11),st->regs[rs2]);
+        mem_write8(st,st->regs[rs1]+imm,st->regs[rs2]);
+        RV_STORE_CHECK(st->regs[rs1]+imm,1);
         break;
     case RV_SH:
-        st->funcs.write16(st,st->regs[rs1]+RV_EXTEND(imm,11),st->regs[rs2]);
+        mem_write16(st,st->regs[rs1]+imm,st->regs[rs2]);
+        RV_STORE_CHECK(st->regs[rs1]+imm,2);
         break;
     case RV_SW:
-        st->funcs.write32(st,st->regs[rs1]+RV_EXTEND(imm,11),st->regs[rs2]);
+        mem_write32(st,st->regs[rs1]+imm,st->regs[rs2]);
+        RV_STORE_CHECK(st->regs[rs1]+imm,4);
         break;
     case RV_ADDI:
-        st->regs[rd] = (uint32_t)((int32_t)(st->regs[rs1]) + RV_EXTEND(imm,11));
+        st->regs[rd] = st->regs[rs1] + imm;
         break;
     case RV_SLTI:
-        st->regs[rd] = ((int32_t)(st->regs[rs1]) < RV_EXTEND(imm,11))? 1:0;
+        st->regs[rd] = ((int32_t)(st->regs[rs1]) < (int32_t)imm)? 1:0;
         break;
     case RV_SLTIU:
-        st->regs[rd] = (st->regs[rs1] < (uint32_t)(RV_EXTEND(imm,11)))? 1:0;
+        st->regs[rd] = (st->regs[rs1] < imm)? 1:0;
         break;
     case RV_XORI:
-        st->regs[rd] = st->regs[rs1] ^ RV_EXTEND(imm,11);
+        st->regs[rd] = st->regs[rs1] ^ imm;
         break;
     case RV_ORI:
-        st->regs[rd] = st->regs[rs1] | RV_EXTEND(imm,11);
+        st->regs[rd] = st->regs[rs1] | imm;
         break;
     case RV_ANDI:
-        st->regs[rd] = st->regs[rs1] & RV_EXTEND(imm,11);
+        st->regs[rd] = st->regs[rs1] & imm;
         break;
     case RV_SLLI:
         st->regs[rd] = st->regs[rs1] << rs2;
@@ -179,8 +755,8 @@ riscv_exit riscv_exec(riscv_state* st)
         st->regs[rd] = st->regs[rs1] >> rs2;
         break;
     case RV_SRAI:
-        tmp = (st->regs[rs1] & 0x80000000)? ((1U << rs2) - 1) << (32 - rs2) : 0;
-        st->regs[rd] = (st->regs[rs1] >> rs2) | tmp;
+        tmp32 = (st->regs[rs1] & 0x80000000)? ((1U << rs2) - 1) << (32 - rs2) : 0;
+        st->regs[rd] = (st->regs[rs1] >> rs2) | tmp32;
         break;
     case RV_ADD:
         st->regs[rd] = st->regs[rs1] + st->regs[rs2];
@@ -205,8 +781,8 @@ riscv_exit riscv_exec(riscv_state* st)
         break;
     case RV_SRA:
         shf = st->regs[rs2] & 0x1F;
-        tmp = (st->regs[rs1] & 0x80000000)? ((1U << shf) - 1) << (32 - shf) : 0;
-        st->regs[rd] = (st->regs[rs1] >> shf) | tmp;
+        tmp32 = (st->regs[rs1] & 0x80000000)? ((1U << shf) - 1) << (32 - shf) : 0;
+        st->regs[rd] = (st->regs[rs1] >> shf) | tmp32;
         break;
     case RV_OR:
         st->regs[rd] = st->regs[rs1] | st->regs[rs2];
@@ -217,16 +793,782 @@ riscv_exit riscv_exec(riscv_state* st)
     case RV_FENCE:
         break;
     case RV_ECALL:
-        if (st->funcs.ecall(st)) end = 1;
+        if (st->funcs.ecall(st)) end = RVEXIT_HALT;
         break;
     case RV_EBREAK:
         st->funcs.ebreak(st);
+        end = RVEXIT_BREAKPOINT;
+        break;
+    case RV_CSRRW:
+    case RV_CSRRS:
+    case RV_CSRRC:
+    case RV_CSRRWI:
+    case RV_CSRRSI:
+    case RV_CSRRCI:
+        // failed access doesn't retire the instruction
+        if (!riscv_csr_access(st,op,rd,rs1,imm)) return csr_failed(st,imm);
+        break;
+    case RV_MUL:
+    case RV_MULH:
+    case RV_MULHSU:
+    case RV_MULHU:
+    case RV_DIV:
+    case RV_DIVU:
+    case RV_REM:
+    case RV_REMU:
+        st->regs[rd] = riscv_muldiv(op,st->regs[rs1],st->regs[rs2]);
+        break;
+    case RV_SH1ADD:
+    case RV_SH2ADD:
+    case RV_SH3ADD:
+    case RV_ANDN:
+    case RV_ORN:
+    case RV_XNOR:
+    case RV_CLZ:
+    case RV_CTZ:
+    case RV_CPOP:
+    case RV_MAX:
+    case RV_MAXU:
+    case RV_MIN:
+    case RV_MINU:
+    case RV_SEXT_B:
+    case RV_SEXT_H:
+    case RV_ZEXT_H:
+    case RV_ROL:
+    case RV_ROR:
+    case RV_ORC_B:
+    case RV_REV8:
+        st->regs[rd] = riscv_bitmanip(op,st->regs[rs1],st->regs[rs2]);
+        break;
+    case RV_RORI:
+        st->regs[rd] = riscv_bitmanip(op,st->regs[rs1],rs2);
         break;
     }
 
-    if (!jmp) st->ip += 4;
+    if (!jmp) st->ip += len;
+    st->instret++;
+    if (st->trace) trace(st,ip,inst,op,rd,mem);
+
+    return end;
+}
+
+#define RV_BCACHE_IDX(A) ((((A) >> 2) ^ (((A) & 2) << (RV_BCACHE_BITS - 2))) & (RV_BCACHE_SIZE - 1))
+
+// Writes to x0 go here, so x0 is always zero inside a block
+#define RV_SCRATCH_REG RV_NUMREGS
+
+#ifdef RV_THREADED_GOTO
+#define RV_DISPATCH_BEGIN goto *i->handler;
+#define RV_DISPATCH_END
+#define RV_HANDLER(OP) L_##OP:
+#define RV_NEXT() do { i++; goto *i->handler; } while (0)
+#else
+#define RV_DISPATCH_BEGIN for (;; i++) switch (i->op) {
+#define RV_DISPATCH_END }
+#define RV_HANDLER(OP) case OP:
+#define RV_NEXT() continue
+#endif
+
+#define RV_LEAVE(A) do { st->ip = (A); goto leave; } while (0)
+// Address of the next guest instruction
+#define RV_FALL(I) ((I)->ip + (I)->len)
+// (no do-while wrapping here, since RV_NEXT() might be a 'continue' statement)
+#define RV_LOAD_DONE() if (st->fault) RV_LEAVE(RV_FALL(i)); else RV_NEXT()
+#define RV_STORE_DONE(A,N) if (st->fault || code_modified(st,(A),(N))) RV_LEAVE(RV_FALL(i)); else RV_NEXT()
+
+// Execute translated block. Guest registers are kept in local variables all the way through it.
+// Then it goes on to the next cached blocks (after ECALL too), as long as they fit into 'budget' (same meaning as for exec_block)
+static riscv_exit run_block(riscv_state* st, const riscv_block* b, int64_t budget, const void* const** handlers)
+{
+#ifdef RV_THREADED_GOTO
+    static const void* const tab[RVT_NUMOPS] = {
+        [RV_LUI] = &&L_RV_LUI,
+        [RV_AUIPC] = &&L_RV_AUIPC,
+        [RV_JAL] = &&L_RV_JAL,
+        [RV_JALR] = &&L_RV_JALR,
+        [RV_BEQ] = &&L_RV_BEQ,
+        [RV_BNE] = &&L_RV_BNE,
+        [RV_BLT] = &&L_RV_BLT,
+        [RV_BGE] = &&L_RV_BGE,
+        [RV_BLTU] = &&L_RV_BLTU,
+        [RV_BGEU] = &&L_RV_BGEU,
+        [RV_LB] = &&L_RV_LB,
+        [RV_LH] = &&L_RV_LH,
+        [RV_LW] = &&L_RV_LW,
+        [RV_LBU] = &&L_RV_LBU,
+        [RV_LHU] = &&L_RV_LHU,
+        [RV_SB] = &&L_RV_SB,
+        [RV_SH] = &&L_RV_SH,
+        [RV_SW] = &&L_RV_SW,
+        [RV_ADDI] = &&L_RV_ADDI,
+        [RV_SLTI] = &&L_RV_SLTI,
+        [RV_SLTIU] = &&L_RV_SLTIU,
+        [RV_XORI] = &&L_RV_XORI,
+        [RV_ORI] = &&L_RV_ORI,
+        [RV_ANDI] = &&L_RV_ANDI,
+        [RV_SLLI] = &&L_RV_SLLI,
+        [RV_SRLI] = &&L_RV_SRLI,
+        [RV_SRAI] = &&L_RV_SRAI,
+        [RV_ADD] = &&L_RV_ADD,
+        [RV_SUB] = &&L_RV_SUB,
+        [RV_SLL] = &&L_RV_SLL,
+        [RV_SLT] = &&L_RV_SLT,
+        [RV_SLTU] = &&L_RV_SLTU,
+        [RV_XOR] = &&L_RV_XOR,
+        [RV_SRL] = &&L_RV_SRL,
+        [RV_SRA] = &&L_RV_SRA,
+        [RV_OR] = &&L_RV_OR,
+        [RV_AND] = &&L_RV_AND,
+        [RV_FENCE] = &&L_RV_FENCE,
+        [RV_ECALL] = &&L_RV_ECALL,
+        [RV_EBREAK] = &&L_RV_EBREAK,
+        [RV_CSRRW] = &&L_RV_CSRRW,
+        [RV_CSRRS] = &&L_RV_CSRRS,
+        [RV_CSRRC] = &&L_RV_CSRRC,
+        [RV_CSRRWI] = &&L_RV_CSRRWI,
+        [RV_CSRRSI] = &&L_RV_CSRRSI,
+        [RV_CSRRCI] = &&L_RV_CSRRCI,
+        [RV_MUL] = &&L_RV_MUL,
+        [RV_MULH] = &&L_RV_MULH,
+        [RV_MULHSU] = &&L_RV_MULHSU,
+        [RV_MULHU] = &&L_RV_MULHU,
+        [RV_DIV] = &&L_RV_DIV,
+        [RV_DIVU] = &&L_RV_DIVU,
+        [RV_REM] = &&L_RV_REM,
+        [RV_REMU] = &&L_RV_REMU,
+        [RV_SH1ADD] = &&L_RV_SH1ADD,
+        [RV_SH2ADD] = &&L_RV_SH2ADD,
+        [RV_SH3ADD] = &&L_RV_SH3ADD,
+        [RV_ANDN] = &&L_RV_ANDN,
+        [RV_ORN] = &&L_RV_ORN,
+        [RV_XNOR] = &&L_RV_XNOR,
+        [RV_CLZ] = &&L_RV_CLZ,
+        [RV_CTZ] = &&L_RV_CTZ,
+        [RV_CPOP] = &&L_RV_CPOP,
+        [RV_MAX] = &&L_RV_MAX,
+        [RV_MAXU] = &&L_RV_MAXU,
+        [RV_MIN] = &&L_RV_MIN,
+        [RV_MINU] = &&L_RV_MINU,
+        [RV_SEXT_B] = &&L_RV_SEXT_B,
+        [RV_SEXT_H] = &&L_RV_SEXT_H,
+        [RV_ZEXT_H] = &&L_RV_ZEXT_H,
+        [RV_ROL] = &&L_RV_ROL,
+        [RV_ROR] = &&L_RV_ROR,
+        [RV_RORI] = &&L_RV_RORI,
+        [RV_ORC_B] = &&L_RV_ORC_B,
+        [RV_REV8] = &&L_RV_REV8,
+        [RVT_EXIT] = &&L_RVT_EXIT,
+        [RVT_LUI_ADDI] = &&L_RVT_LUI_ADDI,
+        [RVT_AUIPC_JALR] = &&L_RVT_AUIPC_JALR,
+        [RVT_AUIPC_LW] = &&L_RVT_AUIPC_LW,
+        [RVT_SLT_BR] = &&L_RVT_SLT_BR,
+        [RVT_SLTU_BR] = &&L_RVT_SLTU_BR,
+        [RVT_ADDI_BNE] = &&L_RVT_ADDI_BNE,
+    };
+
+    if (handlers) {
+        *handlers = tab;
+        return RVEXIT_SUCCESS;
+    }
+#else
+    (void)handlers;
+#endif
+
+    uint32_t r[RV_NUMREGS+1];
+    memcpy(r,st->regs,sizeof(st->regs));
+    r[RVR_ZERO] = 0;
+
+    const riscv_tinst* i = b->code;
+    riscv_exit ret;
+    uint32_t t;
+    uint8_t shf;
+
+next_block:
+    RV_DISPATCH_BEGIN
+
+    RV_HANDLER(RV_LUI)
+        r[i->rd] = i->imm;
+        RV_NEXT();
+    RV_HANDLER(RV_AUIPC)
+        r[i->rd] = i->imm; // already relative to IP
+        RV_NEXT();
+    RV_HANDLER(RV_JAL)
+        r[i->rd] = RV_FALL(i);
+        RV_LEAVE(i->imm);
+    RV_HANDLER(RV_JALR)
+        t = (r[i->rs1] + i->imm) & ~1U;
+        r[i->rd] = RV_FALL(i);
+        RV_LEAVE(t);
+    RV_HANDLER(RV_BEQ)
+        RV_LEAVE((r[i->rs1] == r[i->rs2])? i->imm : RV_FALL(i));
+    RV_HANDLER(RV_BNE)
+        RV_LEAVE((r[i->rs1] != r[i->rs2])? i->imm : RV_FALL(i));
+    RV_HANDLER(RV_BLT)
+        RV_LEAVE(((int32_t)r[i->rs1] < (int32_t)r[i->rs2])? i->imm : RV_FALL(i));
+    RV_HANDLER(RV_BGE)
+        RV_LEAVE(((int32_t)r[i->rs1] >= (int32_t)r[i->rs2])? i->imm : RV_FALL(i));
+    RV_HANDLER(RV_BLTU)
+        RV_LEAVE((r[i->rs1] < r[i->rs2])? i->imm : RV_FALL(i));
+    RV_HANDLER(RV_BGEU)
+        RV_LEAVE((r[i->rs1] >= r[i->rs2])? i->imm : RV_FALL(i));
+    RV_HANDLER(RV_LB)
+        r[i->rd] = read8(st,r[i->rs1]+i->imm,1);
+        RV_LOAD_DONE();
+    RV_HANDLER(RV_LH)
+        r[i->rd] = read16(st,r[i->rs1]+i->imm,1);
+        RV_LOAD_DONE();
+    RV_HANDLER(RV_LW)
+        r[i->rd] = mem_read32(st,r[i->rs1]+i->imm);
+        RV_LOAD_DONE();
+    RV_HANDLER(RV_LBU)
+        r[i->rd] = read8(st,r[i->rs1]+i->imm,0);
+        RV_LOAD_DONE();
+    RV_HANDLER(RV_LHU)
+        r[i->rd] = read16(st,r[i->rs1]+i->imm,0);
+        RV_LOAD_DONE();
+    RV_HANDLER(RV_SB)
+        t = r[i->rs1] + i->imm;
+        mem_write8(st,t,r[i->rs2]);
+        RV_STORE_DONE(t,1);
+    RV_HANDLER(RV_SH)
+        t = r[i->rs1] + i->imm;
+        mem_write16(st,t,r[i->rs2]);
+        RV_STORE_DONE(t,2);
+    RV_HANDLER(RV_SW)
+        t = r[i->rs1] + i->imm;
+        mem_write32(st,t,r[i->rs2]);
+        RV_STORE_DONE(t,4);
+    RV_HANDLER(RV_ADDI)
+        r[i->rd] = r[i->rs1] + i->imm;
+        RV_NEXT();
+    RV_HANDLER(RV_SLTI)
+        r[i->rd] = ((int32_t)r[i->rs1] < (int32_t)i->imm)? 1:0;
+        RV_NEXT();
+    RV_HANDLER(RV_SLTIU)
+        r[i->rd] = (r[i->rs1] < i->imm)? 1:0;
+        RV_NEXT();
+    RV_HANDLER(RV_XORI)
+        r[i->rd] = r[i->rs1] ^ i->imm;
+        RV_NEXT();
+    RV_HANDLER(RV_ORI)
+        r[i->rd] = r[i->rs1] | i->imm;
+        RV_NEXT();
+    RV_HANDLER(RV_ANDI)
+        r[i->rd] = r[i->rs1] & i->imm;
+        RV_NEXT();
+    RV_HANDLER(RV_SLLI)
+        r[i->rd] = r[i->rs1] << i->rs2;
+        RV_NEXT();
+    RV_HANDLER(RV_SRLI)
+        r[i->rd] = r[i->rs1] >> i->rs2;
+        RV_NEXT();
+    RV_HANDLER(RV_SRAI)
+        t = (r[i->rs1] & 0x80000000)? ((1U << i->rs2) - 1) << (32 - i->rs2) : 0;
+        r[i->rd] = (r[i->rs1] >> i->rs2) | t;
+        RV_NEXT();
+    RV_HANDLER(RV_ADD)
+        r[i->rd] = r[i->rs1] + r[i->rs2];
+        RV_NEXT();
+    RV_HANDLER(RV_SUB)
+        r[i->rd] = r[i->rs1] - r[i->rs2];
+        RV_NEXT();
+    RV_HANDLER(RV_SLL)
+        r[i->rd] = r[i->rs1] << (r[i->rs2] & 0x1F);
+        RV_NEXT();
+    RV_HANDLER(RV_SLT)
+        r[i->rd] = ((int32_t)r[i->rs1] < (int32_t)r[i->rs2])? 1:0;
+        RV_NEXT();
+    RV_HANDLER(RV_SLTU)
+        r[i->rd] = (r[i->rs1] < r[i->rs2])? 1:0;
+        RV_NEXT();
+    RV_HANDLER(RV_XOR)
+        r[i->rd] = r[i->rs1] ^ r[i->rs2];
+        RV_NEXT();
+    RV_HANDLER(RV_SRL)
+        r[i->rd] = r[i->rs1] >> (r[i->rs2] & 0x1F);
+        RV_NEXT();
+    RV_HANDLER(RV_SRA)
+        shf = r[i->rs2] & 0x1F;
+        t = (r[i->rs1] & 0x80000000)? ((1U << shf) - 1) << (32 - shf) : 0;
+        r[i->rd] = (r[i->rs1] >> shf) | t;
+        RV_NEXT();
+    RV_HANDLER(RV_OR)
+        r[i->rd] = r[i->rs1] | r[i->rs2];
+        RV_NEXT();
+    RV_HANDLER(RV_AND)
+        r[i->rd] = r[i->rs1] & r[i->rs2];
+        RV_NEXT();
+    RV_HANDLER(RV_FENCE)
+        RV_NEXT();
+    RV_HANDLER(RV_ECALL)
+        // host needs to see actual registers contents (and might change them)
+        memcpy(st->regs,r,sizeof(st->regs));
+        st->ip = i->ip;
+        st->instret += i->count;
+        ret = st->funcs.ecall(st)? RVEXIT_HALT : RVEXIT_SUCCESS;
+        st->ip += i->len;
+        if (ret != RVEXIT_SUCCESS) return ret;
+        memcpy(r,st->regs,sizeof(st->regs)); // (x0 is still zero, nobody writes it outside of step())
+        budget -= i->count;
+        goto chain;
+    RV_HANDLER(RV_EBREAK)
+        memcpy(st->regs,r,sizeof(st->regs));
+        st->ip = i->ip;
+        st->instret += i->count;
+        st->funcs.ebreak(st);
+        st->ip += i->len;
+        return RVEXIT_BREAKPOINT;
+    RV_HANDLER(RV_CSRRW)
+    RV_HANDLER(RV_CSRRS)
+    RV_HANDLER(RV_CSRRC)
+    RV_HANDLER(RV_CSRRWI)
+    RV_HANDLER(RV_CSRRSI)
+    RV_HANDLER(RV_CSRRCI)
+        // counters must be up to date (CSR instructions end blocks, so it's the same as ECALL)
+        memcpy(st->regs,r,sizeof(st->regs));
+        st->ip = i->ip;
+        st->instret += i->count - 1;
+        if (!riscv_csr_access(st,i->op,(i->rd == RV_SCRATCH_REG)? 0 : i->rd,i->rs1,i->imm)) return csr_failed(st,i->imm);
+        st->instret++;
+        st->ip += i->len;
+        return RVEXIT_SUCCESS;
+    RV_HANDLER(RV_MUL)
+        r[i->rd] = riscv_muldiv(RV_MUL,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_MULH)
+        r[i->rd] = riscv_muldiv(RV_MULH,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_MULHSU)
+        r[i->rd] = riscv_muldiv(RV_MULHSU,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_MULHU)
+        r[i->rd] = riscv_muldiv(RV_MULHU,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_DIV)
+        r[i->rd] = riscv_muldiv(RV_DIV,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_DIVU)
+        r[i->rd] = riscv_muldiv(RV_DIVU,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_REM)
+        r[i->rd] = riscv_muldiv(RV_REM,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_REMU)
+        r[i->rd] = riscv_muldiv(RV_REMU,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_SH1ADD)
+        r[i->rd] = riscv_bitmanip(RV_SH1ADD,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_SH2ADD)
+        r[i->rd] = riscv_bitmanip(RV_SH2ADD,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_SH3ADD)
+        r[i->rd] = riscv_bitmanip(RV_SH3ADD,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_ANDN)
+        r[i->rd] = riscv_bitmanip(RV_ANDN,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_ORN)
+        r[i->rd] = riscv_bitmanip(RV_ORN,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_XNOR)
+        r[i->rd] = riscv_bitmanip(RV_XNOR,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_CLZ)
+        r[i->rd] = riscv_bitmanip(RV_CLZ,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_CTZ)
+        r[i->rd] = riscv_bitmanip(RV_CTZ,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_CPOP)
+        r[i->rd] = riscv_bitmanip(RV_CPOP,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_MAX)
+        r[i->rd] = riscv_bitmanip(RV_MAX,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_MAXU)
+        r[i->rd] = riscv_bitmanip(RV_MAXU,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_MIN)
+        r[i->rd] = riscv_bitmanip(RV_MIN,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_MINU)
+        r[i->rd] = riscv_bitmanip(RV_MINU,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_SEXT_B)
+        r[i->rd] = riscv_bitmanip(RV_SEXT_B,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_SEXT_H)
+        r[i->rd] = riscv_bitmanip(RV_SEXT_H,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_ZEXT_H)
+        r[i->rd] = riscv_bitmanip(RV_ZEXT_H,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_ROL)
+        r[i->rd] = riscv_bitmanip(RV_ROL,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_ROR)
+        r[i->rd] = riscv_bitmanip(RV_ROR,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_RORI)
+        r[i->rd] = riscv_bitmanip(RV_RORI,r[i->rs1],i->rs2);
+        RV_NEXT();
+    RV_HANDLER(RV_ORC_B)
+        r[i->rd] = riscv_bitmanip(RV_ORC_B,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RV_REV8)
+        r[i->rd] = riscv_bitmanip(RV_REV8,r[i->rs1],r[i->rs2]);
+        RV_NEXT();
+    RV_HANDLER(RVT_EXIT)
+        RV_LEAVE(i->imm);
+    RV_HANDLER(RVT_LUI_ADDI)
+        st->bcache->fused[RVF_LUI_ADDI]++;
+        r[i->rd] = i->imm;
+        RV_NEXT();
+    RV_HANDLER(RVT_AUIPC_JALR)
+        st->bcache->fused[RVF_AUIPC_JALR]++;
+        r[i->rd] = i->imm2;
+        r[i->rs2] = RV_FALL(i);
+        RV_LEAVE(i->imm);
+    RV_HANDLER(RVT_AUIPC_LW)
+        st->bcache->fused[RVF_AUIPC_LW]++;
+        r[i->rd] = i->imm2;
+        r[i->rs2] = mem_read32(st,i->imm);
+        if (st->fault) RV_LEAVE(RV_FALL(i)); else RV_NEXT();
+    RV_HANDLER(RVT_SLT_BR)
+        st->bcache->fused[RVF_SLT_BRANCH]++;
+        t = ((int32_t)r[i->rs1] < (int32_t)r[i->rs2])? 1:0;
+        r[i->rd] = t;
+        RV_LEAVE((t == i->imm2)? i->imm : RV_FALL(i));
+    RV_HANDLER(RVT_SLTU_BR)
+        st->bcache->fused[RVF_SLT_BRANCH]++;
+        t = (r[i->rs1] < r[i->rs2])? 1:0;
+        r[i->rd] = t;
+        RV_LEAVE((t == i->imm2)? i->imm : RV_FALL(i));
+    RV_HANDLER(RVT_ADDI_BNE)
+        st->bcache->fused[RVF_ADDI_BNE]++;
+        r[i->rd] = r[i->rs1] + i->imm;
+        RV_LEAVE((r[i->rd] != r[i->rs2])? i->imm2 : RV_FALL(i));
+
+    RV_DISPATCH_END
+
+leave:
+    st->instret += i->count;
+    budget -= i->count;
+chain:
+    // faults and code modifications are left to the caller (the latter invalidate blocks, so the lookup misses)
+    if (budget > 0 && !st->fault) {
+        const riscv_block* nb = st->bcache->blocks + RV_BCACHE_IDX(st->ip);
+        if (nb->len && nb->ip == st->ip) {
+            st->bcache->hits++;
+            i = nb->code;
+            goto next_block;
+        }
+    }
+    memcpy(st->regs,r,sizeof(st->regs));
+    return RVEXIT_SUCCESS;
+}
+
+// Try to fuse two consecutive instructions into a single macro-op
+// Both register writes are always done, so the result is exactly the same as executing them one by one
+// (and jumps into the middle of a pair simply start another block with the second instruction).
+static int fuse_pair(const riscv_tinst* a, const riscv_tinst* b, riscv_tinst* f)
+{
+    // first instruction's result must be used by the second one
+    if (a->rd == RV_SCRATCH_REG) return 0;
+
+    *f = *a;
+    f->len = a->len + b->len;
+    f->count = b->count;
+    switch (a->op) {
+    case RV_LUI:
+        if (b->op != RV_ADDI || b->rs1 != a->rd || b->rd != a->rd) return 0;
+        f->op = RVT_LUI_ADDI;
+        f->imm = a->imm + b->imm;
+        return 1;
+
+    case RV_AUIPC:
+        if ((b->op != RV_JALR && b->op != RV_LW) || b->rs1 != a->rd) return 0;
+        f->op = (b->op == RV_JALR)? RVT_AUIPC_JALR : RVT_AUIPC_LW;
+        f->rs2 = b->rd;
+        f->imm = a->imm + b->imm; // jump target or address of the variable
+        if (b->op == RV_JALR) f->imm &= ~1U;
+        f->imm2 = a->imm;
+        return 1;
+
+    case RV_SLT:
+    case RV_SLTU:
+        if (b->op != RV_BEQ && b->op != RV_BNE) return 0;
+        if (!((b->rs1 == a->rd && !b->rs2) || (!b->rs1 && b->rs2 == a->rd))) return 0;
+        f->op = (a->op == RV_SLT)? RVT_SLT_BR : RVT_SLTU_BR;
+        f->imm = b->imm;
+        f->imm2 = (b->op == RV_BNE); // the result of comparison which makes the branch taken
+        return 1;
+
+    case RV_ADDI:
+        if (b->op != RV_BNE || (b->rs1 != a->rd && b->rs2 != a->rd)) return 0;
+        f->op = RVT_ADDI_BNE;
+        f->rs2 = (b->rs1 == a->rd)? b->rs2 : b->rs1; // the other register to compare with
+        f->imm2 = b->imm;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Fuse instruction pairs in the block, returns new number of instructions
+static uint32_t fuse(riscv_tinst* code, uint32_t n)
+{
+    uint32_t k = 0;
+    riscv_tinst f;
+
+    for (uint32_t j = 0; j < n; j++, k++) {
+        if (j + 1 < n && fuse_pair(code + j,code + j + 1,&f)) {
+            code[k] = f;
+            j++;
+        } else if (k != j)
+            code[k] = code[j];
+    }
 
-    return end? RVEXIT_HALT : RVEXIT_SUCCESS;
+    return k;
+}
+
+// Translate basic block starting at current IP into threaded code
+static int translate(riscv_state* st, riscv_block* b)
+{
+    uint32_t ip = st->ip;
+    uint32_t page = RV_ICACHE_PAGE(ip);
+    uint32_t fault = st->fault;
+    uint32_t n = 0;
+    int end = 0;
+    riscv_decoded d;
+
+    b->len = 0;
+    while (!end && n < RV_BLOCK_MAX_LEN && RV_ICACHE_PAGE(ip) == page) {
+        // an instruction we can't fetch or decode (or the one crossing page boundary) ends the block before it
+        if (!predecode(st,ip,&d) || st->fault || RV_ICACHE_PAGE(ip + d.len - 1) != page) break;
+
+        riscv_tinst* t = b->code + n++;
+        t->op = d.op;
+        t->rd = d.rd? d.rd : RV_SCRATCH_REG;
+        t->rs1 = d.rs1;
+        t->rs2 = d.rs2;
+        t->imm = d.imm;
+        t->ip = ip;
+        t->len = d.len;
+        t->count = n;
+
+        switch (d.op) {
+        case RV_AUIPC:
+            t->imm += ip;
+            break;
+        case RV_JAL:
+        case RV_BEQ:
+        case RV_BNE:
+        case RV_BLT:
+        case RV_BGE:
+        case RV_BLTU:
+        case RV_BGEU:
+            t->imm += ip;
+            end = 1;
+            break;
+        case RV_JALR:
+        case RV_ECALL:
+        case RV_EBREAK:
+        case RV_CSRRW:
+        case RV_CSRRS:
+        case RV_CSRRC:
+        case RV_CSRRWI:
+        case RV_CSRRSI:
+        case RV_CSRRCI:
+            end = 1;
+            break;
+        }
+
+        ip += d.len;
+    }
+
+    // translation shouldn't have any visible side effects
+    st->fault = fault;
+    if (!n) return 0;
+
+    // terminate the block
+    if (!end) {
+        riscv_tinst* t = b->code + n;
+        t->op = RVT_EXIT;
+        t->imm = ip;
+        t->ip = ip;
+        t->len = 0;
+        t->count = n; // it doesn't retire anything itself
+    }
+
+    // fuse common instruction pairs (the terminator is never fused, so it just moves along)
+    n = fuse(b->code,n + !end) - !end;
+
+#ifdef RV_THREADED_GOTO
+    for (uint32_t k = 0; k < n + !end; k++) b->code[k].handler = thr_handlers[b->code[k].op];
+#endif
+
+    b->ip = st->ip;
+    b->len = n;
+    b->count = 0;
+    b->native = NULL;
+
+    uint32_t flt = RV_ICACHE_FILTER(page);
+    st->bcache->code_pages[flt >> 3] |= 1U << (flt & 7);
+    return 1;
+}
+
+void riscv_bcache_reset(riscv_bcache* bc)
+{
+    memset(bc,0,sizeof(riscv_bcache));
+}
+
+#ifdef RV_USE_JIT
+// Drop all native code
+static void jit_flush(riscv_state* st)
+{
+    riscv_bcache* bc = st->bcache;
+    riscv_jit_flush(st->jit);
+    for (uint32_t i = 0; i < RV_BCACHE_SIZE; i++) bc->blocks[i].native = NULL;
+    memset(bc->native_pages,0,sizeof(bc->native_pages));
+    bc->flush_native = 0;
+}
+
+// Compile a hot block (if native code buffer is full, it's flushed entirely)
+static void jit_compile(riscv_state* st, riscv_block* b)
+{
+    int unsupported;
+    b->native = riscv_jit_compile(st,b,&unsupported);
+    if (!b->native && !unsupported) {
+        jit_flush(st);
+        b->native = riscv_jit_compile(st,b,&unsupported);
+    }
+    if (!b->native) return;
+
+    uint32_t flt = RV_ICACHE_FILTER(RV_ICACHE_PAGE(b->ip));
+    st->bcache->native_pages[flt >> 3] |= 1U << (flt & 7);
+}
+#endif /* RV_USE_JIT */
+
+// Execute one translated block (or a single instruction, if it can't be translated)
+// Translated or native code might run many chained blocks, but no more than 'budget' instructions plus one block
+static inline riscv_exit exec_block(riscv_state* st, int64_t budget)
+{
+    riscv_bcache* bc = st->bcache;
+    riscv_block* b = bc->blocks + RV_BCACHE_IDX(st->ip);
+    if (b->len && b->ip == st->ip)
+        bc->hits++;
+    else {
+        bc->misses++;
+        // let the reference implementation deal with the problem, if any
+        if (!translate(st,b)) return step(st);
+    }
+
+#ifdef RV_USE_JIT
+    riscv_jit* jit = st->jit;
+    if (jit && !st->profile) {
+        if (bc->flush_native) jit_flush(st);
+
+        if (b->native) {
+            st->instret += riscv_jit_run(st,b->native,budget);
+
+            // try to link the exit taken with its target, so next time we won't even get here
+            if (jit->last_exit && !bc->flush_native) {
+                riscv_block* nb = bc->blocks + RV_BCACHE_IDX(st->ip);
+                if (nb->len && nb->ip == st->ip && nb->native) riscv_jit_chain(jit,nb->native);
+            }
+            return RVEXIT_SUCCESS;
+        }
+
+        // no chaining here, every block must be counted
+        riscv_exit r = run_block(st,b,0,NULL);
+        if (b->len && ++b->count == RV_JIT_HOT_THRESHOLD) jit_compile(st,b);
+        return r;
+    }
+#endif
+
+    return run_block(st,b,budget,NULL);
+}
+
+// Execute one block and count it in the profile
+static riscv_exit exec_profiled(riscv_state* st)
+{
+    uint32_t ip = st->ip;
+    uint64_t start = st->instret;
+    riscv_exit r = exec_block(st,0);
+    riscv_profile_block(st->profile,ip,st->instret - start);
+    return r;
+}
+
+riscv_exit riscv_run(riscv_state* st, uint64_t max_instructions, uint64_t* retired)
+{
+    assert((st->ip & 1) == 0); // sanity check
+    if (!dec_ready) riscv_init();
+
+    uint64_t start = st->instret;
+    riscv_exit r = RVEXIT_BUDGET;
+
+    for (uint64_t done = 0; done < max_instructions; done = st->instret - start) {
+        // whole blocks are only executed when they can't overrun the budget
+        uint64_t left = max_instructions - done;
+        if (st->bcache && !st->trace && left >= RV_BLOCK_MAX_LEN)
+            r = st->profile? exec_profiled(st) :
+                exec_block(st,(left - RV_BLOCK_MAX_LEN + 1 > INT64_MAX)? INT64_MAX : (int64_t)(left - RV_BLOCK_MAX_LEN + 1));
+        else
+            r = step(st);
+
+        if (st->fault) r = RVEXIT_FAULT;
+        if (r != RVEXIT_SUCCESS) break;
+        r = RVEXIT_BUDGET;
+    }
+
+    if (retired) *retired = st->instret - start;
+    return r;
+}
+
+// Single-step API doesn't report breakpoints and faults (the latter are still visible in 'fault' field)
+riscv_exit riscv_exec(riscv_state* st)
+{
+    riscv_exit r = riscv_run(st,1,NULL);
+    return (r == RVEXIT_HALT || r == RVEXIT_WRONGOPCODE)? r : RVEXIT_SUCCESS;
+}
+
+riscv_exit riscv_exec_block(riscv_state* st)
+{
+    if (!st->bcache || st->trace) return riscv_exec(st);
+
+    assert((st->ip & 1) == 0); // sanity check
+    if (!dec_ready) riscv_init();
+
+#ifdef RV_USE_JIT
+    riscv_exit r = st->profile? exec_profiled(st) : exec_block(st,RV_JIT_SLICE);
+#else
+    riscv_exit r = st->profile? exec_profiled(st) : exec_block(st,0);
+#endif
+    return (r == RVEXIT_HALT || r == RVEXIT_WRONGOPCODE)? r : RVEXIT_SUCCESS;
+}
+
+riscv_op riscv_decode(uint32_t inst, uint32_t* imm)
+{
+    if (!dec_ready) riscv_init();
+    return decode(riscv_expand(inst),imm);
+}
+
+uint32_t riscv_expand(uint32_t inst)
+{
+    return (RV_INST_LEN(inst) == 2)? expand(inst & 0xFFFF) : inst;
+}
+
+const riscv_decoded* riscv_fetch(riscv_state* st, uint32_t ip, riscv_decoded* tmp)
+{
+    if (!dec_ready) riscv_init();
+
+    uint32_t old = st->ip;
+    st->ip = ip;
+    const riscv_decoded* d = fetch(st,tmp);
+    st->ip = old;
+    return d;
 }
 
 #ifdef RV_USE_DISASM
@@ -234,15 +1576,20 @@ riscv_exit riscv_disasm(uint32_t inst, char* str, int len)
 {
     if (!str || !len) return RVEXIT_ERROR;
 
+    // compressed instruction is shown as the one it stands for
+    const char* prefix = (RV_INST_LEN(inst) == 2)? "c." : "";
+    inst = riscv_expand(inst);
+
     uint32_t imm = 0;
     uint32_t rds[3];
     rds[0] = (inst >> 7) & 0x1F;
     rds[1] = (inst >> 15) & 0x1F;
     rds[2] = (inst >> 20) & 0x1F;
+    if (!dec_ready) riscv_init();
     riscv_op op = decode(inst,&imm);
-    if (op > RV_EBREAK) return RVEXIT_WRONGOPCODE;
+    if (op >= RV_NUMOPS) return RVEXIT_WRONGOPCODE;
 
-    int r = snprintf(str,len,"%s ",riscv_names[op]);
+    int r = snprintf(str,len,"%s%s ",prefix,riscv_names[op]);
     if (r < 0 || r >= len) return RVEXIT_ERROR;
     str += r;
     len -= r;
@@ -19,6 +19,14 @@
 
 #define RV_USE_DISASM
 
+// Native code translator is only available on x86-64 Linux hosts (define RV_NO_JIT to remove it completely)
+#if !defined(RV_NO_JIT) && defined(__x86_64__) && defined(__linux__)
+#define RV_USE_JIT
+#endif
+
+// Length of an instruction (in bytes) by its first 16-bit parcel: compressed ones (RV32C) are 2 bytes long
+#define RV_INST_LEN(I) ((((I) & 3) == 3)? 4 : 2)
+
 // I made this to make sign extend easily optimizable by a compiler - should be converted into 3 or 4 instructions
 #define RV_EXTEND(X,B) ((int32_t)( ((X) & (1U << (B))) ? ((X) | (((1U << (32 - ((B)+1))) - 1) << ((B)+1))) : (X) ))
 
@@ -62,9 +70,116 @@ typedef enum {
     RV_AND,
     RV_FENCE,
     RV_ECALL,
-    RV_EBREAK
+    RV_EBREAK,
+    RV_CSRRW,
+    RV_CSRRS,
+    RV_CSRRC,
+    RV_CSRRWI,
+    RV_CSRRSI,
+    RV_CSRRCI,
+    RV_MUL,
+    RV_MULH,
+    RV_MULHSU,
+    RV_MULHU,
+    RV_DIV,
+    RV_DIVU,
+    RV_REM,
+    RV_REMU,
+    RV_SH1ADD,
+    RV_SH2ADD,
+    RV_SH3ADD,
+    RV_ANDN,
+    RV_ORN,
+    RV_XNOR,
+    RV_CLZ,
+    RV_CTZ,
+    RV_CPOP,
+    RV_MAX,
+    RV_MAXU,
+    RV_MIN,
+    RV_MINU,
+    RV_SEXT_B,
+    RV_SEXT_H,
+    RV_ZEXT_H,
+    RV_ROL,
+    RV_ROR,
+    RV_RORI,
+    RV_ORC_B,
+    RV_REV8,
+    RV_NUMOPS /* not an opcode, just the number of known opcodes */
 } riscv_op;
 
+#define RV_CSR_OP(OP) ((OP) >= RV_CSRRW && (OP) <= RV_CSRRCI)
+#define RV_MULDIV_OP(OP) ((OP) >= RV_MUL && (OP) <= RV_REMU)
+#define RV_BITMANIP_OP(OP) ((OP) >= RV_SH1ADD && (OP) <= RV_REV8)
+
+// RV32M operations. Division never traps: division by zero gives all ones (quotient) or the dividend (remainder),
+// signed overflow (-2^31 / -1) gives the dividend (quotient) or zero (remainder)
+static inline uint32_t riscv_muldiv(uint32_t op, uint32_t a, uint32_t b)
+{
+    switch (op) {
+    case RV_MUL: return a * b;
+    case RV_MULH: return (uint32_t)(((int64_t)(int32_t)a * (int32_t)b) >> 32);
+    case RV_MULHSU: return (uint32_t)(((int64_t)(int32_t)a * (uint64_t)b) >> 32);
+    case RV_MULHU: return (uint32_t)(((uint64_t)a * b) >> 32);
+    case RV_DIV:
+        if (!b) return 0xFFFFFFFF;
+        if (a == 0x80000000 && b == 0xFFFFFFFF) return a;
+        return (uint32_t)((int32_t)a / (int32_t)b);
+    case RV_DIVU: return b? a / b : 0xFFFFFFFF;
+    case RV_REM:
+        if (!b) return a;
+        if (a == 0x80000000 && b == 0xFFFFFFFF) return 0;
+        return (uint32_t)((int32_t)a % (int32_t)b);
+    case RV_REMU: return b? a % b : a;
+    default: return 0;
+    }
+}
+
+// Zba and Zbb operations ('b' is the shift amount for RORI, unary ones ignore it).
+// Bit counts, byte swap and rotations compile into single host instructions.
+static inline uint32_t riscv_bitmanip(uint32_t op, uint32_t a, uint32_t b)
+{
+    switch (op) {
+    case RV_SH1ADD: return (a << 1) + b;
+    case RV_SH2ADD: return (a << 2) + b;
+    case RV_SH3ADD: return (a << 3) + b;
+    case RV_ANDN: return a & ~b;
+    case RV_ORN: return a | ~b;
+    case RV_XNOR: return ~(a ^ b);
+    case RV_CLZ: return a? (uint32_t)__builtin_clz(a) : 32;
+    case RV_CTZ: return a? (uint32_t)__builtin_ctz(a) : 32;
+    case RV_CPOP: return (uint32_t)__builtin_popcount(a);
+    case RV_MAX: return ((int32_t)a > (int32_t)b)? a : b;
+    case RV_MAXU: return (a > b)? a : b;
+    case RV_MIN: return ((int32_t)a < (int32_t)b)? a : b;
+    case RV_MINU: return (a < b)? a : b;
+    case RV_SEXT_B: return (uint32_t)(int32_t)(int8_t)a;
+    case RV_SEXT_H: return (uint32_t)(int32_t)(int16_t)a;
+    case RV_ZEXT_H: return a & 0xFFFF;
+    case RV_ROL: return (a << (b & 31)) | (a >> (-b & 31));
+    case RV_ROR:
+    case RV_RORI: return (a >> (b & 31)) | (a << (-b & 31));
+    case RV_ORC_B: // top bit of each byte is set if the byte isn't zero, then spread it over the byte
+        return (((((a & 0x7F7F7F7F) + 0x7F7F7F7F) | a) & 0x80808080) >> 7) * 0xFF;
+    case RV_REV8: return __builtin_bswap32(a);
+    default: return 0;
+    }
+}
+
+// Control and status registers (Zicsr): only the user-level counters, which are read-only.
+// There's no timing model, so 'cycle' is the same as 'instret'; 'time' is host monotonic clock.
+typedef enum {
+    RV_CSR_CYCLE = 0xC00,
+    RV_CSR_TIME = 0xC01,
+    RV_CSR_INSTRET = 0xC02,
+    RV_CSR_CYCLEH = 0xC80,
+    RV_CSR_TIMEH = 0xC81,
+    RV_CSR_INSTRETH = 0xC82,
+} riscv_csr;
+
+#define RV_TIME_FREQ 1000000 /* 'time' CSR ticks per second */
+
 typedef enum {
     RVR_ZERO,
     RVR_RA,
@@ -106,6 +221,9 @@ typedef enum {
     RVEXIT_HALT,
     RVEXIT_ERROR,
     RVEXIT_WRONGOPCODE,
+    RVEXIT_BUDGET,          /* riscv_run() only: the instruction budget is exhausted */
+    RVEXIT_BREAKPOINT,      /* riscv_run() only: EBREAK was executed */
+    RVEXIT_FAULT,           /* riscv_run() only: memory callback has set the 'fault' field */
 } riscv_exit;
 
 // Callbacks, conveniently brought together
@@ -123,19 +241,171 @@ typedef struct {
     void (*ebreak)(riscv_state* state);
 } riscv_callbacks;
 
+// Pre-decoded instruction
+typedef struct {
+    uint32_t ip;    /* Address of the instruction (also serves as cache tag) */
+    uint8_t op;     /* Opcode (riscv_op) */
+    uint8_t rd;     /* Register fields */
+    uint8_t rs1;
+    uint8_t rs2;
+    uint32_t imm;   /* Immediate argument, already sign-extended */
+    uint32_t inst;  /* Instruction as it is in memory (compressed ones in the lower half) */
+    uint8_t len;    /* Instruction length in bytes (2 for compressed ones) */
+} riscv_decoded;
+
+// Pre-decoded instructions cache (direct-mapped, indexed by instruction address)
+// Entries are invalidated with page granularity on every store into a page containing cached code
+#define RV_ICACHE_BITS 14
+#define RV_ICACHE_SIZE (1U << RV_ICACHE_BITS)
+#define RV_ICACHE_PAGE_BITS 12
+#define RV_ICACHE_FILTER_BITS 16
+#define RV_ICACHE_INVALID 0xFFFFFFFF
+
+typedef struct {
+    riscv_decoded lines[RV_ICACHE_SIZE];                    /* Cached instructions */
+    uint8_t code_pages[(1U << RV_ICACHE_FILTER_BITS) / 8];  /* Hashed bitmap of pages with cached code */
+    uint64_t hits;                                          /* Statistics counters */
+    uint64_t misses;
+    uint64_t invalidations;                                 /* Number of page invalidations */
+    uint64_t dropped;                                       /* Number of lines invalidated */
+} riscv_icache;
+
+// Translated basic blocks of direct-threaded code
+// Blocks never cross page boundaries, so they're invalidated the same way as pre-decoded instructions
+#define RV_BLOCK_MAX_LEN 32
+#define RV_BCACHE_BITS 10
+#define RV_BCACHE_SIZE (1U << RV_BCACHE_BITS)
+
+// Threaded code pseudo-opcodes (in addition to riscv_op)
+enum {
+    RVT_EXIT = RV_NUMOPS,   /* leave the block and continue at 'imm' */
+    RVT_LUI_ADDI,           /* fused pairs (macro-ops) - see riscv_fusion below */
+    RVT_AUIPC_JALR,
+    RVT_AUIPC_LW,
+    RVT_SLT_BR,
+    RVT_SLTU_BR,
+    RVT_ADDI_BNE,
+    RVT_NUMOPS
+};
+
+#define RVT_FUSED(OP) ((OP) > RVT_EXIT) /* fused ops stand for two guest instructions */
+
+// Fused instruction pairs
+typedef enum {
+    RVF_LUI_ADDI,       /* lui rd,hi; addi rd,rd,lo - load a 32-bit constant */
+    RVF_AUIPC_JALR,     /* auipc rd,hi; jalr rd2,lo(rd) - far call or jump */
+    RVF_AUIPC_LW,       /* auipc rd,hi; lw rd2,lo(rd) - load a global variable */
+    RVF_SLT_BRANCH,     /* slt(u) rd,a,b; beq/bne rd,x0,target - compare and branch */
+    RVF_ADDI_BNE,       /* addi rd,rs,k; bne rd,x,target - loop counter */
+    RVF_NUMIDIOMS
+} riscv_fusion;
+
+typedef struct {
+    const void* handler;    /* Address of the handler (used only with computed goto dispatch) */
+    uint8_t op;             /* Opcode (riscv_op or one of internal pseudo-ops) */
+    uint8_t rd;             /* Register fields (writes to x0 are redirected into a scratch register) */
+    uint8_t rs1;
+    uint8_t rs2;
+    uint32_t imm;           /* Immediate argument (absolute target address for jumps and branches) */
+    uint32_t ip;            /* Address of the instruction */
+    uint32_t imm2;          /* Second immediate argument (fused ops only) */
+    uint8_t len;            /* Length of guest code in bytes (both instructions for fused ops) */
+    uint8_t count;          /* Number of guest instructions in the block up to (and including) this one */
+} riscv_tinst;
+
+typedef struct {
+    uint32_t ip;                            /* Start address */
+    uint32_t len;                           /* Number of instructions (0 means the slot is empty) */
+    uint32_t count;                         /* Number of executions (used to find hot blocks) */
+    const void* native;                     /* Native code of this block, if it's compiled */
+    riscv_tinst code[RV_BLOCK_MAX_LEN+1];   /* Threaded code, always terminated by an exit */
+} riscv_block;
+
+typedef struct {
+    riscv_block blocks[RV_BCACHE_SIZE];                     /* Translated blocks */
+    uint8_t code_pages[(1U << RV_ICACHE_FILTER_BITS) / 8];  /* Hashed bitmap of pages with translated code */
+    uint8_t native_pages[(1U << RV_ICACHE_FILTER_BITS) / 8];/* Same for native code (since the last flush) */
+    uint8_t flush_native;                                   /* Native code must be flushed before next use */
+    uint64_t hits;                                          /* Statistics counters */
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t dropped;
+    uint64_t fused[RVF_NUMIDIOMS];                          /* Number of fused pairs executed */
+} riscv_bcache;
+
+typedef struct riscv_jit_s riscv_jit; // native code translator state (see riscv_jit.h)
+typedef struct riscv_trace_s riscv_trace; // binary execution trace (see riscv_trace.h)
+typedef struct riscv_profile_s riscv_profile; // hot-spot profiler (see riscv_profile.h)
+
 // Virtual machine state main structure
 typedef struct riscv_state_s {
     uint32_t ip;                /* The Instruction Pointer */
     uint32_t regs[RV_NUMREGS];  /* CPU Registers */
+    uint32_t fault;             /* Set to non-zero by callbacks to stop execution (e.g., on memory access fault) */
+    uint64_t instret;           /* Number of instructions retired */
     riscv_callbacks funcs;      /* Interface callback functions */
+    uint8_t* ram;               /* Flat RAM window (optional): guest memory at [ram_base; ram_base + ram_size) */
+    uint32_t ram_base;          /* is accessed directly, callbacks are only called for addresses outside of it */
+    uint32_t ram_size;
+    riscv_icache* icache;       /* Pre-decoded instructions cache (optional, may be NULL) */
+    riscv_bcache* bcache;       /* Translated blocks cache (optional, may be NULL) */
+    riscv_jit* jit;             /* Native code translator (optional, requires blocks cache) */
+    riscv_trace* trace;         /* Binary execution trace (optional; instructions are executed one by one then) */
+    riscv_profile* profile;     /* Block execution counters (optional, requires blocks cache; native code isn't used then) */
     void* user;                 /* User-defined data */
 } riscv_state;
 
-// Main function
+// Build decoder tables (called automatically on first use, but it's better to call it
+// once yourself before running VMs in multiple threads)
+void riscv_init(void);
+
+// Main function: run until 'max_instructions' are retired, or until the program halts, hits a breakpoint,
+// or a memory fault occurs (the latter stops execution right after faulty instruction; clear 'fault' field
+// to continue). The number of instructions retired by this call is stored into 'retired' (if it's not NULL).
+// The fastest available engine is used: blocks cache and native code translator are used if attached.
+riscv_exit riscv_run(riscv_state* st, uint64_t max_instructions, uint64_t* retired);
+
+// Execute single instruction (returns only SUCCESS, HALT or WRONGOPCODE)
 riscv_exit riscv_exec(riscv_state* st);
 
+// Alternative execution engine: direct-threaded interpreter, executes whole basic block at once
+// (falls back to riscv_exec() if there's no blocks cache). If native code translator is attached,
+// hot blocks are compiled and executed natively (possibly many chained blocks in one call).
+riscv_exit riscv_exec_block(riscv_state* st);
+
+// Fetch and decode instruction at the given address (through the pre-decoded instructions cache, if it's attached)
+// Returns NULL if that's not a valid instruction; 'tmp' is used as storage when there's no cache.
+const riscv_decoded* riscv_fetch(riscv_state* st, uint32_t ip, riscv_decoded* tmp);
+
+// Decode single instruction word (returns RV_NUMOPS if it's not a valid instruction)
+// If the lower half of the word is a compressed instruction, the upper half is ignored.
+riscv_op riscv_decode(uint32_t inst, uint32_t* imm);
+
+// Expand compressed instruction (the lower half of 'inst') into its 32-bit equivalent.
+// 32-bit instructions are returned as they are; zero means it's not a valid instruction.
+uint32_t riscv_expand(uint32_t inst);
+
+// Execute Zicsr instruction 'op' (register fields and CSR number as they're encoded) without moving IP,
+// 'instret' must count all the instructions before this one. Returns 0 (and does nothing) if the CSR
+// doesn't exist or the instruction writes a read-only one.
+int riscv_csr_access(riscv_state* st, uint32_t op, uint32_t rd, uint32_t rs1, uint32_t csr);
+
+// Pre-decoded caches management
+void riscv_icache_reset(riscv_icache* ic);
+void riscv_bcache_reset(riscv_bcache* bc);
+
+// Invalidate all pre-decoded instructions and translated blocks in the memory range
+// Returns non-zero if there was (or might have been) some code
+int riscv_icache_invalidate(riscv_state* st, uint32_t addr, uint32_t len);
+
+#ifdef RV_DECODER_SELFCHECK
+// Compare table-driven decoder against the reference one for encodings [from; to]
+// Returns the number of mismatches found
+uint32_t riscv_decoder_selfcheck(uint32_t from, uint32_t to);
+#endif /* RV_DECODER_SELFCHECK */
+
 #ifdef RV_USE_DISASM
-// Helper function - disassemble single operation
+// Helper function - disassemble single operation (compressed ones are shown expanded, with 'c.' prefix)
 riscv_exit riscv_disasm(uint32_t inst, char* str, int len);
 #endif /* RV_USE_DISASM */
 
@@ -0,0 +1,551 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+#include "riscv_batch.h"
+
+// GCC vector extensions: with -mavx2 every operation on these is a single AVX2 instruction, otherwise it's a pair of SSE2 ones
+typedef uint32_t rv_lanes __attribute__((vector_size(RV_BATCH_WIDTH * 4)));
+typedef int32_t rv_slanes __attribute__((vector_size(RV_BATCH_WIDTH * 4)));
+
+#define RV_BATCH_VECTORS (RV_NUMREGS + 2) /* registers, mask and scratch */
+#define RV_BATCH_NONE 0xFFFFFFFF
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define RV_LE16(X) __builtin_bswap16(X)
+#define RV_LE32(X) __builtin_bswap32(X)
+#else
+#define RV_LE16(X) (X)
+#define RV_LE32(X) (X)
+#endif
+
+// Accesses which fall into hart's RAM window are done directly (pointer to the data is returned), the rest go through callbacks
+// (RAM, RB and RS are the arrays of window pointers, bases and sizes)
+#define RV_WINDOW(I,A,N) ((RS[I] >= (N) && (A) - RB[I] <= RS[I] - (N))? RAM[I] + ((A) - RB[I]) : NULL)
+
+static uint32_t load_slow(riscv_state* st, uint8_t op, uint32_t addr)
+{
+    switch (op) {
+    case RV_LB: return (uint32_t)RV_EXTEND(st->funcs.read8(st,addr) & 0xFF,7);
+    case RV_LH: return (uint32_t)RV_EXTEND(st->funcs.read16(st,addr) & 0xFFFF,15);
+    case RV_LBU: return st->funcs.read8(st,addr) & 0xFF;
+    case RV_LHU: return st->funcs.read16(st,addr) & 0xFFFF;
+    default: return st->funcs.read32(st,addr);
+    }
+}
+
+static void store_slow(riscv_state* st, uint8_t op, uint32_t addr, uint32_t val)
+{
+    uint32_t len = (op == RV_SB)? 1 : (op == RV_SH)? 2 : 4;
+    switch (op) {
+    case RV_SB: st->funcs.write8(st,addr,val); break;
+    case RV_SH: st->funcs.write16(st,addr,val); break;
+    default: st->funcs.write32(st,addr,val);
+    }
+    if (st->icache || st->bcache) riscv_icache_invalidate(st,addr,len);
+}
+
+riscv_batch* riscv_batch_create(riscv_state** harts, uint32_t n)
+{
+    if (!n) return NULL;
+    riscv_batch* b = (riscv_batch*)calloc(1,sizeof(riscv_batch));
+    if (!b) return NULL;
+
+    b->n = n;
+    b->nvec = (n + RV_BATCH_WIDTH - 1) / RV_BATCH_WIDTH;
+    b->harts = harts;
+
+    // all the vectors are allocated in one aligned chunk
+    size_t vsize = (size_t)b->nvec * sizeof(rv_lanes);
+    uint8_t* vecs = (uint8_t*)aligned_alloc(sizeof(rv_lanes),vsize * RV_BATCH_VECTORS);
+    b->vany = (uint8_t*)calloc(b->nvec,1);
+    b->ip = (uint32_t*)calloc(n,sizeof(uint32_t));
+    b->exits = (riscv_exit*)calloc(n,sizeof(riscv_exit));
+    b->retired = (uint64_t*)calloc(n,sizeof(uint64_t));
+    b->joined = (uint64_t*)calloc(n,sizeof(uint64_t));
+    b->group = (uint32_t*)calloc(n,sizeof(uint32_t));
+    b->ram = (uint8_t**)calloc(n,sizeof(uint8_t*));
+    b->ram_base = (uint32_t*)calloc(n,sizeof(uint32_t));
+    b->ram_size = (uint32_t*)calloc(n,sizeof(uint32_t));
+    b->watch = (uint8_t*)calloc(n,1);
+    if (!vecs || !b->vany || !b->ip || !b->exits || !b->retired || !b->joined || !b->group ||
+        !b->ram || !b->ram_base || !b->ram_size || !b->watch) {
+        if (vecs) free(vecs);
+        b->regs[0] = NULL;
+        riscv_batch_destroy(b);
+        return NULL;
+    }
+
+    memset(vecs,0,vsize * RV_BATCH_VECTORS);
+    for (int r = 0; r < RV_NUMREGS; r++) b->regs[r] = (uint32_t*)(vecs + vsize * r);
+    b->mask = (uint32_t*)(vecs + vsize * RV_NUMREGS);
+    b->tmp = (uint32_t*)(vecs + vsize * (RV_NUMREGS + 1));
+    return b;
+}
+
+void riscv_batch_destroy(riscv_batch* b)
+{
+    if (!b) return;
+    if (b->regs[0]) free(b->regs[0]);
+    if (b->vany) free(b->vany);
+    if (b->ip) free(b->ip);
+    if (b->exits) free(b->exits);
+    if (b->retired) free(b->retired);
+    if (b->joined) free(b->joined);
+    if (b->group) free(b->group);
+    if (b->ram) free(b->ram);
+    if (b->ram_base) free(b->ram_base);
+    if (b->ram_size) free(b->ram_size);
+    if (b->watch) free(b->watch);
+    free(b);
+}
+
+// Copy hart's registers from vectors into its own state and back
+static void unpack_hart(riscv_batch* b, uint32_t i)
+{
+    riscv_state* st = b->harts[i];
+    for (int r = 0; r < RV_NUMREGS; r++) st->regs[r] = b->regs[r][i];
+}
+
+static void pack_hart(riscv_batch* b, uint32_t i)
+{
+    riscv_state* st = b->harts[i];
+    b->regs[RVR_ZERO][i] = 0;
+    for (int r = 1; r < RV_NUMREGS; r++) b->regs[r][i] = st->regs[r];
+}
+
+// Vector flags: no lanes of current group, some of them, or all of them
+enum {
+    RV_VEC_NONE = 0,
+    RV_VEC_SOME,
+    RV_VEC_FULL
+};
+
+static void update_vany(riscv_batch* b, uint32_t k)
+{
+    const uint32_t* m = b->mask + k * RV_BATCH_WIDTH;
+    uint32_t all = RV_BATCH_NONE, any = 0;
+    for (int l = 0; l < RV_BATCH_WIDTH; l++) {
+        all &= m[l];
+        any |= m[l];
+    }
+    b->vany[k] = all? RV_VEC_FULL : (any? RV_VEC_SOME : RV_VEC_NONE);
+}
+
+// Hart leaves the batch: its final instruction pointer goes right into its state
+static void finish_hart(riscv_batch* b, uint32_t i, uint32_t ip)
+{
+    b->harts[i]->ip = ip;
+    b->ip[i] = RV_BATCH_NONE;
+}
+
+// Remove j-th hart from current group: it has stopped at current instruction ('retire' is the instruction length
+// if it's completed, zero otherwise)
+static void stop_hart(riscv_batch* b, uint32_t j, riscv_exit why, uint32_t retire)
+{
+    uint32_t i = b->group[j];
+    b->exits[i] = why;
+    b->retired[i] += b->clock - b->joined[i] + (retire? 1 : 0);
+    finish_hart(b,i,b->pc + retire);
+    b->mask[i] = 0;
+    update_vany(b,i / RV_BATCH_WIDTH);
+    b->group[j] = b->group[--b->gsize];
+}
+
+// Disband current group (every hart must have its 'ip' set already) and build the next one
+static void regroup(riscv_batch* b)
+{
+    for (uint32_t j = 0; j < b->gsize; j++) {
+        uint32_t i = b->group[j];
+        b->retired[i] += b->clock - b->joined[i];
+        b->mask[i] = 0;
+        if (b->ip[i] != RV_BATCH_NONE && b->retired[i] >= b->budget) finish_hart(b,i,b->ip[i]);
+    }
+    b->regroups++;
+
+    // the group with the lowest instruction pointer goes first, so the ones behind can catch up with others
+    // (harts which have left the batch are never chosen, as their 'ip' is RV_BATCH_NONE)
+    uint32_t pc = RV_BATCH_NONE, next = RV_BATCH_NONE;
+    for (uint32_t i = 0; i < b->n; i++) pc = (b->ip[i] < pc)? b->ip[i] : pc;
+    for (uint32_t i = 0; i < b->n; i++) next = (b->ip[i] > pc && b->ip[i] < next)? b->ip[i] : next;
+
+    b->gsize = 0;
+    b->pc = pc;
+    b->waitpc = next;
+    if (pc == RV_BATCH_NONE) return;
+
+    // groups are often split in halves, so this loop is branchless ('joined' is only used for the harts of the group)
+    uint32_t *ip = b->ip, *group = b->group, *mask = b->mask, gsize = 0;
+    uint64_t *retired = b->retired, *joined = b->joined, budget = b->budget, clock = b->clock, left = UINT64_MAX;
+    for (uint32_t i = 0; i < b->n; i++) {
+        uint32_t in = (ip[i] == pc);
+        uint64_t l = budget - retired[i];
+        group[gsize] = i;
+        gsize += in;
+        mask[i] = -in;
+        joined[i] = clock;
+        left = (in && l < left)? l : left;
+    }
+    b->gsize = gsize;
+    b->gend = (left > UINT64_MAX - b->clock)? UINT64_MAX : b->clock + left;
+    for (uint32_t k = 0; k < b->nvec; k++) update_vany(b,k);
+}
+
+static void set_group_ip(riscv_batch* b)
+{
+    for (uint32_t j = 0; j < b->gsize; j++) b->ip[b->group[j]] = b->pc;
+}
+
+// Run small group one hart at a time, until it reaches the next group
+static void run_scalar(riscv_batch* b)
+{
+    for (uint32_t j = 0; j < b->gsize; j++) {
+        uint32_t i = b->group[j];
+        riscv_state* st = b->harts[i];
+        unpack_hart(b,i);
+        st->ip = b->pc;
+
+        uint64_t left = b->budget - b->retired[i] - (b->clock - b->joined[i]);
+        uint64_t done = 0, n;
+        riscv_exit r = RVEXIT_BUDGET;
+        if (b->waitpc == RV_BATCH_NONE)
+            r = riscv_run(st,left,&done); // nobody to merge with, so don't look back
+        else {
+            while (done < left && st->ip < b->waitpc) {
+                r = riscv_run(st,1,&n);
+                done += n;
+                if (r != RVEXIT_BUDGET) break;
+            }
+        }
+
+        // the instructions are accounted in 'retired' (they're added back when the run ends)
+        st->instret -= done;
+        b->retired[i] += done;
+        b->scalar += done;
+        b->ip[i] = st->ip;
+        if (r != RVEXIT_BUDGET) {
+            b->exits[i] = r;
+            finish_hart(b,i,st->ip);
+        }
+        pack_hart(b,i);
+    }
+    regroup(b);
+}
+
+#define RV_REG(X) ((rv_lanes*)b->regs[X])
+#define RV_MASK ((rv_lanes*)b->mask)
+#define RV_TMP ((rv_lanes*)b->tmp)
+#define RV_FOR_VECTORS for (uint32_t k = 0; k < b->nvec; k++) if (b->vany[k])
+
+// Masked ALU operation: 'a' and 'c' are source registers, 'iv' is immediate
+// (vectors with every lane in the group don't need blending)
+#define RV_ALU(EXPR) if (rd) { \
+        rv_lanes *A = RV_REG(rs1), *C = RV_REG(rs2), *D = RV_REG(rd), *M = RV_MASK; \
+        for (uint32_t k = 0; k < b->nvec; k++) { \
+            if (!b->vany[k]) continue; \
+            rv_lanes a = A[k], c = C[k]; (void)a; (void)c; \
+            if (b->vany[k] == RV_VEC_FULL) D[k] = (rv_lanes)(EXPR); \
+            else D[k] = ((rv_lanes)(EXPR) & M[k]) | (D[k] & ~M[k]); \
+        } \
+    } break;
+
+// Lane by lane operation for the harts in the group (for the ones vector extensions can't do)
+#define RV_SCALAR(EXPR) if (rd) { \
+        uint32_t *A = b->regs[rs1], *C = b->regs[rs2], *D = b->regs[rd]; \
+        for (uint32_t j = 0; j < gsize; j++) { \
+            uint32_t i = b->group[j], a = A[i], c = C[i]; \
+            D[i] = (EXPR); \
+        } \
+    } break;
+
+// Conditional branch: 'taken' mask goes into scratch vector
+#define RV_BRANCH(COND) { \
+        rv_lanes *A = RV_REG(rs1), *C = RV_REG(rs2), *M = RV_MASK, *T = RV_TMP; \
+        for (uint32_t k = 0; k < b->nvec; k++) { \
+            if (!b->vany[k]) continue; \
+            rv_lanes a = A[k], c = C[k], m = M[k]; \
+            rv_lanes t = (rv_lanes)(COND) & m; \
+            T[k] = t; \
+            taken |= t; \
+            fall |= ~t & m; \
+        } \
+    } \
+    branch = 1; \
+    break;
+
+// Every hart has its own memory, so it's worth to prefetch the data for harts a few steps ahead
+#define RV_BATCH_PREFETCH 4
+#define RV_PREFETCH(J) if ((J) >= RV_BATCH_PREFETCH) { \
+        uint32_t pi = G[(J) - RV_BATCH_PREFETCH], pa = S1[pi] + imm; \
+        const uint8_t* pp = RV_WINDOW(pi,pa,1); \
+        if (pp) __builtin_prefetch(pp); \
+    }
+
+// Load or store for every hart of the group (in reverse order, so harts can leave the group on faults).
+// All the arrays are in local variables, as the compiler can't prove that byte stores don't overwrite them.
+#define RV_MEMORY_BEGIN uint32_t *G = b->group, *S1 = b->regs[rs1], *S2 = b->regs[rs2], *D = b->regs[rd]; \
+    uint8_t **RAM = b->ram; \
+    uint32_t *RB = b->ram_base, *RS = b->ram_size; \
+    for (uint32_t j = gsize; j--;) { \
+        RV_PREFETCH(j) \
+        uint32_t i = G[j], addr = S1[i] + imm;
+
+#define RV_LOAD(N,FAST) { RV_MEMORY_BEGIN \
+        uint32_t v; \
+        const uint8_t* p = RV_WINDOW(i,addr,N); \
+        if (p) { FAST; } \
+        else v = load_slow(b->harts[i],d->op,addr); \
+        if (rd) D[i] = v; \
+        if (!p && b->harts[i]->fault) stop_hart(b,j,RVEXIT_FAULT,d->len); \
+    } (void)S2; } break;
+
+#define RV_STORE(N,FAST) { const uint8_t* W = b->watch; RV_MEMORY_BEGIN \
+        uint32_t v = S2[i]; \
+        uint8_t* p = RV_WINDOW(i,addr,N); \
+        if (p) { \
+            FAST; \
+            if (W[i]) riscv_icache_invalidate(b->harts[i],addr,N); \
+        } else { \
+            store_slow(b->harts[i],d->op,addr,v); \
+            if (b->harts[i]->fault) stop_hart(b,j,RVEXIT_FAULT,d->len); \
+        } \
+    } (void)D; } break;
+
+#define RV_SIGNED(X) ((rv_slanes)(X))
+#define RV_SELECT(COND,X,Y) (((X) & (rv_lanes)(COND)) | ((Y) & ~(rv_lanes)(COND)))
+
+static int any_lane(const rv_lanes* v)
+{
+    uint32_t r = 0;
+    for (int l = 0; l < RV_BATCH_WIDTH; l++) r |= (*v)[l];
+    return r != 0;
+}
+
+// Execute one instruction for every hart of current group. Returns zero if the group is disbanded.
+static int step_group(riscv_batch* b)
+{
+    // code is fetched through the first hart (which might not be in the group, so its fault flag must stay intact)
+    riscv_decoded tmp;
+    riscv_state* first = b->harts[0];
+    uint32_t fault = first->fault;
+    const riscv_decoded* d = riscv_fetch(first,b->pc,&tmp);
+    first->fault = fault;
+    if (!d) {
+        // let every hart try it on its own, to find out whether it's an access fault
+        while (b->gsize) {
+            riscv_state* st = b->harts[b->group[b->gsize - 1]];
+            riscv_fetch(st,b->pc,&tmp);
+            stop_hart(b,b->gsize - 1,st->fault? RVEXIT_FAULT : RVEXIT_WRONGOPCODE,0);
+        }
+        regroup(b);
+        return 0;
+    }
+
+    uint32_t rd = d->rd, rs1 = d->rs1, rs2 = d->rs2, imm = d->imm;
+    uint32_t next = b->pc + d->len;
+    rv_lanes iv = (rv_lanes){0} + imm;
+    rv_lanes taken = {0}, fall = {0};
+    int branch = 0, diverged = 0;
+    uint32_t gsize = b->gsize;
+
+    switch (d->op) {
+    case RV_LUI: RV_ALU(iv)
+    case RV_AUIPC: RV_ALU(iv + b->pc)
+    case RV_ADDI: RV_ALU(a + iv)
+    case RV_SLTI: RV_ALU((RV_SIGNED(a) < RV_SIGNED(iv)) & 1)
+    case RV_SLTIU: RV_ALU((a < iv) & 1)
+    case RV_XORI: RV_ALU(a ^ iv)
+    case RV_ORI: RV_ALU(a | iv)
+    case RV_ANDI: RV_ALU(a & iv)
+    case RV_SLLI: RV_ALU(a << rs2)
+    case RV_SRLI: RV_ALU(a >> rs2)
+    case RV_SRAI: RV_ALU(RV_SIGNED(a) >> (int32_t)rs2)
+    case RV_ADD: RV_ALU(a + c)
+    case RV_SUB: RV_ALU(a - c)
+    case RV_SLL: RV_ALU(a << (c & 0x1F))
+    case RV_SLT: RV_ALU((RV_SIGNED(a) < RV_SIGNED(c)) & 1)
+    case RV_SLTU: RV_ALU((a < c) & 1)
+    case RV_XOR: RV_ALU(a ^ c)
+    case RV_SRL: RV_ALU(a >> (c & 0x1F))
+    case RV_SRA: RV_ALU(RV_SIGNED(a) >> RV_SIGNED(c & 0x1F))
+    case RV_OR: RV_ALU(a | c)
+    case RV_AND: RV_ALU(a & c)
+    case RV_MUL: RV_ALU(a * c)
+    case RV_MULH: RV_SCALAR(riscv_muldiv(RV_MULH,a,c))
+    case RV_MULHSU: RV_SCALAR(riscv_muldiv(RV_MULHSU,a,c))
+    case RV_MULHU: RV_SCALAR(riscv_muldiv(RV_MULHU,a,c))
+    case RV_DIV: RV_SCALAR(riscv_muldiv(RV_DIV,a,c))
+    case RV_DIVU: RV_SCALAR(riscv_muldiv(RV_DIVU,a,c))
+    case RV_REM: RV_SCALAR(riscv_muldiv(RV_REM,a,c))
+    case RV_REMU: RV_SCALAR(riscv_muldiv(RV_REMU,a,c))
+    case RV_SH1ADD: RV_ALU((a << 1) + c)
+    case RV_SH2ADD: RV_ALU((a << 2) + c)
+    case RV_SH3ADD: RV_ALU((a << 3) + c)
+    case RV_ANDN: RV_ALU(a & ~c)
+    case RV_ORN: RV_ALU(a | ~c)
+    case RV_XNOR: RV_ALU(~(a ^ c))
+    case RV_CLZ: RV_SCALAR(riscv_bitmanip(RV_CLZ,a,c))
+    case RV_CTZ: RV_SCALAR(riscv_bitmanip(RV_CTZ,a,c))
+    case RV_CPOP: RV_SCALAR(riscv_bitmanip(RV_CPOP,a,c))
+    case RV_MAX: RV_ALU(RV_SELECT(RV_SIGNED(a) > RV_SIGNED(c),a,c))
+    case RV_MAXU: RV_ALU(RV_SELECT(a > c,a,c))
+    case RV_MIN: RV_ALU(RV_SELECT(RV_SIGNED(a) < RV_SIGNED(c),a,c))
+    case RV_MINU: RV_ALU(RV_SELECT(a < c,a,c))
+    case RV_SEXT_B: RV_ALU(RV_SIGNED(a << 24) >> 24)
+    case RV_SEXT_H: RV_ALU(RV_SIGNED(a << 16) >> 16)
+    case RV_ZEXT_H: RV_ALU(a & 0xFFFF)
+    case RV_ROL: RV_ALU((a << (c & 0x1F)) | (a >> (-c & 0x1F)))
+    case RV_ROR: RV_ALU((a >> (c & 0x1F)) | (a << (-c & 0x1F)))
+    case RV_RORI: RV_ALU((a >> rs2) | (a << (-rs2 & 0x1F)))
+    case RV_ORC_B: RV_ALU((((((a & 0x7F7F7F7F) + 0x7F7F7F7F) | a) & 0x80808080) >> 7) * 0xFF)
+    case RV_REV8: RV_SCALAR(riscv_bitmanip(RV_REV8,a,c))
+
+    case RV_JAL:
+        next = b->pc + imm;
+        RV_ALU((rv_lanes){0} + (b->pc + d->len))
+    case RV_JALR:
+        RV_FOR_VECTORS RV_TMP[k] = (RV_REG(rs1)[k] + iv) & ~1U;
+        next = b->tmp[b->group[0]];
+        for (uint32_t j = 1; j < gsize && !diverged; j++) diverged = (b->tmp[b->group[j]] != next);
+        RV_ALU((rv_lanes){0} + (b->pc + d->len))
+
+    case RV_BEQ: RV_BRANCH(a == c)
+    case RV_BNE: RV_BRANCH(a != c)
+    case RV_BLT: RV_BRANCH(RV_SIGNED(a) < RV_SIGNED(c))
+    case RV_BGE: RV_BRANCH(RV_SIGNED(a) >= RV_SIGNED(c))
+    case RV_BLTU: RV_BRANCH(a < c)
+    case RV_BGEU: RV_BRANCH(a >= c)
+
+    // memory accesses and system calls are done hart by hart
+    case RV_LB: RV_LOAD(1,v = (uint32_t)RV_EXTEND(*p,7))
+    case RV_LBU: RV_LOAD(1,v = *p)
+    case RV_LH: RV_LOAD(2,uint16_t h; memcpy(&h,p,2); v = (uint32_t)RV_EXTEND(RV_LE16(h),15))
+    case RV_LHU: RV_LOAD(2,uint16_t h; memcpy(&h,p,2); v = RV_LE16(h))
+    case RV_LW: RV_LOAD(4,memcpy(&v,p,4); v = RV_LE32(v))
+    case RV_SB: RV_STORE(1,*p = v)
+    case RV_SH: RV_STORE(2,uint16_t h = RV_LE16((uint16_t)v); memcpy(p,&h,2))
+    case RV_SW: RV_STORE(4,uint32_t w = RV_LE32(v); memcpy(p,&w,4))
+    case RV_FENCE:
+        break;
+    case RV_ECALL:
+    case RV_EBREAK:
+        for (uint32_t j = gsize; j--;) {
+            uint32_t i = b->group[j];
+            riscv_state* st = b->harts[i];
+            unpack_hart(b,i);
+            st->ip = b->pc;
+            riscv_exit r = RVEXIT_SUCCESS;
+            if (d->op == RV_EBREAK) {
+                st->funcs.ebreak(st);
+                r = RVEXIT_BREAKPOINT;
+            } else if (st->funcs.ecall(st))
+                r = RVEXIT_HALT;
+            if (st->fault) r = RVEXIT_FAULT;
+            pack_hart(b,i);
+            if (r != RVEXIT_SUCCESS) stop_hart(b,j,r,d->len);
+        }
+        break;
+    case RV_CSRRW:
+    case RV_CSRRS:
+    case RV_CSRRC:
+    case RV_CSRRWI:
+    case RV_CSRRSI:
+    case RV_CSRRCI:
+        for (uint32_t j = gsize; j--;) {
+            // counters are only added to hart's state at the end of the run
+            uint32_t i = b->group[j];
+            riscv_state* st = b->harts[i];
+            uint64_t pending = b->retired[i] + b->clock - b->joined[i];
+            unpack_hart(b,i);
+            st->instret += pending;
+            int ok = riscv_csr_access(st,d->op,rd,rs1,imm);
+            st->instret -= pending;
+            pack_hart(b,i);
+            if (!ok) stop_hart(b,j,RVEXIT_WRONGOPCODE,0);
+        }
+        break;
+    }
+
+    b->lockstep += gsize;
+
+    // branch outcome might be different for different harts
+    if (branch) {
+        int t = any_lane(&taken), f = any_lane(&fall);
+        if (t && f) {
+            for (uint32_t j = 0; j < b->gsize; j++) {
+                uint32_t i = b->group[j];
+                b->ip[i] = b->tmp[i]? b->pc + imm : b->pc + d->len;
+            }
+            diverged = 1;
+        } else if (t)
+            next = b->pc + imm;
+    } else if (diverged) {
+        for (uint32_t j = 0; j < b->gsize; j++) b->ip[b->group[j]] = b->tmp[b->group[j]];
+    }
+
+    b->clock++;
+    if (diverged) {
+        b->divergences++;
+        regroup(b);
+        return 0;
+    }
+
+    b->pc = next;
+    if (!b->gsize || b->pc >= b->waitpc || b->clock >= b->gend) {
+        set_group_ip(b);
+        regroup(b);
+        return 0;
+    }
+    return 1;
+}
+
+uint64_t riscv_batch_run(riscv_batch* b, uint64_t max_instructions)
+{
+    for (uint32_t i = 0; i < b->n; i++) {
+        riscv_state* st = b->harts[i];
+        for (int r = 0; r < RV_NUMREGS; r++) b->regs[r][i] = r? st->regs[r] : 0;
+        b->ram[i] = st->ram;
+        b->ram_base[i] = st->ram_base;
+        b->ram_size[i] = st->ram_size;
+        b->watch[i] = (st->icache || st->bcache);
+        b->retired[i] = 0;
+
+        // harts which have stopped for good are skipped
+        switch (b->exits[i]) {
+        case RVEXIT_SUCCESS:
+        case RVEXIT_BUDGET:
+        case RVEXIT_BREAKPOINT:
+            b->ip[i] = max_instructions? st->ip : RV_BATCH_NONE;
+            b->exits[i] = RVEXIT_BUDGET;
+            break;
+        default:
+            b->ip[i] = RV_BATCH_NONE;
+        }
+    }
+
+    b->budget = max_instructions;
+    b->gsize = 0;
+    regroup(b);
+
+    while (b->gsize) {
+        if (b->gsize < RV_BATCH_MIN_LANES) run_scalar(b);
+        else while (step_group(b)) ;
+    }
+
+    // every hart has left the batch by now, so their instruction pointers are already in place
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < b->n; i++) {
+        riscv_state* st = b->harts[i];
+        unpack_hart(b,i);
+        st->instret += b->retired[i];
+        total += b->retired[i];
+    }
+    return total;
+}
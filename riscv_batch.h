@@ -0,0 +1,66 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef RISCV_BATCH_H_
+#define RISCV_BATCH_H_
+
+#include "riscv.h"
+
+#define RV_BATCH_WIDTH 8            /* lanes in one vector (8 x 32 bits is one AVX2 register or two SSE ones) */
+#ifndef RV_BATCH_MIN_LANES
+#define RV_BATCH_MIN_LANES 2        /* smaller groups of harts are executed one by one with riscv_run() */
+#endif
+
+// Lockstep executor: many harts running the same code, each with its own memory.
+// Harts sharing the same instruction pointer form a group, which executes every instruction at once,
+// with registers kept in structure-of-arrays form. If harts diverge on a branch, the group with the lowest
+// instruction pointer runs first, until it reaches the next group (where they merge back).
+// All harts must have the same code in memory, as it is only fetched (and decoded) through the first one.
+typedef struct {
+    uint32_t n;                     /* Number of harts */
+    uint32_t nvec;                  /* Number of vectors (n rounded up to RV_BATCH_WIDTH) */
+    riscv_state** harts;            /* Hart states (memory window, callbacks, 'fault' flag) */
+    uint32_t* regs[RV_NUMREGS];     /* Registers: regs[r][hart] */
+    uint32_t* mask;                 /* All ones for the harts of current group, zero for others */
+    uint32_t* tmp;                  /* Per-lane scratch values */
+    uint8_t* vany;                  /* Non-zero for vectors with some lanes of current group */
+    uint32_t* ip;                   /* Instruction pointers (stale for current group, all ones for stopped harts) */
+    riscv_exit* exits;              /* Why each hart has stopped (RVEXIT_BUDGET if it's still running) */
+    uint64_t* retired;              /* Instructions retired by each hart in current run */
+    uint64_t* joined;               /* Clock value when the hart has joined current group */
+    uint8_t** ram;                  /* RAM windows of harts (copied from their states when a run starts) */
+    uint32_t* ram_base;
+    uint32_t* ram_size;
+    uint8_t* watch;                 /* Non-zero for harts with caches (their stores must be checked for code modification) */
+    uint32_t* group;                /* Harts of current group */
+    uint32_t gsize;                 /* Their number */
+    uint32_t pc;                    /* Instruction pointer of current group */
+    uint32_t waitpc;                /* Lowest instruction pointer of other harts (group must stop there to merge) */
+    uint64_t clock;                 /* Number of group steps done */
+    uint64_t gend;                  /* Group must stop at this clock value to let its harts leave on budget */
+    uint64_t budget;                /* Max instructions per hart in current run */
+    uint64_t lockstep;              /* Statistics counters: instructions retired in lockstep (all harts) */
+    uint64_t scalar;                /* Instructions retired one hart at a time */
+    uint64_t divergences;           /* Number of groups split by branches */
+    uint64_t regroups;              /* Number of times groups were rebuilt */
+} riscv_batch;
+
+// Create and destroy lockstep executor for 'n' harts (the states must stay alive while it's used)
+riscv_batch* riscv_batch_create(riscv_state** harts, uint32_t n);
+void riscv_batch_destroy(riscv_batch* b);
+
+// Run every hart until it retires 'max_instructions', halts, hits a breakpoint or a memory fault occurs
+// (exits[] tell which of these has happened). Hart states are up to date when it returns.
+// Harts which have halted, faulted or stumbled upon unknown instruction are skipped by subsequent runs
+// (set their exits[] to RVEXIT_SUCCESS to resume them).
+// Hart states (including RAM windows) must not be changed by callbacks while it runs, except for the registers in ECALL.
+// Returns the total number of instructions retired by all harts.
+uint64_t riscv_batch_run(riscv_batch* b, uint64_t max_instructions);
+
+#endif /* RISCV_BATCH_H_ */
@@ -0,0 +1,838 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// A very simple x86-64 native code translator for hot translated blocks.
+// Guest registers stay in riscv_state (rbx points to it), riscv_jit context is in r12.
+// Flat RAM window is accessed directly, other memory accesses are done through the usual callbacks.
+// ECALL, EBREAK and CSR instructions are left for interpreter.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "riscv.h"
+#include "riscv_jit.h"
+
+#ifdef RV_USE_JIT
+
+#define RV_JIT_MAX_INSN 192         // worst case native code size per guest instruction (including its exit stub)
+#define RV_JIT_BLOCK_OVERHEAD 64    // block entry and final exit
+#define RV_JIT_MAX_STUBS (2 * RV_BLOCK_MAX_LEN + 2)
+
+#define OFF_IP ((uint32_t)offsetof(riscv_state,ip))
+#define OFF_REG(R) ((uint32_t)(offsetof(riscv_state,regs) + 4 * (R)))
+#define OFF_FAULT ((uint32_t)offsetof(riscv_state,fault))
+#define OFF_RAM ((uint32_t)offsetof(riscv_state,ram))
+#define OFF_RAM_BASE ((uint32_t)offsetof(riscv_state,ram_base))
+#define OFF_RAM_SIZE ((uint32_t)offsetof(riscv_state,ram_size))
+#define OFF_BUDGET ((uint8_t)offsetof(riscv_jit,budget))
+#define OFF_LAST_EXIT ((uint8_t)offsetof(riscv_jit,last_exit))
+
+// x86 registers numbers
+enum {
+    X_EAX = 0,
+    X_ECX = 1,
+    X_EDX = 2,
+    X_ESI = 6,
+};
+
+// x86 condition codes (for Jcc, SETcc and CMOVcc)
+enum {
+    X_CC_B = 0x2,
+    X_CC_AE = 0x3,
+    X_CC_E = 0x4,
+    X_CC_NE = 0x5,
+    X_CC_A = 0x7,
+    X_CC_L = 0xC,
+    X_CC_GE = 0xD,
+    X_CC_LE = 0xE,
+    X_CC_G = 0xF,
+};
+
+// Out-of-line exit stub, which is generated after the block body
+typedef struct {
+    uint8_t* site;      // rel32 field of the jump leading to this stub
+    uint32_t ip;        // guest IP to continue from
+    uint32_t refund;    // number of instructions charged but not executed
+    int patchable;      // can be chained to another block
+} jit_stub;
+
+typedef struct {
+    riscv_jit* jit;
+    uint8_t* p;
+    jit_stub stubs[RV_JIT_MAX_STUBS];
+    int nstubs;
+} jit_emitter;
+
+typedef void (*jit_enter_fn)(riscv_state* st, riscv_jit* jit, const void* code);
+
+// Trampolines live at the very beginning of the code buffer
+#define JIT_ENTER(J) ((jit_enter_fn)(void*)((J)->code))
+#define JIT_EPILOGUE(J) ((J)->code + 16)
+
+static inline void e8(jit_emitter* e, uint8_t b) { *(e->p++) = b; }
+static inline void e32(jit_emitter* e, uint32_t v) { memcpy(e->p,&v,4); e->p += 4; }
+static inline void e64(jit_emitter* e, uint64_t v) { memcpy(e->p,&v,8); e->p += 8; }
+
+static inline void rel32_at(uint8_t* site, const uint8_t* target)
+{
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site,&rel,4);
+}
+
+// mov r32, guest_reg (x0 is always zero, regardless of memory contents)
+static void ld_reg(jit_emitter* e, int x, uint8_t r)
+{
+    if (!r) {
+        e8(e,0x31); e8(e,0xC0 | (x << 3) | x);      // xor x, x
+    } else {
+        e8(e,0x8B); e8(e,0x83 | (x << 3)); e32(e,OFF_REG(r));
+    }
+}
+
+// mov guest_reg, eax (writes to x0 are simply dropped)
+static void st_reg(jit_emitter* e, uint8_t r)
+{
+    if (!r || r >= RV_NUMREGS) return;
+    e8(e,0x89); e8(e,0x83); e32(e,OFF_REG(r));
+}
+
+// mov dword guest_reg, imm32
+static void st_reg_imm(jit_emitter* e, uint8_t r, uint32_t v)
+{
+    if (!r || r >= RV_NUMREGS) return;
+    e8(e,0xC7); e8(e,0x83); e32(e,OFF_REG(r)); e32(e,v);
+}
+
+// setcc al; movzx eax, al
+static void setcc_eax(jit_emitter* e, uint8_t cc)
+{
+    e8(e,0x0F); e8(e,0x90 | cc); e8(e,0xC0);
+    e8(e,0x0F); e8(e,0xB6); e8(e,0xC0);
+}
+
+// Jcc/JMP to an out-of-line stub
+static void jump_stub(jit_emitter* e, int cc, uint32_t ip, uint32_t refund, int patchable)
+{
+    if (cc < 0) e8(e,0xE9);
+    else {
+        e8(e,0x0F); e8(e,0x80 | cc);
+    }
+    jit_stub* s = e->stubs + e->nstubs++;
+    s->site = e->p;
+    s->ip = ip;
+    s->refund = refund;
+    s->patchable = patchable;
+    e32(e,0);
+}
+
+// Emit an exit: refund unused budget, set IP, remember the exit point (if it can be chained later)
+static void emit_exit(jit_emitter* e, uint32_t ip, uint32_t refund, int patchable)
+{
+    uint8_t* start = e->p;
+
+    // mov dword [rbx+ip], imm32 - it's 10 bytes long, so there's enough space to patch in a 5-byte jump
+    e8(e,0xC7); e8(e,0x83); e32(e,OFF_IP); e32(e,ip);
+
+    if (refund) {
+        // add qword [r12+budget], imm32
+        e8(e,0x49); e8(e,0x81); e8(e,0x44); e8(e,0x24); e8(e,OFF_BUDGET); e32(e,refund);
+    }
+
+    if (patchable) {
+        // lea rax, [rip+start]; mov [r12+last_exit], rax
+        e8(e,0x48); e8(e,0x8D); e8(e,0x05); e32(e,(uint32_t)(start - (e->p + 4)));
+        e8(e,0x49); e8(e,0x89); e8(e,0x44); e8(e,0x24); e8(e,OFF_LAST_EXIT);
+    }
+
+    // jmp epilogue
+    e8(e,0xE9); e32(e,0);
+    rel32_at(e->p - 4,JIT_EPILOGUE(e->jit));
+}
+
+// Memory access helpers, called from native code
+static uint32_t jit_lb(riscv_state* st, uint32_t addr) { return (uint32_t)RV_EXTEND(st->funcs.read8(st,addr) & 0xFF,7); }
+static uint32_t jit_lh(riscv_state* st, uint32_t addr) { return (uint32_t)RV_EXTEND(st->funcs.read16(st,addr) & 0xFFFF,15); }
+static uint32_t jit_lw(riscv_state* st, uint32_t addr) { return st->funcs.read32(st,addr); }
+static uint32_t jit_lbu(riscv_state* st, uint32_t addr) { return st->funcs.read8(st,addr) & 0xFF; }
+static uint32_t jit_lhu(riscv_state* st, uint32_t addr) { return st->funcs.read16(st,addr) & 0xFFFF; }
+
+// Stores return non-zero if native code must stop right after them
+#define JIT_STORE_DONE(A,N) (st->fault || ((st->icache || st->bcache) && riscv_icache_invalidate(st,(A),(N))))
+
+static uint32_t jit_sb(riscv_state* st, uint32_t addr, uint32_t val)
+{
+    st->funcs.write8(st,addr,val);
+    return JIT_STORE_DONE(addr,1);
+}
+
+static uint32_t jit_sh(riscv_state* st, uint32_t addr, uint32_t val)
+{
+    st->funcs.write16(st,addr,val);
+    return JIT_STORE_DONE(addr,2);
+}
+
+static uint32_t jit_sw(riscv_state* st, uint32_t addr, uint32_t val)
+{
+    st->funcs.write32(st,addr,val);
+    return JIT_STORE_DONE(addr,4);
+}
+
+// Stores inside the flat RAM window only need to check for code modification
+static uint32_t jit_code_check(riscv_state* st, uint32_t addr, uint32_t len)
+{
+    return (st->icache || st->bcache) && riscv_icache_invalidate(st,addr,len);
+}
+
+// Short forward jumps
+static inline uint8_t* jmp8(jit_emitter* e, uint8_t opc)
+{
+    e8(e,opc); e8(e,0);
+    return e->p - 1;
+}
+
+static inline void land8(jit_emitter* e, uint8_t* site)
+{
+    if (site) *site = (uint8_t)(e->p - (site + 1));
+}
+
+// Guest address into eax: either register plus offset or an absolute address
+static void emit_addr(jit_emitter* e, const riscv_tinst* i, int absolute)
+{
+    if (absolute) {
+        e8(e,0xB8); e32(e,i->imm);
+    } else {
+        ld_reg(e,X_EAX,i->rs1);
+        if (i->imm) {
+            e8(e,0x05); e32(e,i->imm);
+        }
+    }
+}
+
+// Check if access of 'len' bytes at eax falls into the RAM window (goes to 'slow' sites if it doesn't)
+// On success, ecx contains offset into the window and rdx - its host base pointer
+static void emit_window_check(jit_emitter* e, uint32_t len, uint8_t** slow)
+{
+    // mov ecx, eax; sub ecx, [rbx+ram_base]; mov edx, [rbx+ram_size]
+    e8(e,0x89); e8(e,0xC1);
+    e8(e,0x2B); e8(e,0x8B); e32(e,OFF_RAM_BASE);
+    e8(e,0x8B); e8(e,0x93); e32(e,OFF_RAM_SIZE);
+    slow[0] = NULL;
+    if (len > 1) {
+        // sub edx, len-1; jbe slow
+        e8(e,0x83); e8(e,0xEA); e8(e,len - 1);
+        slow[0] = jmp8(e,0x76);
+    }
+    // cmp ecx, edx; jae slow; mov rdx, [rbx+ram]
+    e8(e,0x39); e8(e,0xD1);
+    slow[1] = jmp8(e,0x73);
+    e8(e,0x48); e8(e,0x8B); e8(e,0x93); e32(e,OFF_RAM);
+}
+
+// Load into guest register 'rd', directly from RAM window or through a helper
+static void emit_load(jit_emitter* e, const riscv_tinst* i, uint8_t rd, int absolute, uint32_t next, uint32_t refund)
+{
+    uint8_t* slow[2];
+    uint32_t len;
+    const void* helper;
+
+    emit_addr(e,i,absolute);
+    switch (i->op) {
+    case RV_LB: len = 1; helper = (void*)jit_lb; break;
+    case RV_LH: len = 2; helper = (void*)jit_lh; break;
+    case RV_LBU: len = 1; helper = (void*)jit_lbu; break;
+    case RV_LHU: len = 2; helper = (void*)jit_lhu; break;
+    default: len = 4; helper = (void*)jit_lw;
+    }
+    emit_window_check(e,len,slow);
+
+    // movsx/movzx/mov eax, [rdx+rcx]
+    switch (i->op) {
+    case RV_LB: e8(e,0x0F); e8(e,0xBE); break;
+    case RV_LH: e8(e,0x0F); e8(e,0xBF); break;
+    case RV_LBU: e8(e,0x0F); e8(e,0xB6); break;
+    case RV_LHU: e8(e,0x0F); e8(e,0xB7); break;
+    default: e8(e,0x8B);
+    }
+    e8(e,0x04); e8(e,0x0A);
+    st_reg(e,rd);
+    uint8_t* done = jmp8(e,0xEB);
+
+    // mov esi, eax; mov rdi, rbx; mov rax, helper; call rax
+    land8(e,slow[0]);
+    land8(e,slow[1]);
+    e8(e,0x89); e8(e,0xC6);
+    e8(e,0x48); e8(e,0x89); e8(e,0xDF);
+    e8(e,0x48); e8(e,0xB8); e64(e,(uint64_t)(uintptr_t)helper);
+    e8(e,0xFF); e8(e,0xD0);
+    st_reg(e,rd);
+    // cmp dword [rbx+fault], 0; jne out
+    e8(e,0x83); e8(e,0xBB); e32(e,OFF_FAULT); e8(e,0);
+    jump_stub(e,X_CC_NE,next,refund,0);
+    land8(e,done);
+}
+
+// Store guest register, directly into RAM window or through a helper
+static void emit_store(jit_emitter* e, const riscv_tinst* i, uint32_t refund)
+{
+    uint8_t* slow[2];
+    uint32_t len = (i->op == RV_SB)? 1 : (i->op == RV_SH)? 2 : 4;
+    const void* helper = (i->op == RV_SB)? (void*)jit_sb : (i->op == RV_SH)? (void*)jit_sh : (void*)jit_sw;
+
+    // mov esi, eax
+    emit_addr(e,i,0);
+    e8(e,0x89); e8(e,0xC6);
+    emit_window_check(e,len,slow);
+
+    // mov [rdx+rcx], al/ax/eax
+    ld_reg(e,X_EAX,i->rs2);
+    if (len == 1) e8(e,0x88);
+    else {
+        if (len == 2) e8(e,0x66);
+        e8(e,0x89);
+    }
+    e8(e,0x04); e8(e,0x0A);
+    // mov edx, len; mov rax, jit_code_check
+    e8(e,0xBA); e32(e,len);
+    e8(e,0x48); e8(e,0xB8); e64(e,(uint64_t)(uintptr_t)jit_code_check);
+    uint8_t* call = jmp8(e,0xEB);
+
+    // mov edx, [rs2]; mov rax, helper
+    land8(e,slow[0]);
+    land8(e,slow[1]);
+    ld_reg(e,X_EDX,i->rs2);
+    e8(e,0x48); e8(e,0xB8); e64(e,(uint64_t)(uintptr_t)helper);
+
+    // mov rdi, rbx; call rax; test eax, eax; jnz out
+    land8(e,call);
+    e8(e,0x48); e8(e,0x89); e8(e,0xDF);
+    e8(e,0xFF); e8(e,0xD0);
+    e8(e,0x85); e8(e,0xC0);
+    jump_stub(e,X_CC_NE,i->ip + i->len,refund,0);
+}
+
+// op eax, ecx (reg-reg form of ALU instructions)
+static void alu_rr(jit_emitter* e, const riscv_tinst* i, uint8_t opc)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    e8(e,opc); e8(e,0xC8);
+    st_reg(e,i->rd);
+}
+
+// op eax, imm32 (short forms for eax)
+static void alu_ri(jit_emitter* e, const riscv_tinst* i, uint8_t opc)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    e8(e,opc); e32(e,i->imm);
+    st_reg(e,i->rd);
+}
+
+// shift eax, imm8 (ext is the x86 opcode extension: 0 = ROL, 1 = ROR, 4 = SHL, 5 = SHR, 7 = SAR)
+static void shift_ri(jit_emitter* e, const riscv_tinst* i, uint8_t ext)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    e8(e,0xC1); e8(e,0xC0 | (ext << 3)); e8(e,i->rs2);
+    st_reg(e,i->rd);
+}
+
+// shift eax, cl (x86 masks the count to 5 bits, just like RISC-V does)
+static void shift_rr(jit_emitter* e, const riscv_tinst* i, uint8_t ext)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    e8(e,0xD3); e8(e,0xC0 | (ext << 3));
+    st_reg(e,i->rd);
+}
+
+// cmp eax, ecx; setcc
+static void set_rr(jit_emitter* e, const riscv_tinst* i, uint8_t cc)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    e8(e,0x39); e8(e,0xC8);
+    setcc_eax(e,cc);
+    st_reg(e,i->rd);
+}
+
+// cmp eax, imm32; setcc
+static void set_ri(jit_emitter* e, const riscv_tinst* i, uint8_t cc)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    e8(e,0x3D); e32(e,i->imm);
+    setcc_eax(e,cc);
+    st_reg(e,i->rd);
+}
+
+// High half of the product: imul/mul ecx leaves it in edx (MULHSU needs 64-bit product of sign- and zero-extended operands)
+static void mul_high(jit_emitter* e, const riscv_tinst* i)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    if (i->op == RV_MULHSU) {
+        // movsxd rax, eax; imul rax, rcx; shr rax, 32
+        e8(e,0x48); e8(e,0x63); e8(e,0xC0);
+        e8(e,0x48); e8(e,0x0F); e8(e,0xAF); e8(e,0xC1);
+        e8(e,0x48); e8(e,0xC1); e8(e,0xE8); e8(e,32);
+    } else {
+        // imul ecx / mul ecx; mov eax, edx
+        e8(e,0xF7); e8(e,(i->op == RV_MULH)? 0xE9 : 0xE1);
+        e8(e,0x89); e8(e,0xD0);
+    }
+    st_reg(e,i->rd);
+}
+
+// Division and remainder: x86 traps on division by zero and on signed overflow, RISC-V doesn't
+static void divide(jit_emitter* e, const riscv_tinst* i)
+{
+    int sign = (i->op == RV_DIV || i->op == RV_REM);
+    int rem = (i->op == RV_REM || i->op == RV_REMU);
+    uint8_t* ovf = NULL;
+
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    // test ecx, ecx; jz zero
+    e8(e,0x85); e8(e,0xC9);
+    uint8_t* zero = jmp8(e,0x74);
+    if (sign) {
+        // cmp ecx, -1; jne normal; cmp eax, 0x80000000; je overflow
+        e8(e,0x83); e8(e,0xF9); e8(e,0xFF);
+        uint8_t* normal = jmp8(e,0x75);
+        e8(e,0x3D); e32(e,0x80000000);
+        ovf = jmp8(e,0x74);
+        land8(e,normal);
+        // cdq; idiv ecx
+        e8(e,0x99);
+        e8(e,0xF7); e8(e,0xF9);
+    } else {
+        // xor edx, edx; div ecx
+        e8(e,0x31); e8(e,0xD2);
+        e8(e,0xF7); e8(e,0xF1);
+    }
+    // mov eax, edx
+    if (rem) {
+        e8(e,0x89); e8(e,0xD0);
+    }
+    uint8_t* done = jmp8(e,0xEB);
+
+    // division by zero: quotient is all ones, remainder is the dividend (already in eax)
+    land8(e,zero);
+    if (!rem) {
+        e8(e,0xB8); e32(e,0xFFFFFFFF);
+    }
+    // overflow: quotient is the dividend, remainder is zero
+    if (ovf && rem) {
+        uint8_t* skip = jmp8(e,0xEB);
+        land8(e,ovf);
+        e8(e,0x31); e8(e,0xC0);
+        land8(e,skip);
+        ovf = NULL;
+    }
+    land8(e,done);
+    land8(e,ovf);
+    st_reg(e,i->rd);
+}
+
+// sh1add/sh2add/sh3add: lea eax, [rcx + rax * scale]
+static void shift_add(jit_emitter* e, const riscv_tinst* i, uint8_t scale)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    e8(e,0x8D); e8(e,0x04); e8(e,(scale << 6) | 0x01);
+    st_reg(e,i->rd);
+}
+
+// andn/orn: not ecx; op eax, ecx (BMI's andn isn't everywhere)
+static void alu_not_rr(jit_emitter* e, const riscv_tinst* i, uint8_t opc)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    e8(e,0xF7); e8(e,0xD1);
+    e8(e,opc); e8(e,0xC8);
+    st_reg(e,i->rd);
+}
+
+// min/max: cmp eax, ecx; cmovcc eax, ecx
+static void min_max(jit_emitter* e, const riscv_tinst* i, uint8_t cc)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    e8(e,0x39); e8(e,0xC8);
+    e8(e,0x0F); e8(e,0x40 | cc); e8(e,0xC1);
+    st_reg(e,i->rd);
+}
+
+// clz/ctz: bsr/bsf leave ZF set (and the destination undefined) for zero, which must give 32.
+// CLZ is 31 - bsr, done as xor with 31, so zero input gets 63 first.
+static void count_zeros(jit_emitter* e, const riscv_tinst* i)
+{
+    int lead = (i->op == RV_CLZ);
+    ld_reg(e,X_EAX,i->rs1);
+    // mov ecx, 32/63; bsr/bsf eax, eax; cmovz eax, ecx
+    e8(e,0xB9); e32(e,lead? 63 : 32);
+    e8(e,0x0F); e8(e,lead? 0xBD : 0xBC); e8(e,0xC0);
+    e8(e,0x0F); e8(e,0x44); e8(e,0xC1);
+    // xor eax, 31
+    if (lead) {
+        e8(e,0x83); e8(e,0xF0); e8(e,31);
+    }
+    st_reg(e,i->rd);
+}
+
+// cpop: popcnt eax, eax if the host has it, bit twiddling otherwise
+static void count_bits(jit_emitter* e, const riscv_tinst* i)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    if (e->jit->popcnt) {
+        e8(e,0xF3); e8(e,0x0F); e8(e,0xB8); e8(e,0xC0);
+    } else {
+        // eax -= (eax >> 1) & 0x55555555
+        e8(e,0x89); e8(e,0xC1);
+        e8(e,0xD1); e8(e,0xE9);
+        e8(e,0x81); e8(e,0xE1); e32(e,0x55555555);
+        e8(e,0x29); e8(e,0xC8);
+        // eax = (eax & 0x33333333) + ((eax >> 2) & 0x33333333)
+        e8(e,0x89); e8(e,0xC1);
+        e8(e,0xC1); e8(e,0xE9); e8(e,2);
+        e8(e,0x81); e8(e,0xE1); e32(e,0x33333333);
+        e8(e,0x25); e32(e,0x33333333);
+        e8(e,0x01); e8(e,0xC8);
+        // eax = ((eax + (eax >> 4)) & 0x0F0F0F0F) * 0x01010101 >> 24
+        e8(e,0x89); e8(e,0xC1);
+        e8(e,0xC1); e8(e,0xE9); e8(e,4);
+        e8(e,0x01); e8(e,0xC8);
+        e8(e,0x25); e32(e,0x0F0F0F0F);
+        e8(e,0x69); e8(e,0xC0); e32(e,0x01010101);
+        e8(e,0xC1); e8(e,0xE8); e8(e,24);
+    }
+    st_reg(e,i->rd);
+}
+
+// Conditional branch: both targets are chainable exits
+static void branch(jit_emitter* e, const riscv_tinst* i, uint8_t cc)
+{
+    ld_reg(e,X_EAX,i->rs1);
+    ld_reg(e,X_ECX,i->rs2);
+    e8(e,0x39); e8(e,0xC8);
+    jump_stub(e,cc,i->imm,0,1);
+    emit_exit(e,i->ip + i->len,0,1);
+}
+
+// Build entry and exit trampolines
+static void emit_trampolines(riscv_jit* jit)
+{
+    jit_emitter em;
+    jit_emitter* e = &em;
+    e->jit = jit;
+    e->p = jit->code;
+
+    // enter: push rbx; push r12; sub rsp, 8; mov rbx, rdi; mov r12, rsi; jmp rdx
+    e8(e,0x53);
+    e8(e,0x41); e8(e,0x54);
+    e8(e,0x48); e8(e,0x83); e8(e,0xEC); e8(e,0x08);
+    e8(e,0x48); e8(e,0x89); e8(e,0xFB);
+    e8(e,0x49); e8(e,0x89); e8(e,0xF4);
+    e8(e,0xFF); e8(e,0xE2);
+
+    // epilogue: add rsp, 8; pop r12; pop rbx; ret
+    while (e->p < JIT_EPILOGUE(jit)) e8(e,0xCC);
+    e8(e,0x48); e8(e,0x83); e8(e,0xC4); e8(e,0x08);
+    e8(e,0x41); e8(e,0x5C);
+    e8(e,0x5B);
+    e8(e,0xC3);
+
+    jit->blocks_start = (uint32_t)(e->p - jit->code + 15) & ~15U;
+    jit->used = jit->blocks_start;
+}
+
+riscv_jit* riscv_jit_create(uint32_t size)
+{
+    if (!size) size = RV_JIT_DEFAULT_SIZE;
+
+    riscv_jit* jit = (riscv_jit*)calloc(1,sizeof(riscv_jit));
+    if (!jit) return NULL;
+
+    void* mem = mmap(NULL,size,PROT_READ|PROT_WRITE|PROT_EXEC,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (mem == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    jit->code = (uint8_t*)mem;
+    jit->size = size;
+    jit->popcnt = __builtin_cpu_supports("popcnt");
+    emit_trampolines(jit);
+    return jit;
+}
+
+void riscv_jit_destroy(riscv_jit* jit)
+{
+    if (!jit) return;
+    munmap(jit->code,jit->size);
+    free(jit);
+}
+
+void riscv_jit_flush(riscv_jit* jit)
+{
+    jit->used = jit->blocks_start;
+    jit->flushes++;
+}
+
+// Count fused pair execution: mov rax, counter; add qword [rax], 1
+static void count_fused(jit_emitter* e, uint64_t* counter)
+{
+    e8(e,0x48); e8(e,0xB8); e64(e,(uint64_t)(uintptr_t)counter);
+    e8(e,0x48); e8(e,0x83); e8(e,0x00); e8(e,0x01);
+}
+
+const void* riscv_jit_compile(riscv_state* st, const riscv_block* b, int* unsupported)
+{
+    riscv_jit* jit = st->jit;
+    uint64_t* fused = st->bcache->fused;
+
+    // native code doesn't do ECALL, EBREAK and CSR accesses, so we just stop before them
+    uint32_t n = b->len;
+    uint8_t last = b->code[n-1].op;
+    if (last == RV_ECALL || last == RV_EBREAK || RV_CSR_OP(last)) n--;
+
+    *unsupported = (n == 0);
+    if (!n) return NULL;
+
+    // the budget is in guest instructions, and fused ops stand for two of them
+    uint32_t cnt = b->code[n-1].count;
+
+    // check if we have enough space left
+    if (jit->used + (n + 1) * RV_JIT_MAX_INSN + RV_JIT_BLOCK_OVERHEAD > jit->size) return NULL;
+
+    jit_emitter em;
+    jit_emitter* e = &em;
+    e->jit = jit;
+    e->p = jit->code + jit->used;
+    e->nstubs = 0;
+    uint8_t* entry = e->p;
+
+    // check the budget first: cmp qword [r12+budget], 0; jle out; sub qword [r12+budget], n
+    // (so a block is always executed entirely once it's started, and the budget might be slightly overrun)
+    e8(e,0x49); e8(e,0x83); e8(e,0x7C); e8(e,0x24); e8(e,OFF_BUDGET); e8(e,0);
+    jump_stub(e,X_CC_LE,b->ip,0,0);
+    e8(e,0x49); e8(e,0x81); e8(e,0x6C); e8(e,0x24); e8(e,OFF_BUDGET); e32(e,cnt);
+
+    int end = 0;
+    for (uint32_t k = 0; k < n && !end; k++) {
+        const riscv_tinst* i = b->code + k;
+        uint32_t refund = cnt - i->count;
+
+        switch (i->op) {
+        case RV_LUI:
+        case RV_AUIPC: // already relative to IP
+            st_reg_imm(e,i->rd,i->imm);
+            break;
+        case RV_JAL:
+            st_reg_imm(e,i->rd,i->ip + i->len);
+            emit_exit(e,i->imm,0,1);
+            end = 1;
+            break;
+        case RV_JALR:
+            // mov eax, [rs1]; add eax, imm; and eax, -2; mov [rd], next ip; mov [ip], eax; jmp epilogue
+            ld_reg(e,X_EAX,i->rs1);
+            e8(e,0x05); e32(e,i->imm);
+            e8(e,0x83); e8(e,0xE0); e8(e,0xFE);
+            st_reg_imm(e,i->rd,i->ip + i->len);
+            e8(e,0x89); e8(e,0x83); e32(e,OFF_IP);
+            e8(e,0xE9); e32(e,0);
+            rel32_at(e->p - 4,JIT_EPILOGUE(jit));
+            end = 1;
+            break;
+        case RV_BEQ: branch(e,i,X_CC_E); end = 1; break;
+        case RV_BNE: branch(e,i,X_CC_NE); end = 1; break;
+        case RV_BLT: branch(e,i,X_CC_L); end = 1; break;
+        case RV_BGE: branch(e,i,X_CC_GE); end = 1; break;
+        case RV_BLTU: branch(e,i,X_CC_B); end = 1; break;
+        case RV_BGEU: branch(e,i,X_CC_AE); end = 1; break;
+        case RV_LB:
+        case RV_LH:
+        case RV_LW:
+        case RV_LBU:
+        case RV_LHU:
+            emit_load(e,i,i->rd,0,i->ip + i->len,refund);
+            break;
+        case RV_SB:
+        case RV_SH:
+        case RV_SW:
+            emit_store(e,i,refund);
+            break;
+        case RV_ADDI: alu_ri(e,i,0x05); break;
+        case RV_SLTI: set_ri(e,i,X_CC_L); break;
+        case RV_SLTIU: set_ri(e,i,X_CC_B); break;
+        case RV_XORI: alu_ri(e,i,0x35); break;
+        case RV_ORI: alu_ri(e,i,0x0D); break;
+        case RV_ANDI: alu_ri(e,i,0x25); break;
+        case RV_SLLI: shift_ri(e,i,4); break;
+        case RV_SRLI: shift_ri(e,i,5); break;
+        case RV_SRAI: shift_ri(e,i,7); break;
+        case RV_ADD: alu_rr(e,i,0x01); break;
+        case RV_SUB: alu_rr(e,i,0x29); break;
+        case RV_SLL: shift_rr(e,i,4); break;
+        case RV_SLT: set_rr(e,i,X_CC_L); break;
+        case RV_SLTU: set_rr(e,i,X_CC_B); break;
+        case RV_XOR: alu_rr(e,i,0x31); break;
+        case RV_SRL: shift_rr(e,i,5); break;
+        case RV_SRA: shift_rr(e,i,7); break;
+        case RV_OR: alu_rr(e,i,0x09); break;
+        case RV_AND: alu_rr(e,i,0x21); break;
+        case RV_MUL:
+            // imul eax, ecx
+            ld_reg(e,X_EAX,i->rs1);
+            ld_reg(e,X_ECX,i->rs2);
+            e8(e,0x0F); e8(e,0xAF); e8(e,0xC1);
+            st_reg(e,i->rd);
+            break;
+        case RV_MULH:
+        case RV_MULHSU:
+        case RV_MULHU:
+            mul_high(e,i);
+            break;
+        case RV_DIV:
+        case RV_DIVU:
+        case RV_REM:
+        case RV_REMU:
+            divide(e,i);
+            break;
+        case RV_SH1ADD: shift_add(e,i,1); break;
+        case RV_SH2ADD: shift_add(e,i,2); break;
+        case RV_SH3ADD: shift_add(e,i,3); break;
+        case RV_ANDN: alu_not_rr(e,i,0x21); break;
+        case RV_ORN: alu_not_rr(e,i,0x09); break;
+        case RV_XNOR:
+            // xor eax, ecx; not eax
+            ld_reg(e,X_EAX,i->rs1);
+            ld_reg(e,X_ECX,i->rs2);
+            e8(e,0x31); e8(e,0xC8);
+            e8(e,0xF7); e8(e,0xD0);
+            st_reg(e,i->rd);
+            break;
+        case RV_CLZ:
+        case RV_CTZ:
+            count_zeros(e,i);
+            break;
+        case RV_CPOP: count_bits(e,i); break;
+        case RV_MAX: min_max(e,i,X_CC_L); break;
+        case RV_MAXU: min_max(e,i,X_CC_B); break;
+        case RV_MIN: min_max(e,i,X_CC_G); break;
+        case RV_MINU: min_max(e,i,X_CC_A); break;
+        case RV_SEXT_B:
+        case RV_SEXT_H:
+        case RV_ZEXT_H:
+            // movsx eax, al / movsx eax, ax / movzx eax, ax
+            ld_reg(e,X_EAX,i->rs1);
+            e8(e,0x0F); e8(e,(i->op == RV_SEXT_B)? 0xBE : (i->op == RV_SEXT_H)? 0xBF : 0xB7); e8(e,0xC0);
+            st_reg(e,i->rd);
+            break;
+        case RV_ROL: shift_rr(e,i,0); break;
+        case RV_ROR: shift_rr(e,i,1); break;
+        case RV_RORI: shift_ri(e,i,1); break;
+        case RV_ORC_B:
+            // movd xmm0, eax; pxor xmm1, xmm1; pcmpeqb xmm0, xmm1; movd eax, xmm0; not eax
+            ld_reg(e,X_EAX,i->rs1);
+            e8(e,0x66); e8(e,0x0F); e8(e,0x6E); e8(e,0xC0);
+            e8(e,0x66); e8(e,0x0F); e8(e,0xEF); e8(e,0xC9);
+            e8(e,0x66); e8(e,0x0F); e8(e,0x74); e8(e,0xC1);
+            e8(e,0x66); e8(e,0x0F); e8(e,0x7E); e8(e,0xC0);
+            e8(e,0xF7); e8(e,0xD0);
+            st_reg(e,i->rd);
+            break;
+        case RV_REV8:
+            // bswap eax
+            ld_reg(e,X_EAX,i->rs1);
+            e8(e,0x0F); e8(e,0xC8);
+            st_reg(e,i->rd);
+            break;
+        case RV_FENCE:
+            break;
+        case RVT_LUI_ADDI:
+            count_fused(e,fused + RVF_LUI_ADDI);
+            st_reg_imm(e,i->rd,i->imm);
+            break;
+        case RVT_AUIPC_JALR:
+            count_fused(e,fused + RVF_AUIPC_JALR);
+            st_reg_imm(e,i->rd,i->imm2);
+            st_reg_imm(e,i->rs2,i->ip + i->len);
+            emit_exit(e,i->imm,0,1);
+            end = 1;
+            break;
+        case RVT_AUIPC_LW:
+            count_fused(e,fused + RVF_AUIPC_LW);
+            st_reg_imm(e,i->rd,i->imm2);
+            emit_load(e,i,i->rs2,1,i->ip + i->len,refund);
+            break;
+        case RVT_SLT_BR:
+        case RVT_SLTU_BR:
+            // compare, store result and branch on it: test eax, eax; jnz/jz taken
+            count_fused(e,fused + RVF_SLT_BRANCH);
+            set_rr(e,i,(i->op == RVT_SLT_BR)? X_CC_L : X_CC_B);
+            e8(e,0x85); e8(e,0xC0);
+            jump_stub(e,i->imm2? X_CC_NE : X_CC_E,i->imm,0,1);
+            emit_exit(e,i->ip + i->len,0,1);
+            end = 1;
+            break;
+        case RVT_ADDI_BNE:
+            count_fused(e,fused + RVF_ADDI_BNE);
+            alu_ri(e,i,0x05);
+            ld_reg(e,X_ECX,i->rs2);
+            e8(e,0x39); e8(e,0xC8);
+            jump_stub(e,X_CC_NE,i->imm2,0,1);
+            emit_exit(e,i->ip + i->len,0,1);
+            end = 1;
+            break;
+        default:
+            // shouldn't happen, but let's be on the safe side: let interpreter do it
+            emit_exit(e,i->ip,refund + (RVT_FUSED(i->op)? 2 : 1),0);
+            end = 1;
+        }
+    }
+
+    // fall through into the next block (or into ECALL, EBREAK or CSR instruction)
+    if (!end) emit_exit(e,(n < b->len)? b->code[n].ip : b->code[n].imm,0,(n == b->len));
+
+    // out-of-line exits
+    for (int k = 0; k < e->nstubs; k++) {
+        rel32_at(e->stubs[k].site,e->p);
+        emit_exit(e,e->stubs[k].ip,e->stubs[k].refund,e->stubs[k].patchable);
+    }
+
+    jit->used = (uint32_t)(e->p - jit->code + 15) & ~15U;
+    jit->compiled++;
+    return entry;
+}
+
+uint64_t riscv_jit_run(riscv_state* st, const void* native, int64_t budget)
+{
+    riscv_jit* jit = st->jit;
+    jit->budget = budget;
+    jit->last_exit = NULL;
+    jit->runs++;
+
+    JIT_ENTER(jit)(st,jit,native);
+
+    return budget - jit->budget;
+}
+
+void riscv_jit_chain(riscv_jit* jit, const void* target)
+{
+    if (!jit->last_exit) return;
+
+    // replace the exit with a direct jump
+    jit->last_exit[0] = 0xE9;
+    rel32_at(jit->last_exit + 1,(const uint8_t*)target);
+    jit->last_exit = NULL;
+    jit->chained++;
+}
+
+#endif /* RV_USE_JIT */
@@ -0,0 +1,63 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef RISCV_JIT_H_
+#define RISCV_JIT_H_
+
+#include "riscv.h"
+
+#ifdef RV_USE_JIT
+
+#define RV_JIT_DEFAULT_SIZE (4U << 20) /* default size of native code buffer */
+#ifndef RV_JIT_HOT_THRESHOLD
+#define RV_JIT_HOT_THRESHOLD 32        /* block gets compiled after being executed this many times */
+#endif
+#ifndef RV_JIT_SLICE
+#define RV_JIT_SLICE 100000            /* max number of instructions executed natively in one go */
+#endif
+
+// Native code translator state
+struct riscv_jit_s {
+    // these two are accessed by the native code directly, so they must stay in front
+    int64_t budget;             /* Instructions left before returning to host */
+    uint8_t* last_exit;         /* Patchable exit taken by the native code (if any) */
+
+    uint8_t* code;              /* Native code buffer */
+    uint32_t size;              /* Its size */
+    uint32_t used;              /* Amount of it already used */
+    uint32_t blocks_start;      /* Compiled blocks start after the trampolines */
+
+    uint64_t compiled;          /* Statistics counters */
+    uint64_t flushes;
+    uint64_t chained;
+    uint64_t runs;
+    int popcnt;                 /* Host CPU has POPCNT instruction */
+};
+
+// Create and destroy translator (size is the size of native code buffer, 0 means default)
+riscv_jit* riscv_jit_create(uint32_t size);
+void riscv_jit_destroy(riscv_jit* jit);
+
+// Compile a block (using translator attached to the VM). Returns address of native code or NULL if there's no space left
+// (or if the block can't be compiled at all, which is indicated by setting 'unsupported' flag)
+const void* riscv_jit_compile(riscv_state* st, const riscv_block* b, int* unsupported);
+
+// Run native code, starting at the given block. Returns the number of instructions retired.
+// Blocks are never interrupted by the budget check, so the budget might be overrun by up to one block.
+uint64_t riscv_jit_run(riscv_state* st, const void* native, int64_t budget);
+
+// Patch the last exit taken to jump directly into the target block
+void riscv_jit_chain(riscv_jit* jit, const void* target);
+
+// Drop all compiled code
+void riscv_jit_flush(riscv_jit* jit);
+
+#endif /* RV_USE_JIT */
+
+#endif /* RISCV_JIT_H_ */
@@ -0,0 +1,109 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+#include "riscv.h"
+#include "riscv_profile.h"
+
+static riscv_prof_block* alloc_table(uint32_t size)
+{
+    riscv_prof_block* t = (riscv_prof_block*)calloc(size,sizeof(riscv_prof_block));
+    if (t)
+        for (uint32_t i = 0; i < size; i++) t[i].ip = RV_PROF_EMPTY;
+    return t;
+}
+
+riscv_profile* riscv_profile_create(void)
+{
+    riscv_profile* p = (riscv_profile*)calloc(1,sizeof(riscv_profile));
+    if (!p) return NULL;
+    p->blocks = alloc_table(RV_PROF_INIT_SIZE);
+    if (!p->blocks) {
+        free(p);
+        return NULL;
+    }
+    p->mask = RV_PROF_INIT_SIZE - 1;
+    p->last = RV_PROF_EMPTY;
+    return p;
+}
+
+void riscv_profile_destroy(riscv_profile* p)
+{
+    if (!p) return;
+    free(p->blocks);
+    free(p);
+}
+
+// Linear probing from the block's home slot
+static uint32_t probe(const riscv_prof_block* t, uint32_t mask, uint32_t ip)
+{
+    uint32_t s = (ip >> 2) & mask;
+    while (t[s].ip != ip && t[s].ip != RV_PROF_EMPTY) s = (s + 1) & mask;
+    return s;
+}
+
+// Double the table size (slots move, so the last block's slot is updated as well)
+static int grow(riscv_profile* p)
+{
+    uint32_t mask = p->mask * 2 + 1;
+    riscv_prof_block* t = alloc_table(mask + 1);
+    if (!t) return 0;
+
+    uint32_t last = RV_PROF_EMPTY;
+    for (uint32_t i = 0; i <= p->mask; i++) {
+        if (p->blocks[i].ip == RV_PROF_EMPTY) continue;
+        uint32_t s = probe(t,mask,p->blocks[i].ip);
+        t[s] = p->blocks[i];
+        if (i == p->last) last = s;
+    }
+
+    free(p->blocks);
+    p->blocks = t;
+    p->mask = mask;
+    p->last = last;
+    return 1;
+}
+
+uint32_t riscv_profile_slot(riscv_profile* p, uint32_t ip)
+{
+    uint32_t s = probe(p->blocks,p->mask,ip);
+    if (p->blocks[s].ip == ip) return s;
+
+    // new block
+    if (p->used * 2 >= p->mask) {
+        if (!grow(p)) return RV_PROF_EMPTY;
+        s = probe(p->blocks,p->mask,ip);
+    }
+    riscv_prof_block* b = p->blocks + s;
+    b->ip = ip;
+    for (int i = 0; i < RV_PROF_SUCC; i++) b->succ[i] = RV_PROF_EMPTY;
+    p->used++;
+    return s;
+}
+
+static int by_insts(const void* a, const void* b)
+{
+    const riscv_prof_block* x = *(const riscv_prof_block* const*)a;
+    const riscv_prof_block* y = *(const riscv_prof_block* const*)b;
+    if (x->insts != y->insts) return (x->insts < y->insts)? 1 : -1;
+    return (x->ip > y->ip) - (x->ip < y->ip);
+}
+
+uint32_t riscv_profile_sorted(riscv_profile* p, riscv_prof_block*** blocks)
+{
+    *blocks = (riscv_prof_block**)malloc((p->used + 1) * sizeof(riscv_prof_block*));
+    if (!*blocks) return 0;
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i <= p->mask; i++)
+        if (p->blocks[i].ip != RV_PROF_EMPTY) (*blocks)[n++] = p->blocks + i;
+    qsort(*blocks,n,sizeof(riscv_prof_block*),by_insts);
+    return n;
+}
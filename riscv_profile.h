@@ -0,0 +1,82 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef RISCV_PROFILE_H_
+#define RISCV_PROFILE_H_
+
+#include <inttypes.h>
+#include "riscv.h"
+
+// Hot-spot profiler: counts executions of translated blocks and transitions between them (edges).
+// It works with the blocks cache only (native code translator is bypassed while profiling).
+
+#define RV_PROF_INIT_SIZE 4096      /* initial number of slots in blocks table (it grows when it's half full) */
+#define RV_PROF_SUCC 2              /* number of successors counted separately for each block */
+#define RV_PROF_EMPTY 0xFFFFFFFF    /* empty slot (not a valid instruction address) */
+
+typedef struct {
+    uint32_t ip;                        /* Start address of the block */
+    uint32_t len;                       /* Number of instructions in it (the longest run of it) */
+    uint64_t count;                     /* Number of executions */
+    uint64_t insts;                     /* Number of instructions executed */
+    uint32_t succ[RV_PROF_SUCC];        /* Start addresses of the first successors seen */
+    uint64_t edges[RV_PROF_SUCC];       /* Number of transitions to each of them */
+    uint64_t other;                     /* Number of transitions to any other successor */
+} riscv_prof_block;
+
+struct riscv_profile_s {
+    riscv_prof_block* blocks;           /* Open-addressing hash table, indexed by start address */
+    uint32_t mask;                      /* Table size - 1 */
+    uint32_t used;
+    uint32_t last;                      /* Slot of the block executed last (RV_PROF_EMPTY at start) */
+    uint64_t lost;                      /* Executions not counted (no memory to grow the table) */
+};
+
+riscv_profile* riscv_profile_create(void);
+void riscv_profile_destroy(riscv_profile* p);
+
+// Find (or add) a block slot, returns RV_PROF_EMPTY if the table can't grow
+uint32_t riscv_profile_slot(riscv_profile* p, uint32_t ip);
+
+// Count one execution of the block (of 'len' instructions) starting at 'ip'
+static inline void riscv_profile_block(riscv_profile* p, uint32_t ip, uint32_t len)
+{
+    uint32_t s = (ip >> 2) & p->mask;
+    if (p->blocks[s].ip != ip) s = riscv_profile_slot(p,ip);
+    if (s == RV_PROF_EMPTY) {
+        p->lost++;
+        return;
+    }
+
+    riscv_prof_block* b = p->blocks + s;
+    if (len > b->len) b->len = len;
+    b->count++;
+    b->insts += len;
+
+    // edge from the previous block
+    if (p->last != RV_PROF_EMPTY) {
+        riscv_prof_block* l = p->blocks + p->last;
+        int i;
+        for (i = 0; i < RV_PROF_SUCC; i++) {
+            if (l->succ[i] == RV_PROF_EMPTY) l->succ[i] = ip;
+            if (l->succ[i] == ip) {
+                l->edges[i]++;
+                break;
+            }
+        }
+        if (i == RV_PROF_SUCC) l->other++;
+    }
+    p->last = s;
+}
+
+// Make an array of all blocks sorted by the number of instructions executed (the hottest first)
+// Returns the number of blocks, the array must be freed by the caller
+uint32_t riscv_profile_sorted(riscv_profile* p, riscv_prof_block*** blocks);
+
+#endif /* RISCV_PROFILE_H_ */
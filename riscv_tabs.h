@@ -53,7 +53,42 @@ static const char* riscv_encode[] = {
     "0000000          111     0110011",
     "                 000     0001111",
     "00000000000000000000000001110011",
-    "00000000000100000000000001110011"
+    "00000000000100000000000001110011",
+    "GFEDCBA@?>=<     001     1110011",
+    "GFEDCBA@?>=<     010     1110011",
+    "GFEDCBA@?>=<     011     1110011",
+    "GFEDCBA@?>=<     101     1110011",
+    "GFEDCBA@?>=<     110     1110011",
+    "GFEDCBA@?>=<     111     1110011",
+    "0000001          000     0110011",
+    "0000001          001     0110011",
+    "0000001          010     0110011",
+    "0000001          011     0110011",
+    "0000001          100     0110011",
+    "0000001          101     0110011",
+    "0000001          110     0110011",
+    "0000001          111     0110011",
+    "0010000          010     0110011",
+    "0010000          100     0110011",
+    "0010000          110     0110011",
+    "0100000          111     0110011",
+    "0100000          110     0110011",
+    "0100000          100     0110011",
+    "011000000000     001     0010011",
+    "011000000001     001     0010011",
+    "011000000010     001     0010011",
+    "0000101          110     0110011",
+    "0000101          111     0110011",
+    "0000101          100     0110011",
+    "0000101          101     0110011",
+    "011000000100     001     0010011",
+    "011000000101     001     0010011",
+    "000010000000     100     0110011",
+    "0110000          001     0110011",
+    "0110000          101     0110011",
+    "0110000          101     0010011",
+    "001010000111     101     0010011",
+    "011010011000     101     0010011"
 };
 
 // The reason why I made these tabs separate instead of combining them into one structure,
@@ -101,7 +136,42 @@ static const char* riscv_names[] = {
     "AND",
     "FENCE",
     "ECALL",
-    "EBREAK"
+    "EBREAK",
+    "CSRRW",
+    "CSRRS",
+    "CSRRC",
+    "CSRRWI",
+    "CSRRSI",
+    "CSRRCI",
+    "MUL",
+    "MULH",
+    "MULHSU",
+    "MULHU",
+    "DIV",
+    "DIVU",
+    "REM",
+    "REMU",
+    "SH1ADD",
+    "SH2ADD",
+    "SH3ADD",
+    "ANDN",
+    "ORN",
+    "XNOR",
+    "CLZ",
+    "CTZ",
+    "CPOP",
+    "MAX",
+    "MAXU",
+    "MIN",
+    "MINU",
+    "SEXT.B",
+    "SEXT.H",
+    "ZEXT.H",
+    "ROL",
+    "ROR",
+    "RORI",
+    "ORC.B",
+    "REV8"
 };
 
 static const char* riscv_useregs[] = {
@@ -144,7 +214,42 @@ static const char* riscv_useregs[] = {
     "111",
     "110",
     "000",
-    "000"
+    "000",
+    "110",
+    "110",
+    "110",
+    "100",
+    "100",
+    "100",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "111",
+    "110",
+    "110",
+    "110",
+    "111",
+    "111",
+    "111",
+    "111",
+    "110",
+    "110",
+    "110",
+    "111",
+    "111",
+    "110",
+    "110",
+    "110"
 };
 
 static const char* riscv_regname[32] = {
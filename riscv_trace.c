@@ -0,0 +1,201 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "riscv.h"
+#include "riscv_trace.h"
+
+#define RV_TRACE_IDLE_NS 1000000    // writer sleeps that long when there's nothing to write
+#define RV_TRACE_WAIT_NS 50000      // VM sleeps that long when the buffer is full
+
+static void nap(long ns)
+{
+    struct timespec ts = { 0, ns };
+    nanosleep(&ts,NULL);
+}
+
+static void put32(FILE* f, uint32_t val)
+{
+    for (int i = 0; i < 4; i++, val >>= 8) fputc(val & 0xFF,f);
+}
+
+// Writer thread: stream everything between tail and head into the file
+static void* writer(void* arg)
+{
+    riscv_trace* t = (riscv_trace*)arg;
+    uint32_t size = t->mask + 1;
+    for (;;) {
+        // (the stop flag must be checked before the head, to get the last records)
+        int stop = __atomic_load_n(&t->stop,__ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&t->head,__ATOMIC_ACQUIRE);
+        if (head == t->tail) {
+            if (stop) break;
+            nap(RV_TRACE_IDLE_NS);
+            continue;
+        }
+
+        // the data might wrap around the end of the buffer
+        uint32_t pos = t->tail & t->mask;
+        uint64_t len = head - t->tail;
+        uint32_t first = (len > size - pos)? size - pos : len;
+        if (fwrite(t->buf + pos,first,1,t->file) != 1 || (len > first && fwrite(t->buf,len - first,1,t->file) != 1))
+            t->failed = true;
+        t->bytes += len;
+        __atomic_store_n(&t->tail,head,__ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+riscv_trace* riscv_trace_create(const char* fn, uint32_t size, uint32_t options)
+{
+    if (!size) size = RV_TRACE_DEFAULT_SIZE;
+    if (size < 2 * RV_TRACE_MAX_REC) size = 2 * RV_TRACE_MAX_REC;
+    uint32_t sz = 1;
+    while (sz < size) sz <<= 1;
+
+    riscv_trace* t = (riscv_trace*)calloc(1,sizeof(riscv_trace));
+    if (!t) return NULL;
+    t->buf = (uint8_t*)malloc(sz);
+    t->mask = sz - 1;
+    t->limit = sz;
+    t->options = options;
+    memset(t->ctx.tab_ip,0xFF,sizeof(t->ctx.tab_ip)); // (not a valid instruction address)
+    t->file = t->buf? fopen(fn,"wb") : NULL;
+    if (!t->file) {
+        free(t->buf);
+        free(t);
+        return NULL;
+    }
+
+    put32(t->file,RV_TRACE_MAGIC);
+    put32(t->file,RV_TRACE_VERSION);
+    put32(t->file,options);
+
+    if (pthread_create(&t->writer,NULL,writer,t)) {
+        fclose(t->file);
+        free(t->buf);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+bool riscv_trace_destroy(riscv_trace* t)
+{
+    if (!t) return true;
+    __atomic_store_n(&t->stop,1,__ATOMIC_RELEASE);
+    pthread_join(t->writer,NULL);
+    bool ok = !fclose(t->file) && !t->failed;
+    free(t->buf);
+    free(t);
+    return ok;
+}
+
+void riscv_trace_wait(riscv_trace* t)
+{
+    for (;;) {
+        t->limit = __atomic_load_n(&t->tail,__ATOMIC_ACQUIRE) + t->mask + 1;
+        if (t->head + RV_TRACE_MAX_REC <= t->limit) return;
+        t->stalls++;
+        nap(RV_TRACE_WAIT_NS);
+    }
+}
+
+bool riscv_trace_open(riscv_trace_reader* r, const char* fn)
+{
+    memset(r,0,sizeof(riscv_trace_reader));
+    memset(r->ctx.tab_ip,0xFF,sizeof(r->ctx.tab_ip));
+    r->file = fopen(fn,"rb");
+    if (!r->file) return false;
+
+    uint8_t hdr[12];
+    uint32_t val[3];
+    if (fread(hdr,sizeof(hdr),1,r->file) == 1) {
+        for (int i = 0; i < 3; i++) val[i] = hdr[i*4] | (hdr[i*4+1] << 8) | (hdr[i*4+2] << 16) | ((uint32_t)hdr[i*4+3] << 24);
+        if (val[0] == RV_TRACE_MAGIC && val[1] == RV_TRACE_VERSION) {
+            r->options = val[2];
+            return true;
+        }
+    }
+    fclose(r->file);
+    r->file = NULL;
+    return false;
+}
+
+// Read zigzag-encoded varint, returns false if there's no complete one
+static bool get_delta(FILE* f, uint32_t* delta)
+{
+    uint32_t val = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = fgetc(f);
+        if (c == EOF) return false;
+        val |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *delta = (val >> 1) ^ -(val & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+int riscv_trace_read(riscv_trace_reader* r, riscv_trace_rec* rec)
+{
+    riscv_trace_ctx* c = &r->ctx;
+    int flags = fgetc(r->file);
+    if (flags == EOF) return 0;
+    if (flags & ~(RV_TRACE_JUMP | RV_TRACE_NEW)) return -1;
+
+    uint32_t delta = 0;
+    if ((flags & RV_TRACE_JUMP) && !get_delta(r->file,&delta)) return -1;
+    rec->ip = c->next + delta;
+
+    uint32_t slot = (rec->ip >> 1) & (RV_TRACE_TAB_SIZE - 1);
+    if (flags & RV_TRACE_NEW) {
+        // lower half tells if there's the upper one
+        uint8_t b[4] = { 0, 0, 0, 0 };
+        if (fread(b,2,1,r->file) != 1) return -1;
+        if (RV_INST_LEN(b[0]) == 4 && fread(b + 2,2,1,r->file) != 1) return -1;
+        c->tab_ip[slot] = rec->ip;
+        c->tab_inst[slot] = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+    } else if (c->tab_ip[slot] != rec->ip)
+        return -1;
+    rec->inst = c->tab_inst[slot];
+    c->next = rec->ip + RV_INST_LEN(rec->inst);
+
+    uint32_t imm;
+    rec->op = riscv_decode(rec->inst,&imm);
+    if (rec->op >= RV_NUMOPS) return -1;
+
+    // compressed instructions have their register fields elsewhere
+    rec->rd = RV_TRACE_WRITES_RD(rec->op)? (riscv_expand(rec->inst) >> 7) & 0x1F : 0;
+    if (rec->rd) {
+        if (!get_delta(r->file,&delta)) return -1;
+        c->regs[rec->rd] += delta;
+    }
+    rec->val = c->regs[rec->rd];
+
+    rec->has_mem = (r->options & RV_TRACE_MEM) && RV_TRACE_MEM_OP(rec->op);
+    if (rec->has_mem) {
+        if (!get_delta(r->file,&delta)) return -1;
+        c->mem += delta;
+    }
+    rec->mem = c->mem;
+
+    r->records++;
+    return 1;
+}
+
+void riscv_trace_close(riscv_trace_reader* r)
+{
+    if (r->file) fclose(r->file);
+    r->file = NULL;
+}
@@ -0,0 +1,169 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef RISCV_TRACE_H_
+#define RISCV_TRACE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "riscv.h"
+
+// Binary execution trace. Every instruction executed is put into a ring buffer as a compact record,
+// and a background thread streams the buffer into a file. Records are delta-encoded:
+//
+//   flags byte: RV_TRACE_JUMP - address isn't the next one after previous instruction (followed by address delta)
+//               RV_TRACE_NEW - instruction word isn't the one seen at this address last time (followed by the word)
+//   address delta (if RV_TRACE_JUMP is set)
+//   new value of rd, as a delta from its previous value (only for instructions writing into rd other than x0)
+//   memory address, as a delta from the previous one (only for loads and stores, if RV_TRACE_MEM is enabled)
+//
+// Deltas are zigzag-encoded varints (1 to 5 bytes), instruction words are 4 bytes (2 for compressed ones, little-endian).
+// The file starts with a header: RV_TRACE_MAGIC, format version and options (4 bytes each).
+
+#define RV_TRACE_MAGIC 0x52545652U      /* "RVTR" */
+#define RV_TRACE_VERSION 2
+#define RV_TRACE_DEFAULT_SIZE (1U << 20) /* default size of ring buffer */
+#define RV_TRACE_MAX_REC 24             /* max size of one record */
+#define RV_TRACE_TAB_BITS 12            /* known instructions table (direct-mapped, indexed by address) */
+#define RV_TRACE_TAB_SIZE (1U << RV_TRACE_TAB_BITS)
+
+// Record flags
+#define RV_TRACE_JUMP 0x01
+#define RV_TRACE_NEW 0x02
+
+// Trace options
+#define RV_TRACE_MEM 0x01               /* record memory addresses of loads and stores */
+
+// Encoder (decoder) state, the same on both sides
+typedef struct {
+    uint32_t next;                          /* Address of the next instruction, if there's no jump */
+    uint32_t mem;                           /* Last memory address */
+    uint32_t regs[RV_NUMREGS];              /* Last values of the registers */
+    uint32_t tab_ip[RV_TRACE_TAB_SIZE];     /* Known instructions */
+    uint32_t tab_inst[RV_TRACE_TAB_SIZE];
+} riscv_trace_ctx;
+
+struct riscv_trace_s {
+    uint8_t* buf;                   /* Ring buffer */
+    uint32_t mask;                  /* Its size - 1 (size is a power of 2) */
+    uint32_t options;
+    uint64_t head;                  /* Write position (only written by VM thread) */
+    uint64_t tail;                  /* Read position (only written by the writer thread) */
+    uint64_t limit;                 /* VM can write up to here without checking the tail */
+    riscv_trace_ctx ctx;
+    FILE* file;
+    pthread_t writer;
+    int stop;                       /* Tells the writer to finish */
+    bool failed;                    /* Unable to write the file */
+    uint64_t records;               /* Statistics counters */
+    uint64_t bytes;
+    uint64_t stalls;                /* Number of times VM had to wait for the writer */
+};
+
+// Create trace: ring buffer of the given size (0 means default, otherwise it's rounded up to a power of 2)
+// and the writer thread streaming it into file 'fn'. Returns NULL on error.
+riscv_trace* riscv_trace_create(const char* fn, uint32_t size, uint32_t options);
+
+// Write out everything left in the buffer, stop the writer and close the file
+// Returns false if the trace couldn't be written completely
+bool riscv_trace_destroy(riscv_trace* t);
+
+// Wait until there's enough space in the buffer for one record (called by riscv_trace_insn())
+void riscv_trace_wait(riscv_trace* t);
+
+// Instructions writing into rd, loads and stores
+#define RV_TRACE_WRITES_RD(OP) (((OP) < RV_BEQ || (OP) > RV_BGEU) && ((OP) < RV_SB || (OP) > RV_SW) && \
+                                ((OP) < RV_FENCE || (OP) > RV_EBREAK))
+#define RV_TRACE_MEM_OP(OP) ((OP) >= RV_LB && (OP) <= RV_SW)
+
+static inline uint32_t riscv_trace_zigzag(uint32_t delta)
+{
+    return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline void riscv_trace_put(riscv_trace* t, uint64_t* h, uint32_t val)
+{
+    while (val >= 0x80) {
+        t->buf[(*h)++ & t->mask] = (val & 0x7F) | 0x80;
+        val >>= 7;
+    }
+    t->buf[(*h)++ & t->mask] = val;
+}
+
+// Put one executed instruction into the trace: its address and word, opcode, destination register and its value
+// after it's executed, and memory address it has accessed (for loads and stores)
+static inline void riscv_trace_insn(riscv_trace* t, uint32_t ip, uint32_t inst, uint32_t op, uint32_t rd, uint32_t val, uint32_t mem)
+{
+    if (t->head + RV_TRACE_MAX_REC > t->limit) riscv_trace_wait(t);
+
+    riscv_trace_ctx* c = &t->ctx;
+    uint64_t h = t->head;
+    uint64_t fl = h++;
+    uint8_t flags = 0;
+
+    if (ip != c->next) {
+        flags |= RV_TRACE_JUMP;
+        riscv_trace_put(t,&h,riscv_trace_zigzag(ip - c->next));
+    }
+    uint32_t len = RV_INST_LEN(inst);
+    c->next = ip + len;
+
+    uint32_t slot = (ip >> 1) & (RV_TRACE_TAB_SIZE - 1);
+    if (c->tab_ip[slot] != ip || c->tab_inst[slot] != inst) {
+        flags |= RV_TRACE_NEW;
+        c->tab_ip[slot] = ip;
+        c->tab_inst[slot] = inst;
+        for (uint32_t i = 0; i < len; i++, inst >>= 8) t->buf[h++ & t->mask] = inst & 0xFF;
+    }
+
+    if (rd && RV_TRACE_WRITES_RD(op)) {
+        riscv_trace_put(t,&h,riscv_trace_zigzag(val - c->regs[rd]));
+        c->regs[rd] = val;
+    }
+
+    if ((t->options & RV_TRACE_MEM) && RV_TRACE_MEM_OP(op)) {
+        riscv_trace_put(t,&h,riscv_trace_zigzag(mem - c->mem));
+        c->mem = mem;
+    }
+
+    t->buf[fl & t->mask] = flags;
+    t->records++;
+    __atomic_store_n(&t->head,h,__ATOMIC_RELEASE);
+}
+
+// Trace reader (for offline tools)
+typedef struct {
+    FILE* file;
+    uint32_t options;
+    riscv_trace_ctx ctx;
+    uint64_t records;
+} riscv_trace_reader;
+
+// Decoded record
+typedef struct {
+    uint32_t ip;
+    uint32_t inst;
+    uint32_t op;        /* Opcode (riscv_op) */
+    uint32_t rd;        /* Register written (0 if none) */
+    uint32_t val;       /* Its new value */
+    bool has_mem;
+    uint32_t mem;       /* Memory address accessed */
+} riscv_trace_rec;
+
+// Open trace file, returns false if it can't be read or isn't a trace of known version
+bool riscv_trace_open(riscv_trace_reader* r, const char* fn);
+
+// Read next record: returns 1 on success, 0 at the end of trace, -1 if the trace is broken
+int riscv_trace_read(riscv_trace_reader* r, riscv_trace_rec* rec);
+
+void riscv_trace_close(riscv_trace_reader* r);
+
+#endif /* RISCV_TRACE_H_ */
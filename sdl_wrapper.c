@@ -8,41 +8,61 @@
  * */
 
 #include <stdbool.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include "sdl_wrapper.h"
 
-static SDL_Window* wnd = NULL;
-static SDL_Renderer* ren = NULL;
-static SDL_Texture* screen_tex = NULL;
-
-int sdl_wrapper_init(int w, int h, const char* title)
+int sdl_wrapper_init(sdl_wrapper* sdl, int w, int h, const char* title)
 {
+    memset(sdl,0,sizeof(sdl_wrapper));
     if (SDL_Init(SDL_INIT_VIDEO)) {
         puts("Can't open video");
         return 1;
     }
 
-    if (SDL_CreateWindowAndRenderer(w,h,0,&wnd,&ren)) {
+    if (SDL_CreateWindowAndRenderer(w,h,0,&sdl->wnd,&sdl->ren)) {
         puts("Can't create main window");
         return 2;
     }
 
-    if (SDL_SetRenderDrawColor(ren,0,0,0,255)) {
+    if (SDL_SetRenderDrawColor(sdl->ren,0,0,0,255)) {
         puts("Can't set up background color");
         return 3;
     }
 
-    SDL_SetWindowTitle(wnd,title);
-    SDL_RenderClear(ren);
-    SDL_RenderPresent(ren);
+    sdl->screen_tex = SDL_CreateTexture(sdl->ren,SDL_PIXELFORMAT_ARGB8888,SDL_TEXTUREACCESS_STREAMING,w,h);
+    if (!sdl->screen_tex) {
+        puts("Can't create screen texture");
+        return 4;
+    }
+    sdl->screen_w = w;
+
+    SDL_SetWindowTitle(sdl->wnd,title);
+    SDL_RenderClear(sdl->ren);
+    SDL_RenderPresent(sdl->ren);
 
     return 0;
 }
 
-void sdl_wrapper_destroy()
+void sdl_wrapper_destroy(sdl_wrapper* sdl)
 {
-    if (ren) SDL_DestroyRenderer(ren);
-    if (wnd) SDL_DestroyWindow(wnd);
-    if (screen_tex) SDL_DestroyTexture(screen_tex);
+    if (sdl->screen_tex) SDL_DestroyTexture(sdl->screen_tex);
+    if (sdl->ren) SDL_DestroyRenderer(sdl->ren);
+    if (sdl->wnd) SDL_DestroyWindow(sdl->wnd);
+    memset(sdl,0,sizeof(sdl_wrapper));
     SDL_Quit();
 }
+
+// Show new frame and process window events (returns non-zero if user wants to quit)
+int sdl_wrapper_update(sdl_wrapper* sdl, const void* pixels)
+{
+    SDL_Event ev;
+    int quit = 0;
+    while (SDL_PollEvent(&ev))
+        if (ev.type == SDL_QUIT) quit = 1;
+
+    SDL_UpdateTexture(sdl->screen_tex,NULL,pixels,sdl->screen_w * 4);
+    SDL_RenderCopy(sdl->ren,sdl->screen_tex,NULL,NULL);
+    SDL_RenderPresent(sdl->ren);
+    return quit;
+}
@@ -10,7 +10,20 @@
 #ifndef SDL_WRAPPER_H_
 #define SDL_WRAPPER_H_
 
-int sdl_wrapper_init(int w, int h, const char* title);
-void sdl_wrapper_destroy();
+struct SDL_Window;
+struct SDL_Renderer;
+struct SDL_Texture;
+
+// Window of one VM
+typedef struct {
+    struct SDL_Window* wnd;
+    struct SDL_Renderer* ren;
+    struct SDL_Texture* screen_tex;
+    int screen_w;
+} sdl_wrapper;
+
+int sdl_wrapper_init(sdl_wrapper* sdl, int w, int h, const char* title);
+void sdl_wrapper_destroy(sdl_wrapper* sdl);
+int sdl_wrapper_update(sdl_wrapper* sdl, const void* pixels);
 
 #endif /* SDL_WRAPPER_H_ */
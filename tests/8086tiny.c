@@ -774,7 +774,7 @@ int main(void)
 			pc_interrupt(0xA), int8_asap = 0, KEYBOARD_DRIVER;
 	}
 
-	printf("%p, %p\n",opcode_stream,mem);
+	printf("%u instructions\n",inst_counter);
 
 	return 0;
 }
@@ -0,0 +1,211 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Lockstep engine benchmark: runs the same program on many harts (each with its own input and memory)
+// using lockstep executor and then as independent VMs, one after another, and compares the results
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../riscv.h"
+#include "../riscv_jit.h"
+#include "../riscv_batch.h"
+#include "bench.h"
+
+#define RAM_SIZE 8192
+#define BUF_ADDR 0x1000
+
+// xorshift random numbers, accumulated into a small table, with data-dependent branch in the middle
+static const uint32_t program[] = {
+    U(1,RVR_T1,0x37),                       // lui t1,1
+    I(0,RVR_ZERO,0,RVR_T0,0x13),            // li t0,0
+    I(13,RVR_A0,1,RVR_T2,0x13),             // loop: slli t2,a0,13
+    R(0,RVR_T2,RVR_A0,4,RVR_A0),            // xor a0,a0,t2
+    I(17,RVR_A0,5,RVR_T2,0x13),             // srli t2,a0,17
+    R(0,RVR_T2,RVR_A0,4,RVR_A0),            // xor a0,a0,t2
+    I(5,RVR_A0,1,RVR_T2,0x13),              // slli t2,a0,5
+    R(0,RVR_T2,RVR_A0,4,RVR_A0),            // xor a0,a0,t2
+    I(0xFC,RVR_A0,7,RVR_T3,0x13),           // andi t3,a0,0xFC
+    R(0,RVR_T1,RVR_T3,0,RVR_T3),            // add t3,t3,t1
+    I(0,RVR_T3,2,RVR_T4,0x03),              // lw t4,0(t3)
+    R(0,RVR_A0,RVR_T4,0,RVR_T4),            // add t4,t4,a0
+    S(0,RVR_T4,RVR_T3,2),                   // sw t4,0(t3)
+    I(1,RVR_A0,7,RVR_T5,0x13),              // andi t5,a0,1
+    B(12,RVR_ZERO,RVR_T5,0),                // beq t5,zero,skip
+    I(3,RVR_T0,0,RVR_T0,0x13),              // addi t0,t0,3
+    R(0,RVR_A0,RVR_T0,4,RVR_T0),            // xor t0,t0,a0
+    R(0,RVR_T4,RVR_T0,0,RVR_T0),            // skip: add t0,t0,t4
+    I(-1,RVR_A1,0,RVR_A1,0x13),             // addi a1,a1,-1
+    B(-0x44,RVR_ZERO,RVR_A1,1),             // bne a1,zero,loop
+    I(0,RVR_T0,0,RVR_A0,0x13),              // mv a0,t0
+    I(93,RVR_ZERO,0,RVR_A7,0x13),           // li a7,93
+    0x00000073,                             // ecall
+};
+
+static riscv_state* harts;
+static riscv_state** hart_ptrs;
+static uint8_t* rams;
+static uint32_t* results;
+static uint32_t nharts, iterations;
+
+static void reset_harts(void)
+{
+    for (uint32_t i = 0; i < nharts; i++) {
+        riscv_state* st = harts + i;
+        uint8_t* ram = rams + (size_t)i * RAM_SIZE;
+        memset(ram,0,RAM_SIZE);
+        memcpy(ram,program,sizeof(program));
+
+        memset(st,0,sizeof(riscv_state));
+        st->funcs.read8 = no_read;
+        st->funcs.read16 = no_read;
+        st->funcs.read32 = no_read;
+        st->funcs.write8 = no_write;
+        st->funcs.write16 = no_write;
+        st->funcs.write32 = no_write;
+        st->funcs.ecall = ecall;
+        st->funcs.ebreak = ebreak;
+        st->ram = ram;
+        st->ram_size = RAM_SIZE;
+        st->regs[RVR_A0] = (i * 2654435761U) | 1;
+        st->regs[RVR_A1] = iterations + (i & 15) * (iterations / 64);
+    }
+}
+
+// Check hart states against the first run. Returns the number of mismatches.
+static uint32_t check_results(int first)
+{
+    uint32_t errs = 0;
+    for (uint32_t i = 0; i < nharts; i++) {
+        uint32_t* r = results + i * 3;
+        uint32_t cur[3] = { harts[i].regs[RVR_A0], harts[i].ip, (uint32_t)harts[i].instret };
+        if (first) memcpy(r,cur,sizeof(cur));
+        else if (memcmp(r,cur,sizeof(cur))) errs++;
+    }
+    return errs;
+}
+
+static void report(const char* name, uint64_t insts, double ms, uint32_t errs)
+{
+    printf("%-28s %12" PRIu64 " instructions in %9.2f ms: %9.2f MIPS",name,insts,ms,insts / ms / 1000.0);
+    if (errs) printf(" (%u MISMATCHES)",errs);
+    putchar('\n');
+}
+
+// Run every hart as independent VM with given caches (they're reset before each VM)
+static uint64_t run_scalar(riscv_icache* ic, riscv_bcache* bc, riscv_jit* jit)
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < nharts; i++) {
+        riscv_state* st = harts + i;
+        if (ic) riscv_icache_reset(ic);
+        if (bc) riscv_bcache_reset(bc);
+#ifdef RV_USE_JIT
+        if (jit) riscv_jit_flush(jit);
+#endif
+        st->icache = ic;
+        st->bcache = bc;
+        st->jit = jit;
+
+        uint64_t n;
+        while (riscv_run(st,UINT64_MAX,&n) == RVEXIT_BUDGET) ;
+        total += st->instret;
+        st->icache = NULL;
+        st->bcache = NULL;
+        st->jit = NULL;
+    }
+    return total;
+}
+
+int main(int argc, char* argv[])
+{
+    nharts = (argc > 1)? strtoul(argv[1],NULL,0) : 1024;
+    iterations = (argc > 2)? strtoul(argv[2],NULL,0) : 10000;
+    if (!nharts || iterations < 64) {
+        printf("Usage: %s [harts] [iterations (at least 64)]\n",argv[0]);
+        return 1;
+    }
+
+    riscv_init();
+    harts = (riscv_state*)calloc(nharts,sizeof(riscv_state));
+    hart_ptrs = (riscv_state**)calloc(nharts,sizeof(riscv_state*));
+    rams = (uint8_t*)malloc((size_t)nharts * RAM_SIZE);
+    results = (uint32_t*)calloc(nharts * 3,sizeof(uint32_t));
+    riscv_icache* ic = (riscv_icache*)malloc(sizeof(riscv_icache));
+    riscv_bcache* bc = (riscv_bcache*)malloc(sizeof(riscv_bcache));
+    if (!harts || !hart_ptrs || !rams || !results || !ic || !bc) {
+        printf("ERROR: Unable to allocate memory\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < nharts; i++) hart_ptrs[i] = harts + i;
+
+    printf("Running %u harts, %u+ iterations each\n",nharts,iterations);
+    uint32_t errs = 0;
+    double t;
+    uint64_t n;
+
+    // reference: independent VMs, one instruction at a time
+    reset_harts();
+    t = now_ms();
+    n = run_scalar(ic,NULL,NULL);
+    report("Independent VMs (reference)",n,now_ms() - t,check_results(1));
+
+    reset_harts();
+    t = now_ms();
+    n = run_scalar(ic,bc,NULL);
+    report("Independent VMs (threaded)",n,now_ms() - t,(errs += check_results(0)));
+
+#ifdef RV_USE_JIT
+    riscv_jit* jit = riscv_jit_create(0);
+    if (jit) {
+        reset_harts();
+        t = now_ms();
+        n = run_scalar(ic,bc,jit);
+        uint32_t e = check_results(0);
+        errs += e;
+        report("Independent VMs (native)",n,now_ms() - t,e);
+        riscv_jit_destroy(jit);
+    }
+#endif
+
+    // all harts in lockstep (code is decoded through the first one, so it gets the cache)
+    reset_harts();
+    riscv_icache_reset(ic);
+    harts[0].icache = ic;
+    riscv_batch* b = riscv_batch_create(hart_ptrs,nharts);
+    if (!b) {
+        printf("ERROR: Unable to create lockstep executor\n");
+        return 1;
+    }
+    t = now_ms();
+    n = riscv_batch_run(b,UINT64_MAX);
+    t = now_ms() - t;
+    for (uint32_t i = 0; i < nharts; i++)
+        if (b->exits[i] != RVEXIT_HALT) errs++;
+    uint32_t e = check_results(0);
+    errs += e;
+    report("Lockstep",n,t,e);
+    printf("Lockstep: %.2f%% of instructions in lockstep, %" PRIu64 " divergences, %" PRIu64 " regroups\n",
+           100.0 * b->lockstep / (b->lockstep + b->scalar),b->divergences,b->regroups);
+
+    riscv_batch_destroy(b);
+    free(ic);
+    free(bc);
+    free(results);
+    free(rams);
+    free(hart_ptrs);
+    free(harts);
+
+    if (errs) {
+        printf("FAILURE: %u mismatches found\n",errs);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
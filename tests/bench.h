@@ -0,0 +1,52 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+// Common parts of the benchmarks: instruction encoders for generated programs, core callback stubs and timers
+
+#include <time.h>
+#include "../riscv.h"
+
+// Instruction encoders
+#define R(F7,RS2,RS1,F3,RD) (((F7) << 25) | ((RS2) << 20) | ((RS1) << 15) | ((F3) << 12) | ((RD) << 7) | 0x33)
+#define I(IMM,RS1,F3,RD,OP) ((((IMM) & 0xFFF) << 20) | ((RS1) << 15) | ((F3) << 12) | ((RD) << 7) | (OP))
+#define S(IMM,RS2,RS1,F3) (((((IMM) >> 5) & 0x7F) << 25) | ((RS2) << 20) | ((RS1) << 15) | ((F3) << 12) | (((IMM) & 0x1F) << 7) | 0x23)
+#define U(IMM,RD,OP) (((IMM) << 12) | ((RD) << 7) | (OP))
+#define B(IMM,RS2,RS1,F3) (((((IMM) >> 12) & 1) << 31) | ((((IMM) >> 5) & 0x3F) << 25) | ((RS2) << 20) | ((RS1) << 15) | \
+                           ((F3) << 12) | ((((IMM) >> 1) & 0xF) << 8) | ((((IMM) >> 11) & 1) << 7) | 0x63)
+#define J(IMM,RD) (((((IMM) >> 20) & 1) << 31) | ((((IMM) >> 1) & 0x3FF) << 21) | ((((IMM) >> 11) & 1) << 20) | \
+                   ((((IMM) >> 12) & 0xFF) << 12) | ((RD) << 7) | 0x6F)
+#define ECALL 0x00000073
+
+// Compressed instruction encoders (CA and CB take full register numbers, x8-x15 only)
+#define CR(F4,RD,RS2) (((F4) << 12) | ((RD) << 7) | ((RS2) << 2) | 2)
+#define CI(F3,IMM,RD,OP) (((F3) << 13) | ((((IMM) >> 5) & 1) << 12) | ((RD) << 7) | (((IMM) & 0x1F) << 2) | (OP))
+#define CA(F2,RD,RS2) ((0x23 << 10) | (((RD) - 8) << 7) | ((F2) << 5) | (((RS2) - 8) << 2) | 1)
+#define CB(F2,IMM,RD) ((4 << 13) | ((((IMM) >> 5) & 1) << 12) | ((F2) << 10) | (((RD) - 8) << 7) | (((IMM) & 0x1F) << 2) | 1)
+#define C2(A,B) ((uint32_t)(A) | ((uint32_t)(B) << 16))
+
+// Callbacks for programs running entirely inside RAM window (memory callbacks are never called, and exit() halts)
+static inline uint32_t no_read(riscv_state* st, uint32_t addr) { (void)addr; st->fault = 1; return 0; }
+static inline void no_write(riscv_state* st, uint32_t addr, uint32_t val) { (void)addr; (void)val; st->fault = 1; }
+static inline uint8_t ecall(riscv_state* st) { return st->regs[RVR_A7] == 93; }
+static inline void ebreak(riscv_state* st) { (void)st; }
+
+static inline double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline double now_ms(void) { return now_s() * 1e3; }
+static inline double now_us(void) { return now_s() * 1e6; }
+
+#endif /* BENCH_H_ */
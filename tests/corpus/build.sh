@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Builds the guest workload corpus into build/ directory (RISC-V toolchain is needed), and with 'ref' argument,
+# runs the programs with the reference engine of the emulator (build it first) and writes their output into reference files
+# (and checks them against host builds of the same programs, if there's a host compiler).
+# Set RV_ARCH to build them for other extensions (e.g., RV_ARCH=rv32imc_zba_zbb)
+# This file (C) Dmitry Solovyev, 2020-2021
+
+RV_ARCH=${RV_ARCH:-rv32i}
+RV_CC="riscv32-unknown-elf-gcc -march=$RV_ARCH -mabi=ilp32 -Wl,-gc-sections -O2 -g0"
+RV_CXX="riscv32-unknown-elf-g++ -march=$RV_ARCH -mabi=ilp32 -Wl,-gc-sections -O2 -g0"
+OUT=build
+
+cd "$(dirname "$0")" || exit 1
+mkdir -p $OUT || exit 1
+
+# 8086tiny boots from the floppy image compiled into it (fd.h, included from the build directory)
+as --32 -o $OUT/boot86.o boot86.S && ld -m elf_i386 -Ttext=0x7C00 -o $OUT/boot86.elf $OUT/boot86.o || exit 1
+objcopy -O binary $OUT/boot86.elf $OUT/fd.img && (cd $OUT && xxd -i -n fd_img fd.img > fd.h) || exit 1
+rm -f $OUT/boot86.o $OUT/boot86.elf $OUT/fd.img
+
+$RV_CC -mcmodel=medany -w -I$OUT -o $OUT/8086tiny.elf ../8086tiny.c || exit 3
+$RV_CC -o $OUT/crc.elf crc.c || exit 3
+$RV_CC -o $OUT/intkern.elf intkern.c || exit 3
+$RV_CXX -o $OUT/iostream.elf iostream.cpp || exit 3
+echo "Corpus is ready"
+[ "z$1" = "zref" ] || exit 0
+
+# reference outputs come from the guest programs, run one instruction at a time (manifest paths are relative to the root)
+rm -rf $OUT/ref
+(cd ../.. && ./nano_rvi -j tests/corpus/corpus.txt -t 1 -e r -o tests/corpus/$OUT/ref > /dev/null) || exit 2
+NAMES=$(grep -v '^#' corpus.txt | awk 'NF { print $1 }')
+for n in $NAMES; do
+    grep -q "^$n	exit	0	" $OUT/ref/summary.txt || { echo "$n has failed, see $OUT/ref/summary.txt"; exit 2; }
+done
+
+# the programs don't depend on type sizes, so host builds must print the same
+if which gcc g++ > /dev/null; then
+    gcc -O2 -w -I$OUT -o $OUT/8086tiny.host ../8086tiny.c && gcc -O2 -o $OUT/crc.host crc.c &&
+    gcc -O2 -o $OUT/intkern.host intkern.c && g++ -O2 -o $OUT/iostream.host iostream.cpp || exit 2
+    for n in $NAMES; do
+        ./$OUT/$n.host | cmp -s - $OUT/ref/$n.out || { echo "$n prints something else on the host"; exit 2; }
+    done
+fi
+
+for n in $NAMES; do cp $OUT/ref/$n.out $n.ref || exit 2; done
+echo "Reference outputs updated"
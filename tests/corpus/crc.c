@@ -0,0 +1,80 @@
+/*
+ * CRC32 / memcpy workload: fills 1 MiB with pseudo-random data, copies it around
+ * (all sizes and alignments, overlapping moves), and prints CRC32 of the buffers
+ *
+ * riscv32-unknown-elf-gcc -march=rv32i -mabi=ilp32 -Wl,-gc-sections -O2 -g0 -o crc.elf crc.c
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define SIZE (1024*1024)
+#define PASSES 4
+
+static uint32_t table[256];
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1)? (c >> 1) ^ 0xEDB88320 : c >> 1;
+        table[i] = c;
+    }
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t* p, uint32_t len)
+{
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+int main()
+{
+    uint8_t* a = (uint8_t*)malloc(SIZE);
+    uint8_t* b = (uint8_t*)malloc(SIZE);
+    if (!a || !b) {
+        puts("Unable to allocate memory!");
+        return 1;
+    }
+    crc_init();
+
+    uint32_t seed = 12345;
+    for (uint32_t i = 0; i < SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        a[i] = seed >> 16;
+    }
+    printf("Source CRC32 = %08" PRIX32 "\n",crc32(0,a,SIZE));
+
+    uint32_t total = 0;
+    for (int pass = 0; pass < PASSES; pass++) {
+        // whole buffer at once
+        memcpy(b,a,SIZE);
+        total ^= crc32(pass,b,SIZE);
+
+        // small blocks of all sizes at all alignments
+        uint32_t off = 0;
+        for (uint32_t len = 1; off + len + 8 <= SIZE; len = len % 251 + 1) {
+            memcpy(b + off + (len & 7),a + off,len);
+            off += len + 8;
+        }
+        total ^= crc32(total,b,SIZE);
+
+        // overlapping moves both ways
+        for (uint32_t i = 0; i < 64; i++) {
+            uint32_t len = 4096 + i * 97;
+            uint32_t pos = (i * 7919) % (SIZE - len - 64);
+            memmove(b + pos + (i & 31) + 1,b + pos,len);
+            memmove(b + pos,b + pos + (i & 15) + 1,len);
+        }
+        memset(b + pass * 1000,pass,SIZE / 8);
+        total ^= crc32(total,b,SIZE);
+        printf("Pass %d: CRC32 = %08" PRIX32 ", memcmp = %d\n",pass,total,memcmp(a,b,SIZE) > 0);
+    }
+
+    free(b);
+    free(a);
+    printf("Result = %08" PRIX32 "\n",total);
+    return 0;
+}
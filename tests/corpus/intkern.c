@@ -0,0 +1,183 @@
+/*
+ * Integer kernel in the spirit of CoreMark: linked list search and sort, small matrix arithmetic
+ * and a state machine parsing numbers, all results are folded into CRC16
+ *
+ * riscv32-unknown-elf-gcc -march=rv32i -mabi=ilp32 -Wl,-gc-sections -O2 -g0 -o intkern.elf intkern.c
+ * */
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define ITERATIONS 1000
+#define LIST_SIZE 200
+#define MAT_N 16
+#define TEXT_SIZE 2048
+
+typedef struct node_s {
+    struct node_s* next;
+    int16_t key;
+    int16_t val;
+} node;
+
+static node nodes[LIST_SIZE];
+static int16_t mat_a[MAT_N * MAT_N], mat_b[MAT_N * MAT_N];
+static int32_t mat_c[MAT_N * MAT_N];
+static char text[TEXT_SIZE];
+
+static uint16_t crc16(uint16_t crc, uint16_t v)
+{
+    for (int i = 0; i < 16; i++) {
+        uint16_t x = (crc ^ v) & 1;
+        v >>= 1;
+        crc = x? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+// List: build, search, merge sort by value, then by key again
+
+static node* list_build(uint16_t seed)
+{
+    for (int i = 0; i < LIST_SIZE; i++) {
+        nodes[i].next = (i + 1 < LIST_SIZE)? nodes + i + 1 : NULL;
+        nodes[i].key = i;
+        seed = seed * 25173 + 13849;
+        nodes[i].val = seed & 0x7FFF;
+    }
+    return nodes;
+}
+
+static node* list_sort(node* list, int by_key)
+{
+    // bottom-up merge sort
+    for (int k = 1; ; k *= 2) {
+        node *p = list, *head = NULL, *tail = NULL;
+        int merges = 0;
+        while (p) {
+            merges++;
+            node* q = p;
+            int ps = 0, qs = k;
+            while (ps < k && q) {
+                ps++;
+                q = q->next;
+            }
+            while (ps || (qs && q)) {
+                node* e;
+                if (!ps) e = q, q = q->next, qs--;
+                else if (!qs || !q) e = p, p = p->next, ps--;
+                else if ((by_key? p->key - q->key : p->val - q->val) <= 0) e = p, p = p->next, ps--;
+                else e = q, q = q->next, qs--;
+                if (tail) tail->next = e;
+                else head = e;
+                tail = e;
+            }
+            p = q;
+        }
+        tail->next = NULL;
+        list = head;
+        if (merges <= 1) return list;
+    }
+}
+
+static uint16_t list_bench(uint16_t crc, uint16_t seed)
+{
+    node* list = list_build(seed);
+    for (int i = 0; i < 64; i++) {
+        int16_t want = (seed + i * 37) % (LIST_SIZE + 20);
+        int pos = 0;
+        node* n;
+        for (n = list; n && n->key != want; n = n->next) pos++;
+        crc = crc16(crc,n? pos : 0xFFFF);
+    }
+    list = list_sort(list,0);
+    for (node* n = list; n; n = n->next) crc = crc16(crc,n->val);
+    list = list_sort(list,1);
+    return crc16(crc,list->next->key);
+}
+
+// Matrix: multiply, add constant, multiply by constant, extract bits
+
+static uint16_t matrix_bench(uint16_t crc, uint16_t seed)
+{
+    for (int i = 0; i < MAT_N * MAT_N; i++) {
+        seed = seed * 25173 + 13849;
+        mat_a[i] = (seed >> 4) & 0x3FF;
+        mat_b[i] = ((seed >> 8) & 0x3FF) - 0x200;
+    }
+    for (int i = 0; i < MAT_N; i++)
+        for (int j = 0; j < MAT_N; j++) {
+            int32_t s = 0;
+            for (int k = 0; k < MAT_N; k++) s += (int32_t)mat_a[i * MAT_N + k] * mat_b[k * MAT_N + j];
+            mat_c[i * MAT_N + j] = s;
+        }
+    int32_t sum = 0;
+    for (int i = 0; i < MAT_N * MAT_N; i++) {
+        mat_a[i] += 7;
+        mat_c[i] = mat_c[i] * 3 + mat_a[i];
+        sum += (mat_c[i] >> 2) & 0xF;
+        if (sum > 1000) sum -= 1000;
+    }
+    return crc16(crc,sum);
+}
+
+// State machine: classify numbers in a text (integers, decimals, exponents, hex or invalid)
+
+enum { ST_START, ST_INT, ST_DOT, ST_FRAC, ST_EXP, ST_EXPSIGN, ST_EXPNUM, ST_HEX, ST_INVALID, NUM_STATES };
+
+static uint16_t state_bench(uint16_t crc, uint16_t seed)
+{
+    static const char alphabet[] = "0123456789.eE+-x ,abF";
+    for (int i = 0; i < TEXT_SIZE - 1; i++) {
+        seed = seed * 25173 + 13849;
+        text[i] = alphabet[(seed >> 6) % (sizeof(alphabet) - 1)];
+    }
+    text[TEXT_SIZE - 1] = 0;
+
+    uint32_t counts[NUM_STATES];
+    memset(counts,0,sizeof(counts));
+    int st = ST_START;
+    for (const char* p = text; ; p++) {
+        char c = *p;
+        if (!c || c == ' ' || c == ',') {
+            if (st != ST_START) counts[st]++;
+            st = ST_START;
+            if (!c) break;
+            continue;
+        }
+        int digit = (c >= '0' && c <= '9');
+        switch (st) {
+        case ST_START: st = digit? ST_INT : (c == '.')? ST_DOT : (c == '+' || c == '-')? ST_INT : ST_INVALID; break;
+        case ST_INT:
+            if (c == 'x' && p[-1] == '0') st = ST_HEX;
+            else st = digit? ST_INT : (c == '.')? ST_DOT : (c == 'e' || c == 'E')? ST_EXP : ST_INVALID;
+            break;
+        case ST_DOT: st = digit? ST_FRAC : ST_INVALID; break;
+        case ST_FRAC: st = digit? ST_FRAC : (c == 'e' || c == 'E')? ST_EXP : ST_INVALID; break;
+        case ST_EXP: st = digit? ST_EXPNUM : (c == '+' || c == '-')? ST_EXPSIGN : ST_INVALID; break;
+        case ST_EXPSIGN:
+        case ST_EXPNUM: st = digit? ST_EXPNUM : ST_INVALID; break;
+        case ST_HEX: st = (digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))? ST_HEX : ST_INVALID; break;
+        default: break;
+        }
+    }
+    for (int i = 0; i < NUM_STATES; i++) crc = crc16(crc,counts[i]);
+    return crc;
+}
+
+int main()
+{
+    uint16_t crc_list = 0, crc_matrix = 0, crc_state = 0;
+    for (uint16_t i = 0; i < ITERATIONS; i++) {
+        crc_list = list_bench(crc_list,i);
+        crc_matrix = matrix_bench(crc_matrix,i);
+        crc_state = state_bench(crc_state,i);
+    }
+    uint16_t crc = crc16(crc16(crc16(0,crc_list),crc_matrix),crc_state);
+
+    printf("Iterations: %d\n",ITERATIONS);
+    printf("List CRC: 0x%04x\n",crc_list);
+    printf("Matrix CRC: 0x%04x\n",crc_matrix);
+    printf("State CRC: 0x%04x\n",crc_state);
+    printf("Result CRC: 0x%04x\n",crc);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * C++ workload: word frequencies of a generated text with std::map, sorting, string streams,
+ * formatted iostream output and exceptions
+ *
+ * riscv32-unknown-elf-g++ -march=rv32i -mabi=ilp32 -Wl,-gc-sections -O2 -g0 -o iostream.elf iostream.cpp
+ * */
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+using namespace std;
+
+static const char* words[] = { "risc", "five", "nano", "emulator", "block", "cache", "jump", "branch",
+                               "load", "store", "register", "immediate", "shift", "trap", "fence", "hart" };
+
+class generator {
+public:
+    explicit generator(uint32_t seed) : state(seed) {}
+    uint32_t next() { return state = state * 1664525u + 1013904223u; }
+private:
+    uint32_t state;
+};
+
+static string make_text(generator& g, int n)
+{
+    ostringstream s;
+    for (int i = 0; i < n; i++) {
+        uint32_t r = g.next() >> 8;
+        // skew distribution towards the first words
+        s << words[(r % 16) & ((r >> 4) % 16)];
+        s << ((i % 12 == 11)? ".\n" : " ");
+    }
+    return s.str();
+}
+
+static int parse_checked(const string& w)
+{
+    if (w.size() > 8) throw length_error("word '" + w + "' is too long");
+    return (int)w.size();
+}
+
+int main()
+{
+    generator g(2021);
+    map<string,int> freq;
+    uint32_t errors = 0, letters = 0;
+
+    for (int round = 0; round < 200; round++) {
+        istringstream in(make_text(g,500));
+        string w;
+        while (in >> w) {
+            if (w.back() == '.') w.pop_back();
+            freq[w]++;
+            try {
+                letters += parse_checked(w);
+            } catch (const length_error& e) {
+                if (!errors++) cout << "Exception: " << e.what() << endl;
+            }
+        }
+    }
+
+    vector<pair<string,int> > sorted(freq.begin(),freq.end());
+    sort(sorted.begin(),sorted.end(),[](const pair<string,int>& a, const pair<string,int>& b) {
+        return (a.second != b.second)? a.second > b.second : a.first < b.first;
+    });
+
+    int total = 0;
+    for (auto& p : sorted) total += p.second;
+    cout << "Words: " << total << ", distinct: " << sorted.size() << ", letters: " << letters << ", errors: " << errors << endl;
+    for (auto& p : sorted) {
+        cout << setw(10) << left << p.first << right << setw(7) << p.second
+             << setw(8) << fixed << setprecision(2) << p.second * 100.0 / total << "%"
+             << "  0x" << hex << setw(4) << setfill('0') << p.second << dec << setfill(' ') << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Guest workload benchmark: runs every program of the corpus (tests/corpus) with every execution engine,
+// each run in a separate emulator process (so its peak RSS can be measured), checks the output against
+// the reference one, and prints wall time, guest MIPS and peak RSS of each run
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+#define EMULATOR "./nano_rvi"
+#define MANIFEST "tests/corpus/corpus.txt"
+#define WORK_DIR "corpus_bench.d"
+#define MAX_LINE 4096
+#define MAX_NAME 256
+
+typedef struct {
+    char status[16];
+    uint32_t exit_code;
+    uint64_t instret;
+    double ms;
+} job_result;
+
+// Run the emulator on a single-job manifest, returns false if it can't be started or crashed
+static bool run(const char* name, char engine, double* wall, long* rss)
+{
+    char log[MAX_LINE], eng[2] = { engine, 0 };
+    snprintf(log,sizeof(log),WORK_DIR "/%s.log",name);
+
+    double t = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (!pid) {
+        int fd = open(log,O_WRONLY | O_CREAT | O_TRUNC,0644);
+        if (fd >= 0) {
+            dup2(fd,STDOUT_FILENO);
+            dup2(fd,STDERR_FILENO);
+        }
+        execl(EMULATOR,EMULATOR,"-j",WORK_DIR "/job.txt","-t","1","-o",WORK_DIR,"-e",eng,(char*)NULL);
+        _exit(127);
+    }
+
+    int st;
+    struct rusage ru;
+    if (wait4(pid,&st,0,&ru) != pid) return false;
+    *wall = now_ms() - t;
+    *rss = ru.ru_maxrss;
+    return WIFEXITED(st) && WEXITSTATUS(st) != 127;
+}
+
+static bool read_summary(const char* name, job_result* r)
+{
+    FILE* f = fopen(WORK_DIR "/summary.txt","r");
+    if (!f) return false;
+    char line[MAX_LINE], jn[MAX_LINE];
+    bool ok = false;
+    while (!ok && fgets(line,sizeof(line),f)) {
+        if (line[0] == '#') continue;
+        ok = sscanf(line,"%s %15s %u %" SCNu64 " %lf",jn,r->status,&r->exit_code,&r->instret,&r->ms) == 5 && !strcmp(jn,name);
+    }
+    fclose(f);
+    return ok;
+}
+
+// Returns 1 if files are equal, 0 if not, -1 if reference file doesn't exist
+static int compare(const char* out, const char* ref)
+{
+    FILE* a = fopen(ref,"rb");
+    if (!a) return -1;
+    FILE* b = fopen(out,"rb");
+    int ca = 0, cb = 0;
+    if (b)
+        do {
+            ca = fgetc(a);
+            cb = fgetc(b);
+        } while (ca == cb && ca != EOF);
+    fclose(a);
+    if (b) fclose(b);
+    return b && ca == cb;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* engines = (argc > 1)? argv[1] : "rtj";
+    const char* manifest = (argc > 2)? argv[2] : MANIFEST;
+    if (!*engines || strspn(engines,"rtj") != strlen(engines)) {
+        printf("Usage: %s [engines (any of r, t, j)] [corpus manifest]\n",argv[0]);
+        return 1;
+    }
+
+    FILE* mf = fopen(manifest,"r");
+    if (!mf) {
+        printf("ERROR: Unable to open file '%s'\n",manifest);
+        return 1;
+    }
+    if (access(EMULATOR,X_OK) || (mkdir(WORK_DIR,0755) && access(WORK_DIR,W_OK))) {
+        printf("ERROR: Run it from the repository root after building the emulator\n");
+        fclose(mf);
+        return 1;
+    }
+
+    // reference outputs are next to the manifest
+    const char* slash = strrchr(manifest,'/');
+    int dirlen = slash? (int)(slash - manifest + 1) : 0;
+
+    printf("%-10s %-10s %-8s %10s %12s %9s %9s  %s\n","Workload","Engine","Status","Wall, ms","Instructions","MIPS","RSS, MiB","Output");
+    char line[MAX_LINE];
+    uint32_t runs = 0, errs = 0, missing = 0;
+    while (fgets(line,sizeof(line),mf)) {
+        char* p = line + strspn(line," \t\r\n");
+        char name[MAX_NAME], elf[MAX_LINE];
+        if (!*p || *p == '#') continue;
+        if (sscanf(p,"%255s %*s %*s %*s %*s %4095s",name,elf) != 2) {
+            printf("ERROR: Malformed line in '%s': %s",manifest,p);
+            errs++;
+            continue;
+        }
+        if (access(elf,R_OK)) {
+            printf("%-10s (no %s, see tests/corpus/build.sh)\n",name,elf);
+            missing++;
+            continue;
+        }
+
+        FILE* job = fopen(WORK_DIR "/job.txt","w");
+        if (!job) {
+            printf("ERROR: Unable to create file '%s'\n",WORK_DIR "/job.txt");
+            errs++;
+            break;
+        }
+        fputs(p,job);
+        fclose(job);
+
+        char out[MAX_LINE], ref[MAX_LINE];
+        snprintf(out,sizeof(out),WORK_DIR "/%s.out",name);
+        if (snprintf(ref,sizeof(ref),"%.*s%s.ref",dirlen,manifest,name) >= (int)sizeof(ref)) ref[0] = 0;
+
+        for (const char* e = engines; *e; e++) {
+            const char* eng = (*e == 'r')? "reference" : (*e == 't')? "threaded" : "jit";
+            double wall = 0;
+            long rss = 0;
+            job_result r;
+            remove(WORK_DIR "/summary.txt");
+            remove(out);
+            runs++;
+
+            if (!run(name,*e,&wall,&rss) || !read_summary(name,&r)) {
+                printf("%-10s %-10s failed to run (see %s/%s.log)\n",name,eng,WORK_DIR,name);
+                errs++;
+                continue;
+            }
+            int cmp = compare(out,ref);
+            const char* res = (cmp > 0)? "OK" : (cmp < 0)? "no reference" : "DIFFERENT";
+            bool ok = !strcmp(r.status,"exit") && !r.exit_code;
+            if (!cmp || !ok) errs++;
+
+            char status[32];
+            if (ok || strcmp(r.status,"exit")) strcpy(status,r.status);
+            else snprintf(status,sizeof(status),"exit %u",r.exit_code);
+            printf("%-10s %-10s %-8s %10.1f %12" PRIu64 " %9.1f %9.1f  %s\n",name,eng,status,wall,r.instret,
+                   r.ms? r.instret / r.ms / 1000.0 : 0.0,rss / 1024.0,res);
+        }
+    }
+    fclose(mf);
+
+    if (errs || !runs) {
+        printf("FAILURE: %u of %u runs failed, %u workloads not built\n",errs,runs,missing);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Decoder self-check: compares table-driven decoder against the reference one
+// for every possible 32-bit encoding (or for the range given in command line)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../riscv.h"
+
+int main(int argc, char* argv[])
+{
+    uint32_t from = 0, to = 0xFFFFFFFF;
+    if (argc > 2) {
+        from = strtoul(argv[1],NULL,0);
+        to = strtoul(argv[2],NULL,0);
+    }
+
+    printf("Checking decoder on encodings 0x%08X - 0x%08X...\n",from,to);
+    uint32_t errs = riscv_decoder_selfcheck(from,to);
+    if (errs) {
+        printf("FAILURE: %u mismatches found\n",errs);
+        return 1;
+    }
+
+    puts("SUCCESS");
+    return 0;
+}
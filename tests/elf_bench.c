@@ -0,0 +1,206 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// ELF loader benchmark: generates program images of different sizes (big read-only segment, small data segment,
+// big BSS and a note which must not be loaded), and measures the time from readelf() to the program exit,
+// compared with just reading the file into memory (which is what a copying loader has to do at least)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../interface.h"
+#include "../elf.h"
+#include "bench.h"
+
+#define CODE_ADDR 0x10000
+#define NOTE_ADDR 0x1000
+#define DATA_SIZE 0x4000
+#define STACK_SIZE (64 * 1024)
+#define FILE_NAME "elf_bench.elf"
+
+typedef struct {
+    uint32_t ro_end;    /* End of read-only segment (it starts at CODE_ADDR) */
+    uint32_t data;      /* Data segment address */
+    uint32_t bss_end;   /* End of BSS (which follows the data) */
+} layout;
+
+// Load address into a register (lui + addi)
+static void emit_li(uint32_t* code, int* n, uint32_t reg, uint32_t val)
+{
+    code[(*n)++] = U((val + 0x800) >> 12,reg,0x37);
+    code[(*n)++] = I(val & 0xFFF,reg,0,reg,0x13);
+}
+
+// Write ELF file with 'ro_size' bytes of read-only segment and as much of BSS
+static bool make_elf(uint32_t ro_size, layout* l)
+{
+    l->ro_end = CODE_ADDR + ro_size;
+    l->data = l->ro_end + 0x100; // data shares a page with the end of read-only segment
+    l->bss_end = l->data + DATA_SIZE + ro_size;
+
+    // the program adds up the last word of read-only segment, first word of data and last word of BSS, and exits with that
+    uint32_t code[32];
+    int n = 0;
+    emit_li(code,&n,RVR_T0,l->ro_end - 4);
+    code[n++] = I(0,RVR_T0,2,RVR_A0,0x03);          // lw a0,0(t0)
+    emit_li(code,&n,RVR_T0,l->data);
+    code[n++] = I(0,RVR_T0,2,RVR_T1,0x03);          // lw t1,0(t0)
+    code[n++] = R(0,RVR_T1,RVR_A0,0,RVR_A0);        // add a0,a0,t1
+    emit_li(code,&n,RVR_T0,l->bss_end - 4);
+    code[n++] = I(0,RVR_T0,2,RVR_T1,0x03);          // lw t1,0(t0)
+    code[n++] = R(0,RVR_T1,RVR_A0,0,RVR_A0);        // add a0,a0,t1
+    code[n++] = I(93,RVR_ZERO,0,RVR_A7,0x13);       // li a7,93
+    code[n++] = 0x00000073;                         // ecall
+
+    elf_header_t h;
+    elf_proghdr_t ph[3];
+    memset(&h,0,sizeof(h));
+    memset(ph,0,sizeof(ph));
+    memcpy(h.magic,"\x7f" "ELF",4);
+    h.class = 1;
+    h.endianness = 1;
+    h.ver = 1;
+    h.type = 2;
+    h.machine = ELF_RISCV_MACH_CODE;
+    h.ver_again = 1;
+    h.entry = CODE_ADDR;
+    h.proghdr_off = sizeof(h);
+    h.hdrsize = sizeof(h);
+    h.proghdr_size = sizeof(elf_proghdr_t);
+    h.proghdr_num = 3;
+
+    ph[0].type = ELF_PT_LOAD; // read-only: code and constants
+    ph[0].off = 0x1000;
+    ph[0].vaddr = ph[0].paddr = CODE_ADDR;
+    ph[0].filesz = ph[0].memsz = ro_size;
+    ph[0].flags = 5;
+    ph[0].align = 0x1000;
+    ph[1].type = ELF_PT_LOAD; // data and BSS
+    ph[1].off = 0x1000 + ro_size + 0x100;
+    ph[1].vaddr = ph[1].paddr = l->data;
+    ph[1].filesz = DATA_SIZE;
+    ph[1].memsz = l->bss_end - l->data;
+    ph[1].flags = 6;
+    ph[1].align = 0x1000;
+    ph[2].type = 4; // note (must be ignored)
+    ph[2].off = 0x1000;
+    ph[2].vaddr = NOTE_ADDR;
+    ph[2].filesz = ph[2].memsz = 0x100;
+
+    FILE* f = fopen(FILE_NAME,"wb");
+    if (!f) return false;
+    uint8_t* buf = (uint8_t*)calloc(1,ph[1].off + DATA_SIZE);
+    if (!buf) {
+        fclose(f);
+        return false;
+    }
+    memcpy(buf,&h,sizeof(h));
+    memcpy(buf + sizeof(h),ph,sizeof(ph));
+    memset(buf + ph[0].off,0x11,ro_size);
+    memcpy(buf + ph[0].off,code,n * 4);
+    memset(buf + ph[1].off,0x22,DATA_SIZE);
+    bool ok = fwrite(buf,ph[1].off + DATA_SIZE,1,f) == 1;
+    free(buf);
+    return !fclose(f) && ok;
+}
+
+// Just read the whole file into a buffer (it's in page cache already)
+static double read_file(uint32_t size)
+{
+    uint8_t* buf = (uint8_t*)malloc(size);
+    int fd = open(FILE_NAME,O_RDONLY);
+    double t = now_ms();
+    uint32_t done = 0;
+    ssize_t r;
+    while (buf && fd >= 0 && done < size && (r = read(fd,buf + done,size - done)) > 0) done += r;
+    t = now_ms() - t;
+    if (fd >= 0) close(fd);
+    free(buf);
+    return t;
+}
+
+static bool setup(rv_interface* iface, const layout* l)
+{
+    rv_iface_init(iface);
+    iface->ram_size = (l->bss_end + STACK_SIZE + 0xFFFFF) & ~0xFFFFFU;
+    iface->stack_size = STACK_SIZE;
+    return rv_iface_resize(iface);
+}
+
+// Load and run the program, returns total time (or negative value on error)
+static double run(rv_interface* iface, const layout* l, uint32_t* errs, double* load)
+{
+    double t = now_ms();
+    if (!readelf(iface,FILE_NAME) || !rv_iface_start(iface)) return -1;
+    *load = now_ms() - t;
+    while (rv_iface_step(iface)) ;
+    t = now_ms() - t;
+
+    if (iface->status != RVSTAT_EXIT || iface->exit_code != 0x11111111U + 0x22222222U) (*errs)++;
+    if (!memcmp(iface->ram + NOTE_ADDR,iface->ram + CODE_ADDR,16) || iface->ram[l->bss_end - 1]) (*errs)++;
+    return t;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t max_mib = (argc > 1)? strtoul(argv[1],NULL,0) : 256;
+    if (!max_mib || max_mib > 1024) {
+        printf("Usage: %s [max image size, MiB (up to 1024)]\n",argv[0]);
+        return 1;
+    }
+
+    riscv_init();
+    uint32_t errs = 0;
+    layout l;
+
+    // loader must not leave garbage in BSS and must skip non-loadable segments
+    rv_interface iface;
+    if (!make_elf(0x3000,&l) || !setup(&iface,&l)) {
+        printf("ERROR: Unable to prepare test\n");
+        return 1;
+    }
+    memset(iface.ram,0xEE,iface.ram_size);
+    double load;
+    if (run(&iface,&l,&errs,&load) < 0) errs++;
+    for (uint32_t a = l.data + DATA_SIZE; a < l.bss_end; a++)
+        if (iface.ram[a]) {
+            errs++;
+            break;
+        }
+    rv_iface_stop(&iface);
+
+    printf("%10s %12s %12s %12s\n","Image","Read file","Load","Load+run");
+    for (uint32_t mib = 1; mib <= max_mib; mib *= 4) {
+        uint32_t size = mib << 20;
+        if (!make_elf(size,&l)) {
+            printf("ERROR: Unable to write '%s'\n",FILE_NAME);
+            return 1;
+        }
+
+        double tread = read_file(size);
+        if (!setup(&iface,&l)) return 1;
+        double t = run(&iface,&l,&errs,&load);
+        rv_iface_stop(&iface);
+        if (t < 0) {
+            errs++;
+            break;
+        }
+        printf("%6u MiB %9.3f ms %9.3f ms %9.3f ms\n",mib,tread,load,t);
+    }
+    remove(FILE_NAME);
+
+    if (errs) {
+        printf("FAILURE: %u errors found\n",errs);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
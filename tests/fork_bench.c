@@ -0,0 +1,255 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// VM fork benchmark: boots one VM (it fills a big chunk of RAM, pretending to initialize itself),
+// then forks many clones of it, measuring fork latency and resident memory, and lets each clone
+// handle a small "request" (write a few pages), checking that nobody sees the writes of others
+// (and that the pages the original zeroes after it has been forked are zero in its next clones,
+// and that a clone can't commit much more RAM than the original is allowed to, and that a failed fork
+// leaves nothing behind)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "../interface.h"
+#include "bench.h"
+
+#define STACK_SIZE (64 * 1024)
+#define INIT_START 0x100000
+#define REQUEST_SIZE (4 * 4096)
+
+// Fill [a0; a1) with (address ^ a2) and exit
+static const uint32_t program[] = {
+    R(0,RVR_A2,RVR_A0,4,RVR_T0),            // loop: xor t0,a0,a2
+    S(0,RVR_T0,RVR_A0,2),                   // sw t0,0(a0)
+    I(4,RVR_A0,0,RVR_A0,0x13),              // addi a0,a0,4
+    B(-12,RVR_A1,RVR_A0,1),                 // bne a0,a1,loop
+    I(93,RVR_ZERO,0,RVR_A7,0x13),           // li a7,93
+    0x00000073,                             // ecall
+};
+
+// Zero [a0; a1) and exit (placed right after the program above)
+#define ZERO_IP sizeof(program)
+static const uint32_t zero_program[] = {
+    S(0,RVR_ZERO,RVR_A0,2),                 // loop: sw zero,0(a0)
+    I(4,RVR_A0,0,RVR_A0,0x13),              // addi a0,a0,4
+    B(-8,RVR_A1,RVR_A0,1),                  // bne a0,a1,loop
+    I(93,RVR_ZERO,0,RVR_A7,0x13),           // li a7,93
+    ECALL,                                  // ecall
+};
+
+// Memory used by the process, KiB: proportional set size (shared pages are counted once, not in every clone)
+// plus the memory file holding RAM snapshot (its pages don't belong to any process once the original is forked)
+static long mem_kib(rv_interface* orig)
+{
+    struct stat sb;
+    long file = (orig->ram_file && !orig->ram_shared && !fstat(orig->ram_file->fd,&sb))? sb.st_blocks / 2 : 0;
+    char line[256];
+    long pss = 0;
+    FILE* f = fopen("/proc/self/smaps_rollup","r");
+    if (!f) return 0;
+    while (fgets(line,sizeof(line),f))
+        if (sscanf(line,"Pss: %ld",&pss) == 1) break;
+    fclose(f);
+    return pss + file;
+}
+
+// Address space size of the process, bytes (0 if it's unknown)
+static long vm_size(void)
+{
+    long pages = 0;
+    FILE* f = fopen("/proc/self/statm","r");
+    if (!f) return 0;
+    if (fscanf(f,"%ld",&pages) != 1) pages = 0;
+    fclose(f);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static void run(rv_interface* iface, uint32_t ip, uint32_t start, uint32_t end, uint32_t key)
+{
+    iface->vm.ip = ip;
+    iface->vm.regs[RVR_A0] = start;
+    iface->vm.regs[RVR_A1] = end;
+    iface->vm.regs[RVR_A2] = key;
+    iface->status = RVSTAT_RUNNING;
+    while (rv_iface_step(iface)) ;
+}
+
+// Check that the range has the right contents (zeros, if 'zero' is set)
+static int check(rv_interface* iface, uint32_t start, uint32_t end, uint32_t key, bool zero)
+{
+    for (uint32_t a = start; a < end; a += 4)
+        if (*(uint32_t*)(iface->ram + a) != (zero? 0 : (a ^ key))) return 1;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t nclones = (argc > 1)? strtoul(argv[1],NULL,0) : 1000;
+    uint32_t ram_mib = (argc > 2)? strtoul(argv[2],NULL,0) : 64;
+    uint32_t init_mib = (argc > 3)? strtoul(argv[3],NULL,0) : 16;
+    if (nclones < 2 || !ram_mib || init_mib >= ram_mib) {
+        printf("Usage: %s [clones (at least 2)] [RAM size, MiB] [initialized RAM size, MiB (less than RAM size)]\n",argv[0]);
+        return 1;
+    }
+
+    riscv_init();
+    rv_interface* vms = (rv_interface*)calloc(nclones + 1,sizeof(rv_interface));
+    if (!vms) {
+        printf("ERROR: Unable to allocate memory\n");
+        return 1;
+    }
+
+    // boot the original VM
+    rv_interface* orig = vms;
+    rv_iface_init(orig);
+    orig->ram_size = ram_mib << 20;
+    orig->stack_size = STACK_SIZE;
+    if (!rv_iface_resize(orig)) return 1;
+    memcpy(orig->ram,program,sizeof(program));
+    memcpy(orig->ram + ZERO_IP,zero_program,sizeof(zero_program));
+    if (!rv_iface_start(orig)) return 1;
+
+    uint32_t init_end = INIT_START + (init_mib << 20);
+    long rss0 = mem_kib(orig);
+    double t = now_us();
+    run(orig,0,INIT_START,init_end,0);
+    printf("Initialization: %u MiB of %u MiB RAM filled in %.2f ms, memory %ld KiB\n",init_mib,ram_mib,(now_us() - t) / 1000.0,mem_kib(orig) - rss0);
+
+    // a full copy of RAM is what we'd have to do without copy-on-write
+    uint32_t errs = 0;
+    uint8_t* copy = (uint8_t*)malloc(orig->ram_size);
+    if (!copy) return 1;
+    t = now_us();
+    memcpy(copy,orig->ram,orig->ram_size);
+    t = now_us() - t;
+    errs += (copy[init_end - 4] != orig->ram[init_end - 4]);
+    printf("Full RAM copy (for comparison): %.2f us\n",t);
+    free(copy);
+
+    // the first fork turns RAM of the original into copy-on-write mapping as well
+    t = now_us();
+    if (!rv_iface_fork(orig,vms + 1)) {
+        printf("ERROR: Unable to fork VM\n");
+        return 1;
+    }
+    printf("First fork: %.2f us\n",now_us() - t);
+
+    // fork the rest of clones
+    long rss1 = mem_kib(orig);
+    double tmin = 1e30, tmax = 0, total = 0;
+    for (uint32_t i = 2; i <= nclones; i++) {
+        t = now_us();
+        if (!rv_iface_fork(orig,vms + i)) {
+            printf("ERROR: Unable to fork VM #%u\n",i);
+            return 1;
+        }
+        t = now_us() - t;
+        total += t;
+        if (t < tmin) tmin = t;
+        if (t > tmax) tmax = t;
+    }
+    long rss2 = mem_kib(orig);
+    printf("Fork: %u clones, %.2f us average (min %.2f, max %.2f), memory %ld KiB (%.1f KiB per clone)\n",
+           nclones - 1,total / (nclones - 1),tmin,tmax,rss2 - rss1,(double)(rss2 - rss1) / (nclones - 1));
+
+    // handle a request in every clone
+    t = now_us();
+    for (uint32_t i = 1; i <= nclones; i++) {
+        uint32_t start = INIT_START + ((i * REQUEST_SIZE) % (init_end - INIT_START - REQUEST_SIZE));
+        run(vms + i,0,start,start + REQUEST_SIZE,i);
+        if (vms[i].status != RVSTAT_EXIT) errs++;
+    }
+    t = now_us() - t;
+    long rss3 = mem_kib(orig);
+    printf("Requests: %u KiB written by every clone in %.2f us average, memory %ld KiB more (%.1f KiB per clone)\n",
+           REQUEST_SIZE / 1024,t / nclones,rss3 - rss2,(double)(rss3 - rss2) / nclones);
+
+    // every clone must see its own writes and the original data everywhere else
+    errs += check(orig,INIT_START,init_end,0,false);
+    for (uint32_t i = 1; i <= nclones; i++) {
+        uint32_t start = INIT_START + ((i * REQUEST_SIZE) % (init_end - INIT_START - REQUEST_SIZE));
+        errs += check(vms + i,start,start + REQUEST_SIZE,i,false);
+        errs += check(vms + i,INIT_START,start,0,false);
+        errs += check(vms + i,start + REQUEST_SIZE,init_end,0,false);
+    }
+
+    // clones of a clone work too
+    rv_interface grandchild;
+    if (!rv_iface_fork(vms + 1,&grandchild)) errs++;
+    else {
+        uint32_t start = INIT_START + (REQUEST_SIZE % (init_end - INIT_START - REQUEST_SIZE));
+        errs += check(&grandchild,start,start + REQUEST_SIZE,1,false);
+        rv_iface_stop(&grandchild);
+    }
+
+    // memory zeroed by the original after it's been forked must be zero in its next clones as well
+    rv_interface late;
+    run(orig,ZERO_IP,INIT_START,INIT_START + REQUEST_SIZE,0);
+    if (!rv_iface_fork(orig,&late)) errs++;
+    else {
+        errs += check(&late,INIT_START,INIT_START + REQUEST_SIZE,0,true);
+        errs += check(&late,INIT_START + REQUEST_SIZE,init_end,0,false);
+        rv_iface_stop(&late);
+    }
+
+    // clones have the same RAM limit as the original (writing past the initialized memory commits new pages),
+    // and they're stopped before they get far past it
+    rv_interface hog;
+    if (!rv_iface_fork(orig,&hog)) errs++;
+    else {
+        run(&hog,0,init_end,init_end + orig->ram_size,0);
+        uint64_t used = rv_iface_committed(&hog);
+        printf("RAM hog: status %u, %" PRIu64 " KiB committed\n",hog.status,used / 1024);
+        errs += (hog.status != RVSTAT_NOMEM || used > (uint64_t)orig->ram_size + (IFACE_MIN_SLICE / 2) * RVMEM_PAGE_SIZE);
+        rv_iface_stop(&hog);
+    }
+
+    // a fork that fails (here, there's no address space to map RAM of the clone) releases what it has got
+    // by then (a copy of the open file, the output buffer), and the clone is left blank
+    rv_interface failed;
+    struct rlimit lim;
+    long size = vm_size();
+    if (!size || getrlimit(RLIMIT_AS,&lim)) errs++;
+    else {
+        orig->files[3] = open("/dev/null",O_RDONLY | O_CLOEXEC);
+        int next = fcntl(0,F_DUPFD_CLOEXEC,0);
+        close(next);
+        struct rlimit low = { (rlim_t)size + (16 << 20), lim.rlim_max };
+        setrlimit(RLIMIT_AS,&low);
+        bool ok = rv_iface_fork(orig,&failed);
+        setrlimit(RLIMIT_AS,&lim);
+        int fd = fcntl(0,F_DUPFD_CLOEXEC,0);
+        printf("Failed fork: %s, next file %d (was %d)\n",ok? "succeeded" : "failed",fd,next);
+        errs += ok || fd != next || failed.ram || failed.con.buf || failed.files[3] != -1;
+        close(fd);
+        rv_iface_stop(&failed);
+
+        // and the original can still be forked
+        if (!rv_iface_fork(orig,&failed)) errs++;
+        else {
+            errs += check(&failed,INIT_START + REQUEST_SIZE,init_end,0,false);
+            rv_iface_stop(&failed);
+        }
+    }
+
+    for (uint32_t i = 0; i <= nclones; i++) rv_iface_stop(vms + i);
+    free(vms);
+
+    if (errs) {
+        printf("FAILURE: %u errors found\n",errs);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Code cache invalidation check, with every engine:
+// - stores into a device page at the top of address space must not throw away the code at the bottom of it
+//   (they used to share the page filter bit, so every console store invalidated page 0);
+// - code changed in a page which shares the filter bit with another code page must not stay in the cache
+//   after that other page has been invalidated (they must share the cache lines as well).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../riscv.h"
+#include "../riscv_jit.h"
+#include "bench.h"
+
+#define DEVICE_BASE 0xF0000000  /* written through callbacks, the writes are ignored */
+#define LEAF_ADDR 0x1000        /* another function, with some data in its page */
+#define DATA_OFFSET 0x7FC
+#define FUNC_ADDR 0x10000000    /* page 0x10000 shares the filter bit with page 1 if upper bits are folded in carelessly */
+#define RAM_SIZE (FUNC_ADDR + 0x1000)
+#define PATCH_ADDR 0x7F8        /* replacement instruction for the function */
+
+enum {
+    ENG_REFERENCE,  /* pre-decoded instructions cache */
+    ENG_THREADED,   /* translated blocks cache */
+    ENG_JIT,        /* native code translator */
+    NUM_ENGINES
+};
+
+static const char* engine_names[NUM_ENGINES] = { "reference", "threaded", "jit" };
+
+// Loop a0 times storing into the device page, then exit
+static const uint32_t device_loop[] = {
+    U(DEVICE_BASE >> 12,RVR_T0,0x37),           // lui t0,device
+    S(0,RVR_A0,RVR_T0,0),                       // loop: sb a0,0(t0)
+    I(-1,RVR_A0,0,RVR_A0,0x13),                 // addi a0,a0,-1
+    B(-8,RVR_ZERO,RVR_A0,1),                    // bnez a0,loop
+    I(93,RVR_ZERO,0,RVR_A7,0x13),               // li a7,93
+    ECALL,                                      // ecall
+};
+
+// Call the leaf function and the function (li a0,1), store into the page of the leaf one,
+// patch the function (li a0,2) and call it again, exit with the sum (3)
+static const uint32_t patch_func[] = {
+    U(FUNC_ADDR >> 12,RVR_S0,0x37),             // lui s0,func
+    U(LEAF_ADDR >> 12,RVR_T1,0x37),             // lui t1,leaf
+    I(0,RVR_T1,0,RVR_RA,0x67),                  // jalr ra,0(t1)
+    I(0,RVR_S0,0,RVR_RA,0x67),                  // jalr ra,0(s0)
+    I(0,RVR_A0,0,RVR_S1,0x13),                  // mv s1,a0
+    S(DATA_OFFSET,RVR_ZERO,RVR_T1,2),           // sw zero,data(t1)
+    I(PATCH_ADDR,RVR_ZERO,2,RVR_T0,0x03),       // lw t0,patch(zero)
+    S(0,RVR_T0,RVR_S0,2),                       // sw t0,0(s0)
+    I(0,RVR_S0,0,RVR_RA,0x67),                  // jalr ra,0(s0)
+    R(0,RVR_S1,RVR_A0,0,RVR_A0),                // add a0,a0,s1
+    I(93,RVR_ZERO,0,RVR_A7,0x13),               // li a7,93
+    ECALL,                                      // ecall
+};
+
+static const uint32_t func[] = {
+    I(1,RVR_ZERO,0,RVR_A0,0x13),                // li a0,1
+    I(0,RVR_RA,0,RVR_ZERO,0x67),                // ret
+};
+
+static const uint32_t leaf[] = {
+    I(0,RVR_RA,0,RVR_ZERO,0x67),                // ret
+};
+
+static void device_write(riscv_state* st, uint32_t addr, uint32_t val)
+{
+    (void)val;
+    if (addr < DEVICE_BASE) st->fault = 1;
+}
+
+// Run the program, returns its exit code (or -1 if it didn't exit), and the number of invalidated pages
+static int64_t run(uint32_t eng, uint8_t* ram, const uint32_t* prog, size_t len, uint32_t a0, uint64_t* inval)
+{
+    riscv_state st;
+    memset(&st,0,sizeof(st));
+    memcpy(ram,prog,len);
+    st.funcs.read8 = no_read;
+    st.funcs.read16 = no_read;
+    st.funcs.read32 = no_read;
+    st.funcs.write8 = device_write;
+    st.funcs.write16 = device_write;
+    st.funcs.write32 = device_write;
+    st.funcs.ecall = ecall;
+    st.funcs.ebreak = ebreak;
+    st.ram = ram;
+    st.ram_size = RAM_SIZE;
+    st.regs[RVR_A0] = a0;
+
+    st.icache = (riscv_icache*)malloc(sizeof(riscv_icache));
+    if (st.icache) riscv_icache_reset(st.icache);
+    if (eng >= ENG_THREADED) {
+        st.bcache = (riscv_bcache*)malloc(sizeof(riscv_bcache));
+        if (st.bcache) riscv_bcache_reset(st.bcache);
+    }
+#ifdef RV_USE_JIT
+    if (eng == ENG_JIT) st.jit = riscv_jit_create(0);
+#endif
+
+    int64_t res = -1;
+    if (st.icache && (eng < ENG_THREADED || st.bcache) && (eng != ENG_JIT || st.jit)) {
+        riscv_exit r;
+        uint64_t n;
+        while ((r = riscv_run(&st,UINT64_MAX,&n)) == RVEXIT_BUDGET) ;
+        if (r == RVEXIT_HALT && !st.fault) res = st.regs[RVR_A0];
+    }
+    *inval = (st.icache? st.icache->invalidations : 0) + (st.bcache? st.bcache->invalidations : 0);
+
+    free(st.icache);
+    free(st.bcache);
+#ifdef RV_USE_JIT
+    if (st.jit) riscv_jit_destroy(st.jit);
+#endif
+    return res;
+}
+
+int main()
+{
+    // (the pages in between are never touched)
+    uint8_t* ram = (uint8_t*)calloc(1,RAM_SIZE);
+    if (!ram) {
+        printf("ERROR: Unable to allocate memory\n");
+        return 1;
+    }
+    riscv_init();
+
+    uint32_t errs = 0;
+    for (uint32_t e = 0; e < NUM_ENGINES; e++) {
+#ifndef RV_USE_JIT
+        if (e == ENG_JIT) break;
+#endif
+        uint64_t inval;
+        int64_t r = run(e,ram,device_loop,sizeof(device_loop),100000,&inval);
+        printf("%10s: device stores: exit code %" PRId64 ", %" PRIu64 " pages invalidated\n",engine_names[e],r,inval);
+        if (r || inval) errs++;
+
+        memcpy(ram + FUNC_ADDR,func,sizeof(func));
+        memcpy(ram + LEAF_ADDR,leaf,sizeof(leaf));
+        *(uint32_t*)(ram + PATCH_ADDR) = I(2,RVR_ZERO,0,RVR_A0,0x13);  // li a0,2
+        r = run(e,ram,patch_func,sizeof(patch_func),0,&inval);
+        printf("%10s: patched function: exit code %" PRId64 " (3 expected)\n",engine_names[e],r);
+        if (r != 3) errs++;
+    }
+    free(ram);
+
+    if (errs) {
+        printf("FAILURE: %u errors found\n",errs);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
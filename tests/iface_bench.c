@@ -0,0 +1,150 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Interface overhead benchmark: runs a loop reading a device register (so every access goes through memory callbacks),
+// a loop printing characters through the console register, and a plain ALU loop with all the engines,
+// and prints instructions per second (it also checks that console output captured in memory is all there).
+// Build it as is to get callbacks and step functions specialised for debug options,
+// or with IFACE_GENERIC to get the ones checking them at run-time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../interface.h"
+#include "bench.h"
+
+#define RAM_SIZE (1024 * 1024)
+#define STACK_SIZE (64 * 1024)
+#define CAPTURE_SIZE 100000     /* characters printed with captured output (several times the buffer size) */
+
+// Loop a0 times (a0 is set by the benchmark), 3 instructions per iteration, then exit
+static const uint32_t mmio_loop[] = {
+    U(IFACE_CONSOLE_BASE >> 12,RVR_T0,0x37),    // lui t0,console
+    I(0,RVR_T0,4,RVR_T1,0x03),                  // loop: lbu t1,0(t0)
+    I(-1,RVR_A0,0,RVR_A0,0x13),                 // addi a0,a0,-1
+    B(-8,RVR_ZERO,RVR_A0,1),                    // bnez a0,loop
+    I(93,RVR_ZERO,0,RVR_A7,0x13),               // li a7,93
+    0x00000073,                                 // ecall
+};
+
+// Same with a store into the console data register (output goes into /dev/null)
+static const uint32_t console_loop[] = {
+    U(IFACE_CONSOLE_BASE >> 12,RVR_T0,0x37),    // lui t0,console
+    S(0,RVR_A0,RVR_T0,0),                       // loop: sb a0,0(t0)
+    I(-1,RVR_A0,0,RVR_A0,0x13),                 // addi a0,a0,-1
+    B(-8,RVR_ZERO,RVR_A0,1),                    // bnez a0,loop
+    I(93,RVR_ZERO,0,RVR_A7,0x13),               // li a7,93
+    0x00000073,                                 // ecall
+};
+
+static const uint32_t alu_loop[] = {
+    I(0,RVR_ZERO,0,RVR_T0,0x13),                // li t0,0
+    I(3,RVR_T0,0,RVR_T0,0x13),                  // loop: addi t0,t0,3
+    I(-1,RVR_A0,0,RVR_A0,0x13),                 // addi a0,a0,-1
+    B(-8,RVR_ZERO,RVR_A0,1),                    // bnez a0,loop
+    I(93,RVR_ZERO,0,RVR_A7,0x13),               // li a7,93
+    0x00000073,                                 // ecall
+};
+
+// Set up the VM to run the program for 'iters' iterations
+static bool start(rv_interface* iface, const uint32_t* prog, size_t len, uint32_t engine, uint32_t iters, FILE* out)
+{
+    rv_iface_init(iface);
+    iface->out = out;
+    iface->ram_size = RAM_SIZE;
+    iface->stack_size = STACK_SIZE;
+    iface->engine = engine;
+    iface->headless = true;
+    if (!rv_iface_resize(iface)) return false;
+    memcpy(iface->ram,prog,len);
+    if (!rv_iface_start(iface)) {
+        rv_iface_stop(iface);
+        return false;
+    }
+    iface->vm.regs[RVR_A0] = iters;
+    return true;
+}
+
+// Run the program, returns millions of instructions per second (or negative value on error)
+static double run(const uint32_t* prog, size_t len, uint32_t engine, uint32_t iters, FILE* out)
+{
+    rv_interface iface;
+    if (!start(&iface,prog,len,engine,iters,out)) return -1;
+
+    double t = now_s();
+    while (rv_iface_step(&iface)) ;
+    t = now_s() - t;
+
+    double mips = (iface.status == RVSTAT_EXIT)? iface.vm.instret / t / 1e6 : -1;
+    if (prog == console_loop && iface.con.total != iters) mips = -1; // (every character must get there)
+    rv_iface_stop(&iface);
+    return mips;
+}
+
+// Print through the console register with output captured in memory, returns true if it's all there, in order
+static bool capture(uint32_t engine, uint32_t iters)
+{
+    rv_interface iface;
+    if (!start(&iface,console_loop,sizeof(console_loop),engine,iters,NULL)) return false;
+    while (rv_iface_step(&iface)) ;
+
+    uint32_t len;
+    const uint8_t* buf = rv_console_captured(&iface.con,&len);
+    bool ok = (iface.status == RVSTAT_EXIT && len == iters);
+    for (uint32_t i = 0; ok && i < len; i++) ok = (buf[i] == (uint8_t)(iters - i)); // (characters are the counter)
+    rv_iface_stop(&iface);
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t iters = (argc > 1)? strtoul(argv[1],NULL,0) : 20000000;
+    if (!iters) {
+        printf("Usage: %s [loop iterations]\n",argv[0]);
+        return 1;
+    }
+
+    static const char* engines[] = { "reference", "threaded", "jit" };
+    riscv_init();
+#ifdef IFACE_GENERIC
+    puts("Generic callbacks and step function (debug options checked at run-time)");
+#else
+    puts("Callbacks and step function specialised for debug options");
+#endif
+    FILE* null = fopen("/dev/null","w");
+    if (!null) {
+        printf("ERROR: Unable to open /dev/null\n");
+        return 1;
+    }
+    printf("%10s %14s %14s %14s\n","Engine","Device, MIPS","Console, MIPS","ALU, MIPS");
+
+    uint32_t errs = 0;
+    for (uint32_t e = RVENG_REFERENCE; e <= RVENG_JIT; e++) {
+#ifndef RV_USE_JIT
+        if (e == RVENG_JIT) break;
+#endif
+        double mmio = run(mmio_loop,sizeof(mmio_loop),e,iters,stdout);
+        double con = run(console_loop,sizeof(console_loop),e,iters,null);
+        double alu = run(alu_loop,sizeof(alu_loop),e,iters,stdout);
+        if (mmio < 0 || con < 0 || alu < 0) errs++;
+        printf("%10s %14.1f %14.1f %14.1f\n",engines[e],mmio,con,alu);
+        if (!capture(e,CAPTURE_SIZE)) {
+            printf("%10s: captured output is wrong\n",engines[e]);
+            errs++;
+        }
+    }
+    fclose(null);
+
+    if (errs) {
+        printf("FAILURE: %u errors found\n",errs);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Interpreter microbenchmark: generates a loop of instructions of one class (ALU, loads and stores, taken and
+// not taken branches, jumps, system calls, multiplication and division, compressed ALU, bit manipulation) in memory and runs it with every execution engine available.
+// Prints nanoseconds per instruction and MIPS for each pair, and writes the same numbers into a JSON file.
+// Final state of every run is compared with the first one (riscv_exec() without caches), so it's a test as well.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../riscv.h"
+#include "../riscv_jit.h"
+#include "bench.h"
+
+#define RAM_SIZE (64 * 1024)
+#define BUF_ADDR 0x8000     /* data for loads and stores (not in the same page as the code) */
+#define BODY_LEN 60         /* instructions of the class in one loop iteration */
+#define DEFAULT_INSTS 20000000
+#define JSON_FILE "bench.json"
+
+enum {
+    CLASS_ALU,
+    CLASS_MEM,
+    CLASS_TAKEN,
+    CLASS_NOT_TAKEN,
+    CLASS_JUMP,
+    CLASS_ECALL,
+    CLASS_MULDIV,
+    CLASS_COMPRESSED,
+    CLASS_BITMANIP,
+    NUM_CLASSES
+};
+
+static const char* class_names[NUM_CLASSES] = { "alu", "load_store", "branch_taken", "branch_not_taken", "jal_jalr", "ecall", "mul_div", "compressed", "bitmanip" };
+
+enum {
+    ENG_EXEC,       /* riscv_exec(), one instruction at a time, no caches */
+    ENG_REFERENCE,  /* riscv_run() with pre-decoded instructions cache */
+    ENG_THREADED,   /* riscv_run() with translated blocks cache */
+    ENG_JIT,        /* riscv_run() with native code translator */
+    NUM_ENGINES
+};
+
+static const char* engine_names[NUM_ENGINES] = { "exec", "reference", "threaded", "jit" };
+
+// Body of the loop for each class, returns its length in words
+static uint32_t gen_body(uint32_t cls, uint32_t* p)
+{
+    static const uint32_t alu[] = {
+        R(0,RVR_T2,RVR_T1,0,RVR_T1),                // add t1,t1,t2
+        R(0,RVR_T1,RVR_T2,4,RVR_T2),                // xor t2,t2,t1
+        I(3,RVR_T1,1,RVR_T3,0x13),                  // slli t3,t1,3
+        R(0x20,RVR_T2,RVR_T3,0,RVR_T4),             // sub t4,t3,t2
+        I(0x5A5,RVR_T4,6,RVR_T5,0x13),              // ori t5,t4,0x5A5
+        R(0,RVR_T5,RVR_T1,7,RVR_T6),                // and t6,t1,t5
+        R(0,RVR_T6,RVR_T2,3,RVR_A2),                // sltu a2,t2,t6
+        I(5,RVR_T4,5,RVR_A3,0x13),                  // srli a3,t4,5
+        R(0x20,RVR_A2,RVR_A3,5,RVR_A3),             // sra a3,a3,a2
+        R(0,RVR_A3,RVR_A1,0,RVR_A1),                // add a1,a1,a3
+    };
+    // (t4 is often zero and t2 might become zero, so division by zero is there too)
+    static const uint32_t muldiv[] = {
+        R(1,RVR_T2,RVR_T1,0,RVR_T3),                // mul t3,t1,t2
+        R(1,RVR_T1,RVR_T3,1,RVR_T4),                // mulh t4,t3,t1
+        R(1,RVR_T3,RVR_T1,2,RVR_T5),                // mulhsu t5,t1,t3
+        R(1,RVR_T2,RVR_T3,3,RVR_T6),                // mulhu t6,t3,t2
+        R(1,RVR_T4,RVR_T3,4,RVR_A2),                // div a2,t3,t4
+        R(1,RVR_T2,RVR_T3,5,RVR_A3),                // divu a3,t3,t2
+        R(1,RVR_T5,RVR_T1,6,RVR_A4),                // rem a4,t1,t5
+        R(1,RVR_T2,RVR_T6,7,RVR_A5),                // remu a5,t6,t2
+        R(0,RVR_A4,RVR_T1,0,RVR_T1),                // add t1,t1,a4
+        R(0,RVR_A5,RVR_T2,4,RVR_T2),                // xor t2,t2,a5
+    };
+    // (every Zba and Zbb instruction)
+    static const uint32_t bitmanip[] = {
+        R(0x10,RVR_T2,RVR_T1,2,RVR_T3),             // sh1add t3,t1,t2
+        R(0x10,RVR_T1,RVR_T3,4,RVR_T4),             // sh2add t4,t3,t1
+        R(0x10,RVR_T2,RVR_T4,6,RVR_T5),             // sh3add t5,t4,t2
+        R(0x20,RVR_T1,RVR_T5,7,RVR_T6),             // andn t6,t5,t1
+        R(0x20,RVR_T3,RVR_T6,6,RVR_A2),             // orn a2,t6,t3
+        R(0x20,RVR_T4,RVR_A2,4,RVR_A3),             // xnor a3,a2,t4
+        I(0x600,RVR_A3,1,RVR_A4,0x13),              // clz a4,a3
+        I(0x601,RVR_A2,1,RVR_A5,0x13),              // ctz a5,a2
+        I(0x602,RVR_T5,1,RVR_T3,0x13),              // cpop t3,t5
+        R(0x05,RVR_T6,RVR_A3,6,RVR_T4),             // max t4,a3,t6
+        R(0x05,RVR_T4,RVR_A2,7,RVR_T5),             // maxu t5,a2,t4
+        R(0x05,RVR_A3,RVR_T5,4,RVR_T6),             // min t6,t5,a3
+        R(0x05,RVR_T1,RVR_T6,5,RVR_A2),             // minu a2,t6,t1
+        I(0x604,RVR_T5,1,RVR_A3,0x13),              // sext.b a3,t5
+        I(0x605,RVR_T4,1,RVR_A4,0x13),              // sext.h a4,t4
+        R(0x04,RVR_ZERO,RVR_T6,4,RVR_A5),           // zext.h a5,t6
+        R(0x30,RVR_A4,RVR_T1,1,RVR_T1),             // rol t1,t1,a4
+        R(0x30,RVR_A5,RVR_T2,5,RVR_T2),             // ror t2,t2,a5
+        I(0x600 | 13,RVR_T1,5,RVR_T3,0x13),         // rori t3,t1,13
+        I(0x287,RVR_T3,5,RVR_T4,0x13),              // orc.b t4,t3
+        I(0x698,RVR_T2,5,RVR_A5,0x13),              // rev8 a5,t2
+        R(0x10,RVR_A1,RVR_A3,2,RVR_A1),             // sh1add a1,a3,a1
+    };
+    // (two instructions per word)
+    static const uint32_t rvc[] = {
+        C2(CR(9,RVR_T1,RVR_T2),                     // c.add t1,t2
+           CR(8,RVR_A2,RVR_T1)),                    // c.mv a2,t1
+        C2(CB(0,3,RVR_A2),                          // c.srli a2,3
+           CA(1,RVR_A3,RVR_A2)),                    // c.xor a3,a2
+        C2(CI(0,5,RVR_T2,1),                        // c.addi t2,5
+           CB(2,-9,RVR_A3)),                        // c.andi a3,-9
+        C2(CA(0,RVR_A4,RVR_A3),                     // c.sub a4,a3
+           CA(2,RVR_A5,RVR_A4)),                    // c.or a5,a4
+        C2(CB(1,1,RVR_A5),                          // c.srai a5,1
+           CR(9,RVR_A1,RVR_A5)),                    // c.add a1,a5
+    };
+
+    if (cls == CLASS_COMPRESSED) {
+        for (uint32_t k = 0; k < BODY_LEN / 2; k++) p[k] = rvc[k % (sizeof(rvc) / sizeof(rvc[0]))];
+        return BODY_LEN / 2;
+    }
+
+    for (uint32_t k = 0; k < BODY_LEN; k++) {
+        switch (cls) {
+        case CLASS_ALU:
+            p[k] = alu[k % (sizeof(alu) / sizeof(alu[0]))];
+            break;
+        case CLASS_MEM:
+            // store and load back, 15 different words
+            if (k & 1) p[k] = I((k / 2 % 15) * 4,RVR_S0,2,RVR_T1,0x03);     // lw t1,ofs(s0)
+            else p[k] = S((k / 2 % 15) * 4,RVR_T1,RVR_S0,2);                // sw t1,ofs(s0)
+            if (k % 4 == 1) p[k] = I((k / 2 % 15) * 4,RVR_S0,4,RVR_T2,0x03); // lbu t2,ofs(s0)
+            break;
+        case CLASS_TAKEN:
+            p[k] = B(4,RVR_ZERO,RVR_ZERO,0);                                // beq zero,zero,next
+            break;
+        case CLASS_NOT_TAKEN:
+            p[k] = B(8,RVR_ZERO,RVR_ZERO,1);                                // bnez zero,(never)
+            break;
+        case CLASS_JUMP:
+            // jal puts the address of jalr into t0, jalr returns right after itself
+            if (k & 1) p[k] = I(4,RVR_T0,0,RVR_ZERO,0x67);                  // jalr zero,4(t0)
+            else p[k] = J(4,RVR_T0);                                        // jal t0,next
+            break;
+        case CLASS_ECALL:
+            p[k] = ECALL;                                                   // (a7 = 0, does nothing)
+            break;
+        case CLASS_MULDIV:
+            p[k] = muldiv[k % (sizeof(muldiv) / sizeof(muldiv[0]))];
+            break;
+        case CLASS_BITMANIP:
+            p[k] = bitmanip[k % (sizeof(bitmanip) / sizeof(bitmanip[0]))];
+            break;
+        }
+    }
+    return BODY_LEN;
+}
+
+// Build the program: a0 iterations of the body, then exit with a1 as the code
+static uint32_t gen_program(uint32_t cls, uint32_t iters, uint32_t* p)
+{
+    uint32_t n = 0;
+    p[n++] = U((iters + 0x800) >> 12,RVR_A0,0x37);      // lui a0,hi(iters)
+    p[n++] = I(iters & 0xFFF,RVR_A0,0,RVR_A0,0x13);     // addi a0,a0,lo(iters)
+    p[n++] = U(BUF_ADDR >> 12,RVR_S0,0x37);             // lui s0,buf
+    p[n++] = I(0x123,RVR_ZERO,0,RVR_T1,0x13);           // li t1,0x123
+    p[n++] = I(0x456,RVR_ZERO,0,RVR_T2,0x13);           // li t2,0x456
+    p[n++] = I(0,RVR_ZERO,0,RVR_A7,0x13);               // li a7,0
+    uint32_t loop = n;
+    n += gen_body(cls,p + n);
+    p[n++] = R(0,RVR_T1,RVR_A1,0,RVR_A1);               // add a1,a1,t1
+    p[n++] = I(-1,RVR_A0,0,RVR_A0,0x13);                // addi a0,a0,-1
+    p[n] = B((int32_t)(loop - n) * 4,RVR_ZERO,RVR_A0,1); // bnez a0,loop
+    n++;
+    p[n++] = I(0,RVR_A1,0,RVR_A0,0x13);                 // mv a0,a1
+    p[n++] = I(93,RVR_ZERO,0,RVR_A7,0x13);              // li a7,93
+    p[n++] = ECALL;
+    return n;
+}
+
+typedef struct {
+    uint64_t insts;
+    double secs;
+    uint32_t result;    /* Exit code */
+    uint32_t ip;        /* Final IP */
+} bench_result;
+
+// Run the program with given engine, returns false if the engine isn't available (or the program fails)
+static bool run(uint32_t eng, const uint32_t* prog, uint32_t len, uint8_t* ram, bench_result* res)
+{
+    riscv_state st;
+    memset(&st,0,sizeof(st));
+    memset(ram,0,RAM_SIZE);
+    memcpy(ram,prog,len * 4);
+    st.funcs.read8 = no_read;
+    st.funcs.read16 = no_read;
+    st.funcs.read32 = no_read;
+    st.funcs.write8 = no_write;
+    st.funcs.write16 = no_write;
+    st.funcs.write32 = no_write;
+    st.funcs.ecall = ecall;
+    st.funcs.ebreak = ebreak;
+    st.ram = ram;
+    st.ram_size = RAM_SIZE;
+
+    // caches are allocated (and touched) before the clock starts
+    if (eng != ENG_EXEC) {
+        st.icache = (riscv_icache*)malloc(sizeof(riscv_icache));
+        if (st.icache) riscv_icache_reset(st.icache);
+    }
+    if (eng >= ENG_THREADED) {
+        st.bcache = (riscv_bcache*)malloc(sizeof(riscv_bcache));
+        if (st.bcache) riscv_bcache_reset(st.bcache);
+    }
+#ifdef RV_USE_JIT
+    if (eng == ENG_JIT) st.jit = riscv_jit_create(0);
+#endif
+    bool ok = (eng == ENG_EXEC || st.icache) && (eng < ENG_THREADED || st.bcache) && (eng != ENG_JIT || st.jit);
+
+    riscv_exit r = RVEXIT_SUCCESS;
+    double t = now_s();
+    if (!ok)
+        ;
+    else if (eng == ENG_EXEC)
+        while ((r = riscv_exec(&st)) == RVEXIT_SUCCESS) ;
+    else {
+        uint64_t n;
+        while ((r = riscv_run(&st,UINT64_MAX,&n)) == RVEXIT_BUDGET) ;
+    }
+    res->secs = now_s() - t;
+    res->insts = st.instret;
+    res->result = st.regs[RVR_A0];
+    res->ip = st.ip;
+
+    free(st.icache);
+    free(st.bcache);
+#ifdef RV_USE_JIT
+    if (st.jit) riscv_jit_destroy(st.jit);
+#endif
+    return ok && r == RVEXIT_HALT && !st.fault;
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t target = (argc > 1)? strtoull(argv[1],NULL,0) : DEFAULT_INSTS;
+    const char* fn = (argc > 2)? argv[2] : JSON_FILE;
+    if (target < BODY_LEN) {
+        printf("Usage: %s [instructions per run] [JSON file]\n",argv[0]);
+        return 1;
+    }
+
+    uint8_t* ram = (uint8_t*)malloc(RAM_SIZE);
+    uint32_t* prog = (uint32_t*)malloc(RAM_SIZE / 2);
+    FILE* json = fopen(fn,"w");
+    if (!ram || !prog || !json) {
+        printf("ERROR: Unable to allocate memory or create file '%s'\n",fn);
+        return 1;
+    }
+
+    riscv_init();
+    uint32_t iters = target / (BODY_LEN + 3);
+    printf("Running %u iterations of %u instructions of each class\n",iters,BODY_LEN);
+    printf("%-18s","Class");
+    for (uint32_t e = 0; e < NUM_ENGINES; e++) printf(" %19s ",engine_names[e]);
+    printf("\n%-18s","");
+    for (uint32_t e = 0; e < NUM_ENGINES; e++) printf(" %9s %9s ","ns/inst","MIPS");
+    putchar('\n');
+
+    fprintf(json,"{\n  \"instructions_per_iteration\": %u,\n  \"iterations\": %u,\n  \"results\": [",BODY_LEN + 3,iters);
+    uint32_t errs = 0, nres = 0;
+    for (uint32_t c = 0; c < NUM_CLASSES; c++) {
+        uint32_t len = gen_program(c,iters,prog);
+        bench_result first = {0,0,0,0};
+        printf("%-18s",class_names[c]);
+
+        for (uint32_t e = 0; e < NUM_ENGINES; e++) {
+            bench_result res;
+#ifndef RV_USE_JIT
+            if (e == ENG_JIT) {
+                printf(" %19s ","n/a");
+                continue;
+            }
+#endif
+            if (!run(e,prog,len,ram,&res)) {
+                printf(" %19s ","FAILED");
+                errs++;
+                continue;
+            }
+
+            // all engines must end up in the same state
+            if (e == ENG_EXEC) first = res;
+            else if (res.insts != first.insts || res.result != first.result || res.ip != first.ip) errs++;
+
+            double ns = res.secs * 1e9 / res.insts;
+            printf(" %9.2f %9.1f%s",ns,res.insts / res.secs / 1e6,(e && res.result != first.result)? "!" : " ");
+            fprintf(json,"%s\n    { \"class\": \"%s\", \"engine\": \"%s\", \"instructions\": %" PRIu64
+                    ", \"seconds\": %.6f, \"ns_per_inst\": %.3f, \"mips\": %.2f }",
+                    nres++? "," : "",class_names[c],engine_names[e],res.insts,res.secs,ns,res.insts / res.secs / 1e6);
+        }
+        putchar('\n');
+    }
+    fprintf(json,"\n  ]\n}\n");
+    fclose(json);
+    free(prog);
+    free(ram);
+    printf("Results written into '%s'\n",fn);
+
+    if (errs) {
+        printf("FAILURE: %u errors found\n",errs);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
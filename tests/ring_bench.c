@@ -0,0 +1,288 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Syscall ring benchmark: the same stream of write() calls (into a temporary file) is made with ECALL one by one,
+// and through the asynchronous syscall ring in batches (see ring.h), with every engine. Each request comes
+// with some computation, which the program does while the ring thread is busy with the previous batch.
+// Prints syscalls per second for both ways, and checks that every request has been completed
+// (and that forking a VM with requests in flight lets them complete first, and the clone can go on using the ring).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../interface.h"
+#include "bench.h"
+
+#define RAM_SIZE (1024 * 1024)
+#define STACK_SIZE (64 * 1024)
+#define BUF_ADDR 0x10000    /* data written by every request */
+#define BUF_LEN 64
+#define RING_ADDR 0x20000
+#define GUEST_FD 3
+#define PROG_MAX 128
+#define FORK_COUNT 640      /* requests made by the VM which is forked after every batch */
+#define EBREAK 0x00100073
+
+#define LI(RD,IMM) I(IMM,RVR_ZERO,0,RD,0x13)
+#define MV(RD,RS) I(0,RS,0,RD,0x13)
+#define ADDI(RD,RS,IMM) I(IMM,RS,0,RD,0x13)
+
+static uint32_t prog[PROG_MAX];
+static uint32_t n;
+static bool stop_batches;  /* stop (at a breakpoint) after every batch is submitted, before the doorbell */
+
+// Branch back to the instruction 'to' if RS is non-zero
+static void gen_loop(uint32_t to, uint32_t rs)
+{
+    prog[n] = B((int32_t)(to - n) * 4,RVR_ZERO,rs,1);
+    n++;
+}
+
+// Do t5 iterations of work (t5 might be zero)
+static void gen_work(void)
+{
+    prog[n++] = B(16,RVR_ZERO,RVR_T5,0);                // beq t5,zero,done
+    uint32_t work = n;
+    prog[n++] = ADDI(RVR_A4,RVR_A4,3);                  // work: addi a4,a4,3
+    prog[n++] = ADDI(RVR_T5,RVR_T5,-1);                 // addi t5,t5,-1
+    gen_loop(work,RVR_T5);                              // bnez t5,work
+}
+
+// Synchronous: s0 requests, each one is ECALL write(fd, t6, s8) and s9 iterations of work.
+// Exits with the sum of results.
+static void gen_sync(void)
+{
+    n = 0;
+    uint32_t loop = n;
+    prog[n++] = LI(RVR_A0,GUEST_FD);                    // loop: li a0,fd
+    prog[n++] = MV(RVR_A1,RVR_T6);                      // mv a1,t6
+    prog[n++] = MV(RVR_A2,RVR_S8);                      // mv a2,s8
+    prog[n++] = LI(RVR_A7,RVSYS_WRITE);                 // li a7,write
+    prog[n++] = ECALL;                                  // ecall
+    prog[n++] = R(0,RVR_A0,RVR_S4,0,RVR_S4);            // add s4,s4,a0
+    prog[n++] = MV(RVR_T5,RVR_S9);                      // mv t5,s9
+    gen_work();
+    prog[n++] = ADDI(RVR_S0,RVR_S0,-1);                 // addi s0,s0,-1
+    gen_loop(loop,RVR_S0);                              // bnez s0,loop
+    prog[n++] = MV(RVR_A0,RVR_S4);                      // mv a0,s4
+    prog[n++] = LI(RVR_A7,RVSYS_EXIT);                  // li a7,exit
+    prog[n++] = ECALL;                                  // ecall
+}
+
+// Put s6 write requests into the ring (at s1, s5 is its submission queue, s7 is entries - 1, s2 is the tail)
+static void gen_submit(void)
+{
+    prog[n++] = MV(RVR_T1,RVR_S6);                      // mv t1,s6
+    uint32_t sub = n;
+    prog[n++] = R(0,RVR_S7,RVR_S2,7,RVR_T2);            // sub: and t2,s2,s7
+    prog[n++] = I(4,RVR_T2,1,RVR_T3,0x13);              // slli t3,t2,4
+    prog[n++] = I(3,RVR_T2,1,RVR_T4,0x13);              // slli t4,t2,3
+    prog[n++] = R(0,RVR_T4,RVR_T3,0,RVR_T3);            // add t3,t3,t4 (24 bytes per request)
+    prog[n++] = R(0,RVR_S5,RVR_T3,0,RVR_T3);            // add t3,t3,s5
+    prog[n++] = LI(RVR_T4,RVSYS_WRITE);                 // li t4,write
+    prog[n++] = S(0,RVR_T4,RVR_T3,2);                   // sw t4,0(t3)
+    prog[n++] = LI(RVR_T4,GUEST_FD);                    // li t4,fd
+    prog[n++] = S(4,RVR_T4,RVR_T3,2);                   // sw t4,4(t3)
+    prog[n++] = S(8,RVR_T6,RVR_T3,2);                   // sw t6,8(t3)
+    prog[n++] = S(12,RVR_S8,RVR_T3,2);                  // sw s8,12(t3)
+    prog[n++] = S(16,RVR_ZERO,RVR_T3,2);                // sw zero,16(t3)
+    prog[n++] = S(20,RVR_S2,RVR_T3,2);                  // sw s2,20(t3)
+    prog[n++] = ADDI(RVR_S2,RVR_S2,1);                  // addi s2,s2,1
+    prog[n++] = ADDI(RVR_T1,RVR_T1,-1);                 // addi t1,t1,-1
+    gen_loop(sub,RVR_T1);                               // bnez t1,sub
+    prog[n++] = S(4,RVR_S2,RVR_S1,2);                   // sw s2,4(s1) (sq_tail)
+}
+
+// Ring the doorbell, waiting for a0 completions
+static void gen_enter(void)
+{
+    prog[n++] = U(1,RVR_A7,0x37);                       // lui a7,1
+    prog[n++] = ADDI(RVR_A7,RVR_A7,RVRING_SYS_ENTER - 4096); // addi a7,a7,enter-4096
+    prog[n++] = ECALL;                                  // ecall
+}
+
+// Take s6 completions (a5 is the completion queue, s3 is its head), adding results to s4
+static void gen_reap(void)
+{
+    prog[n++] = MV(RVR_T1,RVR_S6);                      // mv t1,s6
+    uint32_t reap = n;
+    prog[n++] = R(0,RVR_S7,RVR_S3,7,RVR_T2);            // reap: and t2,s3,s7
+    prog[n++] = I(3,RVR_T2,1,RVR_T2,0x13);              // slli t2,t2,3
+    prog[n++] = R(0,RVR_A5,RVR_T2,0,RVR_T2);            // add t2,t2,a5
+    prog[n++] = I(4,RVR_T2,2,RVR_T4,0x03);              // lw t4,4(t2)
+    prog[n++] = R(0,RVR_T4,RVR_S4,0,RVR_S4);            // add s4,s4,t4
+    prog[n++] = ADDI(RVR_S3,RVR_S3,1);                  // addi s3,s3,1
+    prog[n++] = ADDI(RVR_T1,RVR_T1,-1);                 // addi t1,t1,-1
+    gen_loop(reap,RVR_T1);                              // bnez t1,reap
+    prog[n++] = S(8,RVR_S3,RVR_S1,2);                   // sw s3,8(s1) (cq_head)
+}
+
+// Ring: sets up the ring (s7 + 1 entries), submits s0 + 1 batches of s6 requests, one ahead: while the ring thread
+// runs one batch, the program takes the results of the previous one and does s10 iterations of work (s9 per request).
+static void gen_ring(void)
+{
+    n = 0;
+    prog[n++] = MV(RVR_A0,RVR_S1);                      // mv a0,s1
+    prog[n++] = ADDI(RVR_A1,RVR_S7,1);                  // addi a1,s7,1
+    prog[n++] = U(1,RVR_A7,0x37);                       // lui a7,1
+    prog[n++] = ADDI(RVR_A7,RVR_A7,RVRING_SYS_SETUP - 4096); // addi a7,a7,setup-4096
+    prog[n++] = ECALL;                                  // ecall
+    prog[n++] = MV(RVR_S4,RVR_A0);                      // mv s4,a0 (non-zero result spoils the sum)
+    prog[n++] = ADDI(RVR_S5,RVR_S1,sizeof(rv_ring_hdr)); // addi s5,s1,header
+    prog[n++] = ADDI(RVR_A5,RVR_S7,1);                  // addi a5,s7,1
+    prog[n++] = I(3,RVR_A5,1,RVR_T3,0x13);              // slli t3,a5,3
+    prog[n++] = I(4,RVR_A5,1,RVR_A5,0x13);              // slli a5,a5,4
+    prog[n++] = R(0,RVR_T3,RVR_A5,0,RVR_A5);            // add a5,a5,t3
+    prog[n++] = R(0,RVR_S5,RVR_A5,0,RVR_A5);            // add a5,a5,s5 (after all the requests)
+    gen_submit();
+    prog[n++] = LI(RVR_A0,0);                           // li a0,0
+    gen_enter();
+    uint32_t loop = n;
+    gen_submit();                                       // loop:
+    if (stop_batches) prog[n++] = EBREAK;               // ebreak
+    prog[n++] = MV(RVR_A0,RVR_S6);                      // mv a0,s6
+    gen_enter();
+    gen_reap();
+    prog[n++] = MV(RVR_T5,RVR_S10);                     // mv t5,s10
+    gen_work();
+    prog[n++] = ADDI(RVR_S0,RVR_S0,-1);                 // addi s0,s0,-1
+    gen_loop(loop,RVR_S0);                              // bnez s0,loop
+    prog[n++] = MV(RVR_A0,RVR_S6);                      // mv a0,s6
+    gen_enter();
+    gen_reap();
+    prog[n++] = MV(RVR_T5,RVR_S10);                     // mv t5,s10
+    gen_work();
+    prog[n++] = MV(RVR_A0,RVR_S4);                      // mv a0,s4
+    prog[n++] = LI(RVR_A7,RVSYS_EXIT);                  // li a7,exit
+    prog[n++] = ECALL;                                  // ecall
+}
+
+// Set up the VM to make 'count' requests (synchronous ones if 'batch' is zero, then 'count' is rounded up to batches)
+static bool start(rv_interface* iface, uint32_t engine, uint32_t* count, uint32_t batch, uint32_t work, FILE* out)
+{
+    if (batch) {
+        gen_ring();
+        *count = (*count + batch - 1) / batch * batch;
+    } else
+        gen_sync();
+
+    rv_iface_init(iface);
+    iface->out = out;
+    iface->ram_size = RAM_SIZE;
+    iface->stack_size = STACK_SIZE;
+    iface->engine = engine;
+    iface->headless = true;
+    if (!rv_iface_resize(iface)) return false;
+    memcpy(iface->ram,prog,n * 4);
+    if (!rv_iface_start(iface)) {
+        rv_iface_stop(iface);
+        return false;
+    }
+    // (a real file, writes into /dev/null cost next to nothing)
+    char name[] = "/tmp/ring_benchXXXXXX";
+    iface->files[GUEST_FD] = mkstemp(name);
+    if (iface->files[GUEST_FD] >= 0) unlink(name);
+
+    uint32_t* r = iface->vm.regs;
+    r[RVR_S0] = batch? *count / batch - 1 : *count;
+    r[RVR_S1] = RING_ADDR;
+    r[RVR_S6] = batch;
+    r[RVR_S7] = batch * 2 - 1;  // (two batches in flight)
+    r[RVR_S8] = BUF_LEN;
+    r[RVR_S9] = work;
+    r[RVR_S10] = work * batch;
+    r[RVR_T6] = BUF_ADDR;
+    return true;
+}
+
+// Run 'count' requests (synchronous ones if 'batch' is zero), returns thousands of syscalls per second
+// (or negative value on error)
+static double run(uint32_t engine, uint32_t count, uint32_t batch, uint32_t work)
+{
+    rv_interface iface;
+    if (!start(&iface,engine,&count,batch,work,stdout)) return -1;
+
+    double t = now_s();
+    while (rv_iface_step(&iface)) ;
+    t = now_s() - t;
+
+    bool ok = iface.status == RVSTAT_EXIT && iface.exit_code == count * BUF_LEN && iface.files[GUEST_FD] >= 0;
+    rv_iface_stop(&iface);
+    return ok? count / t / 1e3 : -1;
+}
+
+// Fork the VM after every batch is submitted (it stops at a breakpoint, and its messages are captured): the clone
+// must have the results of all the requests (unless its completion queue is full), and both VMs must go on
+// submitting the rest of them through their own rings
+static bool fork_check(uint32_t engine, uint32_t count, uint32_t batch)
+{
+    rv_interface iface;
+    stop_batches = true;
+    bool started = start(&iface,engine,&count,batch,0,NULL);
+    stop_batches = false;
+    if (!started) return false;
+
+    bool ok = true;
+    while (ok && rv_iface_step(&iface)) {
+        rv_interface clone;
+        ok = rv_iface_fork(&iface,&clone);
+        if (!ok) break;
+        const rv_ring_hdr* h = (const rv_ring_hdr*)(clone.ram + RING_ADDR);
+        ok = (h->sq_tail == h->sq_head || h->cq_tail - h->cq_head == batch * 2);
+        while (ok && rv_iface_step(&clone)) ;
+        // (old completions have the same results, so it's the queue that tells if the requests have been run)
+        ok = ok && clone.status == RVSTAT_EXIT && clone.exit_code == count * BUF_LEN && h->sq_head == h->sq_tail;
+        rv_iface_stop(&clone);
+    }
+    ok = ok && iface.status == RVSTAT_EXIT && iface.exit_code == count * BUF_LEN;
+    rv_iface_stop(&iface);
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t count = (argc > 1)? strtoul(argv[1],NULL,0) : 500000;
+    uint32_t batch = (argc > 2)? strtoul(argv[2],NULL,0) : 64;
+    if (!count || !batch || batch > RVRING_MAX_ENTRIES / 2) {
+        printf("Usage: %s [syscalls] [batch size (1 to %u)]\n",argv[0],RVRING_MAX_ENTRIES / 2);
+        return 1;
+    }
+
+    static const char* engines[] = { "reference", "threaded", "jit" };
+    static const uint32_t works[] = { 0, 100, 1000 };
+    riscv_init();
+    printf("%u write() calls of %u bytes, batches of %u requests\n",count,BUF_LEN,batch);
+    printf("%10s %16s %14s %14s %8s\n","Engine","Work per call","Sync, K/s","Ring, K/s","Speedup");
+
+    uint32_t errs = 0;
+    for (uint32_t e = RVENG_REFERENCE; e <= RVENG_JIT; e++) {
+#ifndef RV_USE_JIT
+        if (e == RVENG_JIT) break;
+#endif
+        for (uint32_t w = 0; w < sizeof(works) / sizeof(works[0]); w++) {
+            double sync = run(e,count,0,works[w]);
+            double ring = run(e,count,batch,works[w]);
+            if (sync < 0 || ring < 0) errs++;
+            printf("%10s %16u %14.1f %14.1f %7.2fx\n",engines[e],works[w] * 3,sync,ring,(sync > 0)? ring / sync : 0.0);
+        }
+        if (!fork_check(e,FORK_COUNT,batch)) {
+            printf("%10s: forked VM has got unfinished requests or can't use the ring\n",engines[e]);
+            errs++;
+        }
+    }
+
+    if (errs) {
+        printf("FAILURE: %u errors found\n",errs);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
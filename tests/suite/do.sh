@@ -5,7 +5,10 @@
 
 cat enum.txt | sort | awk '{ print tolower($1) }' | while read i ; do
     echo "Testing $i..."
-    riscv32-unknown-elf-gcc -march=rv32i -mabi=ilp32 -static -mcmodel=medany -fvisibility=hidden -nostdlib -nostartfiles "$i.S" || exit 1
+    # only the compressed instructions test is built with C extension, the rest must stay 32-bit instructions
+    ARCH=rv32im_zicsr_zba_zbb
+    [ "$i" = "rvc" ] && ARCH=rv32imc_zicsr_zba_zbb
+    riscv32-unknown-elf-gcc -march=$ARCH -mabi=ilp32 -static -mcmodel=medany -fvisibility=hidden -nostdlib -nostartfiles "$i.S" || exit 1
     R=$(../../nano_rvi -m 1024 -s 512 -f a.out -d s | grep "Exiting with code" | awk '{ print $4 }')
     if [ "z$R" = "z0" ]; then
         echo "SUCCESS"
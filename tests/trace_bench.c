@@ -0,0 +1,130 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Binary trace benchmark: runs a loop filling and summing up a buffer with the reference engine,
+// without trace and with binary trace written into a file, then reads the trace back and checks it
+// (every instruction must be there, and register values must match the final state of the VM)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../interface.h"
+#include "../riscv_trace.h"
+#include "bench.h"
+
+#define RAM_SIZE (1024 * 1024)
+#define STACK_SIZE (64 * 1024)
+#define BUF_ADDR 0x10000
+#define BUF_SIZE 0x10000
+#define FILE_NAME "trace_bench.tr"
+
+// Repeat a0 times: fill the buffer with (address * 3), then add it all up into a1; exit with the sum
+static const uint32_t program[] = {
+    U(BUF_ADDR >> 12,RVR_S0,0x37),              // lui s0,buf
+    U((BUF_ADDR + BUF_SIZE) >> 12,RVR_S1,0x37), // lui s1,buf_end
+    I(0,RVR_S0,0,RVR_T0,0x13),                  // outer: mv t0,s0
+    R(0,RVR_T0,RVR_T0,0,RVR_T1),                // fill: add t1,t0,t0
+    R(0,RVR_T0,RVR_T1,0,RVR_T1),                // add t1,t1,t0
+    S(0,RVR_T1,RVR_T0,2),                       // sw t1,0(t0)
+    I(4,RVR_T0,0,RVR_T0,0x13),                  // addi t0,t0,4
+    B(-16,RVR_S1,RVR_T0,1),                     // bne t0,s1,fill
+    I(0,RVR_S0,0,RVR_T0,0x13),                  // mv t0,s0
+    I(0,RVR_T0,2,RVR_T1,0x03),                  // sum: lw t1,0(t0)
+    R(0,RVR_T1,RVR_A1,0,RVR_A1),                // add a1,a1,t1
+    I(4,RVR_T0,0,RVR_T0,0x13),                  // addi t0,t0,4
+    B(-12,RVR_S1,RVR_T0,1),                     // bne t0,s1,sum
+    I(-1,RVR_A0,0,RVR_A0,0x13),                 // addi a0,a0,-1
+    B(-48,RVR_ZERO,RVR_A0,1),                   // bnez a0,outer
+    I(0,RVR_A1,0,RVR_A0,0x13),                  // mv a0,a1
+    I(93,RVR_ZERO,0,RVR_A7,0x13),               // li a7,93
+    0x00000073,                                 // ecall
+};
+
+// Run the program (with or without trace), returns run time, seconds (or negative value on error)
+static double run(rv_interface* iface, uint32_t iters, const char* trace)
+{
+    rv_iface_init(iface);
+    iface->ram_size = RAM_SIZE;
+    iface->stack_size = STACK_SIZE;
+    iface->headless = true;
+    iface->trace_file = trace;
+    if (!rv_iface_resize(iface)) return -1;
+    memcpy(iface->ram,program,sizeof(program));
+    if (!rv_iface_start(iface)) return -1;
+    iface->vm.regs[RVR_A0] = iters;
+
+    double t = now_s();
+    while (rv_iface_step(iface)) ;
+    return (iface->status == RVSTAT_EXIT)? now_s() - t : -1;
+}
+
+// Read the trace back and compare it with the final VM state
+static uint32_t check(rv_interface* iface, double* secs)
+{
+    riscv_trace_reader r;
+    if (!riscv_trace_open(&r,FILE_NAME)) return 1;
+
+    double t = now_s();
+    riscv_trace_rec rec;
+    uint32_t written = 0, errs = 0, mem = 0;
+    int ret;
+    while ((ret = riscv_trace_read(&r,&rec)) > 0) {
+        written |= 1U << rec.rd;
+        if (rec.has_mem && (rec.mem < BUF_ADDR || rec.mem >= BUF_ADDR + BUF_SIZE)) mem++;
+    }
+    *secs = now_s() - t;
+    riscv_trace_close(&r);
+
+    if (ret < 0 || r.records != iface->vm.instret || mem) errs++;
+    for (int i = 1; i < RV_NUMREGS; i++)
+        if ((written & (1U << i)) && r.ctx.regs[i] != iface->vm.regs[i]) errs++;
+    if (rec.ip != iface->vm.ip - 4) errs++; // (the last one is ECALL)
+    return errs;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t iters = (argc > 1)? strtoul(argv[1],NULL,0) : 200;
+    if (!iters) {
+        printf("Usage: %s [loop iterations]\n",argv[0]);
+        return 1;
+    }
+
+    riscv_init();
+    rv_interface iface;
+    uint32_t errs = 0;
+
+    double plain = run(&iface,iters,NULL);
+    uint64_t n = iface.vm.instret;
+    uint32_t sum = iface.exit_code;
+    rv_iface_stop(&iface);
+
+    // the trace is complete only when the VM is stopped
+    double traced = run(&iface,iters,FILE_NAME);
+    uint64_t stalls = iface.vm.trace? iface.vm.trace->stalls : 0;
+    uint64_t bytes = iface.vm.trace? iface.vm.trace->head : 0;
+    rv_iface_stop(&iface);
+
+    double decode = 0;
+    if (plain < 0 || traced < 0 || iface.vm.instret != n || iface.exit_code != sum) errs++;
+    else errs += check(&iface,&decode);
+    remove(FILE_NAME);
+
+    printf("Without trace: %" PRIu64 " instructions in %.3f s (%.1f MIPS)\n",n,plain,n / plain / 1e6);
+    printf("With trace: %.3f s (%.1f MIPS, %.1f%% slower), %" PRIu64 " bytes (%.2f bytes per instruction), %" PRIu64 " stalls\n",
+           traced,n / traced / 1e6,(traced / plain - 1) * 100,bytes,(double)bytes / n,stalls);
+    printf("Decoding: %.3f s (%.1f million records per second)\n",decode,n / decode / 1e6);
+
+    if (errs) {
+        printf("FAILURE: %u errors found\n",errs);
+        return 1;
+    }
+    puts("SUCCESS");
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ *
+ * Nano RISC-V 32i emulator
+ * Copyright (C) Dmitry 'MatrixS_Master' Solovyev, 2020-2021
+ *
+ * This work is licensed under the MIT License. See included LICENSE file
+ *
+ * */
+
+// Binary execution trace decoder: prints every instruction of the trace (disassembled),
+// the value it has written into its destination register and the memory address it has accessed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "riscv.h"
+#include "riscv_trace.h"
+
+#define DISASM_MAX_LEN 356
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        printf("Usage: %s <trace file> [first record] [number of records]\n",argv[0]);
+        return 1;
+    }
+    uint64_t first = (argc > 2)? strtoull(argv[2],NULL,0) : 0;
+    uint64_t count = (argc > 3)? strtoull(argv[3],NULL,0) : UINT64_MAX;
+
+    riscv_init();
+    riscv_trace_reader r;
+    if (!riscv_trace_open(&r,argv[1])) {
+        printf("ERROR: Unable to read trace file '%s'\n",argv[1]);
+        return 1;
+    }
+
+    // records have to be decoded one by one from the start anyway
+    riscv_trace_rec rec;
+    int ret;
+    uint64_t n = 0;
+    while ((ret = riscv_trace_read(&r,&rec)) > 0 && (n < first || n - first < count)) {
+        if (n++ < first) continue;
+
+        char buf[DISASM_MAX_LEN];
+        if (riscv_disasm(rec.inst,buf,sizeof(buf)) != RVEXIT_SUCCESS) strcpy(buf,"???");
+        int len = RV_INST_LEN(rec.inst) * 2;
+        printf("%10" PRIu64 " 0x%08X: %0*X%*s %-*s",n - 1,rec.ip,len,rec.inst,8 - len,"",(rec.rd || rec.has_mem)? 40 : 0,buf);
+        if (rec.rd) printf(" x%u=0x%08X",rec.rd,rec.val);
+        if (rec.has_mem) printf(" [0x%08X]",rec.mem);
+        putchar('\n');
+    }
+    riscv_trace_close(&r);
+
+    if (ret < 0) {
+        printf("ERROR: Trace is broken after record %" PRIu64 "\n",r.records);
+        return 2;
+    }
+    return 0;
+}